@@ -0,0 +1,473 @@
+/**
+ * SquashFS delta merge tool
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+/*
+ * Benchmark driver running squashmerge on a set of test deltas, laid out
+ * like the test suite (<name>.in, <name>.sqdelta, <name>.out). For every
+ * run, the overall resource usage and the per-phase statistics reported
+ * by squashmerge --stats-json are written out as JSON.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
+
+#define BENCH_DELTA_SUFFIX ".sqdelta"
+/* getrusage() block counts are in 512-byte units */
+#define BENCH_BLOCK_SIZE 512
+
+struct bench_paths
+{
+	const char* delta;
+	char* name;
+	char* input;
+	char* expected;
+	char* output;
+	char* stats;
+};
+
+static void bench_paths_free(struct bench_paths* p)
+{
+	free(p->name);
+	free(p->input);
+	free(p->expected);
+	free(p->output);
+	free(p->stats);
+}
+
+/* join a, the first b_length characters of b and c */
+static char* make_path(const char* a, const char* b, size_t b_length,
+		const char* c)
+{
+	size_t length = strlen(a) + b_length + strlen(c) + 1;
+	char* out = malloc(length);
+
+	if (!out)
+	{
+		fprintf(stderr, "Unable to allocate memory for path.\n"
+				"\terrno: %s\n", strerror(errno));
+		return 0;
+	}
+
+	snprintf(out, length, "%s%.*s%s", a, (int) b_length, b, c);
+	return out;
+}
+
+static int bench_paths_init(struct bench_paths* p, const char* delta,
+		const char* tmpdir)
+{
+	size_t suffix_length = strlen(BENCH_DELTA_SUFFIX);
+	size_t base_length = strlen(delta);
+	const char* name;
+	size_t name_length;
+	char* tmp_prefix;
+
+	if (base_length < suffix_length
+			|| strcmp(delta + base_length - suffix_length, BENCH_DELTA_SUFFIX))
+	{
+		fprintf(stderr, "Delta file name needs to end with %s.\n"
+				"\tpath: %s\n", BENCH_DELTA_SUFFIX, delta);
+		return 0;
+	}
+	base_length -= suffix_length;
+
+	name = strrchr(delta, '/');
+	name = name ? name + 1 : delta;
+	name_length = base_length - (name - delta);
+
+	p->delta = delta;
+	p->name = make_path("", name, name_length, "");
+	p->input = make_path("", delta, base_length, ".in");
+	p->expected = make_path("", delta, base_length, ".out");
+	p->output = 0;
+	p->stats = 0;
+
+	tmp_prefix = make_path(tmpdir, "/", 1, "");
+	if (tmp_prefix)
+	{
+		p->output = make_path(tmp_prefix, name, name_length, ".benchout");
+		p->stats = make_path(tmp_prefix, name, name_length, ".benchstats");
+		free(tmp_prefix);
+	}
+
+	if (!p->name || !p->input || !p->expected || !p->output || !p->stats)
+	{
+		bench_paths_free(p);
+		return 0;
+	}
+
+	return 1;
+}
+
+static long file_size(const char* path)
+{
+	struct stat st;
+
+	if (stat(path, &st) == -1)
+	{
+		fprintf(stderr, "Unable to stat file.\n"
+				"\tpath: %s\n"
+				"\terrno: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	return st.st_size;
+}
+
+static int files_equal(const char* a, const char* b)
+{
+	struct mmap_file fa, fb;
+	int ret = 0;
+
+	fa = mmap_open(a);
+	if (fa.fd == -1)
+		return 0;
+	fb = mmap_open(b);
+	if (fb.fd != -1)
+	{
+		ret = fa.length == fb.length
+			&& !memcmp(fa.data, fb.data, fa.length);
+		mmap_close(&fb);
+	}
+	mmap_close(&fa);
+
+	return ret;
+}
+
+static void write_json_string(FILE* out, const char* str)
+{
+	fputc('"', out);
+	for (; *str; ++str)
+	{
+		if (*str == '"' || *str == '\\')
+			fprintf(out, "\\%c", *str);
+		else if ((unsigned char) *str < 0x20)
+			fprintf(out, "\\u%04x", (unsigned char) *str);
+		else
+			fputc(*str, out);
+	}
+	fputc('"', out);
+}
+
+/* copy the JSON written by squashmerge into the output, reindented */
+static int copy_stats(FILE* out, const char* path)
+{
+	struct mmap_file f;
+	const char* data;
+	size_t length, i;
+
+	f = mmap_open(path);
+	if (f.fd == -1)
+		return 0;
+
+	data = f.data;
+	length = f.length;
+	while (length > 0 && data[length - 1] == '\n')
+		--length;
+
+	for (i = 0; i < length; ++i)
+	{
+		if (data[i] == '\n')
+			fputs("\n\t\t\t\t\t", out);
+		else
+			fputc(data[i], out);
+	}
+
+	mmap_close(&f);
+	return 1;
+}
+
+static double timespec_seconds(const struct timespec* ts)
+{
+	return ts->tv_sec + ts->tv_nsec / 1e9;
+}
+
+static double timeval_seconds(const struct timeval* tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static int bench_run(FILE* out, const char* squashmerge,
+		char* const* extra_args, int extra_count,
+		const struct bench_paths* p, long output_bytes, int first)
+{
+	struct timespec start, end;
+	struct rusage ru;
+	char** argv;
+	double wall_time;
+	pid_t pid;
+	int status;
+	int i, argc = 0;
+
+	argv = malloc(sizeof(*argv) * (extra_count + 7));
+	if (!argv)
+	{
+		fprintf(stderr, "Unable to allocate memory for arguments.\n"
+				"\terrno: %s\n", strerror(errno));
+		return 0;
+	}
+
+	argv[argc++] = (char*) squashmerge;
+	for (i = 0; i < extra_count; ++i)
+		argv[argc++] = extra_args[i];
+	argv[argc++] = "--stats-json";
+	argv[argc++] = p->stats;
+	argv[argc++] = p->input;
+	argv[argc++] = (char*) p->delta;
+	argv[argc++] = p->output;
+	argv[argc] = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pid = fork();
+	if (pid == 0)
+	{
+		execvp(squashmerge, argv);
+		fprintf(stderr, "Unable to execute squashmerge.\n"
+				"\tpath: %s\n"
+				"\terrno: %s\n", squashmerge, strerror(errno));
+		_exit(127);
+	}
+	free(argv);
+	if (pid == -1)
+	{
+		fprintf(stderr, "Unable to fork.\n"
+				"\terrno: %s\n", strerror(errno));
+		return 0;
+	}
+
+	while (wait4(pid, &status, 0, &ru) == -1)
+	{
+		if (errno != EINTR)
+		{
+			fprintf(stderr, "Unable to wait for squashmerge.\n"
+					"\terrno: %s\n", strerror(errno));
+			return 0;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	{
+		fprintf(stderr, "squashmerge failed.\n"
+				"\tdelta: %s\n", p->delta);
+		return 0;
+	}
+
+	wall_time = timespec_seconds(&end) - timespec_seconds(&start);
+	fprintf(out, "%s\n\t\t\t\t{\n"
+			"\t\t\t\t\t\"wall_time\": %.6f,\n"
+			"\t\t\t\t\t\"user_time\": %.6f,\n"
+			"\t\t\t\t\t\"system_time\": %.6f,\n"
+			"\t\t\t\t\t\"throughput_mbps\": %.3f,\n"
+			"\t\t\t\t\t\"max_rss_kb\": %ld,\n"
+			"\t\t\t\t\t\"read_bytes\": %llu,\n"
+			"\t\t\t\t\t\"written_bytes\": %llu,\n"
+			"\t\t\t\t\t\"stats\": ",
+			first ? "" : ",", wall_time,
+			timeval_seconds(&ru.ru_utime), timeval_seconds(&ru.ru_stime),
+			wall_time > 0 ? output_bytes / wall_time / 1e6 : 0.,
+			ru.ru_maxrss,
+			(unsigned long long) ru.ru_inblock * BENCH_BLOCK_SIZE,
+			(unsigned long long) ru.ru_oublock * BENCH_BLOCK_SIZE);
+	if (!copy_stats(out, p->stats))
+		return 0;
+	fprintf(out, "\n\t\t\t\t}");
+
+	return 1;
+}
+
+static int bench_delta(FILE* out, const char* squashmerge,
+		char* const* extra_args, int extra_count, const char* delta,
+		const char* tmpdir, unsigned int runs, int first)
+{
+	struct bench_paths p;
+	long input_bytes, delta_bytes, output_bytes;
+	unsigned int i;
+	int ret = 0;
+
+	if (!bench_paths_init(&p, delta, tmpdir))
+		return 0;
+
+	do
+	{
+		input_bytes = file_size(p.input);
+		delta_bytes = file_size(p.delta);
+		output_bytes = file_size(p.expected);
+		if (input_bytes == -1 || delta_bytes == -1 || output_bytes == -1)
+			break;
+
+		fprintf(out, "%s\n\t\t{\n"
+				"\t\t\t\"name\": ", first ? "" : ",");
+		write_json_string(out, p.name);
+		fprintf(out, ",\n"
+				"\t\t\t\"input_bytes\": %ld,\n"
+				"\t\t\t\"delta_bytes\": %ld,\n"
+				"\t\t\t\"output_bytes\": %ld,\n"
+				"\t\t\t\"runs\": [",
+				input_bytes, delta_bytes, output_bytes);
+
+		for (i = 0; i < runs; ++i)
+		{
+			if (!bench_run(out, squashmerge, extra_args, extra_count,
+						&p, output_bytes, i == 0))
+				break;
+		}
+		if (i != runs)
+			break;
+
+		if (!files_equal(p.output, p.expected))
+		{
+			fprintf(stderr, "Output does not match the expected file.\n"
+					"\tdelta: %s\n", p.delta);
+			break;
+		}
+
+		fprintf(out, "\n\t\t\t]\n\t\t}");
+		fprintf(stderr, "%s: done\n", p.name);
+		ret = 1;
+	} while (0);
+
+	unlink(p.output);
+	unlink(p.stats);
+	bench_paths_free(&p);
+	return ret;
+}
+
+static void print_usage(const char* prog)
+{
+	fprintf(stderr, "Usage: %s [options] <delta>... [-- <squashmerge options>]\n"
+			"\n"
+			"Options:\n"
+			"\t-n, --runs N     run each delta N times (default: 3)\n"
+			"\t-o, --output FILE\n"
+			"\t                 write the JSON results to FILE (default: stdout)\n"
+			"\t-s, --squashmerge PATH\n"
+			"\t                 squashmerge executable (default: squashmerge)\n"
+			"\t-h, --help       print this help\n", prog);
+}
+
+static const struct option long_options[] = {
+	{ "runs", required_argument, 0, 'n' },
+	{ "output", required_argument, 0, 'o' },
+	{ "squashmerge", required_argument, 0, 's' },
+	{ "help", no_argument, 0, 'h' },
+	{ 0, 0, 0, 0 }
+};
+
+int main(int argc, char* argv[])
+{
+	const char* squashmerge = "squashmerge";
+	const char* output_file = 0;
+	const char* tmpdir;
+	unsigned int runs = 3;
+	char** extra_args = 0;
+	int extra_count = 0;
+	int delta_count;
+	FILE* out = stdout;
+	int opt, i;
+
+	int ret = 1;
+
+	while ((opt = getopt_long(argc, argv, "+n:o:s:h", long_options, 0)) != -1)
+	{
+		switch (opt)
+		{
+			case 'n':
+			{
+				char* end;
+				unsigned long v = strtoul(optarg, &end, 10);
+
+				if (*end || v == 0 || v > 1000)
+				{
+					fprintf(stderr, "Invalid run count: %s\n", optarg);
+					return 1;
+				}
+				runs = v;
+				break;
+			}
+			case 'o':
+				output_file = optarg;
+				break;
+			case 's':
+				squashmerge = optarg;
+				break;
+			case 'h':
+				print_usage(argv[0]);
+				return 0;
+			default:
+				print_usage(argv[0]);
+				return 1;
+		}
+	}
+
+	/* the options after -- are passed to squashmerge */
+	for (delta_count = 0; optind + delta_count < argc; ++delta_count)
+	{
+		if (!strcmp(argv[optind + delta_count], "--"))
+		{
+			extra_args = &argv[optind + delta_count + 1];
+			extra_count = argc - optind - delta_count - 1;
+			break;
+		}
+	}
+	if (delta_count == 0)
+	{
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	tmpdir = getenv("TMPDIR");
+	if (!tmpdir)
+		tmpdir = "/tmp";
+
+	if (output_file)
+	{
+		out = fopen(output_file, "w");
+		if (!out)
+		{
+			fprintf(stderr, "Unable to open output file.\n"
+					"\tpath: %s\n"
+					"\terrno: %s\n", output_file, strerror(errno));
+			return 1;
+		}
+	}
+
+	fprintf(out, "{\n\t\"squashmerge\": ");
+	write_json_string(out, squashmerge);
+	fprintf(out, ",\n\t\"benchmarks\": [");
+	for (i = 0; i < delta_count; ++i)
+	{
+		if (!bench_delta(out, squashmerge, extra_args, extra_count,
+					argv[optind + i], tmpdir, runs, i == 0))
+			break;
+	}
+	fprintf(out, "\n\t]\n}\n");
+	if (i == delta_count)
+		ret = 0;
+
+	if (out != stdout && fclose(out) != 0)
+	{
+		fprintf(stderr, "Unable to write output file.\n"
+				"\terrno: %s\n", strerror(errno));
+		ret = 1;
+	}
+
+	return ret;
+}
@@ -0,0 +1,247 @@
+/**
+ * SquashFS delta merge tool
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h> /* for endian conversion */
+
+#include "blocktable.h"
+
+#if defined(HAVE_BUILTIN_CPU_SUPPORTS) \
+	&& (defined(__x86_64__) || defined(__i386__))
+#	define BLOCK_TABLE_SSE41 1
+#	include <immintrin.h>
+#elif (defined(__ARM_NEON) || defined(__ARM_NEON__)) \
+	&& !defined(__ARM_BIG_ENDIAN)
+#	define BLOCK_TABLE_NEON 1
+#	include <arm_neon.h>
+#endif
+
+#ifdef BLOCK_TABLE_SSE41
+
+/* pshufb masks gathering (and byte-swapping) the offset, length
+ * and uncompressed length fields of 4 entries from the 3 vectors
+ * they span; 0x80 clears the byte */
+static const unsigned char sse_gather[3][3][16] =
+{
+	{
+		{ 3, 2, 1, 0, 15, 14, 13, 12, 0x80, 0x80, 0x80, 0x80,
+			0x80, 0x80, 0x80, 0x80 },
+		{ 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+			11, 10, 9, 8, 0x80, 0x80, 0x80, 0x80 },
+		{ 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+			0x80, 0x80, 0x80, 0x80, 7, 6, 5, 4 }
+	},
+	{
+		{ 7, 6, 5, 4, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+			0x80, 0x80, 0x80, 0x80 },
+		{ 0x80, 0x80, 0x80, 0x80, 3, 2, 1, 0, 15, 14, 13, 12,
+			0x80, 0x80, 0x80, 0x80 },
+		{ 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+			0x80, 0x80, 0x80, 0x80, 11, 10, 9, 8 }
+	},
+	{
+		{ 11, 10, 9, 8, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+			0x80, 0x80, 0x80, 0x80 },
+		{ 0x80, 0x80, 0x80, 0x80, 7, 6, 5, 4, 0x80, 0x80, 0x80, 0x80,
+			0x80, 0x80, 0x80, 0x80 },
+		{ 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+			3, 2, 1, 0, 15, 14, 13, 12 }
+	}
+};
+
+__attribute__((target("sse4.1")))
+static __m128i sse_gather_field(const __m128i* v, unsigned int field)
+{
+	const __m128i* m = (const __m128i*) sse_gather[field];
+
+	return _mm_or_si128(
+			_mm_or_si128(
+				_mm_shuffle_epi8(v[0], _mm_loadu_si128(&m[0])),
+				_mm_shuffle_epi8(v[1], _mm_loadu_si128(&m[1]))),
+			_mm_shuffle_epi8(v[2], _mm_loadu_si128(&m[2])));
+}
+
+/* decode and validate 4 entries at a time; stops before the first group
+ * failing validation and returns the count of entries decoded */
+__attribute__((target("sse4.1")))
+static size_t block_table_decode_sse41(struct block_table* t,
+		const struct compressed_block* blocks, uint32_t limit,
+		uint32_t* prev_end)
+{
+	const __m128i limit_v = _mm_set1_epi32((int) limit);
+	__m128i prev_v = _mm_set1_epi32((int) *prev_end);
+	size_t i;
+
+	for (i = 0; i + 4 <= t->count; i += 4)
+	{
+		const __m128i* in = (const __m128i*) &blocks[i];
+		__m128i v[3];
+		__m128i off, len, unc, end, prev, ok;
+
+		v[0] = _mm_loadu_si128(&in[0]);
+		v[1] = _mm_loadu_si128(&in[1]);
+		v[2] = _mm_loadu_si128(&in[2]);
+
+		off = sse_gather_field(v, 0);
+		len = sse_gather_field(v, 1);
+		unc = sse_gather_field(v, 2);
+		end = _mm_add_epi32(off, len);
+		/* the end of the preceding block for each entry */
+		prev = _mm_alignr_epi8(end, prev_v, 12);
+
+		/* no wrap-around, within limit, no overlap */
+		ok = _mm_and_si128(
+				_mm_and_si128(
+					_mm_cmpeq_epi32(_mm_max_epu32(end, off), end),
+					_mm_cmpeq_epi32(_mm_min_epu32(end, limit_v), end)),
+				_mm_cmpeq_epi32(_mm_max_epu32(off, prev), off));
+		if (_mm_movemask_epi8(ok) != 0xffff)
+			break;
+
+		_mm_storeu_si128((__m128i*) &t->offsets[i], off);
+		_mm_storeu_si128((__m128i*) &t->lengths[i], len);
+		_mm_storeu_si128((__m128i*) &t->unc_lengths[i], unc);
+		prev_v = end;
+	}
+
+	*prev_end = (uint32_t) _mm_extract_epi32(prev_v, 3);
+	return i;
+}
+
+#endif /*BLOCK_TABLE_SSE41*/
+
+#ifdef BLOCK_TABLE_NEON
+
+static uint32x4_t neon_bswap(uint32x4_t v)
+{
+	return vreinterpretq_u32_u8(vrev32q_u8(vreinterpretq_u8_u32(v)));
+}
+
+/* decode and validate 4 entries at a time; stops before the first group
+ * failing validation and returns the count of entries decoded */
+static size_t block_table_decode_neon(struct block_table* t,
+		const struct compressed_block* blocks, uint32_t limit,
+		uint32_t* prev_end)
+{
+	const uint32x4_t limit_v = vdupq_n_u32(limit);
+	uint32x4_t prev_v = vdupq_n_u32(*prev_end);
+	size_t i;
+
+	for (i = 0; i + 4 <= t->count; i += 4)
+	{
+		/* the load deinterleaves the fields */
+		uint32x4x3_t v = vld3q_u32((const uint32_t*) &blocks[i]);
+		uint32x4_t off = neon_bswap(v.val[0]);
+		uint32x4_t len = neon_bswap(v.val[1]);
+		uint32x4_t unc = neon_bswap(v.val[2]);
+		uint32x4_t end = vaddq_u32(off, len);
+		/* the end of the preceding block for each entry */
+		uint32x4_t prev = vextq_u32(prev_v, end, 3);
+		uint32x4_t ok;
+		uint32x2_t ok2;
+
+		/* no wrap-around, within limit, no overlap */
+		ok = vandq_u32(vandq_u32(vcgeq_u32(end, off),
+					vcleq_u32(end, limit_v)),
+				vcgeq_u32(off, prev));
+		ok2 = vand_u32(vget_low_u32(ok), vget_high_u32(ok));
+		if ((vget_lane_u32(ok2, 0) & vget_lane_u32(ok2, 1)) != 0xffffffffUL)
+			break;
+
+		vst1q_u32(&t->offsets[i], off);
+		vst1q_u32(&t->lengths[i], len);
+		vst1q_u32(&t->unc_lengths[i], unc);
+		prev_v = end;
+	}
+
+	*prev_end = vgetq_lane_u32(prev_v, 3);
+	return i;
+}
+
+#endif /*BLOCK_TABLE_NEON*/
+
+int block_table_init(struct block_table* t,
+		const struct compressed_block* blocks, size_t count, uint64_t limit)
+{
+	uint32_t limit32 = limit < UINT32_MAX ? (uint32_t) limit : UINT32_MAX;
+	uint32_t prev_end = 0;
+	size_t i = 0;
+
+	t->count = count;
+	t->offsets = malloc(sizeof(*t->offsets) * (count + 1));
+	t->lengths = malloc(sizeof(*t->lengths) * (count + 1));
+	t->unc_lengths = malloc(sizeof(*t->unc_lengths) * (count + 1));
+	t->unc_offsets = malloc(sizeof(*t->unc_offsets) * (count + 1));
+	if (!t->offsets || !t->lengths || !t->unc_lengths || !t->unc_offsets)
+	{
+		fprintf(stderr, "Unable to allocate memory for block table.\n"
+				"\terrno: %s\n", strerror(errno));
+		block_table_free(t);
+		return 0;
+	}
+
+#if defined(BLOCK_TABLE_SSE41)
+	if (__builtin_cpu_supports("sse4.1"))
+		i = block_table_decode_sse41(t, blocks, limit32, &prev_end);
+#elif defined(BLOCK_TABLE_NEON)
+	i = block_table_decode_neon(t, blocks, limit32, &prev_end);
+#endif
+
+	/* the remaining entries, and the group that failed validation */
+	for (; i < count; ++i)
+	{
+		uint32_t offset = ntohl(blocks[i].offset);
+		uint32_t length = ntohl(blocks[i].length);
+		uint32_t end = offset + length;
+
+		if (end < offset || end > limit32 || offset < prev_end)
+		{
+			fprintf(stderr, "Block list is not sorted or exceeds the file.\n"
+					"\toffset: 0x%08lx\n"
+					"\tlength: %lu\n",
+					(unsigned long) offset, (unsigned long) length);
+			block_table_free(t);
+			return 0;
+		}
+
+		t->offsets[i] = offset;
+		t->lengths[i] = length;
+		t->unc_lengths[i] = ntohl(blocks[i].uncompressed_length);
+		prev_end = end;
+	}
+
+	t->unc_offsets[0] = 0;
+	for (i = 0; i < count; ++i)
+		t->unc_offsets[i + 1] = t->unc_offsets[i] + t->unc_lengths[i];
+
+	return 1;
+}
+
+void block_table_free(struct block_table* t)
+{
+	free(t->offsets);
+	free(t->lengths);
+	free(t->unc_lengths);
+	free(t->unc_offsets);
+	t->offsets = 0;
+	t->lengths = 0;
+	t->unc_lengths = 0;
+	t->unc_offsets = 0;
+	t->count = 0;
+}
+
+uint64_t block_table_end(const struct block_table* t)
+{
+	if (t->count == 0)
+		return 0;
+	return (uint64_t) t->offsets[t->count - 1] + t->lengths[t->count - 1];
+}
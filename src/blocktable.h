@@ -0,0 +1,48 @@
+/**
+ * SquashFS delta merge tool
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#pragma once
+
+#ifndef SDT_BLOCKTABLE_H
+#define SDT_BLOCKTABLE_H 1
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#ifdef HAVE_STDINT_H
+#	include <stdint.h>
+#endif
+#include <stdlib.h>
+
+#include "sqdelta.h"
+
+/*
+ * A block list decoded once into host-endian arrays, so that the worker
+ * threads do not need to byte-swap the on-disk entries over and over.
+ */
+struct block_table
+{
+	size_t count;
+
+	uint32_t* offsets;
+	uint32_t* lengths;
+	uint32_t* unc_lengths;
+	/* offsets of the uncompressed blocks relative to the first one,
+	 * unc_offsets[count] is the total uncompressed length */
+	size_t* unc_offsets;
+};
+
+/* decode the list, checking that the blocks are sorted by offset,
+ * do not overlap and end at limit or before */
+int block_table_init(struct block_table* t,
+		const struct compressed_block* blocks, size_t count, uint64_t limit);
+void block_table_free(struct block_table* t);
+
+/* the end of the last (and therefore any) block, 0 if there are none */
+uint64_t block_table_end(const struct block_table* t);
+
+#endif /*!SDT_BLOCKTABLE_H*/
@@ -0,0 +1,92 @@
+/**
+ * SquashFS delta merge tool
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <stdio.h>
+#include <arpa/inet.h> /* for endian conversion */
+
+#include "checksum.h"
+#include "sqdelta.h"
+#include "xxhash.h"
+
+static uint64_t get64(const uint32_t* in)
+{
+	return ((uint64_t) ntohl(in[0]) << 32) | ntohl(in[1]);
+}
+
+size_t checksums_size(size_t segment_count)
+{
+	size_t entry_size = 2 * sizeof(uint32_t);
+
+	if (segment_count > ((size_t) -1 - sizeof(struct sqdelta_checksum_header))
+			/ entry_size)
+		return 0;
+	return sizeof(struct sqdelta_checksum_header) + segment_count * entry_size;
+}
+
+int checksums_read(const struct mmap_file* f, size_t offset,
+		struct target_checksums* c)
+{
+	const struct sqdelta_checksum_header* h;
+
+	h = mmap_read(f, offset, sizeof(*h));
+	if (!h)
+		return 0;
+
+	c->segment_count = ntohl(h->segment_count);
+	c->digest = get64(h->digest);
+	c->size = checksums_size(c->segment_count);
+	if (c->size == 0)
+	{
+		fprintf(stderr, "Checksum table size overflow.\n");
+		return 0;
+	}
+
+	c->entries = mmap_read(f, offset + sizeof(*h), c->size - sizeof(*h));
+	if (!c->entries)
+		return 0;
+
+	if (xxh64(c->entries, c->size - sizeof(*h), 0) != c->digest)
+	{
+		fprintf(stderr, "Checksum table does not match its digest.\n"
+				"\tdigest: %016llx\n", (unsigned long long) c->digest);
+		return 0;
+	}
+
+	return 1;
+}
+
+int checksums_match(const struct target_checksums* c, size_t block_count)
+{
+	if (c->segment_count != 2 * block_count + 1)
+	{
+		fprintf(stderr, "Checksum table does not match the target blocks.\n"
+				"\tsegments: %lu\n"
+				"\tblocks: %lu\n",
+				(unsigned long) c->segment_count, (unsigned long) block_count);
+		return 0;
+	}
+
+	return 1;
+}
+
+int checksum_verify(const struct target_checksums* c, size_t segment,
+		const void* data, size_t length, uint64_t offset)
+{
+	if (xxh64(data, length, 0) != get64(&c->entries[segment * 2]))
+	{
+		fprintf(stderr, "Target data does not match the checksum.\n"
+				"\toffset: 0x%08lx\n"
+				"\tlength: %lu\n",
+				(unsigned long) offset, (unsigned long) length);
+		return 0;
+	}
+
+	return 1;
+}
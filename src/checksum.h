@@ -0,0 +1,56 @@
+/**
+ * SquashFS delta merge tool
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#pragma once
+
+#ifndef SDT_CHECKSUM_H
+#define SDT_CHECKSUM_H 1
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#ifdef HAVE_STDINT_H
+#	include <stdint.h>
+#endif
+#include <stdlib.h>
+
+#include "util.h"
+
+/*
+ * The checksums of the target image carried by a patch. The squashed
+ * image is split at the regular target blocks into 2n+1 segments:
+ * the data before the first block, the first block, the data up to
+ * the second block and so on, ending with the data after the last
+ * block. Segment 2i+1 is therefore block i, and segment 2i the data
+ * preceding it. Each segment is hashed with XXH64, and the digest
+ * of the image is XXH64 of the table.
+ */
+
+struct target_checksums
+{
+	/* two big-endian halves per segment, as stored */
+	const uint32_t* entries;
+	size_t segment_count;
+	uint64_t digest;
+	/* the size of the table in the patch */
+	size_t size;
+};
+
+/* the size of the table with the header, 0 if it would overflow */
+size_t checksums_size(size_t segment_count);
+
+/* read the table at offset, checking the digest */
+int checksums_read(const struct mmap_file* f, size_t offset,
+		struct target_checksums* c);
+/* check that the table has the segments for block_count blocks */
+int checksums_match(const struct target_checksums* c, size_t block_count);
+
+/* check the data of a segment, found at offset in the target */
+int checksum_verify(const struct target_checksums* c, size_t segment,
+		const void* data, size_t length, uint64_t offset);
+
+#endif /*!SDT_CHECKSUM_H*/
@@ -8,7 +8,10 @@
 #	include "config.h"
 #endif
 
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #ifdef ENABLE_LZO
 #	include <lzo/lzo1x.h>
@@ -17,16 +20,148 @@
 #	include <lz4.h>
 #	include <lz4hc.h>
 #endif
+#ifdef ENABLE_ZLIB
+#	include <zlib.h>
+#endif
+#ifdef ENABLE_XZ
+#	include <lzma.h>
+#endif
+#ifdef ENABLE_ZSTD
+#	include <zstd.h>
+#endif
 
 #include "compressor.h"
+#include "stats.h"
+
+/* workspaces are aligned to the cache line */
+#define COMPRESSOR_ALIGNMENT 64
+
+typedef size_t (*compress_func)(struct compressor_ctx* ctx,
+		void* dest, void* src, size_t length, size_t out_size);
+typedef size_t (*decompress_func)(struct compressor_ctx* ctx,
+		void* dest, const void* src, size_t length, size_t out_size);
+typedef void (*batch_func)(struct compressor_ctx* ctx,
+		struct compressor_block* blocks, size_t count);
+
+/* a compression algorithm, resolved once from the compression field */
+struct compressor_backend
+{
+	uint32_t id;
+	const char* name;
+
+	/* all optional; a backend without compress is disabled */
+	int (*init)(uint32_t c);
+	/* may replace the functions of the context with the ones
+	 * specialized for the variant */
+	int (*ctx_init)(struct compressor_ctx* ctx);
+	void (*ctx_free)(struct compressor_ctx* ctx);
+	compress_func compress;
+	decompress_func decompress;
+};
+
+struct compressor_ctx
+{
+	uint32_t c;
+	const struct compressor_backend* backend;
+
+	/* the functions for the variant, the batches call the former
+	 * for each block unless specialized */
+	compress_func compress;
+	decompress_func decompress;
+	batch_func compress_batch;
+	batch_func decompress_batch;
+
+	/* backend state: lzo1x_999 working memory, LZ4_stream_t
+	 * or LZ4_streamHC_t, z_stream pair, lzma options, zstd contexts */
+	void* state;
+	/* output of the trial compressions, for the backends trying
+	 * several variants and keeping the smallest */
+	void* scratch;
+	size_t scratch_size;
+
+	/* block latencies, merged into the global stats on destroy */
+	struct stats_histogram block_stats[STATS_BLOCK_OP_COUNT];
+};
 
 enum compressor_id
 {
 	COMP_ID_LZO = 0x01 << 24,
 	COMP_ID_LZ4 = 0x02 << 24,
+	COMP_ID_ZLIB = 0x03 << 24,
+	COMP_ID_XZ = 0x04 << 24,
+	COMP_ID_ZSTD = 0x05 << 24,
 	COMP_ID_MASK = 0xff << 24
 };
 
+static void* compressor_alloc(size_t size, const char* what)
+{
+	void* out;
+	int ret;
+
+	ret = posix_memalign(&out, COMPRESSOR_ALIGNMENT, size);
+	if (ret != 0)
+	{
+		fprintf(stderr, "Unable to allocate compressor %s.\n"
+				"\terrno: %s\n", what, strerror(ret));
+		return 0;
+	}
+
+	return out;
+}
+
+static void compressor_free_state(struct compressor_ctx* ctx)
+{
+	free(ctx->state);
+}
+
+/* batch kernels with the block function known at compile time,
+ * for it to be inlined into the loop */
+#define COMPRESS_BATCH(name, func) \
+	static void name(struct compressor_ctx* ctx, \
+			struct compressor_block* blocks, size_t count) \
+	{ \
+		size_t i; \
+\
+		for (i = 0; i < count; ++i) \
+			blocks[i].ret = func(ctx, blocks[i].dest, blocks[i].src, \
+					blocks[i].length, blocks[i].out_size); \
+	}
+
+static void compress_each(struct compressor_ctx* ctx,
+		struct compressor_block* blocks, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; ++i)
+		blocks[i].ret = ctx->compress(ctx, blocks[i].dest, blocks[i].src,
+				blocks[i].length, blocks[i].out_size);
+}
+
+static void decompress_each(struct compressor_ctx* ctx,
+		struct compressor_block* blocks, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; ++i)
+		blocks[i].ret = ctx->decompress(ctx, blocks[i].dest, blocks[i].src,
+				blocks[i].length, blocks[i].out_size);
+}
+
+#if defined(ENABLE_ZLIB) || defined(ENABLE_XZ) || defined(ENABLE_ZSTD)
+/* the scratch buffer for a trial compression of out_size */
+static void* compressor_scratch(struct compressor_ctx* ctx, size_t out_size)
+{
+	if (ctx->scratch_size < out_size)
+	{
+		free(ctx->scratch);
+		ctx->scratch = compressor_alloc(out_size, "scratch buffer");
+		ctx->scratch_size = ctx->scratch ? out_size : 0;
+	}
+
+	return ctx->scratch;
+}
+#endif
+
 #ifdef ENABLE_LZO
 enum lzo_options
 {
@@ -37,7 +172,112 @@ enum lzo_options
 	COMP_LZO_KNOWN_FLAG_MASK = COMP_LZO_OPTIMIZED,
 	COMP_LZO_FLAG_MASK = 0xfffff0
 };
-#endif
+
+static int lzo_backend_init(uint32_t c)
+{
+	if ((c & COMP_LZO_ALGO_MASK) < COMP_LZO_ALGO_LZO1X_999_MIN
+			|| (c & COMP_LZO_ALGO_MASK) > COMP_LZO_ALGO_LZO1X_999_MAX)
+	{
+		fprintf(stderr, "Unsupported LZO variant %02x\n",
+				c & COMP_LZO_ALGO_MASK);
+		return 0;
+	}
+
+	if (((c & COMP_LZO_FLAG_MASK) & ~COMP_LZO_KNOWN_FLAG_MASK) != 0)
+	{
+		fprintf(stderr, "Unknown LZO flags enabled: %06x\n",
+				c & COMP_LZO_FLAG_MASK & ~COMP_LZO_KNOWN_FLAG_MASK);
+		return 0;
+	}
+
+	if (lzo_init() != LZO_E_OK)
+	{
+		fprintf(stderr, "lzo_init() failed\n");
+		return 0;
+	}
+
+	return 1;
+}
+
+/* optimize is constant in the callers, and folded */
+static inline size_t lzo_compress_variant(struct compressor_ctx* ctx,
+		void* dest, void* src, size_t length, size_t out_size, int optimize)
+{
+	lzo_uint out_bytes = out_size;
+	lzo_uint orig_size = length;
+
+	if (lzo1x_999_compress_level(src, length, dest, &out_bytes,
+				ctx->state, 0, 0, 0, ctx->c & COMP_LZO_ALGO_MASK) != LZO_E_OK)
+	{
+		fprintf(stderr, "LZO compression failed\n");
+		return 0;
+	}
+
+	if (optimize)
+	{
+		if (lzo1x_optimize(dest, out_bytes, src, &orig_size, 0)
+				!= LZO_E_OK)
+		{
+			fprintf(stderr, "LZO optimization failed\n");
+			return 0;
+		}
+	}
+
+	if (orig_size != length)
+	{
+		fprintf(stderr, "LZO optimization resulted in different input length\n");
+		return 0;
+	}
+
+	return out_bytes;
+}
+
+static size_t lzo_compress(struct compressor_ctx* ctx,
+		void* dest, void* src, size_t length, size_t out_size)
+{
+	return lzo_compress_variant(ctx, dest, src, length, out_size, 0);
+}
+
+static size_t lzo_compress_optimized(struct compressor_ctx* ctx,
+		void* dest, void* src, size_t length, size_t out_size)
+{
+	return lzo_compress_variant(ctx, dest, src, length, out_size, 1);
+}
+
+static size_t lzo_decompress(struct compressor_ctx* ctx,
+		void* dest, const void* src, size_t length, size_t out_size)
+{
+	lzo_uint out_bytes = out_size;
+
+	if (lzo1x_decompress_safe(src, length, dest, &out_bytes, 0) != LZO_E_OK)
+	{
+		fprintf(stderr, "LZO decompression failed (corrupted data?)\n");
+		return 0;
+	}
+
+	return out_bytes;
+}
+
+COMPRESS_BATCH(lzo_compress_batch, lzo_compress)
+COMPRESS_BATCH(lzo_compress_optimized_batch, lzo_compress_optimized)
+COMPRESS_BATCH(lzo_decompress_batch, lzo_decompress)
+
+static int lzo_ctx_init(struct compressor_ctx* ctx)
+{
+	/* the level is an argument of lzo1x_999_compress_level() anyway */
+	if (ctx->c & COMP_LZO_OPTIMIZED)
+	{
+		ctx->compress = lzo_compress_optimized;
+		ctx->compress_batch = lzo_compress_optimized_batch;
+	}
+	else
+		ctx->compress_batch = lzo_compress_batch;
+	ctx->decompress_batch = lzo_decompress_batch;
+
+	ctx->state = compressor_alloc(LZO1X_999_MEM_COMPRESS, "workspace");
+	return ctx->state != 0;
+}
+#endif /*ENABLE_LZO*/
 
 #ifdef ENABLE_LZ4
 enum lz4_options
@@ -47,165 +287,826 @@ enum lz4_options
 	COMP_LZ4_KNOWN_FLAG_MASK = COMP_LZ4_HC,
 	COMP_LZ4_FLAG_MASK = 0xffffff
 };
-#endif
 
-int compressor_init(uint32_t c)
+static int lz4_backend_init(uint32_t c)
 {
-	switch (c & COMP_ID_MASK)
+	if (((c & COMP_LZ4_FLAG_MASK) & ~COMP_LZ4_KNOWN_FLAG_MASK) != 0)
 	{
-		case COMP_ID_LZO:
-#ifdef ENABLE_LZO
-			if ((c & COMP_LZO_ALGO_MASK) < COMP_LZO_ALGO_LZO1X_999_MIN
-					|| (c & COMP_LZO_ALGO_MASK) > COMP_LZO_ALGO_LZO1X_999_MAX)
-			{
-				fprintf(stderr, "Unsupported LZO variant %02x\n",
-						c & COMP_LZO_ALGO_MASK);
-				return 0;
-			}
+		fprintf(stderr, "Unknown LZ4 flags enabled: %08x\n",
+				c & COMP_LZ4_FLAG_MASK);
+		return 0;
+	}
 
-			if (((c & COMP_LZO_FLAG_MASK) & ~COMP_LZO_KNOWN_FLAG_MASK) != 0)
-			{
-				fprintf(stderr, "Unknown LZO flags enabled: %06x\n",
-						c & COMP_LZO_FLAG_MASK & ~COMP_LZO_KNOWN_FLAG_MASK);
-				return 0;
-			}
+	return 1;
+}
 
-			if (lzo_init() != LZO_E_OK)
-			{
-				fprintf(stderr, "lzo_init() failed\n");
-				return 0;
-			}
+/* the extState variants are equivalent to the plain ones
+ * (default acceleration/level), they just reuse the state */
+static size_t lz4_compress_result(int out_bytes)
+{
+	if (out_bytes <= 0)
+	{
+		fprintf(stderr, "LZ4 compression failed\n");
+		return 0;
+	}
+
+	return out_bytes;
+}
+
+static size_t lz4_compress(struct compressor_ctx* ctx,
+		void* dest, void* src, size_t length, size_t out_size)
+{
+#ifdef HAVE_LZ4_COMPRESS_FAST_EXTSTATE
+	return lz4_compress_result(LZ4_compress_fast_extState(ctx->state,
+				src, dest, length, out_size, 1));
 #else
-			fprintf(stderr, "LZO support disabled at build time\n");
-			return 0;
+	return lz4_compress_result(LZ4_compress_limitedOutput(src, dest,
+				length, out_size));
 #endif
-			break;
+}
 
-		case COMP_ID_LZ4:
-#ifdef ENABLE_LZ4
-			if (((c & COMP_LZ4_FLAG_MASK) & ~COMP_LZ4_KNOWN_FLAG_MASK) != 0)
-			{
-				fprintf(stderr, "Unknown LZ4 flags enabled: %08x\n",
-						c & COMP_LZ4_FLAG_MASK);
-				return 0;
-			}
+static size_t lz4_compress_hc(struct compressor_ctx* ctx,
+		void* dest, void* src, size_t length, size_t out_size)
+{
+#ifdef HAVE_LZ4_COMPRESS_HC_EXTSTATEHC
+	return lz4_compress_result(LZ4_compress_HC_extStateHC(ctx->state,
+				src, dest, length, out_size, 0));
 #else
-			fprintf(stderr, "LZ4 support disabled at build time\n");
-			return 0;
+	return lz4_compress_result(LZ4_compressHC_limitedOutput(src, dest,
+				length, out_size));
+#endif
+}
+
+static size_t lz4_decompress(struct compressor_ctx* ctx,
+		void* dest, const void* src, size_t length, size_t out_size)
+{
+	int out_bytes;
+
+	(void) ctx;
+
+	out_bytes = LZ4_decompress_safe(src, dest, length, out_size);
+
+	if (out_bytes < 0)
+	{
+		fprintf(stderr, "LZ4 decompression failed (corrupted data?)\n");
+		return 0;
+	}
+
+	return out_bytes;
+}
+
+COMPRESS_BATCH(lz4_compress_batch, lz4_compress)
+COMPRESS_BATCH(lz4_compress_hc_batch, lz4_compress_hc)
+COMPRESS_BATCH(lz4_decompress_batch, lz4_decompress)
+
+static int lz4_ctx_init(struct compressor_ctx* ctx)
+{
+	size_t state_size = 0;
+
+	if (ctx->c & COMP_LZ4_HC)
+	{
+		ctx->compress = lz4_compress_hc;
+		ctx->compress_batch = lz4_compress_hc_batch;
+#ifdef HAVE_LZ4_COMPRESS_HC_EXTSTATEHC
+		state_size = LZ4_sizeofStateHC();
 #endif
-			break;
-		default:
-			fprintf(stderr, "Unknown compressor %02x requested\n",
-					c & COMP_ID_MASK);
+	}
+	else
+	{
+		ctx->compress_batch = lz4_compress_batch;
+#ifdef HAVE_LZ4_COMPRESS_FAST_EXTSTATE
+		state_size = LZ4_sizeofState();
+#endif
+	}
+	ctx->decompress_batch = lz4_decompress_batch;
+
+	if (!state_size)
+		return 1;
+	ctx->state = compressor_alloc(state_size, "state");
+	return ctx->state != 0;
+}
+#endif /*ENABLE_LZ4*/
+
+#ifdef ENABLE_ZLIB
+enum zlib_options
+{
+	COMP_ZLIB_LEVEL_MASK = 0x0f,
+	COMP_ZLIB_WINDOW_MASK = 0xf0,
+	COMP_ZLIB_WINDOW_SHIFT = 4,
+	COMP_ZLIB_STRATEGY_MASK = 0x1f00,
+	COMP_ZLIB_STRATEGY_SHIFT = 8,
+	COMP_ZLIB_KNOWN_FLAG_MASK = COMP_ZLIB_LEVEL_MASK
+		| COMP_ZLIB_WINDOW_MASK | COMP_ZLIB_STRATEGY_MASK,
+	COMP_ZLIB_FLAG_MASK = 0xffffff
+};
+
+/* in the order of the strategy bits, the first smallest result wins */
+static const int zlib_strategies[] = {
+	Z_DEFAULT_STRATEGY,
+	Z_FILTERED,
+	Z_HUFFMAN_ONLY,
+	Z_RLE,
+	Z_FIXED
+};
+
+struct zlib_state
+{
+	z_stream deflate;
+	z_stream inflate;
+	int deflate_ready;
+	int inflate_ready;
+};
+
+static int zlib_window_bits(uint32_t c)
+{
+	int bits = (c & COMP_ZLIB_WINDOW_MASK) >> COMP_ZLIB_WINDOW_SHIFT;
+
+	return bits ? bits : 15;
+}
+
+static unsigned int zlib_strategy_mask(uint32_t c)
+{
+	unsigned int mask = (c & COMP_ZLIB_STRATEGY_MASK)
+		>> COMP_ZLIB_STRATEGY_SHIFT;
+
+	return mask ? mask : 1;
+}
+
+static int zlib_backend_init(uint32_t c)
+{
+	if ((c & COMP_ZLIB_LEVEL_MASK) < 1 || (c & COMP_ZLIB_LEVEL_MASK) > 9)
+	{
+		fprintf(stderr, "Unsupported zlib compression level %d\n",
+				c & COMP_ZLIB_LEVEL_MASK);
+		return 0;
+	}
+
+	if (zlib_window_bits(c) < 8)
+	{
+		fprintf(stderr, "Unsupported zlib window size %d\n",
+				zlib_window_bits(c));
+		return 0;
+	}
+
+	if (((c & COMP_ZLIB_FLAG_MASK) & ~COMP_ZLIB_KNOWN_FLAG_MASK) != 0)
+	{
+		fprintf(stderr, "Unknown zlib flags enabled: %06x\n",
+				c & COMP_ZLIB_FLAG_MASK & ~COMP_ZLIB_KNOWN_FLAG_MASK);
+		return 0;
 	}
 
 	return 1;
 }
 
-size_t compressor_compress(uint32_t c,
-		void* dest, void* src, size_t length, size_t out_size)
+static int zlib_ctx_init(struct compressor_ctx* ctx)
 {
-	switch (c & COMP_ID_MASK)
+	struct zlib_state* s = calloc(1, sizeof(*s));
+	int ret;
+
+	if (!s)
 	{
-		case COMP_ID_LZO:
-#ifdef ENABLE_LZO
-		{
-			char workspace[LZO1X_999_MEM_COMPRESS];
+		fprintf(stderr, "Unable to allocate compressor state.\n"
+				"\terrno: %s\n", strerror(errno));
+		return 0;
+	}
+	ctx->state = s;
 
-			lzo_uint out_bytes = out_size;
-			lzo_uint orig_size = length;
+	/* the same parameters as the compress2() of mksquashfs */
+	ret = deflateInit2(&s->deflate, ctx->c & COMP_ZLIB_LEVEL_MASK,
+			Z_DEFLATED, zlib_window_bits(ctx->c), 8, Z_DEFAULT_STRATEGY);
+	if (ret == Z_OK)
+	{
+		s->deflate_ready = 1;
+		ret = inflateInit(&s->inflate);
+	}
+	if (ret != Z_OK)
+	{
+		fprintf(stderr, "Unable to initialize zlib stream: %d\n", ret);
+		return 0;
+	}
+	s->inflate_ready = 1;
 
-			if (lzo1x_999_compress_level(src, length, dest, &out_bytes,
-						workspace, 0, 0, 0, c & COMP_LZO_ALGO_MASK) != LZO_E_OK)
-			{
-				fprintf(stderr, "LZO compression failed\n");
-				return 0;
-			}
-
-			if (c & COMP_LZO_OPTIMIZED)
-			{
-				if (lzo1x_optimize(dest, out_bytes, src, &orig_size, 0)
-						!= LZO_E_OK)
-				{
-					fprintf(stderr, "LZO optimization failed\n");
-					return 0;
-				}
-			}
-
-			if (orig_size != length)
-			{
-				fprintf(stderr, "LZO optimization resulted in different input length\n");
+	return 1;
+}
+
+static void zlib_ctx_free(struct compressor_ctx* ctx)
+{
+	struct zlib_state* s = ctx->state;
+
+	if (!s)
+		return;
+	if (s->deflate_ready)
+		deflateEnd(&s->deflate);
+	if (s->inflate_ready)
+		inflateEnd(&s->inflate);
+	free(s);
+}
+
+static size_t zlib_compress(struct compressor_ctx* ctx,
+		void* dest, void* src, size_t length, size_t out_size)
+{
+	struct zlib_state* s = ctx->state;
+	z_stream* strm = &s->deflate;
+	unsigned int mask = zlib_strategy_mask(ctx->c);
+	size_t best = 0;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(zlib_strategies) / sizeof(*zlib_strategies); ++i)
+	{
+		unsigned char* out = dest;
+		int ret;
+
+		if (!(mask & (1 << i)))
+			continue;
+		/* the first result goes straight to dest */
+		if (best)
+		{
+			out = compressor_scratch(ctx, out_size);
+			if (!out)
 				return 0;
-			}
+		}
 
-			return out_bytes;
+		if (deflateReset(strm) != Z_OK
+				|| deflateParams(strm, ctx->c & COMP_ZLIB_LEVEL_MASK,
+					zlib_strategies[i]) != Z_OK)
+		{
+			fprintf(stderr, "zlib compression failed\n");
+			return 0;
 		}
-#endif
-			break;
 
-		case COMP_ID_LZ4:
-#ifdef ENABLE_LZ4
+		strm->next_in = src;
+		strm->avail_in = length;
+		strm->next_out = out;
+		strm->avail_out = out_size;
+		ret = deflate(strm, Z_FINISH);
+		/* did not fit, a larger block than the original */
+		if (ret == Z_OK || ret == Z_BUF_ERROR)
+			continue;
+		if (ret != Z_STREAM_END)
 		{
-			int out_bytes;
+			fprintf(stderr, "zlib compression failed: %d\n", ret);
+			return 0;
+		}
 
-			if (c & COMP_LZ4_HC)
-				out_bytes = LZ4_compressHC_limitedOutput(src, dest, length, out_size);
-			else
-				out_bytes = LZ4_compress_limitedOutput(src, dest, length, out_size);
+		if (!best || strm->total_out < best)
+		{
+			if (out != dest)
+				memcpy(dest, out, strm->total_out);
+			best = strm->total_out;
+		}
+	}
 
-			if (out_bytes <= 0)
-			{
-				fprintf(stderr, "LZ4 compression failed\n");
-				return 0;
-			}
+	if (!best)
+		fprintf(stderr, "zlib compression failed\n");
+	return best;
+}
 
-			return out_bytes;
+static size_t zlib_decompress(struct compressor_ctx* ctx,
+		void* dest, const void* src, size_t length, size_t out_size)
+{
+	struct zlib_state* s = ctx->state;
+	z_stream* strm = &s->inflate;
+
+	if (inflateReset(strm) != Z_OK)
+		return 0;
+
+	strm->next_in = (void*) src;
+	strm->avail_in = length;
+	strm->next_out = dest;
+	strm->avail_out = out_size;
+	if (inflate(strm, Z_FINISH) != Z_STREAM_END)
+	{
+		fprintf(stderr, "zlib decompression failed (corrupted data?)\n");
+		return 0;
+	}
+
+	return strm->total_out;
+}
+#endif /*ENABLE_ZLIB*/
+
+#ifdef ENABLE_XZ
+enum xz_options
+{
+	COMP_XZ_PRESET_MASK = 0x0f,
+	COMP_XZ_EXTREME = 0x10,
+	/* log2 of the dictionary size, 0 for the preset one */
+	COMP_XZ_DICT_MASK = 0x1f00,
+	COMP_XZ_DICT_SHIFT = 8,
+	/* the dictionary is one and a half of the above */
+	COMP_XZ_DICT_HALF = 0x2000,
+	COMP_XZ_FILTER_MASK = 0x3f0000,
+	COMP_XZ_FILTER_SHIFT = 16,
+	COMP_XZ_KNOWN_FLAG_MASK = COMP_XZ_PRESET_MASK | COMP_XZ_EXTREME
+		| COMP_XZ_DICT_MASK | COMP_XZ_DICT_HALF | COMP_XZ_FILTER_MASK,
+	COMP_XZ_FLAG_MASK = 0xffffff
+};
+
+/* in the order of the filter bits, tried after plain LZMA2
+ * like mksquashfs does; the first smallest result wins */
+static const lzma_vli xz_bcj_filters[] = {
+	LZMA_FILTER_X86,
+	LZMA_FILTER_POWERPC,
+	LZMA_FILTER_IA64,
+	LZMA_FILTER_ARM,
+	LZMA_FILTER_ARMTHUMB,
+	LZMA_FILTER_SPARC
+};
+
+static int xz_options(uint32_t c, lzma_options_lzma* opt)
+{
+	uint32_t preset = c & COMP_XZ_PRESET_MASK;
+	unsigned int dict_bits = (c & COMP_XZ_DICT_MASK) >> COMP_XZ_DICT_SHIFT;
+
+	if (c & COMP_XZ_EXTREME)
+		preset |= LZMA_PRESET_EXTREME;
+	if (preset > (9 | LZMA_PRESET_EXTREME) || lzma_lzma_preset(opt, preset))
+	{
+		fprintf(stderr, "Unsupported xz preset %d\n",
+				c & COMP_XZ_PRESET_MASK);
+		return 0;
+	}
+
+	if (dict_bits)
+	{
+		if (dict_bits < 12 || dict_bits > 30)
+		{
+			fprintf(stderr, "Unsupported xz dictionary size 2^%u\n",
+					dict_bits);
+			return 0;
 		}
-#endif
-			break;
+		opt->dict_size = (uint32_t) 1 << dict_bits;
+		if (c & COMP_XZ_DICT_HALF)
+			opt->dict_size += opt->dict_size / 2;
+	}
+	else if (c & COMP_XZ_DICT_HALF)
+	{
+		fprintf(stderr, "Unsupported xz dictionary size\n");
+		return 0;
 	}
 
-	return 0;
+	return 1;
 }
-size_t compressor_decompress(uint32_t c,
-		void* dest, const void* src, size_t length, size_t out_size)
+
+static int xz_backend_init(uint32_t c)
 {
-	switch (c & COMP_ID_MASK)
+	lzma_options_lzma opt;
+
+	if (((c & COMP_XZ_FLAG_MASK) & ~COMP_XZ_KNOWN_FLAG_MASK) != 0)
 	{
-		case COMP_ID_LZO:
-#ifdef ENABLE_LZO
+		fprintf(stderr, "Unknown xz flags enabled: %06x\n",
+				c & COMP_XZ_FLAG_MASK & ~COMP_XZ_KNOWN_FLAG_MASK);
+		return 0;
+	}
+
+	return xz_options(c, &opt);
+}
+
+static int xz_ctx_init(struct compressor_ctx* ctx)
+{
+	ctx->state = malloc(sizeof(lzma_options_lzma));
+	if (!ctx->state)
+	{
+		fprintf(stderr, "Unable to allocate compressor state.\n"
+				"\terrno: %s\n", strerror(errno));
+		return 0;
+	}
+
+	return xz_options(ctx->c, ctx->state);
+}
+
+static size_t xz_compress(struct compressor_ctx* ctx,
+		void* dest, void* src, size_t length, size_t out_size)
+{
+	unsigned int mask = (ctx->c & COMP_XZ_FILTER_MASK) >> COMP_XZ_FILTER_SHIFT;
+	lzma_filter filters[3];
+	size_t best = 0;
+	unsigned int i;
+
+	/* the plain LZMA2 first, then with each of the BCJ filters */
+	for (i = 0; i <= sizeof(xz_bcj_filters) / sizeof(*xz_bcj_filters); ++i)
+	{
+		unsigned char* out = dest;
+		size_t out_pos = 0;
+		int f = 0;
+		lzma_ret ret;
+
+		if (i > 0)
 		{
-			lzo_uint out_bytes = out_size;
+			if (!(mask & (1 << (i - 1))))
+				continue;
+			filters[f].id = xz_bcj_filters[i - 1];
+			filters[f++].options = 0;
+		}
+		filters[f].id = LZMA_FILTER_LZMA2;
+		filters[f++].options = ctx->state;
+		filters[f].id = LZMA_VLI_UNKNOWN;
 
-			if (lzo1x_decompress_safe(src, length, dest, &out_bytes, 0) != LZO_E_OK)
-			{
-				fprintf(stderr, "LZO decompression failed (corrupted data?)\n");
+		if (best)
+		{
+			out = compressor_scratch(ctx, out_size);
+			if (!out)
 				return 0;
-			}
+		}
 
-			return out_bytes;
+		ret = lzma_stream_buffer_encode(filters, LZMA_CHECK_CRC32, 0,
+				src, length, out, &out_pos, out_size);
+		/* did not fit, a larger block than the original */
+		if (ret == LZMA_BUF_ERROR)
+			continue;
+		if (ret != LZMA_OK)
+		{
+			fprintf(stderr, "xz compression failed: %d\n", ret);
+			return 0;
 		}
-#endif
-			break;
 
-		case COMP_ID_LZ4:
-#ifdef ENABLE_LZ4
+		if (!best || out_pos < best)
 		{
-			int out_bytes;
+			if (out != dest)
+				memcpy(dest, out, out_pos);
+			best = out_pos;
+		}
+	}
 
-			out_bytes = LZ4_decompress_safe(src, dest, length, out_size);
+	if (!best)
+		fprintf(stderr, "xz compression failed\n");
+	return best;
+}
 
-			if (out_bytes < 0)
-			{
-				fprintf(stderr, "LZ4 decompression failed (corrupted data?)\n");
-				return 0;
-			}
+static size_t xz_decompress(struct compressor_ctx* ctx,
+		void* dest, const void* src, size_t length, size_t out_size)
+{
+	uint64_t memlimit = UINT64_MAX;
+	size_t in_pos = 0, out_pos = 0;
 
-			return out_bytes;
-		}
+	(void) ctx;
+
+	if (lzma_stream_buffer_decode(&memlimit, 0, 0, src, &in_pos, length,
+				dest, &out_pos, out_size) != LZMA_OK
+			|| in_pos != length)
+	{
+		fprintf(stderr, "xz decompression failed (corrupted data?)\n");
+		return 0;
+	}
+
+	return out_pos;
+}
+#endif /*ENABLE_XZ*/
+
+#ifdef ENABLE_ZSTD
+enum zstd_options
+{
+	COMP_ZSTD_LEVEL_MASK = 0x1f,
+
+	COMP_ZSTD_KNOWN_FLAG_MASK = COMP_ZSTD_LEVEL_MASK,
+	COMP_ZSTD_FLAG_MASK = 0xffffff
+};
+
+/* kept for the consecutive blocks, with their tables allocated */
+struct zstd_state
+{
+	ZSTD_CCtx* cctx;
+	ZSTD_DCtx* dctx;
+};
+
+static int zstd_backend_init(uint32_t c)
+{
+	int level = c & COMP_ZSTD_LEVEL_MASK;
+
+	if (level < 1 || level > ZSTD_maxCLevel())
+	{
+		fprintf(stderr, "Unsupported zstd compression level %d\n", level);
+		return 0;
+	}
+
+	if (((c & COMP_ZSTD_FLAG_MASK) & ~COMP_ZSTD_KNOWN_FLAG_MASK) != 0)
+	{
+		fprintf(stderr, "Unknown zstd flags enabled: %06x\n",
+				c & COMP_ZSTD_FLAG_MASK & ~COMP_ZSTD_KNOWN_FLAG_MASK);
+		return 0;
+	}
+
+	return 1;
+}
+
+static int zstd_ctx_init(struct compressor_ctx* ctx)
+{
+	struct zstd_state* s = calloc(1, sizeof(*s));
+
+	if (!s)
+	{
+		fprintf(stderr, "Unable to allocate compressor state.\n"
+				"\terrno: %s\n", strerror(errno));
+		return 0;
+	}
+	ctx->state = s;
+
+	s->cctx = ZSTD_createCCtx();
+	s->dctx = ZSTD_createDCtx();
+	if (!s->cctx || !s->dctx)
+	{
+		fprintf(stderr, "Unable to allocate zstd contexts.\n");
+		return 0;
+	}
+
+	return 1;
+}
+
+static void zstd_ctx_free(struct compressor_ctx* ctx)
+{
+	struct zstd_state* s = ctx->state;
+
+	if (!s)
+		return;
+	ZSTD_freeCCtx(s->cctx);
+	ZSTD_freeDCtx(s->dctx);
+	free(s);
+}
+
+static size_t zstd_compress(struct compressor_ctx* ctx,
+		void* dest, void* src, size_t length, size_t out_size)
+{
+	struct zstd_state* s = ctx->state;
+	size_t bound = ZSTD_compressBound(length);
+	void* out = dest;
+	size_t ret;
+
+	/* zstd refuses output buffers without a margin, even if the result
+	 * would fit; the target length is exactly that of the result */
+	if (out_size < bound)
+	{
+		out = compressor_scratch(ctx, bound);
+		if (!out)
+			return 0;
+	}
+
+	/* the same call as mksquashfs, one frame per block */
+	ret = ZSTD_compressCCtx(s->cctx, out, out != dest ? bound : out_size,
+			src, length, ctx->c & COMP_ZSTD_LEVEL_MASK);
+	if (ZSTD_isError(ret))
+	{
+		fprintf(stderr, "zstd compression failed: %s\n",
+				ZSTD_getErrorName(ret));
+		return 0;
+	}
+	if (ret > out_size)
+	{
+		fprintf(stderr, "zstd compression failed: output too large\n");
+		return 0;
+	}
+
+	if (out != dest)
+		memcpy(dest, out, ret);
+	return ret;
+}
+
+static size_t zstd_decompress(struct compressor_ctx* ctx,
+		void* dest, const void* src, size_t length, size_t out_size)
+{
+	struct zstd_state* s = ctx->state;
+	size_t ret;
+
+	ret = ZSTD_decompressDCtx(s->dctx, dest, out_size, src, length);
+	if (ZSTD_isError(ret))
+	{
+		fprintf(stderr, "zstd decompression failed (corrupted data?)\n");
+		return 0;
+	}
+
+	return ret;
+}
+#endif /*ENABLE_ZSTD*/
+
+static const struct compressor_backend compressor_backends[] = {
+	{
+		COMP_ID_LZO, "LZO",
+#ifdef ENABLE_LZO
+		lzo_backend_init, lzo_ctx_init, compressor_free_state,
+		lzo_compress, lzo_decompress
+#else
+		0, 0, 0, 0, 0
+#endif
+	},
+	{
+		COMP_ID_LZ4, "LZ4",
+#ifdef ENABLE_LZ4
+		lz4_backend_init, lz4_ctx_init, compressor_free_state,
+		lz4_compress, lz4_decompress
+#else
+		0, 0, 0, 0, 0
+#endif
+	},
+	{
+		COMP_ID_ZLIB, "zlib",
+#ifdef ENABLE_ZLIB
+		zlib_backend_init, zlib_ctx_init, zlib_ctx_free,
+		zlib_compress, zlib_decompress
+#else
+		0, 0, 0, 0, 0
+#endif
+	},
+	{
+		COMP_ID_XZ, "xz",
+#ifdef ENABLE_XZ
+		xz_backend_init, xz_ctx_init, compressor_free_state,
+		xz_compress, xz_decompress
+#else
+		0, 0, 0, 0, 0
+#endif
+	},
+	{
+		COMP_ID_ZSTD, "zstd",
+#ifdef ENABLE_ZSTD
+		zstd_backend_init, zstd_ctx_init, zstd_ctx_free,
+		zstd_compress, zstd_decompress
+#else
+		0, 0, 0, 0, 0
 #endif
-			break;
 	}
+};
+
+static const struct compressor_backend* compressor_find(uint32_t c)
+{
+	size_t i;
 
+	for (i = 0; i < sizeof(compressor_backends)
+			/ sizeof(*compressor_backends); ++i)
+	{
+		const struct compressor_backend* b = &compressor_backends[i];
+
+		if (b->id != (c & COMP_ID_MASK))
+			continue;
+		if (!b->compress)
+		{
+			fprintf(stderr, "%s support disabled at build time\n", b->name);
+			return 0;
+		}
+		return b;
+	}
+
+	fprintf(stderr, "Unknown compressor %02x requested\n",
+			(c & COMP_ID_MASK) >> 24);
 	return 0;
 }
+
+int compressor_init(uint32_t c)
+{
+	const struct compressor_backend* b = compressor_find(c);
+
+	if (!b)
+		return 0;
+	return !b->init || b->init(c);
+}
+
+struct compressor_ctx* compressor_ctx_create(uint32_t c)
+{
+	struct compressor_ctx* ctx;
+	const struct compressor_backend* b = compressor_find(c);
+
+	if (!b)
+		return 0;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+	{
+		fprintf(stderr, "Unable to allocate memory for compressor.\n"
+				"\terrno: %s\n", strerror(errno));
+		return 0;
+	}
+	ctx->c = c;
+	ctx->backend = b;
+	ctx->compress = b->compress;
+	ctx->decompress = b->decompress;
+	ctx->compress_batch = compress_each;
+	ctx->decompress_batch = decompress_each;
+
+	if (b->ctx_init && !b->ctx_init(ctx))
+	{
+		compressor_ctx_destroy(ctx);
+		return 0;
+	}
+
+	return ctx;
+}
+
+void compressor_ctx_destroy(struct compressor_ctx* ctx)
+{
+	int i;
+
+	if (!ctx)
+		return;
+
+	for (i = 0; i < STATS_BLOCK_OP_COUNT; ++i)
+		stats_merge_blocks(ctx->c, i, &ctx->block_stats[i]);
+
+	if (ctx->backend->ctx_free)
+		ctx->backend->ctx_free(ctx);
+	free(ctx->scratch);
+	free(ctx);
+}
+
+struct compressor_ctx** compressor_ctx_create_set(uint32_t c,
+		unsigned int count)
+{
+	struct compressor_ctx** out;
+	unsigned int i;
+
+	out = calloc(count, sizeof(*out));
+	if (!out)
+	{
+		fprintf(stderr, "Unable to allocate memory for compressors.\n"
+				"\terrno: %s\n", strerror(errno));
+		return 0;
+	}
+
+	for (i = 0; i < count; ++i)
+	{
+		out[i] = compressor_ctx_create(c);
+		if (!out[i])
+		{
+			while (i-- > 0)
+				compressor_ctx_destroy(out[i]);
+			free(out);
+			return 0;
+		}
+	}
+
+	return out;
+}
+
+void compressor_ctx_destroy_set(struct compressor_ctx** set,
+		unsigned int count)
+{
+	unsigned int i;
+
+	if (!set)
+		return;
+
+	for (i = 0; i < count; ++i)
+		compressor_ctx_destroy(set[i]);
+	free(set);
+}
+
+size_t compressor_ctx_compress(struct compressor_ctx* ctx,
+		void* dest, void* src, size_t length, size_t out_size)
+{
+	double start;
+	size_t ret;
+
+	if (!stats_is_enabled())
+		return ctx->compress(ctx, dest, src, length, out_size);
+
+	start = stats_now();
+	ret = ctx->compress(ctx, dest, src, length, out_size);
+	stats_histogram_add(&ctx->block_stats[STATS_COMPRESS],
+			stats_now() - start);
+	return ret;
+}
+
+size_t compressor_ctx_decompress(struct compressor_ctx* ctx,
+		void* dest, const void* src, size_t length, size_t out_size)
+{
+	double start;
+	size_t ret;
+
+	if (!stats_is_enabled())
+		return ctx->decompress(ctx, dest, src, length, out_size);
+
+	start = stats_now();
+	ret = ctx->decompress(ctx, dest, src, length, out_size);
+	stats_histogram_add(&ctx->block_stats[STATS_DECOMPRESS],
+			stats_now() - start);
+	return ret;
+}
+
+void compressor_ctx_compress_batch(struct compressor_ctx* ctx,
+		struct compressor_block* blocks, size_t count)
+{
+	size_t i;
+
+	if (!stats_is_enabled())
+	{
+		ctx->compress_batch(ctx, blocks, count);
+		return;
+	}
+
+	/* timed block by block */
+	for (i = 0; i < count; ++i)
+		blocks[i].ret = compressor_ctx_compress(ctx, blocks[i].dest,
+				blocks[i].src, blocks[i].length, blocks[i].out_size);
+}
+
+void compressor_ctx_decompress_batch(struct compressor_ctx* ctx,
+		struct compressor_block* blocks, size_t count)
+{
+	size_t i;
+
+	if (!stats_is_enabled())
+	{
+		ctx->decompress_batch(ctx, blocks, count);
+		return;
+	}
+
+	for (i = 0; i < count; ++i)
+		blocks[i].ret = compressor_ctx_decompress(ctx, blocks[i].dest,
+				blocks[i].src, blocks[i].length, blocks[i].out_size);
+}
@@ -16,11 +16,42 @@
 #ifdef HAVE_STDINT_H
 #	include <stdint.h>
 #endif
+#include <stdlib.h>
+
+/* per-thread compressor state, reused for consecutive blocks */
+struct compressor_ctx;
 
 int compressor_init(uint32_t c);
-size_t compressor_compress(uint32_t c,
+
+struct compressor_ctx* compressor_ctx_create(uint32_t c);
+void compressor_ctx_destroy(struct compressor_ctx* ctx);
+
+/* one context per worker thread */
+struct compressor_ctx** compressor_ctx_create_set(uint32_t c,
+		unsigned int count);
+void compressor_ctx_destroy_set(struct compressor_ctx** set,
+		unsigned int count);
+
+size_t compressor_ctx_compress(struct compressor_ctx* ctx,
 		void* dest, void* src, size_t length, size_t out_size);
-size_t compressor_decompress(uint32_t c,
+size_t compressor_ctx_decompress(struct compressor_ctx* ctx,
 		void* dest, const void* src, size_t length, size_t out_size);
 
+/* a block of a batch; ret is set to the output length, 0 on failure */
+struct compressor_block
+{
+	void* dest;
+	void* src;
+	size_t length;
+	size_t out_size;
+
+	size_t ret;
+};
+
+/* process all the blocks, with the variant resolved once per batch */
+void compressor_ctx_compress_batch(struct compressor_ctx* ctx,
+		struct compressor_block* blocks, size_t count);
+void compressor_ctx_decompress_batch(struct compressor_ctx* ctx,
+		struct compressor_block* blocks, size_t count);
+
 #endif /*SDT_COMPRESSOR_H*/
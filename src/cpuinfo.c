@@ -0,0 +1,302 @@
+/**
+ * SquashFS delta merge tool
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <sched.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cpuinfo.h"
+
+#define CGROUP2_ROOT "/sys/fs/cgroup"
+#define NUMA_NODE_ROOT "/sys/devices/system/node"
+
+static unsigned int cpu_count_online(void)
+{
+	long num_cpus = 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+	num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_cpus < 1)
+	{
+		fprintf(stderr, "Warning: unable to get number of CPUs.\n");
+		num_cpus = 1;
+	}
+#endif
+
+	return num_cpus;
+}
+
+static unsigned int cpu_count_affinity(void)
+{
+#ifdef HAVE_SCHED_GETAFFINITY
+	cpu_set_t set;
+
+	if (sched_getaffinity(0, sizeof(set), &set) == 0)
+	{
+		int count = CPU_COUNT(&set);
+		if (count > 0)
+			return count;
+	}
+#endif
+
+	return cpu_count_online();
+}
+
+/* read the cgroup v2 cpu.max quota of a single cgroup, 0 if unlimited */
+static unsigned int cpu_read_cgroup_quota(const char* dir)
+{
+	char path[4096];
+	char quota[32];
+	unsigned long period;
+	unsigned long long q;
+	FILE* f;
+	int ret;
+
+	if (snprintf(path, sizeof(path), "%s/cpu.max", dir) >= (int) sizeof(path))
+		return 0;
+
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	ret = fscanf(f, "%31s %lu", quota, &period);
+	fclose(f);
+
+	if (ret != 2 || !strcmp(quota, "max") || period == 0)
+		return 0;
+
+	q = strtoull(quota, 0, 10);
+	if (q == 0)
+		return 0;
+
+	/* a fractional CPU still deserves a thread */
+	return (q + period - 1) / period;
+}
+
+static unsigned int cpu_count_cgroup(void)
+{
+	char line[4096];
+	char path[4096 + sizeof(CGROUP2_ROOT)];
+	unsigned int limit = 0;
+	FILE* f;
+
+	f = fopen("/proc/self/cgroup", "r");
+	if (!f)
+		return 0;
+
+	path[0] = 0;
+	while (fgets(line, sizeof(line), f))
+	{
+		/* the unified hierarchy is always listed as '0::/path' */
+		if (!strncmp(line, "0::", 3))
+		{
+			line[strcspn(line, "\n")] = 0;
+			snprintf(path, sizeof(path), "%s%s", CGROUP2_ROOT, line + 3);
+			break;
+		}
+	}
+	fclose(f);
+
+	if (!path[0])
+		return 0;
+
+	/* quotas of the parent groups apply as well */
+	for (;;)
+	{
+		unsigned int q = cpu_read_cgroup_quota(path);
+		char* slash;
+
+		if (q != 0 && (limit == 0 || q < limit))
+			limit = q;
+
+		if (strlen(path) <= sizeof(CGROUP2_ROOT) - 1)
+			break;
+		slash = strrchr(path, '/');
+		if (!slash)
+			break;
+		*slash = 0;
+	}
+
+	return limit;
+}
+
+unsigned int cpu_count_available(void)
+{
+	const char* env = getenv("SQUASHMERGE_THREADS");
+	unsigned int num_cpus, quota;
+
+	if (env && *env)
+	{
+		if (cpu_parse_job_count(env, &num_cpus))
+			return num_cpus;
+		fprintf(stderr, "Warning: ignoring invalid SQUASHMERGE_THREADS value.\n"
+				"\tvalue: %s\n", env);
+	}
+
+	num_cpus = cpu_count_affinity();
+	quota = cpu_count_cgroup();
+	if (quota != 0 && quota < num_cpus)
+		num_cpus = quota;
+
+	return num_cpus;
+}
+
+int cpu_parse_job_count(const char* str, unsigned int* out)
+{
+	char* end;
+	unsigned long val;
+
+	errno = 0;
+	val = strtoul(str, &end, 10);
+	if (errno != 0 || *end || end == str || val < 1 || val > 4096)
+		return 0;
+
+	*out = val;
+	return 1;
+}
+
+#if defined(HAVE_SCHED_GETAFFINITY) && defined(HAVE_PTHREAD_SETAFFINITY_NP)
+static int cpu_parse_list(const char* str, cpu_set_t* out)
+{
+	CPU_ZERO(out);
+
+	while (*str && *str != '\n')
+	{
+		char* end;
+		unsigned long first, last;
+
+		first = strtoul(str, &end, 10);
+		if (end == str)
+			return 0;
+		last = first;
+		str = end;
+
+		if (*str == '-')
+		{
+			++str;
+			last = strtoul(str, &end, 10);
+			if (end == str || last < first)
+				return 0;
+			str = end;
+		}
+
+		for (; first <= last && first < CPU_SETSIZE; ++first)
+			CPU_SET(first, out);
+
+		if (*str == ',')
+			++str;
+	}
+
+	return 1;
+}
+
+static int cpu_read_numa_nodes(cpu_set_t** nodes_out, const cpu_set_t* allowed)
+{
+	DIR* d;
+	struct dirent* de;
+	cpu_set_t* nodes = 0;
+	int node_count = 0;
+
+	d = opendir(NUMA_NODE_ROOT);
+	if (!d)
+		return 0;
+
+	while ((de = readdir(d)))
+	{
+		char path[sizeof(NUMA_NODE_ROOT) + 256 + 16];
+		char buf[4096];
+		cpu_set_t* new_nodes;
+		FILE* f;
+
+		if (strncmp(de->d_name, "node", 4)
+				|| !de->d_name[4]
+				|| strspn(de->d_name + 4, "0123456789") != strlen(de->d_name + 4))
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s/cpulist",
+				NUMA_NODE_ROOT, de->d_name);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		if (!fgets(buf, sizeof(buf), f))
+			buf[0] = 0;
+		fclose(f);
+
+		new_nodes = realloc(nodes, sizeof(*nodes) * (node_count + 1));
+		if (!new_nodes)
+		{
+			fprintf(stderr, "Unable to allocate memory for NUMA nodes.\n"
+					"\terrno: %s\n", strerror(errno));
+			free(nodes);
+			closedir(d);
+			return 0;
+		}
+		nodes = new_nodes;
+
+		if (!cpu_parse_list(buf, &nodes[node_count]))
+			continue;
+		CPU_AND(&nodes[node_count], &nodes[node_count], allowed);
+		if (CPU_COUNT(&nodes[node_count]) > 0)
+			++node_count;
+	}
+	closedir(d);
+
+	*nodes_out = nodes;
+	return node_count;
+}
+#endif
+
+int cpu_pin_pool_numa(struct thread_pool* p)
+{
+#if defined(HAVE_SCHED_GETAFFINITY) && defined(HAVE_PTHREAD_SETAFFINITY_NP)
+	cpu_set_t allowed;
+	cpu_set_t* nodes = 0;
+	int node_count;
+	unsigned int i;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+	{
+		fprintf(stderr, "Unable to get CPU affinity.\n"
+				"\terrno: %s\n", strerror(errno));
+		return 0;
+	}
+
+	node_count = cpu_read_numa_nodes(&nodes, &allowed);
+	if (node_count < 2)
+	{
+		/* nothing to gain on a single node */
+		free(nodes);
+		return 1;
+	}
+
+	/* spread workers over the nodes in contiguous groups, matching
+	 * their block ranges; the waiting thread is the caller's own,
+	 * and is left as it is */
+	for (i = 0; i < p->thread_count; ++i)
+	{
+		cpu_set_t* set = &nodes[(unsigned long) i * node_count / p->worker_count];
+		int ret = pthread_setaffinity_np(p->threads[i].thread_id,
+				sizeof(*set), set);
+
+		if (ret != 0)
+			fprintf(stderr, "Warning: unable to pin worker %u.\n"
+					"\terror: %s\n", i, strerror(ret));
+	}
+
+	free(nodes);
+	return 1;
+#else
+	fprintf(stderr, "Warning: CPU pinning is not supported on this system.\n");
+	return 1;
+#endif
+}
@@ -0,0 +1,20 @@
+/**
+ * SquashFS delta merge tool
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#pragma once
+
+#ifndef SDT_CPUINFO_H
+#define SDT_CPUINFO_H 1
+
+#include "threadpool.h"
+
+unsigned int cpu_count_available(void);
+int cpu_parse_job_count(const char* str, unsigned int* out);
+
+/* pins the spawned workers only, not the calling thread */
+int cpu_pin_pool_numa(struct thread_pool* p);
+
+#endif /*!SDT_CPUINFO_H*/
@@ -0,0 +1,715 @@
+/**
+ * SquashFS delta merge tool
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <arpa/inet.h> /* for endian conversion */
+
+#include "checksum.h"
+#include "compressor.h"
+#include "create.h"
+#include "sqdelta.h"
+#include "squashfs.h"
+#include "vcdiff.h"
+#include "xxhash.h"
+
+static const uint32_t sqdelta_magic = 0x5371ceb4UL;
+
+/* expanded target data per VCDIFF window */
+#define CREATE_WINDOW_SIZE (4 << 20)
+/* blocks, or checksum segments, per task */
+#define CREATE_TASK_BLOCKS 64
+
+enum create_block_state
+{
+	/* decompressed into the expanded image */
+	BLOCK_EXPANDED = 0,
+	/* kept compressed, and copied from the source to the target */
+	BLOCK_REUSED,
+	/* kept compressed and not listed, as it does not round-trip */
+	BLOCK_DROPPED
+};
+
+struct create_block
+{
+	uint32_t offset;
+	uint32_t length;
+	uint32_t uncompressed_length;
+	enum create_block_state state;
+
+	/* of the compressed data */
+	uint64_t hash;
+	/* the source block reused by a target block, or the block list
+	 * index of a source block */
+	size_t ref;
+	/* relative to the first uncompressed block */
+	size_t unc_offset;
+};
+
+struct create_image
+{
+	const struct mmap_file* f;
+	struct sqfs_image sqfs;
+	struct create_block* blocks;
+	size_t block_count;
+	/* check that the blocks compress back, for the target */
+	int verify;
+
+	struct compressor_ctx** comp_ctx;
+	unsigned int worker_count;
+	/* two buffers per worker, for the largest block */
+	unsigned char* scratch;
+	size_t scratch_size;
+
+	struct mmap_file expanded;
+	size_t expanded_length;
+	size_t unc_length;
+	/* of the block list, followed by the header */
+	size_t list_length;
+};
+
+typedef int (*create_range_func)(void* arg, size_t first, size_t last,
+		unsigned int worker_no);
+
+struct create_task
+{
+	create_range_func func;
+	void* arg;
+	size_t first;
+	size_t last;
+};
+
+static int create_task_run(void* data, unsigned int worker_no)
+{
+	const struct create_task* t = data;
+
+	return t->func(t->arg, t->first, t->last, worker_no);
+}
+
+/* run func over [0, count) on the workers, per_task items at a time */
+static int run_ranges(struct thread_pool* pool, create_range_func func,
+		void* arg, size_t count, size_t per_task)
+{
+	struct create_task* tasks;
+	struct pool_group group;
+	size_t task_count = (count + per_task - 1) / per_task;
+	size_t i;
+	int ret = 1;
+
+	if (task_count == 0)
+		return 1;
+
+	tasks = malloc(sizeof(*tasks) * task_count);
+	if (!tasks)
+	{
+		fprintf(stderr, "Unable to allocate memory for tasks.\n"
+				"\terrno: %s\n", strerror(errno));
+		return 0;
+	}
+
+	pool_group_init(&group);
+	for (i = 0; i < task_count; ++i)
+	{
+		struct create_task* t = &tasks[i];
+
+		t->func = func;
+		t->arg = arg;
+		t->first = i * per_task;
+		t->last = count - t->first > per_task ? t->first + per_task : count;
+		if (!thread_pool_submit(pool, &group, create_task_run, t))
+		{
+			pool_group_cancel(pool, &group);
+			ret = 0;
+			break;
+		}
+	}
+	if (!thread_pool_wait(pool, &group))
+		ret = 0;
+
+	free(tasks);
+	return ret;
+}
+
+static enum squashmerge_error image_open(struct create_image* img,
+		const struct mmap_file* f, int verify, unsigned int worker_count)
+{
+	size_t i;
+
+	img->f = f;
+	img->verify = verify;
+	img->worker_count = worker_count;
+
+	if (!sqfs_read_superblock(&img->sqfs, f))
+		return SQUASHMERGE_EFORMAT;
+	if (!compressor_init(img->sqfs.compression))
+		return SQUASHMERGE_EUNSUPPORTED;
+	if (!sqfs_read_blocks(&img->sqfs, f))
+		return SQUASHMERGE_EFORMAT;
+
+	img->block_count = img->sqfs.block_count;
+	img->blocks = calloc(img->block_count + 1, sizeof(*img->blocks));
+	if (!img->blocks)
+	{
+		fprintf(stderr, "Unable to allocate memory for block list.\n"
+				"\terrno: %s\n", strerror(errno));
+		return SQUASHMERGE_ENOMEM;
+	}
+
+	img->scratch_size = 1;
+	for (i = 0; i < img->block_count; ++i)
+	{
+		struct create_block* b = &img->blocks[i];
+		const struct sqfs_block* sb = &img->sqfs.blocks[i];
+
+		b->offset = sb->offset;
+		b->length = sb->length;
+		b->uncompressed_length = sb->uncompressed_length;
+		b->state = BLOCK_EXPANDED;
+
+		if (b->length > img->scratch_size)
+			img->scratch_size = b->length;
+		if (b->uncompressed_length > img->scratch_size)
+			img->scratch_size = b->uncompressed_length;
+	}
+
+	img->comp_ctx = compressor_ctx_create_set(img->sqfs.compression,
+			worker_count);
+	img->scratch = malloc(2 * img->scratch_size * worker_count);
+	if (!img->comp_ctx || !img->scratch)
+	{
+		if (img->comp_ctx)
+			fprintf(stderr, "Unable to allocate memory for buffers.\n"
+					"\terrno: %s\n", strerror(errno));
+		return SQUASHMERGE_ENOMEM;
+	}
+
+	return SQUASHMERGE_OK;
+}
+
+static void image_close(struct create_image* img)
+{
+	if (img->expanded.data)
+		mmap_close(&img->expanded);
+	compressor_ctx_destroy_set(img->comp_ctx, img->worker_count);
+	free(img->scratch);
+	free(img->blocks);
+	sqfs_image_free(&img->sqfs);
+}
+
+static int hash_blocks(void* arg, size_t first, size_t last,
+		unsigned int worker_no)
+{
+	struct create_image* img = arg;
+	size_t i;
+
+	(void) worker_no;
+
+	for (i = first; i < last; ++i)
+	{
+		struct create_block* b = &img->blocks[i];
+		const void* data = mmap_read(img->f, b->offset, b->length);
+
+		if (!data)
+			return 0;
+		b->hash = xxh64(data, b->length, 0);
+	}
+
+	return 1;
+}
+
+/* a source block, ordered by the hash */
+struct hashed_block
+{
+	uint64_t hash;
+	uint32_t length;
+	size_t index;
+};
+
+static int hashed_block_cmp(const void* a, const void* b)
+{
+	const struct hashed_block* ha = a;
+	const struct hashed_block* hb = b;
+
+	if (ha->hash != hb->hash)
+		return ha->hash < hb->hash ? -1 : 1;
+	if (ha->length != hb->length)
+		return ha->length < hb->length ? -1 : 1;
+	return 0;
+}
+
+/* mark the target blocks identical to source blocks reused, and the source
+ * blocks they use kept compressed; returns the count, -1 on failure */
+static ssize_t match_reused_blocks(struct create_image* source,
+		struct create_image* target)
+{
+	struct hashed_block* sorted;
+	ssize_t reused = 0;
+	size_t i;
+
+	sorted = malloc(sizeof(*sorted) * (source->block_count + 1));
+	if (!sorted)
+	{
+		fprintf(stderr, "Unable to allocate memory for block hashes.\n"
+				"\terrno: %s\n", strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < source->block_count; ++i)
+	{
+		sorted[i].hash = source->blocks[i].hash;
+		sorted[i].length = source->blocks[i].length;
+		sorted[i].index = i;
+	}
+	qsort(sorted, source->block_count, sizeof(*sorted), hashed_block_cmp);
+
+	for (i = 0; i < target->block_count; ++i)
+	{
+		struct create_block* b = &target->blocks[i];
+		struct hashed_block key;
+		size_t lo = 0, hi = source->block_count;
+
+		key.hash = b->hash;
+		key.length = b->length;
+
+		/* the first of the equal ones */
+		while (lo < hi)
+		{
+			size_t mid = lo + (hi - lo) / 2;
+
+			if (hashed_block_cmp(&sorted[mid], &key) < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		for (; lo < source->block_count
+				&& hashed_block_cmp(&sorted[lo], &key) == 0; ++lo)
+		{
+			struct create_block* sb = &source->blocks[sorted[lo].index];
+
+			if (!memcmp((const char*) source->f->data + sb->offset,
+						(const char*) target->f->data + b->offset, b->length))
+			{
+				b->state = BLOCK_REUSED;
+				b->ref = sorted[lo].index;
+				sb->state = BLOCK_REUSED;
+				++reused;
+				break;
+			}
+		}
+	}
+
+	free(sorted);
+	return reused;
+}
+
+/* decompress the blocks into the uncompressed part, and clear them;
+ * the blocks that do not decompress to the expected length, or do not
+ * compress back to the same data for the target, are dropped */
+static int expand_blocks(void* arg, size_t first, size_t last,
+		unsigned int worker_no)
+{
+	struct create_image* img = arg;
+	struct compressor_ctx* ctx = img->comp_ctx[worker_no];
+	unsigned char* unc = img->scratch + 2 * img->scratch_size * worker_no;
+	unsigned char* packed = unc + img->scratch_size;
+	unsigned char* out = img->expanded.data;
+	size_t i;
+
+	for (i = first; i < last; ++i)
+	{
+		struct create_block* b = &img->blocks[i];
+		const unsigned char* data = mmap_read(img->f, b->offset, b->length);
+
+		if (!data)
+			return 0;
+
+		/* the merge copies the reused target blocks from the source */
+		if (b->state == BLOCK_REUSED)
+		{
+			if (img->verify)
+				memset(out + b->offset, 0, b->length);
+			continue;
+		}
+
+		if (compressor_ctx_decompress(ctx, unc, data, b->length,
+					img->scratch_size) != b->uncompressed_length)
+		{
+			b->state = BLOCK_DROPPED;
+			continue;
+		}
+		if (img->verify
+				&& (compressor_ctx_compress(ctx, packed, unc,
+						b->uncompressed_length, b->length) != b->length
+					|| memcmp(packed, data, b->length)))
+		{
+			b->state = BLOCK_DROPPED;
+			continue;
+		}
+
+		memcpy(out + img->f->length + b->unc_offset, unc,
+				b->uncompressed_length);
+		memset(out + b->offset, 0, b->length);
+	}
+
+	return 1;
+}
+
+static int image_expand(struct thread_pool* pool, struct create_image* img)
+{
+	unsigned char* unc;
+	size_t unc_length = 0;
+	size_t entry_size = sizeof(struct compressed_block_reuse);
+	size_t i;
+
+	for (i = 0; i < img->block_count; ++i)
+	{
+		struct create_block* b = &img->blocks[i];
+
+		if (b->state != BLOCK_EXPANDED)
+			continue;
+		b->unc_offset = unc_length;
+		unc_length += b->uncompressed_length;
+	}
+
+	img->expanded = mmap_create_anonymous(img->f->length + unc_length
+			+ entry_size * img->block_count + sizeof(struct sqdelta_header));
+	if (!img->expanded.data)
+		return 0;
+	memcpy(img->expanded.data, img->f->data, img->f->length);
+
+	if (!run_ranges(pool, expand_blocks, img, img->block_count,
+				CREATE_TASK_BLOCKS))
+		return 0;
+
+	/* close the gaps of the dropped blocks */
+	unc = (unsigned char*) img->expanded.data + img->f->length;
+	unc_length = 0;
+	for (i = 0; i < img->block_count; ++i)
+	{
+		struct create_block* b = &img->blocks[i];
+
+		if (b->state != BLOCK_EXPANDED)
+			continue;
+		if (b->unc_offset != unc_length)
+			memmove(unc + unc_length, unc + b->unc_offset,
+					b->uncompressed_length);
+		b->unc_offset = unc_length;
+		unc_length += b->uncompressed_length;
+	}
+
+	img->unc_length = unc_length;
+	return 1;
+}
+
+/* write the block list and the header after the uncompressed blocks;
+ * the reused target blocks refer to the source block list */
+static void image_write_trailer(struct create_image* img, uint32_t flags,
+		const struct create_image* source)
+{
+	unsigned char* start = (unsigned char*) img->expanded.data
+		+ img->f->length + img->unc_length;
+	unsigned char* pos = start;
+	size_t entry_size = flags & SQDELTA_FLAG_BLOCK_REUSE
+		? sizeof(struct compressed_block_reuse)
+		: sizeof(struct compressed_block);
+	struct sqdelta_header h;
+	size_t count = 0;
+	size_t i;
+
+	for (i = 0; i < img->block_count; ++i)
+	{
+		struct create_block* b = &img->blocks[i];
+		struct compressed_block_reuse e;
+
+		if (b->state == BLOCK_DROPPED)
+			continue;
+
+		e.offset = htonl(b->offset);
+		e.length = htonl(b->length);
+		e.uncompressed_length = htonl(b->state == BLOCK_EXPANDED
+				? b->uncompressed_length : 0);
+		if (b->state == BLOCK_EXPANDED)
+			e.source = htonl(SQDELTA_NO_SOURCE);
+		else if (source)
+			e.source = htonl(source->blocks[b->ref].ref);
+		else
+			e.source = htonl(count);
+		/* the 3-field entries are the leading fields */
+		memcpy(pos, &e, entry_size);
+
+		if (!source)
+			b->ref = count;
+		pos += entry_size;
+		++count;
+	}
+
+	h.magic = htonl(sqdelta_magic);
+	h.flags = htonl(flags);
+	h.compression = htonl(img->sqfs.compression);
+	h.block_count = htonl(count);
+	memcpy(pos, &h, sizeof(h));
+
+	img->list_length = pos - start;
+	img->expanded_length = pos + sizeof(h)
+		- (unsigned char*) img->expanded.data;
+}
+
+/* the target checksum table, split at the expanded blocks */
+struct checksum_data
+{
+	const struct create_image* target;
+	/* the expanded blocks */
+	const struct create_block** blocks;
+	size_t block_count;
+	uint32_t* entries;
+};
+
+static int hash_segments(void* arg, size_t first, size_t last,
+		unsigned int worker_no)
+{
+	const struct checksum_data* c = arg;
+	const struct create_block** blocks = c->blocks;
+	size_t s;
+
+	(void) worker_no;
+
+	for (s = first; s < last; ++s)
+	{
+		size_t i = s / 2;
+		size_t start, end;
+		uint64_t h;
+
+		if (s % 2)
+		{
+			start = blocks[i]->offset;
+			end = start + blocks[i]->length;
+		}
+		else
+		{
+			start = i > 0 ? blocks[i - 1]->offset + blocks[i - 1]->length : 0;
+			end = i < c->block_count ? blocks[i]->offset
+				: c->target->f->length;
+		}
+
+		h = xxh64((const char*) c->target->f->data + start, end - start, 0);
+		c->entries[2 * s] = htonl((uint32_t) (h >> 32));
+		c->entries[2 * s + 1] = htonl((uint32_t) h);
+	}
+
+	return 1;
+}
+
+/* build the checksum table, header included */
+static uint32_t* target_checksums(struct thread_pool* pool,
+		const struct create_image* target, size_t* size)
+{
+	struct checksum_data c;
+	struct sqdelta_checksum_header h;
+	uint32_t* table;
+	size_t segments, i;
+	uint64_t digest;
+
+	c.target = target;
+	c.blocks = malloc(sizeof(*c.blocks) * (target->block_count + 1));
+	if (!c.blocks)
+	{
+		fprintf(stderr, "Unable to allocate memory for checksums.\n"
+				"\terrno: %s\n", strerror(errno));
+		return 0;
+	}
+
+	c.block_count = 0;
+	for (i = 0; i < target->block_count; ++i)
+	{
+		if (target->blocks[i].state == BLOCK_EXPANDED)
+			c.blocks[c.block_count++] = &target->blocks[i];
+	}
+	segments = 2 * c.block_count + 1;
+
+	*size = checksums_size(segments);
+	table = *size ? malloc(*size) : 0;
+	if (!table)
+	{
+		fprintf(stderr, "Unable to allocate memory for checksums.\n"
+				"\terrno: %s\n", strerror(errno));
+		free(c.blocks);
+		return 0;
+	}
+	c.entries = table + sizeof(h) / sizeof(*table);
+
+	if (!run_ranges(pool, hash_segments, &c, segments, CREATE_TASK_BLOCKS))
+	{
+		free(c.blocks);
+		free(table);
+		return 0;
+	}
+
+	digest = xxh64(c.entries, *size - sizeof(h), 0);
+	h.segment_count = htonl(segments);
+	h.digest[0] = htonl((uint32_t) (digest >> 32));
+	h.digest[1] = htonl((uint32_t) digest);
+	memcpy(table, &h, sizeof(h));
+
+	free(c.blocks);
+	return table;
+}
+
+struct window_data
+{
+	const struct vcdiff_encoder* encoder;
+	const unsigned char* target;
+	size_t length;
+	unsigned char** windows;
+	size_t* window_lengths;
+};
+
+static int encode_windows(void* arg, size_t first, size_t last,
+		unsigned int worker_no)
+{
+	const struct window_data* w = arg;
+	size_t i;
+
+	(void) worker_no;
+
+	for (i = first; i < last; ++i)
+	{
+		size_t offset = i * CREATE_WINDOW_SIZE;
+		size_t length = w->length - offset > CREATE_WINDOW_SIZE
+			? CREATE_WINDOW_SIZE : w->length - offset;
+
+		if (!vcdiff_encode_window(w->encoder, w->target + offset, length,
+					&w->windows[i], &w->window_lengths[i]))
+			return 0;
+	}
+
+	return 1;
+}
+
+static int write_data(int fd, const void* data, size_t length)
+{
+	struct mmap_file f = mmap_from_memory(data, length);
+
+	return mmap_write_to_fd(&f, length, fd, IO_SYNC_NONE);
+}
+
+enum squashmerge_error create_patch(struct thread_pool* pool,
+		const struct mmap_file* source_f, const struct mmap_file* target_f,
+		int patch_fd)
+{
+	struct create_image source;
+	struct create_image target;
+	struct vcdiff_encoder encoder;
+	struct window_data w;
+	unsigned char vcdiff_header[VCDIFF_HEADER_SIZE];
+	uint32_t* checksums = 0;
+	size_t checksums_length = 0;
+	size_t window_count = 0;
+	ssize_t reused;
+	uint32_t flags;
+	size_t i;
+
+	enum squashmerge_error ret;
+
+	memset(&source, 0, sizeof(source));
+	memset(&target, 0, sizeof(target));
+	memset(&w, 0, sizeof(w));
+	encoder.table = 0;
+
+	do
+	{
+		ret = image_open(&source, source_f, 0, pool->worker_count);
+		if (ret != SQUASHMERGE_OK)
+			break;
+		ret = image_open(&target, target_f, 1, pool->worker_count);
+		if (ret != SQUASHMERGE_OK)
+			break;
+
+		ret = SQUASHMERGE_ENOMEM;
+		if (!run_ranges(pool, hash_blocks, &source, source.block_count,
+					CREATE_TASK_BLOCKS)
+				|| !run_ranges(pool, hash_blocks, &target, target.block_count,
+					CREATE_TASK_BLOCKS))
+			break;
+		reused = match_reused_blocks(&source, &target);
+		if (reused == -1)
+			break;
+
+		if (!image_expand(pool, &source) || !image_expand(pool, &target))
+			break;
+
+		/* the source list first, the target refers to it */
+		flags = reused > 0 ? SQDELTA_FLAG_BLOCK_REUSE : 0;
+		image_write_trailer(&source, flags | SQDELTA_FLAG_CHECKSUMS, 0);
+		image_write_trailer(&target, flags, &source);
+
+		checksums = target_checksums(pool, &target, &checksums_length);
+		if (!checksums)
+			break;
+
+		if (!vcdiff_encoder_init(&encoder, source.expanded.data,
+					source.expanded_length))
+			break;
+
+		window_count = (target.expanded_length + CREATE_WINDOW_SIZE - 1)
+			/ CREATE_WINDOW_SIZE;
+		w.encoder = &encoder;
+		w.target = target.expanded.data;
+		w.length = target.expanded_length;
+		w.windows = calloc(window_count + 1, sizeof(*w.windows));
+		w.window_lengths = calloc(window_count + 1, sizeof(*w.window_lengths));
+		if (!w.windows || !w.window_lengths)
+		{
+			fprintf(stderr, "Unable to allocate memory for VCDIFF windows.\n"
+					"\terrno: %s\n", strerror(errno));
+			break;
+		}
+		if (!run_ranges(pool, encode_windows, &w, window_count, 1))
+			break;
+
+		/* the header and the block list are the trailer of the expanded
+		 * source, in the reverse order */
+		ret = SQUASHMERGE_EIO;
+		if (!write_data(patch_fd, (const char*) source.expanded.data
+					+ source.expanded_length - sizeof(struct sqdelta_header),
+					sizeof(struct sqdelta_header))
+				|| !write_data(patch_fd, (const char*) source.expanded.data
+					+ source_f->length + source.unc_length, source.list_length)
+				|| !write_data(patch_fd, checksums, checksums_length)
+				|| !write_data(patch_fd, vcdiff_header,
+					vcdiff_encode_header(vcdiff_header)))
+			break;
+		for (i = 0; i < window_count; ++i)
+		{
+			if (!write_data(patch_fd, w.windows[i], w.window_lengths[i]))
+				break;
+		}
+		if (i < window_count)
+			break;
+
+		ret = SQUASHMERGE_OK;
+	} while (0);
+
+	if (w.windows)
+	{
+		for (i = 0; i < window_count; ++i)
+			free(w.windows[i]);
+	}
+	free(w.windows);
+	free(w.window_lengths);
+	vcdiff_encoder_free(&encoder);
+	free(checksums);
+	image_close(&target);
+	image_close(&source);
+
+	return ret;
+}
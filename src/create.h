@@ -0,0 +1,29 @@
+/**
+ * SquashFS delta merge tool
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#pragma once
+
+#ifndef SDT_CREATE_H
+#define SDT_CREATE_H 1
+
+#include "squashmerge.h"
+#include "threadpool.h"
+#include "util.h"
+
+/*
+ * Patch generation between two SquashFS images. Both images are expanded
+ * in anonymous memory, on the worker threads: the target blocks are kept
+ * compressed unless they decompress to the expected length and compress
+ * back to the same data, and the target blocks identical to source blocks
+ * are reused verbatim. The patch carries the target checksums, and its
+ * VCDIFF data is encoded in independent windows, in parallel.
+ */
+
+enum squashmerge_error create_patch(struct thread_pool* pool,
+		const struct mmap_file* source_f, const struct mmap_file* target_f,
+		int patch_fd);
+
+#endif /*!SDT_CREATE_H*/
@@ -0,0 +1,375 @@
+/**
+ * SquashFS delta merge tool
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+/*
+ * Decoder for the DJW secondary compression used by xdelta3 to compress
+ * the VCDIFF sections. It is a semi-static Huffman coder with up to 8
+ * code tables selected per sector; the code lengths themselves are
+ * MTF + 1/2-run coded using another Huffman code.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include "djw.h"
+
+#define DJW_ALPHABET_SIZE 256
+#define DJW_MAX_CODELEN 20
+/* RUN_0, RUN_1 and MTF indices 1..DJW_MAX_CODELEN */
+#define DJW_TOTAL_CODES (DJW_MAX_CODELEN + 2)
+#define DJW_RUN_1 1
+#define DJW_EXTRA_12OFFSET 7
+#define DJW_EXTRA_CODE_BITS 4
+#define DJW_CLCLEN_BITS 4
+#define DJW_MAX_GROUPS 8
+#define DJW_GROUP_BITS 3
+#define DJW_SECTORSZ_MULT 5
+#define DJW_SECTORSZ_BITS 5
+#define DJW_GBCLEN_BITS 3
+
+struct bit_reader
+{
+	const unsigned char* pos;
+	const unsigned char* end;
+	unsigned int cur_byte;
+	unsigned int cur_mask;
+};
+
+struct huff_decoder
+{
+	unsigned char inorder[DJW_ALPHABET_SIZE];
+	long base[DJW_TOTAL_CODES + 1];
+	long limit[DJW_TOTAL_CODES + 1];
+	unsigned int min_len;
+	unsigned int max_len;
+	unsigned int code_count;
+};
+
+/* the initial MTF order of code lengths, most likely first */
+static const unsigned char djw_clen_mtf_init[DJW_MAX_CODELEN + 1] = {
+	0, 4, 5, 6, 7, 8, 9, 10, 3, 11, 2, 12, 13, 1, 14, 15, 16, 17, 18, 19, 20
+};
+
+/* bits are stored LSB-first, values MSB-first */
+static int bit_read(struct bit_reader* b, unsigned int* bit)
+{
+	if (b->cur_mask == 0x100)
+	{
+		if (b->pos == b->end)
+			return 0;
+
+		b->cur_byte = *b->pos++;
+		b->cur_mask = 1;
+	}
+
+	*bit = !!(b->cur_byte & b->cur_mask);
+	b->cur_mask <<= 1;
+	return 1;
+}
+
+static int bits_read(struct bit_reader* b, unsigned int nbits,
+		unsigned int* value)
+{
+	unsigned int v = 0;
+
+	while (nbits-- > 0)
+	{
+		unsigned int bit;
+
+		if (!bit_read(b, &bit))
+			return 0;
+		v = (v << 1) | bit;
+	}
+
+	*value = v;
+	return 1;
+}
+
+/* build canonical code decoder from code lengths (<= max_len each) */
+static void huff_build(struct huff_decoder* h, const unsigned char* clen,
+		unsigned int asize)
+{
+	unsigned int nr_len[DJW_TOTAL_CODES + 1];
+	long tmp_base[DJW_TOTAL_CODES + 1];
+	unsigned int i;
+
+	memset(nr_len, 0, sizeof(nr_len));
+	for (i = 0; i < asize; ++i)
+		++nr_len[clen[i]];
+
+	h->code_count = asize - nr_len[0];
+	if (h->code_count == 0)
+	{
+		h->min_len = h->max_len = 0;
+		return;
+	}
+
+	for (i = 1; nr_len[i] == 0; ++i)
+		;
+	h->min_len = i;
+	for (i = DJW_MAX_CODELEN; nr_len[i] == 0; --i)
+		;
+	h->max_len = i;
+
+	tmp_base[h->min_len] = 0;
+	h->base[h->min_len] = 0;
+	h->limit[h->min_len] = (long) nr_len[h->min_len] - 1;
+	for (i = h->min_len + 1; i <= h->max_len; ++i)
+	{
+		long last_limit = (h->limit[i - 1] + 1) << 1;
+
+		tmp_base[i] = tmp_base[i - 1] + nr_len[i - 1];
+		h->limit[i] = last_limit + nr_len[i] - 1;
+		h->base[i] = last_limit - tmp_base[i];
+	}
+
+	for (i = 0; i < asize; ++i)
+	{
+		if (clen[i] != 0)
+			h->inorder[tmp_base[clen[i]]++] = i;
+	}
+}
+
+static int huff_decode(struct bit_reader* b, const struct huff_decoder* h,
+		unsigned int* sym)
+{
+	long code = 0;
+	unsigned int len = 0;
+
+	for (;;)
+	{
+		unsigned int bit;
+
+		if (len == h->max_len)
+			return 0;
+		if (!bit_read(b, &bit))
+			return 0;
+
+		code = (code << 1) | bit;
+		++len;
+
+		if (len >= h->min_len && code <= h->limit[len])
+			break;
+	}
+
+	code -= h->base[len];
+	if (code < 0 || (unsigned long) code >= h->code_count)
+		return 0;
+
+	*sym = h->inorder[code];
+	return 1;
+}
+
+/* MTF + 1/2 run decoding; if skip_offset is non-zero, values whose
+ * counterpart skip_offset earlier is zero are known to be zero too */
+static int djw_decode_1_2(struct bit_reader* b, const struct huff_decoder* h,
+		unsigned char* mtf, unsigned int mtf_size,
+		unsigned int elts, unsigned int skip_offset, unsigned char* values)
+{
+	unsigned int n = 0;
+	unsigned long rep = 0;
+	unsigned int mtf_i = 0;
+	unsigned int shift = 0;
+
+	while (n < elts)
+	{
+		unsigned int sym;
+
+		if (skip_offset != 0 && n >= skip_offset
+				&& values[n - skip_offset] == 0)
+		{
+			values[n++] = 0;
+			continue;
+		}
+
+		if (rep != 0)
+		{
+			values[n++] = mtf[0];
+			--rep;
+			continue;
+		}
+
+		if (mtf_i != 0)
+		{
+			unsigned char v = mtf[mtf_i];
+
+			memmove(&mtf[1], &mtf[0], mtf_i);
+			mtf[0] = v;
+			values[n++] = v;
+			mtf_i = 0;
+			continue;
+		}
+
+		if (!huff_decode(b, h, &sym))
+			return 0;
+
+		if (sym <= DJW_RUN_1)
+		{
+			if (shift >= 24)
+				return 0;
+			rep = (unsigned long) (sym + 1) << shift;
+			++shift;
+		}
+		else
+		{
+			mtf_i = sym - DJW_RUN_1;
+			if (mtf_i >= mtf_size)
+				return 0;
+			shift = 0;
+		}
+	}
+
+	/* more repeats than values */
+	return rep == 0 && mtf_i == 0;
+}
+
+int djw_decompress(const unsigned char* in, size_t in_length,
+		unsigned char* out, size_t out_length)
+{
+	struct bit_reader b;
+	struct huff_decoder* groups_dec = 0;
+	unsigned char* sel_group = 0;
+	unsigned int groups, sector_size, num_codes, i;
+	size_t sectors, c;
+	int ret = 0;
+
+	b.pos = in;
+	b.end = in + in_length;
+	b.cur_byte = 0;
+	b.cur_mask = 0x100;
+
+	if (out_length == 0)
+	{
+		fprintf(stderr, "Invalid DJW section output size.\n");
+		return 0;
+	}
+
+	do
+	{
+		unsigned char clen[DJW_MAX_GROUPS * DJW_ALPHABET_SIZE];
+		unsigned char cl_clen[DJW_TOTAL_CODES];
+		unsigned char cl_mtf[DJW_MAX_CODELEN + 1];
+		struct huff_decoder cl_dec;
+
+		if (!bits_read(&b, DJW_GROUP_BITS, &groups))
+			break;
+		++groups;
+
+		if (groups > 1)
+		{
+			if (!bits_read(&b, DJW_SECTORSZ_BITS, &sector_size))
+				break;
+			sector_size = (sector_size + 1) * DJW_SECTORSZ_MULT;
+		}
+		else
+			sector_size = out_length > 0xffffffffUL
+				? 0xffffffffUL : out_length;
+		sectors = 1 + (out_length - 1) / sector_size;
+
+		/* code lengths of the code length code */
+		if (!bits_read(&b, DJW_EXTRA_CODE_BITS, &num_codes))
+			break;
+		num_codes += DJW_EXTRA_12OFFSET;
+
+		memset(cl_clen, 0, sizeof(cl_clen));
+		for (i = 0; i < num_codes; ++i)
+		{
+			unsigned int v;
+
+			if (!bits_read(&b, DJW_CLCLEN_BITS, &v))
+				break;
+			cl_clen[i] = v;
+		}
+		if (i != num_codes)
+			break;
+		huff_build(&cl_dec, cl_clen, DJW_TOTAL_CODES);
+
+		/* code lengths of all groups */
+		memcpy(cl_mtf, djw_clen_mtf_init, sizeof(cl_mtf));
+		if (!djw_decode_1_2(&b, &cl_dec, cl_mtf, sizeof(cl_mtf),
+					DJW_ALPHABET_SIZE * groups, DJW_ALPHABET_SIZE, clen))
+			break;
+
+		groups_dec = malloc(sizeof(*groups_dec) * groups);
+		if (!groups_dec)
+			break;
+		for (i = 0; i < groups * DJW_ALPHABET_SIZE; ++i)
+		{
+			if (clen[i] > DJW_MAX_CODELEN)
+				break;
+		}
+		if (i != groups * DJW_ALPHABET_SIZE)
+			break;
+		for (i = 0; i < groups; ++i)
+			huff_build(&groups_dec[i], &clen[i * DJW_ALPHABET_SIZE],
+					DJW_ALPHABET_SIZE);
+
+		sel_group = calloc(sectors, 1);
+		if (!sel_group)
+			break;
+
+		/* group selectors for each sector */
+		if (groups > 1)
+		{
+			unsigned char gb_clen[DJW_MAX_GROUPS + 1];
+			unsigned char sel_mtf[DJW_MAX_GROUPS];
+			struct huff_decoder sel_dec;
+
+			for (i = 0; i < groups + 1; ++i)
+			{
+				unsigned int v;
+
+				if (!bits_read(&b, DJW_GBCLEN_BITS, &v))
+					break;
+				gb_clen[i] = v;
+			}
+			if (i != groups + 1)
+				break;
+			huff_build(&sel_dec, gb_clen, groups + 1);
+
+			for (i = 0; i < groups; ++i)
+				sel_mtf[i] = i;
+			if (!djw_decode_1_2(&b, &sel_dec, sel_mtf, groups,
+						sectors, 0, sel_group))
+				break;
+		}
+
+		for (c = 0; c < sectors; ++c)
+		{
+			const struct huff_decoder* h = &groups_dec[sel_group[c]];
+			size_t n = out_length - c * sector_size;
+
+			if (n > sector_size)
+				n = sector_size;
+
+			while (n-- > 0)
+			{
+				unsigned int sym;
+
+				if (!huff_decode(&b, h, &sym))
+					break;
+				*out++ = sym;
+			}
+			if (n != (size_t) -1)
+				break;
+		}
+		if (c != sectors)
+			break;
+
+		ret = 1;
+	} while (0);
+
+	if (!ret)
+		fprintf(stderr, "DJW secondary decompression failed (corrupted data?)\n");
+
+	free(sel_group);
+	free(groups_dec);
+	return ret;
+}
@@ -0,0 +1,20 @@
+/**
+ * SquashFS delta merge tool
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#pragma once
+
+#ifndef SDT_DJW_H
+#define SDT_DJW_H 1
+
+#include <stdlib.h>
+
+/* xdelta3 secondary compressor id for the DJW static Huffman coder */
+#define DJW_SECONDARY_ID 1
+
+int djw_decompress(const unsigned char* in, size_t in_length,
+		unsigned char* out, size_t out_length);
+
+#endif /*!SDT_DJW_H*/
@@ -0,0 +1,522 @@
+/**
+ * SquashFS delta merge tool
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "expand.h"
+
+static int expanded_source_setup(struct expanded_source* e,
+		const struct mmap_file* source_f,
+		const struct block_table* blocks,
+		const void* block_list, size_t block_list_length,
+		const void* header, size_t header_length)
+{
+	e->source_f = source_f;
+	e->block_count = blocks->count;
+	e->block_offsets = blocks->offsets;
+	e->block_lengths = blocks->lengths;
+	e->unc_data = 0;
+	e->unc_length = 0;
+	e->unc_offsets = blocks->unc_offsets;
+	e->cache = 0;
+	e->block_list = block_list;
+	e->block_list_length = block_list_length;
+	e->header = header;
+	e->header_length = header_length;
+	e->target_f = 0;
+
+	/* the table is sorted already */
+	if (block_table_end(blocks) > source_f->length)
+	{
+		fprintf(stderr, "Block list exceeds the source file.\n"
+				"\toffset: 0x%08lx\n",
+				(unsigned long) blocks->offsets[blocks->count - 1]);
+		return 0;
+	}
+
+	return 1;
+}
+
+static void expanded_source_set_length(struct expanded_source* e)
+{
+	e->length = e->source_f->length + e->unc_length
+		+ e->block_list_length + e->header_length;
+}
+
+int expanded_source_init(struct expanded_source* e,
+		const struct mmap_file* source_f,
+		const struct block_table* blocks,
+		const void* block_list, size_t block_list_length,
+		const void* header, size_t header_length,
+		const void* unc_data, size_t unc_length)
+{
+	if (!expanded_source_setup(e, source_f, blocks,
+				block_list, block_list_length, header, header_length))
+		return 0;
+
+	e->unc_data = unc_data;
+	e->unc_length = unc_length;
+	expanded_source_set_length(e);
+	return 1;
+}
+
+int expanded_source_init_lazy(struct expanded_source* e,
+		const struct mmap_file* source_f,
+		const struct block_table* blocks,
+		const void* block_list, size_t block_list_length,
+		const void* header, size_t header_length,
+		uint32_t compression, size_t cache_size)
+{
+	size_t block_count = blocks->count;
+	struct block_cache* c;
+
+	if (!expanded_source_setup(e, source_f, blocks,
+				block_list, block_list_length, header, header_length))
+		return 0;
+
+	c = calloc(1, sizeof(*c));
+	if (c && pthread_mutex_init(&c->lock, 0) != 0)
+	{
+		free(c);
+		c = 0;
+	}
+	if (c && pthread_cond_init(&c->loaded, 0) != 0)
+	{
+		pthread_mutex_destroy(&c->lock);
+		free(c);
+		c = 0;
+	}
+	if (c)
+	{
+		c->data = calloc(block_count, sizeof(*c->data));
+		c->pins = calloc(block_count, sizeof(*c->pins));
+		c->loading = calloc(block_count, sizeof(*c->loading));
+		c->lru_prev = malloc(sizeof(*c->lru_prev) * (block_count + 1));
+		c->lru_next = malloc(sizeof(*c->lru_next) * (block_count + 1));
+	}
+	e->cache = c;
+	if (!c || !c->data || !c->pins || !c->loading
+			|| !c->lru_prev || !c->lru_next)
+	{
+		fprintf(stderr, "Unable to allocate memory for block cache.\n"
+				"\terrno: %s\n", strerror(errno));
+		expanded_source_free(e);
+		return 0;
+	}
+
+	e->unc_length = e->unc_offsets[block_count];
+	expanded_source_set_length(e);
+
+	c->compression = compression;
+	c->max_bytes = cache_size;
+	c->lru_prev[block_count] = block_count;
+	c->lru_next[block_count] = block_count;
+
+	return 1;
+}
+
+void expanded_source_free(struct expanded_source* e)
+{
+	if (e->cache)
+	{
+		size_t i;
+
+		if (e->cache->data)
+		{
+			for (i = 0; i < e->block_count; ++i)
+				free(e->cache->data[i]);
+		}
+		for (i = 0; i < e->cache->spare_count; ++i)
+			compressor_ctx_destroy(e->cache->spare_ctx[i]);
+		pthread_cond_destroy(&e->cache->loaded);
+		pthread_mutex_destroy(&e->cache->lock);
+		free(e->cache->spare_ctx);
+		free(e->cache->data);
+		free(e->cache->pins);
+		free(e->cache->loading);
+		free(e->cache->lru_prev);
+		free(e->cache->lru_next);
+		free(e->cache);
+		e->cache = 0;
+	}
+}
+
+static void block_cache_unlink(struct block_cache* c, size_t i)
+{
+	c->lru_next[c->lru_prev[i]] = c->lru_next[i];
+	c->lru_prev[c->lru_next[i]] = c->lru_prev[i];
+}
+
+static void block_cache_push_front(struct block_cache* c, size_t head,
+		size_t i)
+{
+	c->lru_prev[i] = head;
+	c->lru_next[i] = c->lru_next[head];
+	c->lru_prev[c->lru_next[head]] = i;
+	c->lru_next[head] = i;
+}
+
+/* called with the lock held, returns it to the LRU list when unused */
+static void block_cache_unpin(struct block_cache* c, size_t head, size_t i)
+{
+	if (--c->pins[i] == 0)
+		block_cache_push_front(c, head, i);
+}
+
+/* called with the lock held; 0 means a new context has to be created */
+static struct compressor_ctx* block_cache_take_ctx(struct block_cache* c)
+{
+	if (c->spare_count == 0)
+		return 0;
+	return c->spare_ctx[--c->spare_count];
+}
+
+/* called with the lock held */
+static void block_cache_return_ctx(struct block_cache* c,
+		struct compressor_ctx* ctx)
+{
+	if (c->spare_count == c->spare_alloc)
+	{
+		size_t new_alloc = c->spare_alloc ? c->spare_alloc * 2 : 8;
+		struct compressor_ctx** grown = realloc(c->spare_ctx,
+				sizeof(*grown) * new_alloc);
+
+		/* not worth failing the merge */
+		if (!grown)
+		{
+			compressor_ctx_destroy(ctx);
+			return;
+		}
+		c->spare_ctx = grown;
+		c->spare_alloc = new_alloc;
+	}
+	c->spare_ctx[c->spare_count++] = ctx;
+}
+
+/* decompress the block, without the lock held */
+static unsigned char* expanded_source_load_block(
+		const struct expanded_source* e, struct compressor_ctx* ctx,
+		size_t i)
+{
+	struct block_cache* c = e->cache;
+	size_t unc_length = e->unc_offsets[i + 1] - e->unc_offsets[i];
+	size_t ret;
+	unsigned char* data;
+
+	data = malloc(unc_length > 0 ? unc_length : 1);
+	if (!data)
+	{
+		fprintf(stderr, "Unable to allocate memory for decompressed block.\n"
+				"\terrno: %s\n", strerror(errno));
+		return 0;
+	}
+
+	ret = compressor_ctx_decompress(ctx, data,
+			(const unsigned char*) e->source_f->data + e->block_offsets[i],
+			e->block_lengths[i], unc_length);
+	if (ret != unc_length)
+	{
+		if (ret != 0)
+			fprintf(stderr, "Block decompression resulted in different size.\n"
+					"\toffset: 0x%08lx\n"
+					"\tlength: %lu\n"
+					"\texpected unpacked length: %lu\n"
+					"\treal unpacked length: %lu\n",
+					(unsigned long) e->block_offsets[i],
+					(unsigned long) e->block_lengths[i],
+					(unsigned long) unc_length, (unsigned long) ret);
+		free(data);
+		return 0;
+	}
+
+	if (c->reuse)
+	{
+		uint64_t hash[2];
+
+		reuse_hash(data, unc_length, hash);
+		if (!reuse_cache_add(c->reuse, hash, unc_length,
+					(const unsigned char*) e->source_f->data
+						+ e->block_offsets[i],
+					e->block_lengths[i], 0))
+		{
+			free(data);
+			return 0;
+		}
+	}
+
+	return data;
+}
+
+/* get the decompressed block pinned, decompressing it if necessary;
+ * called with the lock held, which is released while decompressing */
+static const unsigned char* expanded_source_get_block(
+		const struct expanded_source* e, size_t i)
+{
+	struct block_cache* c = e->cache;
+	size_t head = e->block_count;
+	size_t unc_length = e->unc_offsets[i + 1] - e->unc_offsets[i];
+	struct compressor_ctx* ctx;
+	unsigned char* data;
+
+	/* another reader may be decompressing it already */
+	while (c->loading[i])
+		pthread_cond_wait(&c->loaded, &c->lock);
+
+	if (c->data[i])
+	{
+		if (c->pins[i]++ == 0)
+			block_cache_unlink(c, i);
+		return c->data[i];
+	}
+
+	/* evict the least recently used blocks to make room */
+	while (c->cached_bytes + unc_length > c->max_bytes
+			&& c->lru_prev[head] != head)
+	{
+		size_t victim = c->lru_prev[head];
+
+		block_cache_unlink(c, victim);
+		c->cached_bytes -= e->unc_offsets[victim + 1] - e->unc_offsets[victim];
+		free(c->data[victim]);
+		c->data[victim] = 0;
+	}
+
+	c->loading[i] = 1;
+	c->cached_bytes += unc_length;
+	ctx = block_cache_take_ctx(c);
+	pthread_mutex_unlock(&c->lock);
+
+	if (!ctx)
+		ctx = compressor_ctx_create(c->compression);
+	data = ctx ? expanded_source_load_block(e, ctx, i) : 0;
+
+	pthread_mutex_lock(&c->lock);
+	if (ctx)
+		block_cache_return_ctx(c, ctx);
+	c->loading[i] = 0;
+	pthread_cond_broadcast(&c->loaded);
+	if (!data)
+	{
+		c->cached_bytes -= unc_length;
+		return 0;
+	}
+
+	c->data[i] = data;
+	c->pins[i] = 1;
+	return data;
+}
+
+/* copy the uncompressed blocks, decompressing them as necessary */
+static int expanded_source_read_lazy(const struct expanded_source* e,
+		unsigned char* dest, size_t offset, size_t length)
+{
+	struct block_cache* c = e->cache;
+	size_t head = e->block_count;
+	size_t lo = 0, hi = e->block_count;
+	size_t pinned = head;
+
+	/* find the block containing offset */
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (e->unc_offsets[mid + 1] <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	/* the blocks are pinned while copying, for the other readers
+	 * to use the cache meanwhile */
+	for (; length > 0; ++lo)
+	{
+		const unsigned char* data;
+		size_t block_pos = offset - e->unc_offsets[lo];
+		size_t n = e->unc_offsets[lo + 1] - offset;
+
+		pthread_mutex_lock(&c->lock);
+		if (pinned != head)
+			block_cache_unpin(c, head, pinned);
+		data = expanded_source_get_block(e, lo);
+		pthread_mutex_unlock(&c->lock);
+		if (!data)
+		{
+			pinned = head;
+			break;
+		}
+		pinned = lo;
+
+		if (n > length)
+			n = length;
+
+		memcpy(dest, data + block_pos, n);
+		dest += n;
+		offset += n;
+		length -= n;
+	}
+
+	if (pinned != head)
+	{
+		pthread_mutex_lock(&c->lock);
+		block_cache_unpin(c, head, pinned);
+		pthread_mutex_unlock(&c->lock);
+	}
+
+	return length == 0;
+}
+
+/* copy the source data, with the compressed blocks replaced by zeros */
+static void expanded_source_read_input(const struct expanded_source* e,
+		unsigned char* dest, size_t offset, size_t length)
+{
+	const unsigned char* src = e->source_f->data;
+	size_t lo = 0, hi = e->block_count;
+
+	/* find the first block ending past offset */
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (e->block_offsets[mid] + e->block_lengths[mid] <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	while (length > 0)
+	{
+		size_t n;
+
+		if (lo < e->block_count && e->block_offsets[lo] <= offset)
+		{
+			/* inside a compressed block */
+			n = e->block_offsets[lo] + e->block_lengths[lo] - offset;
+			if (n > length)
+				n = length;
+			memset(dest, 0, n);
+			++lo;
+		}
+		else
+		{
+			n = length;
+			if (lo < e->block_count && e->block_offsets[lo] - offset < n)
+				n = e->block_offsets[lo] - offset;
+			memcpy(dest, src + offset, n);
+		}
+
+		dest += n;
+		offset += n;
+		length -= n;
+	}
+}
+
+int expanded_source_read(void* priv, void* dest, uint64_t offset,
+		size_t length)
+{
+	const struct expanded_source* e = priv;
+	unsigned char* out = dest;
+	uint64_t part_start;
+	int i;
+
+	const unsigned char* parts[3];
+	size_t part_lengths[3];
+
+	if (offset + length > e->length || offset + length < offset)
+	{
+		fprintf(stderr, "Trying to read past expanded source.\n");
+		return 0;
+	}
+
+	/* input data */
+	part_start = e->source_f->length;
+	if (length > 0 && offset < part_start)
+	{
+		size_t n = part_start - offset;
+
+		if (n > length)
+			n = length;
+		expanded_source_read_input(e, out, offset, n);
+		out += n;
+		offset += n;
+		length -= n;
+	}
+
+	/* uncompressed blocks, block list and header */
+	parts[0] = e->unc_data;
+	part_lengths[0] = e->unc_length;
+	parts[1] = e->block_list;
+	part_lengths[1] = e->block_list_length;
+	parts[2] = e->header;
+	part_lengths[2] = e->header_length;
+
+	for (i = 0; i < 3 && length > 0; ++i)
+	{
+		if (offset < part_start + part_lengths[i])
+		{
+			size_t n = part_start + part_lengths[i] - offset;
+
+			if (n > length)
+				n = length;
+			if (i == 0 && e->cache)
+			{
+				if (!expanded_source_read_lazy(e, out,
+							offset - part_start, n))
+					return 0;
+			}
+			else
+				memcpy(out, parts[i] + (offset - part_start), n);
+			out += n;
+			offset += n;
+			length -= n;
+		}
+		part_start += part_lengths[i];
+	}
+
+	return 1;
+}
+
+/* clone the ranges that are verbatim source data into the target */
+static int expanded_source_copy(void* priv, void* dest,
+		uint64_t target_offset, uint64_t offset, size_t length)
+{
+	const struct expanded_source* e = priv;
+	size_t lo = 0, hi = e->block_count;
+
+	if (!e->target_f || offset + length > e->source_f->length)
+		return expanded_source_read(priv, dest, offset, length);
+
+	/* find the first block ending past offset, it must not overlap */
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (e->block_offsets[mid] + e->block_lengths[mid] <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if ((lo < e->block_count && e->block_offsets[lo] < offset + length)
+			|| !mmap_clone_range(e->target_f, target_offset,
+				e->source_f, offset, length))
+		return expanded_source_read(priv, dest, offset, length);
+
+	return 1;
+}
+
+void expanded_source_init_vcdiff(struct expanded_source* e,
+		struct vcdiff_source* src)
+{
+	src->read = expanded_source_read;
+	src->copy = expanded_source_copy;
+	src->priv = e;
+	src->length = e->length;
+}
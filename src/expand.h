@@ -0,0 +1,112 @@
+/**
+ * SquashFS delta merge tool
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#pragma once
+
+#ifndef SDT_EXPAND_H
+#define SDT_EXPAND_H 1
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#ifdef HAVE_STDINT_H
+#	include <stdint.h>
+#endif
+
+#include <pthread.h>
+
+#include "blocktable.h"
+#include "compressor.h"
+#include "reuse.h"
+#include "util.h"
+#include "vcdiff.h"
+
+/* LRU cache of lazily decompressed source blocks, shared by
+ * the windows decoded in parallel */
+struct block_cache
+{
+	/* guards the cache; the blocks are decompressed and copied out
+	 * without holding it, pinned meanwhile */
+	pthread_mutex_t lock;
+	/* signalled when a block is done decompressing */
+	pthread_cond_t loaded;
+	uint32_t compression;
+	/* contexts not in use, one is created for each concurrent read */
+	struct compressor_ctx** spare_ctx;
+	size_t spare_count;
+	size_t spare_alloc;
+	/* optional, gets the decompressed blocks registered */
+	struct reuse_cache* reuse;
+
+	/* decompressed data for each block, 0 if not cached */
+	unsigned char** data;
+	/* the readers copying from each block, which can not be evicted
+	 * and is kept off the LRU list meanwhile */
+	unsigned int* pins;
+	/* set while the block is being decompressed */
+	unsigned char* loading;
+	/* LRU list links, block_count is the list head */
+	size_t* lru_prev;
+	size_t* lru_next;
+
+	/* includes the blocks being decompressed */
+	size_t cached_bytes;
+	size_t max_bytes;
+};
+
+/*
+ * A virtual view of the expanded input file: the unchanged ranges are
+ * read from the source mapping, the compressed block ranges read as
+ * zeros, while the uncompressed blocks and the trailer come from memory.
+ */
+struct expanded_source
+{
+	const struct mmap_file* source_f;
+
+	/* compressed block locations, from the block table */
+	size_t block_count;
+	const uint32_t* block_offsets;
+	const uint32_t* block_lengths;
+
+	/* uncompressed blocks, either in memory or decompressed on demand */
+	const unsigned char* unc_data;
+	size_t unc_length;
+	const size_t* unc_offsets;
+	struct block_cache* cache;
+
+	/* block list and header, as stored in the patch */
+	const unsigned char* block_list;
+	size_t block_list_length;
+	const unsigned char* header;
+	size_t header_length;
+
+	/* optional, gets the verbatim source data cloned into it */
+	struct mmap_file* target_f;
+
+	uint64_t length;
+};
+
+int expanded_source_init(struct expanded_source* e,
+		const struct mmap_file* source_f,
+		const struct block_table* blocks,
+		const void* block_list, size_t block_list_length,
+		const void* header, size_t header_length,
+		const void* unc_data, size_t unc_length);
+int expanded_source_init_lazy(struct expanded_source* e,
+		const struct mmap_file* source_f,
+		const struct block_table* blocks,
+		const void* block_list, size_t block_list_length,
+		const void* header, size_t header_length,
+		uint32_t compression, size_t cache_size);
+void expanded_source_free(struct expanded_source* e);
+
+int expanded_source_read(void* priv, void* dest, uint64_t offset,
+		size_t length);
+void expanded_source_init_vcdiff(struct expanded_source* e,
+		struct vcdiff_source* src);
+
+#endif /*!SDT_EXPAND_H*/
@@ -0,0 +1,391 @@
+/**
+ * SquashFS delta merge tool
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h> /* for endian conversion */
+
+#include "journal.h"
+#include "reuse.h"
+
+static const uint32_t journal_magic = 0x53716a31UL;
+
+/* recompressed data synced between the checkpoints */
+#define JOURNAL_CHECKPOINT_BYTES (64 << 20)
+
+/* network-endian, the 64-bit values split into halves */
+struct journal_file_header
+{
+	uint32_t magic;
+	uint32_t block_count;
+	uint32_t inputs_hash[4];
+	uint32_t target_length[2];
+	uint32_t trailer_hash[4];
+};
+
+enum journal_block_state
+{
+	JOURNAL_BLOCK_TODO = 0,
+	JOURNAL_BLOCK_COMPRESSED,
+	/* compressed before the current checkpoint started */
+	JOURNAL_BLOCK_SYNCING,
+	JOURNAL_BLOCK_SYNCED
+};
+
+static void put64(uint32_t* out, uint64_t val)
+{
+	out[0] = htonl((uint32_t) (val >> 32));
+	out[1] = htonl((uint32_t) val);
+}
+
+static uint64_t get64(const uint32_t* in)
+{
+	return ((uint64_t) ntohl(in[0]) << 32) | ntohl(in[1]);
+}
+
+static size_t bitmap_size(size_t block_count)
+{
+	return (block_count + 7) / 8;
+}
+
+int journal_init(struct merge_journal* j, const char* path)
+{
+	int ret;
+
+	memset(j, 0, sizeof(*j));
+	j->path = path;
+	j->fd = -1;
+#ifdef ENABLE_TEST_HOOKS
+	/* lets the tests interrupt the recompression */
+	if (getenv("SQUASHMERGE_JOURNAL_STOP_AFTER"))
+		j->stop_after = strtoul(getenv("SQUASHMERGE_JOURNAL_STOP_AFTER"),
+				0, 10);
+#endif
+
+	ret = pthread_mutex_init(&j->lock, 0);
+	if (ret != 0)
+	{
+		fprintf(stderr, "Unable to initialize journal.\n"
+				"\terror: %s\n", strerror(ret));
+		return 0;
+	}
+
+	return 1;
+}
+
+void journal_free(struct merge_journal* j)
+{
+	if (j->fd != -1)
+		close(j->fd);
+	free(j->state);
+	free(j->bitmap);
+	pthread_mutex_destroy(&j->lock);
+}
+
+void journal_add_input(struct merge_journal* j, int fd, size_t length)
+{
+	uint64_t* out = &j->inputs[j->input_count++ * 4];
+	struct stat st;
+
+	if (fd != -1 && fstat(fd, &st) == 0)
+	{
+		out[0] = st.st_dev;
+		out[1] = st.st_ino;
+		out[2] = st.st_size;
+		out[3] = st.st_mtime;
+	}
+	else
+		out[2] = length;
+}
+
+static void journal_inputs_hash(const struct merge_journal* j,
+		uint64_t hash[2])
+{
+	reuse_hash(j->inputs, sizeof(*j->inputs) * 4 * j->input_count, hash);
+}
+
+static int journal_alloc(struct merge_journal* j, size_t block_count)
+{
+	j->block_count = block_count;
+	j->state = calloc(block_count + 1, sizeof(*j->state));
+	j->bitmap = calloc(bitmap_size(block_count) + 1, 1);
+	if (!j->state || !j->bitmap)
+	{
+		fprintf(stderr, "Unable to allocate memory for journal.\n"
+				"\terrno: %s\n", strerror(errno));
+		return 0;
+	}
+
+	return 1;
+}
+
+int journal_load(struct merge_journal* j)
+{
+	struct journal_file_header h;
+	uint64_t inputs_hash[2];
+
+	j->fd = open(j->path, O_RDWR);
+	if (j->fd == -1)
+	{
+		if (errno != ENOENT)
+			fprintf(stderr, "Warning: unable to open journal, starting over.\n"
+					"\tpath: %s\n"
+					"\terrno: %s\n", j->path, strerror(errno));
+		return 0;
+	}
+
+	journal_inputs_hash(j, inputs_hash);
+	/* an incomplete journal is as good as none */
+	if (pread(j->fd, &h, sizeof(h), 0) != sizeof(h)
+			|| ntohl(h.magic) != journal_magic
+			|| get64(&h.inputs_hash[0]) != inputs_hash[0]
+			|| get64(&h.inputs_hash[2]) != inputs_hash[1])
+	{
+		close(j->fd);
+		j->fd = -1;
+		return 0;
+	}
+
+	j->block_count = ntohl(h.block_count);
+	j->target_length = get64(h.target_length);
+	j->trailer_hash[0] = get64(&h.trailer_hash[0]);
+	j->trailer_hash[1] = get64(&h.trailer_hash[2]);
+	return 1;
+}
+
+int journal_resume(struct merge_journal* j,
+		const struct mmap_file* target_f, size_t block_count)
+{
+	size_t length = bitmap_size(block_count);
+	size_t done = 0;
+	size_t i;
+
+	if (block_count != j->block_count)
+		return 0;
+	if (!journal_alloc(j, block_count))
+		return 0;
+	if (pread(j->fd, j->bitmap, length, sizeof(struct journal_file_header))
+			!= (ssize_t) length)
+		return 0;
+
+	for (i = 0; i < block_count; ++i)
+	{
+		if (j->bitmap[i / 8] & (1 << (i % 8)))
+		{
+			j->state[i] = JOURNAL_BLOCK_SYNCED;
+			++done;
+		}
+	}
+
+	fprintf(stderr, "Resuming the merge from the journal.\n"
+			"\trecompressed blocks: %lu of %lu\n",
+			(unsigned long) done, (unsigned long) block_count);
+
+	j->target_f = target_f;
+	j->resumed = 1;
+	return 1;
+}
+
+int journal_discard(struct merge_journal* j)
+{
+	if (j->fd != -1)
+		close(j->fd);
+	j->fd = -1;
+
+	if (unlink(j->path) == -1 && errno != ENOENT)
+	{
+		fprintf(stderr, "Unable to remove journal.\n"
+				"\tpath: %s\n"
+				"\terrno: %s\n", j->path, strerror(errno));
+		return 0;
+	}
+
+	return 1;
+}
+
+static int journal_sync(int fd, const char* what)
+{
+#ifdef HAVE_FDATASYNC
+	if (fdatasync(fd) == -1)
+#else
+	if (fsync(fd) == -1)
+#endif
+	{
+		fprintf(stderr, "Unable to sync %s.\n"
+				"\terrno: %s\n", what, strerror(errno));
+		return 0;
+	}
+
+	return 1;
+}
+
+/* the journal may only list what is on the disk */
+static int journal_sync_target(const struct mmap_file* target_f)
+{
+	if (msync(target_f->data, target_f->length, MS_SYNC) == -1)
+	{
+		fprintf(stderr, "Unable to sync target file.\n"
+				"\terrno: %s\n", strerror(errno));
+		return 0;
+	}
+
+	return journal_sync(target_f->fd, "target file");
+}
+
+static int journal_write(struct merge_journal* j, const void* data,
+		size_t length, size_t offset)
+{
+	if (pwrite(j->fd, data, length, offset) != (ssize_t) length)
+	{
+		fprintf(stderr, "Unable to write journal.\n"
+				"\tpath: %s\n"
+				"\terrno: %s\n", j->path, strerror(errno));
+		return 0;
+	}
+
+	return 1;
+}
+
+int journal_begin(struct merge_journal* j, const struct mmap_file* target_f,
+		const uint64_t trailer_hash[2], size_t block_count)
+{
+	struct journal_file_header h;
+	uint64_t inputs_hash[2];
+
+	if (j->resumed)
+		return 1;
+
+	if (!journal_sync_target(target_f))
+		return 0;
+	if (!journal_alloc(j, block_count))
+		return 0;
+
+	j->fd = open(j->path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (j->fd == -1)
+	{
+		fprintf(stderr, "Unable to create journal.\n"
+				"\tpath: %s\n"
+				"\terrno: %s\n", j->path, strerror(errno));
+		return 0;
+	}
+
+	journal_inputs_hash(j, inputs_hash);
+	h.magic = htonl(journal_magic);
+	h.block_count = htonl(block_count);
+	put64(&h.inputs_hash[0], inputs_hash[0]);
+	put64(&h.inputs_hash[2], inputs_hash[1]);
+	put64(h.target_length, target_f->length);
+	put64(&h.trailer_hash[0], trailer_hash[0]);
+	put64(&h.trailer_hash[2], trailer_hash[1]);
+
+	/* the header last, a journal cut short before it is ignored */
+	if (!journal_write(j, j->bitmap, bitmap_size(block_count), sizeof(h))
+			|| !journal_write(j, &h, sizeof(h), 0)
+			|| !journal_sync(j->fd, "journal"))
+		return 0;
+
+	j->target_f = target_f;
+	return 1;
+}
+
+int journal_block_skipped(const struct merge_journal* j, size_t block)
+{
+	return j->resumed && j->state[block] == JOURNAL_BLOCK_SYNCED;
+}
+
+int journal_block_done(struct merge_journal* j, size_t block,
+		size_t length)
+{
+	int checkpoint;
+#ifdef ENABLE_TEST_HOOKS
+	int stop;
+#endif
+
+	pthread_mutex_lock(&j->lock);
+	j->state[block] = JOURNAL_BLOCK_COMPRESSED;
+	++j->pending;
+	j->pending_bytes += length;
+	checkpoint = j->pending_bytes >= JOURNAL_CHECKPOINT_BYTES
+		&& !j->checkpointing;
+#ifdef ENABLE_TEST_HOOKS
+	stop = ++j->done == j->stop_after;
+#endif
+	pthread_mutex_unlock(&j->lock);
+
+#ifdef ENABLE_TEST_HOOKS
+	if (stop)
+	{
+		journal_checkpoint(j);
+		fprintf(stderr, "Stopping the merge, as requested for testing.\n");
+		return 0;
+	}
+#endif
+
+	/* the worker stopping at the threshold does the checkpoint */
+	return !checkpoint || journal_checkpoint(j);
+}
+
+int journal_checkpoint(struct merge_journal* j)
+{
+	size_t length = bitmap_size(j->block_count);
+	size_t i;
+	int ret = 0;
+
+	pthread_mutex_lock(&j->lock);
+	if (j->checkpointing || j->pending == 0)
+	{
+		pthread_mutex_unlock(&j->lock);
+		return 1;
+	}
+	j->checkpointing = 1;
+	for (i = 0; i < j->block_count; ++i)
+	{
+		if (j->state[i] == JOURNAL_BLOCK_COMPRESSED)
+			j->state[i] = JOURNAL_BLOCK_SYNCING;
+	}
+	j->pending = 0;
+	j->pending_bytes = 0;
+	pthread_mutex_unlock(&j->lock);
+
+	do
+	{
+		/* the blocks marked syncing are in the mapping already */
+		if (!journal_sync_target(j->target_f))
+			break;
+
+		/* only this thread changes the bitmap */
+		pthread_mutex_lock(&j->lock);
+		for (i = 0; i < j->block_count; ++i)
+		{
+			if (j->state[i] == JOURNAL_BLOCK_SYNCING)
+			{
+				j->state[i] = JOURNAL_BLOCK_SYNCED;
+				j->bitmap[i / 8] |= 1 << (i % 8);
+			}
+		}
+		pthread_mutex_unlock(&j->lock);
+
+		/* the bits are only ever set, a torn write is still valid */
+		ret = journal_write(j, j->bitmap, length,
+					sizeof(struct journal_file_header))
+			&& journal_sync(j->fd, "journal");
+	} while (0);
+
+	pthread_mutex_lock(&j->lock);
+	j->checkpointing = 0;
+	pthread_mutex_unlock(&j->lock);
+
+	return ret;
+}
@@ -0,0 +1,96 @@
+/**
+ * SquashFS delta merge tool
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#pragma once
+
+#ifndef SDT_JOURNAL_H
+#define SDT_JOURNAL_H 1
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#ifdef HAVE_STDINT_H
+#	include <stdint.h>
+#endif
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "util.h"
+
+/*
+ * A record of a merge writing its target in place, for a rerun to
+ * resume the recompression instead of starting over. It is written
+ * once the expanded target is complete (and synced), identifying
+ * the inputs, the target length and its trailer, and then updated
+ * with the blocks recompressed (and synced) since.
+ */
+
+/* the inputs identified at most */
+#define JOURNAL_MAX_INPUTS 2
+
+struct merge_journal
+{
+	const char* path;
+	int fd;
+
+	/* st_dev, st_ino, st_size and st_mtime of each input */
+	uint64_t inputs[JOURNAL_MAX_INPUTS * 4];
+	unsigned int input_count;
+
+	uint64_t target_length;
+	uint64_t trailer_hash[2];
+	/* the journal was read back, and the blocks are to be skipped */
+	int resumed;
+
+	const struct mmap_file* target_f;
+	size_t block_count;
+	/* enum journal_block_state per block */
+	unsigned char* state;
+	/* the synced blocks, as written to the file */
+	unsigned char* bitmap;
+	/* blocks done since the last checkpoint */
+	size_t pending;
+	size_t pending_bytes;
+#ifdef ENABLE_TEST_HOOKS
+	/* for testing, fail the merge after a checkpoint at that many
+	 * blocks done, 0 to run through */
+	size_t stop_after;
+	size_t done;
+#endif
+	int checkpointing;
+	pthread_mutex_t lock;
+};
+
+int journal_init(struct merge_journal* j, const char* path);
+void journal_free(struct merge_journal* j);
+
+/* identify an input by its descriptor, or by the length if fd is -1 */
+void journal_add_input(struct merge_journal* j, int fd, size_t length);
+
+/* read a journal of the same inputs, returning 0 if there is none;
+ * the target needs to be checked against target_length
+ * and the trailer_hash then */
+int journal_load(struct merge_journal* j);
+/* continue a loaded journal with the blocks it lists done */
+int journal_resume(struct merge_journal* j,
+		const struct mmap_file* target_f, size_t block_count);
+/* remove the journal, before the target is overwritten */
+int journal_discard(struct merge_journal* j);
+
+/* sync the expanded target and start the journal for its blocks */
+int journal_begin(struct merge_journal* j, const struct mmap_file* target_f,
+		const uint64_t trailer_hash[2], size_t block_count);
+
+/* whether the block was recompressed by the earlier run */
+int journal_block_skipped(const struct merge_journal* j, size_t block);
+/* note the block recompressed, syncing once enough are */
+int journal_block_done(struct merge_journal* j, size_t block,
+		size_t length);
+/* sync the target and record the blocks recompressed until now */
+int journal_checkpoint(struct merge_journal* j);
+
+#endif /*!SDT_JOURNAL_H*/
@@ -0,0 +1,3323 @@
+/**
+ * SquashFS delta merge tool
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <pthread.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <arpa/inet.h> /* for endian conversion */
+
+#ifdef HAVE_STDINT_H
+#	include <stdint.h>
+#endif
+
+#include "blocktable.h"
+#include "checksum.h"
+#include "compressor.h"
+#include "cpuinfo.h"
+#include "create.h"
+#include "expand.h"
+#include "journal.h"
+#include "reuse.h"
+#include "scheduler.h"
+#include "sqdelta.h"
+#include "squashmerge.h"
+#include "stats.h"
+#include "stream.h"
+#include "threadpool.h"
+#include "util.h"
+#include "vcdiff.h"
+
+static const uint32_t sqdelta_magic = 0x5371ceb4UL;
+
+static struct sqdelta_header read_sqdelta_header(const struct mmap_file* f,
+		size_t offset)
+{
+	struct sqdelta_header* h;
+	struct sqdelta_header out;
+
+	out.magic = 0;
+
+	h = mmap_read(f, offset, sizeof(*h));
+	if (!h)
+		return out;
+
+	if (ntohl(h->magic) != sqdelta_magic)
+	{
+		fprintf(stderr, "Incorrect magic in patch file.\n"
+				"\tmagic: %08x, expected: %08x\n",
+				ntohl(h->magic), sqdelta_magic);
+		return out;
+	}
+
+	out.flags = ntohl(h->flags);
+	if (out.flags & ~SQDELTA_KNOWN_FLAGS)
+	{
+		fprintf(stderr, "Unknown flag enabled in patch file.\n"
+				"\tflags: %08x\n", ntohl(h->flags));
+		return out;
+	}
+
+	out.compression = ntohl(h->compression);
+	out.block_count = ntohl(h->block_count);
+	out.magic = sqdelta_magic;
+
+	return out;
+}
+
+/* a block reused verbatim from the source file, host-endian */
+struct reused_block
+{
+	size_t offset;
+	size_t length;
+	size_t source;
+};
+
+/* a block list split into the blocks going through (de)compression
+ * and the blocks passed through verbatim */
+struct block_list
+{
+	/* regular blocks, in the 3-field on-disk format */
+	struct compressed_block* blocks;
+	size_t block_count;
+	struct reused_block* reused;
+	size_t reused_count;
+	/* the regular blocks, decoded */
+	struct block_table table;
+
+	/* the list as stored in the file */
+	const struct compressed_block_reuse* entries;
+	size_t entry_count;
+	size_t size;
+
+	int owned;
+};
+
+static size_t block_list_entry_size(uint32_t flags)
+{
+	if (flags & SQDELTA_FLAG_BLOCK_REUSE)
+		return sizeof(struct compressed_block_reuse);
+	return sizeof(struct compressed_block);
+}
+
+static void block_list_free(struct block_list* l)
+{
+	if (l->owned)
+		free(l->blocks);
+	free(l->reused);
+	block_table_free(&l->table);
+	l->blocks = 0;
+	l->reused = 0;
+	l->owned = 0;
+}
+
+/* the regular blocks need to end at limit or before */
+static int block_list_read(const struct mmap_file* f, size_t offset,
+		const struct sqdelta_header* dh, struct block_list* l,
+		uint64_t limit)
+{
+	size_t entry_size = block_list_entry_size(dh->flags);
+	size_t i;
+
+	l->blocks = 0;
+	l->block_count = 0;
+	l->reused = 0;
+	l->reused_count = 0;
+	l->entries = 0;
+	l->entry_count = dh->block_count;
+	l->size = entry_size * dh->block_count;
+	l->owned = 0;
+	memset(&l->table, 0, sizeof(l->table));
+
+	if (l->size / entry_size != dh->block_count)
+	{
+		fprintf(stderr, "Block list size overflow.\n");
+		return 0;
+	}
+
+	if (!(dh->flags & SQDELTA_FLAG_BLOCK_REUSE))
+	{
+		l->blocks = mmap_read(f, offset, l->size);
+		l->block_count = dh->block_count;
+		return l->blocks && block_table_init(&l->table, l->blocks,
+				l->block_count, limit);
+	}
+
+	l->entries = mmap_read(f, offset, l->size);
+	if (!l->entries)
+		return 0;
+
+	l->blocks = malloc(sizeof(*l->blocks) * (l->entry_count + 1));
+	l->reused = malloc(sizeof(*l->reused) * (l->entry_count + 1));
+	l->owned = 1;
+	if (!l->blocks || !l->reused)
+	{
+		fprintf(stderr, "Unable to allocate memory for block list.\n"
+				"\terrno: %s\n", strerror(errno));
+		block_list_free(l);
+		return 0;
+	}
+
+	for (i = 0; i < l->entry_count; ++i)
+	{
+		const struct compressed_block_reuse* e = &l->entries[i];
+
+		if (ntohl(e->source) == SQDELTA_NO_SOURCE)
+		{
+			struct compressed_block* b = &l->blocks[l->block_count++];
+
+			b->offset = e->offset;
+			b->length = e->length;
+			b->uncompressed_length = e->uncompressed_length;
+		}
+		else
+		{
+			struct reused_block* r = &l->reused[l->reused_count++];
+
+			if (e->uncompressed_length != 0)
+			{
+				fprintf(stderr, "Reused block has uncompressed data.\n"
+						"\toffset: 0x%08lx\n",
+						(unsigned long) ntohl(e->offset));
+				block_list_free(l);
+				return 0;
+			}
+
+			r->offset = ntohl(e->offset);
+			r->length = ntohl(e->length);
+			r->source = ntohl(e->source);
+		}
+	}
+
+	if (!block_table_init(&l->table, l->blocks, l->block_count, limit))
+	{
+		block_list_free(l);
+		return 0;
+	}
+
+	return 1;
+}
+
+enum patch_format
+{
+	PATCH_UNKNOWN = 0,
+
+	PATCH_VCDIFF,
+	/* vcdiff using features of xdelta3 we do not implement */
+	PATCH_VCDIFF_XDELTA3
+};
+
+static const unsigned char vcdiff_magic[3] = {0xd6, 0xc3, 0xc4};
+
+/* without complete, only the magic is checked */
+static int read_patch_format(const struct mmap_file* f, size_t offset,
+		int complete)
+{
+	unsigned char* hdr;
+
+	hdr = mmap_read(f, offset, sizeof(vcdiff_magic));
+	if (!hdr)
+		return PATCH_UNKNOWN;
+
+	if (!memcmp(hdr, vcdiff_magic, sizeof(vcdiff_magic)))
+	{
+		if (!complete)
+			return PATCH_VCDIFF;
+
+		switch (vcdiff_probe(hdr, f->length - offset))
+		{
+			case VCDIFF_SUPPORTED:
+				return PATCH_VCDIFF;
+			case VCDIFF_UNSUPPORTED:
+				return PATCH_VCDIFF_XDELTA3;
+			default:
+				return PATCH_UNKNOWN;
+		}
+	}
+
+	fprintf(stderr, "Unknown delta format (only vcdiff"
+			" is supported at the moment).\n");
+	return PATCH_UNKNOWN;
+}
+
+/* wait for the rest of a patch that is still being read */
+static int patch_stream_finish(struct input_stream* stream,
+		struct mmap_file* patch_f, size_t patch_offset)
+{
+	if (!input_stream_finish(stream))
+		return 0;
+	patch_f->length = stream->length;
+
+	switch (read_patch_format(patch_f, patch_offset, 1))
+	{
+		case PATCH_VCDIFF:
+			return 1;
+		case PATCH_VCDIFF_XDELTA3:
+			fprintf(stderr, "The patch needs xdelta3, which needs the patch as a file.\n");
+			return 0;
+		default:
+			return 0;
+	}
+}
+
+/* with a memory limit, the part of the target decoded more than size
+ * bytes ago is dropped from memory as the patch is applied, along with
+ * the source mapping (the blocks needed again are reread) */
+struct merge_window
+{
+	const struct mmap_file* source_f;
+	/* set once the target is mapped */
+	const struct mmap_file* target_f;
+	size_t size;
+	/* the target is released up to here */
+	uint64_t released;
+};
+
+static void merge_window_advance(struct merge_window* w, uint64_t decoded)
+{
+	/* release in steps of size, not after every window */
+	if (!w->target_f || decoded < w->released + 2 * w->size)
+		return;
+
+	mmap_release_range(w->target_f, w->released,
+			decoded - w->size - w->released);
+	w->released = decoded - w->size;
+	if (w->source_f)
+		mmap_release_range(w->source_f, 0, w->source_f->length);
+}
+
+/* the progress callback of a merge */
+struct merge_progress
+{
+	squashmerge_progress_func func;
+	void* priv;
+	int cancelled;
+
+	/* the memory limit, follows the progress of the patch */
+	struct merge_window* window;
+	/* records the recompression, for a rerun to resume it */
+	struct merge_journal* journal;
+	/* the checksums of the (final) target, if the patch has them */
+	const struct target_checksums* checksums;
+};
+
+/* return 0 if the merge was cancelled */
+static int progress_report(struct merge_progress* p,
+		enum squashmerge_stage stage, uint64_t done, uint64_t total)
+{
+	if (p->func && !p->cancelled && !p->func(p->priv, stage, done, total))
+	{
+		fprintf(stderr, "Merge cancelled.\n");
+		p->cancelled = 1;
+	}
+	if (p->window && stage == SQUASHMERGE_STAGE_PATCH)
+		merge_window_advance(p->window, done);
+
+	return !p->cancelled;
+}
+
+/* the worker threads, with the options of the context using them */
+struct merge_pool
+{
+	struct thread_pool threads;
+	/* let the workers claim contiguous block ranges, for the memory
+	 * to be touched first by the thread working on it */
+	int local_ranges;
+	/* compressed source data the decompressing workers have read
+	 * ahead of the blocks they claim, 0 for none */
+	size_t prefetch;
+	/* back the temporary file mappings with huge pages */
+	int huge_pages;
+};
+
+struct compress_data_shared
+{
+	struct sqdelta_header* dh;
+	const struct block_table* blocks;
+	struct mmap_file* input_f;
+	struct mmap_file* output_f;
+	/* offset of the uncompressed blocks in their file */
+	size_t unc_base;
+	struct block_scheduler* sched;
+	struct merge_pool* pool;
+	struct pool_group* group;
+	struct compressor_ctx** comp_ctx;
+	struct reuse_cache* reuse;
+	/* drop the blocks from memory once recompressed */
+	int release;
+	struct merge_journal* journal;
+	/* verify the recompressed blocks against the patch */
+	const struct target_checksums* checksums;
+	int thread_count;
+};
+
+static int run_multithreaded(struct merge_pool* pool, pool_task_func func,
+		struct compress_data_shared* d)
+{
+	struct block_scheduler sched;
+	struct pool_group group;
+	unsigned int i;
+	int ret;
+
+	d->thread_count = pool->threads.worker_count;
+
+	if (!scheduler_init(&sched, d->blocks->unc_offsets, d->blocks->count,
+				pool->threads.worker_count, pool->local_ranges))
+		return 0;
+	d->sched = &sched;
+	d->pool = pool;
+	d->group = &group;
+
+	pool_group_init(&group);
+	for (i = 0; i < pool->threads.worker_count; ++i)
+	{
+		if (!thread_pool_submit(&pool->threads, &group, func, d))
+			break;
+	}
+
+	/* on failure, the remaining tasks notice the cancellation
+	 * between blocks and return early */
+	ret = thread_pool_wait(&pool->threads, &group);
+
+	scheduler_free(&sched);
+
+	return ret && i == pool->threads.worker_count;
+}
+
+/* the gap between source blocks read ahead together */
+#define PREFETCH_GAP (64 << 10)
+
+/* hint the source blocks claimed from order[first] on, up to the prefetch
+ * distance, skipping those before order[from] hinted already; the nearby
+ * blocks are coalesced into larger reads; returns the new end */
+static size_t prefetch_source_blocks(const struct compress_data_shared* d,
+		size_t from, size_t first)
+{
+	const struct block_table* blocks = d->blocks;
+	const size_t* order = d->sched->order;
+	size_t ahead = 0, start = 0, end = 0;
+
+	for (; first < blocks->count && ahead < d->pool->prefetch; ++first)
+	{
+		size_t offset = blocks->offsets[order[first]];
+		size_t length = blocks->lengths[order[first]];
+
+		ahead += length;
+		if (first < from)
+			continue;
+
+		if (end > start && offset >= start && offset <= end + PREFETCH_GAP)
+		{
+			if (offset + length > end)
+				end = offset + length;
+			continue;
+		}
+
+		if (end > start)
+			mmap_prefetch_range(d->input_f, start, end - start);
+		start = offset;
+		end = offset + length;
+	}
+
+	if (end > start)
+		mmap_prefetch_range(d->input_f, start, end - start);
+	return first > from ? first : from;
+}
+
+/* blocks passed to the compressor at once */
+#define BLOCK_BATCH_SIZE 16
+
+/* decompress order[first..last), at most BLOCK_BATCH_SIZE blocks */
+static int decompress_block_batch(struct compress_data_shared* d,
+		size_t first, size_t last, unsigned int worker_no)
+{
+	const struct block_table* source_blocks = d->blocks;
+	struct mmap_file* source_f = d->input_f;
+	struct mmap_file* temp_source_f = d->output_f;
+	const size_t* order = d->sched->order;
+
+	struct compressor_block batch[BLOCK_BATCH_SIZE];
+	size_t j;
+
+	for (j = first; j < last; ++j)
+	{
+		struct compressor_block* b = &batch[j - first];
+		size_t i = order[j];
+
+		b->length = source_blocks->lengths[i];
+		b->out_size = source_blocks->unc_lengths[i];
+		b->src = mmap_read(source_f, source_blocks->offsets[i], b->length);
+		b->dest = mmap_read(temp_source_f,
+				d->unc_base + source_blocks->unc_offsets[i], b->out_size);
+
+		if (!b->src || !b->dest)
+			return 0;
+	}
+
+	compressor_ctx_decompress_batch(d->comp_ctx[worker_no],
+			batch, last - first);
+
+	for (j = first; j < last; ++j)
+	{
+		const struct compressor_block* b = &batch[j - first];
+
+		if (b->ret != b->out_size)
+		{
+			if (b->ret != 0)
+				fprintf(stderr, "Block decompression resulted in different size.\n"
+						"\toffset: 0x%08lx\n"
+						"\tlength: %lu\n"
+						"\texpected unpacked length: %lu\n"
+						"\treal unpacked length: %lu\n",
+						(unsigned long) source_blocks->offsets[order[j]], b->length,
+						b->out_size, b->ret);
+
+			return 0;
+		}
+
+		/* remember the compressed form for recompression */
+		if (d->reuse)
+		{
+			uint64_t hash[2];
+
+			reuse_hash(b->dest, b->out_size, hash);
+			if (!reuse_cache_add(d->reuse, hash, b->out_size,
+						b->src, b->length, 0))
+				return 0;
+		}
+	}
+
+	return 1;
+}
+
+static int decompress_blocks(void* data, unsigned int worker_no)
+{
+	struct compress_data_shared* d = data;
+	struct block_scheduler* sched = d->sched;
+
+	size_t first, last, prefetched = 0;
+
+	while (scheduler_claim(sched, worker_no, &first, &last))
+	{
+		size_t j;
+
+		if (pool_group_cancelled(d->group))
+			return 0;
+
+		/* the following blocks are read in the background while
+		 * the claimed ones are decompressed */
+		if (d->pool->prefetch > 0)
+			prefetched = prefetch_source_blocks(d, prefetched, first);
+
+		for (j = first; j < last; j += BLOCK_BATCH_SIZE)
+		{
+			size_t end = last - j > BLOCK_BATCH_SIZE
+				? j + BLOCK_BATCH_SIZE : last;
+
+			if (!decompress_block_batch(d, j, end, worker_no))
+				return 0;
+		}
+
+		/* round-robin with the other merges on the pool */
+		if (d->pool->threads.shared)
+			return thread_pool_submit(&d->pool->threads, d->group,
+					decompress_blocks, d);
+	}
+
+	return 1;
+}
+
+/* decompress the source blocks into output_f, starting at base */
+static int decompress_source_blocks(struct merge_pool* pool,
+		struct compressor_ctx** comp_ctx,
+		struct sqdelta_header* dh,
+		const struct block_table* source_blocks,
+		struct mmap_file* source_f,
+		struct mmap_file* output_f,
+		size_t base,
+		struct reuse_cache* reuse)
+{
+	struct compress_data_shared d;
+
+	d.dh = dh;
+	d.blocks = source_blocks;
+	d.input_f = source_f;
+	d.output_f = output_f;
+	d.comp_ctx = comp_ctx;
+	d.release = 0;
+	d.journal = 0;
+	d.checksums = 0;
+	d.reuse = reuse;
+	d.unc_base = base;
+
+	return run_multithreaded(pool, decompress_blocks, &d);
+}
+
+static int expand_input(struct merge_pool* pool,
+		struct compressor_ctx** comp_ctx,
+		struct sqdelta_header* dh,
+		const struct block_table* source_blocks,
+		struct mmap_file* source_f,
+		struct mmap_file* patch_f,
+		size_t block_list_size,
+		struct mmap_file* temp_source_f,
+		struct reuse_cache* reuse)
+{
+	size_t prev_offset = 0;
+	size_t cloned;
+	size_t i;
+
+	if (block_table_end(source_blocks) > source_f->length)
+	{
+		fprintf(stderr, "Block list exceeds the source file.\n");
+		return 0;
+	}
+
+	/* share the source extents, then drop the compressed blocks */
+	cloned = mmap_clone_file(temp_source_f, source_f);
+	if (cloned > 0)
+	{
+		if (!mmap_copy_range(temp_source_f, cloned, source_f, cloned,
+					source_f->length - cloned))
+			return 0;
+		for (i = 0; i < dh->block_count; ++i)
+		{
+			if (!mmap_punch_hole(temp_source_f,
+						source_blocks->offsets[i], source_blocks->lengths[i]))
+				return 0;
+		}
+	}
+	else
+	{
+		/* copy the data between blocks, leaving holes for the blocks */
+		for (i = 0; i < dh->block_count; ++i)
+		{
+			size_t offset = source_blocks->offsets[i];
+			size_t length = source_blocks->lengths[i];
+
+			if (!mmap_copy_range(temp_source_f, prev_offset, source_f,
+						prev_offset, offset - prev_offset))
+				return 0;
+			prev_offset = offset + length;
+		}
+
+		/* the last block */
+		if (!mmap_copy_range(temp_source_f, prev_offset, source_f,
+					prev_offset, source_f->length - prev_offset))
+			return 0;
+	}
+
+	if (!decompress_source_blocks(pool, comp_ctx, dh, source_blocks,
+				source_f, temp_source_f, source_f->length, reuse))
+		return 0;
+
+	prev_offset = source_f->length
+		+ source_blocks->unc_offsets[source_blocks->count];
+
+	/* copy the block lists and the header */
+	{
+		void* in_pos = mmap_read(patch_f, sizeof(*dh),
+				block_list_size);
+		void* out_pos = mmap_read(temp_source_f,
+				prev_offset, block_list_size);
+		if (!in_pos || !out_pos)
+			return 0;
+
+		memcpy(out_pos, in_pos, block_list_size);
+
+		prev_offset += block_list_size;
+		in_pos = mmap_read(patch_f, 0, sizeof(*dh));
+		out_pos = mmap_read(temp_source_f, prev_offset, sizeof(*dh));
+		if (!in_pos || !out_pos)
+			return 0;
+		memcpy(out_pos, in_pos, sizeof(*dh));
+	}
+
+	return 1;
+}
+
+/* decompress the source blocks into anonymous memory and set up
+ * a virtual view of the expanded source on top of it */
+static int expand_input_in_memory(struct merge_pool* pool,
+		struct compressor_ctx** comp_ctx,
+		struct sqdelta_header* dh,
+		const struct block_table* source_blocks,
+		struct mmap_file* source_f,
+		struct mmap_file* patch_f,
+		size_t block_list_size,
+		size_t unc_length,
+		struct mmap_file* unc_f,
+		struct expanded_source* exp_source,
+		struct reuse_cache* reuse)
+{
+	*unc_f = mmap_create_anonymous(unc_length);
+	if (!unc_f->data)
+		return 0;
+
+	if (!decompress_source_blocks(pool, comp_ctx, dh, source_blocks,
+				source_f, unc_f, 0, reuse)
+			|| !expanded_source_init(exp_source, source_f, source_blocks,
+				(const char*) patch_f->data + sizeof(*dh), block_list_size,
+				patch_f->data, sizeof(*dh),
+				unc_f->data, unc_f->length))
+	{
+		mmap_close(unc_f);
+		return 0;
+	}
+
+	return 1;
+}
+
+static int run_xdelta3(struct mmap_file* patch, struct mmap_file* output,
+		const char* input_path)
+{
+	pid_t child_pid = fork();
+
+	if (child_pid == -1)
+	{
+		fprintf(stderr, "fork() failed\n"
+				"\terrno: %s\n", strerror(errno));
+		return 0;
+	}
+
+	if (child_pid == 0)
+	{
+		/* child */
+		if (close(0) == -1)
+		{
+			fprintf(stderr, "Unable to close stdin in child\n"
+					"\terrno: %s\n", strerror(errno));
+			exit(1);
+		}
+		if (close(1) == -1)
+		{
+			fprintf(stderr, "Unable to close stdout in child\n"
+					"\terrno: %s\n", strerror(errno));
+			exit(1);
+		}
+
+		if (dup2(patch->fd, 0) == -1)
+		{
+			fprintf(stderr, "Unable to dup2() patch file into stdin\n"
+					"\terrno: %s\n", strerror(errno));
+			exit(1);
+		}
+		if (dup2(output->fd, 1) == -1)
+		{
+			fprintf(stderr, "Unable to dup2() output file into stdout\n"
+					"\terrno: %s\n", strerror(errno));
+			exit(1);
+		}
+
+		if (execlp("xdelta3",
+					"xdelta3", "-c", "-d", "-s", input_path, 0) == -1)
+		{
+			fprintf(stderr, "execlp() failed\n"
+					"\terrno: %s\n", strerror(errno));
+			exit(1);
+		}
+	}
+	else
+	{
+		int ret;
+		waitpid(child_pid, &ret, 0);
+
+		if (WEXITSTATUS(ret) != 0)
+		{
+			fprintf(stderr, "Child exited with non-success status\n"
+					"\texit status: %d\n", WEXITSTATUS(ret));
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* check the recompressed block against the patch, if it has checksums */
+static int verify_target_block(const struct compress_data_shared* d,
+		size_t i)
+{
+	const struct block_table* target_blocks = d->blocks;
+	const void* data;
+
+	if (!d->checksums)
+		return 1;
+
+	data = mmap_read(d->output_f, target_blocks->offsets[i],
+			target_blocks->lengths[i]);
+	return data && checksum_verify(d->checksums, 2 * i + 1, data,
+			target_blocks->lengths[i], target_blocks->offsets[i]);
+}
+
+/* a block of a recompression batch */
+struct compress_batch_block
+{
+	size_t index;
+	uint64_t hash[2];
+};
+
+/* recompress the blocks order[first..last), or first..last if order
+ * is null, at most BLOCK_BATCH_SIZE blocks; the blocks skipped through
+ * the journal or reused are not passed to the compressor */
+static int compress_block_batch(struct compress_data_shared* d,
+		const size_t* order, size_t first, size_t last,
+		unsigned int worker_no)
+{
+	const struct block_table* target_blocks = d->blocks;
+	struct mmap_file* target_f = d->output_f;
+
+	struct compressor_block batch[BLOCK_BATCH_SIZE];
+	struct compress_batch_block info[BLOCK_BATCH_SIZE];
+	size_t count = 0;
+	size_t j;
+
+	for (j = first; j < last; ++j)
+	{
+		struct compressor_block* b = &batch[count];
+		size_t i = order ? order[j] : j;
+
+		/* recompressed (and synced) by the interrupted run */
+		if (d->journal && journal_block_skipped(d->journal, i))
+		{
+			if (!verify_target_block(d, i))
+				return 0;
+			continue;
+		}
+
+		b->length = target_blocks->unc_lengths[i];
+		b->out_size = target_blocks->lengths[i];
+		b->dest = mmap_read(target_f, target_blocks->offsets[i], b->out_size);
+		b->src = mmap_read(target_f,
+				d->unc_base + target_blocks->unc_offsets[i], b->length);
+		if (!b->src || !b->dest)
+			return 0;
+
+		/* an identical block was seen compressed already */
+		if (d->reuse)
+		{
+			const void* known;
+
+			reuse_hash(b->src, b->length, info[count].hash);
+			known = reuse_cache_lookup(d->reuse, info[count].hash,
+					b->length, b->out_size);
+			if (known)
+			{
+				memcpy(b->dest, known, b->out_size);
+				if (!verify_target_block(d, i))
+					return 0;
+				continue;
+			}
+		}
+
+		info[count++].index = i;
+	}
+
+	compressor_ctx_compress_batch(d->comp_ctx[worker_no], batch, count);
+
+	for (j = 0; j < count; ++j)
+	{
+		const struct compressor_block* b = &batch[j];
+		size_t i = info[j].index;
+
+		if (b->ret != b->out_size)
+		{
+			if (b->ret != 0)
+				fprintf(stderr, "Block re-compression resulted in different size.\n"
+						"\toffset: 0x%08lx\n"
+						"\tinput length: %lu\n"
+						"\texpected packed length: %lu\n"
+						"\treal packed length: %lu\n",
+						(unsigned long) target_blocks->offsets[i], b->length,
+						b->out_size, b->ret);
+
+			return 0;
+		}
+
+		/* while the data is still in the cache */
+		if (!verify_target_block(d, i))
+			return 0;
+		if (d->reuse && !reuse_cache_add(d->reuse, info[j].hash, b->length,
+					b->dest, b->out_size, 1))
+			return 0;
+		if (d->release)
+			mmap_release_range(target_f,
+					d->unc_base + target_blocks->unc_offsets[i], b->length);
+		if (d->journal && !journal_block_done(d->journal, i, b->length))
+			return 0;
+	}
+
+	return 1;
+}
+
+/* recompress order[first..last), or first..last if order is null */
+static int compress_block_run(struct compress_data_shared* d,
+		const size_t* order, size_t first, size_t last,
+		unsigned int worker_no)
+{
+	size_t j;
+
+	for (j = first; j < last; j += BLOCK_BATCH_SIZE)
+	{
+		size_t end = last - j > BLOCK_BATCH_SIZE
+			? j + BLOCK_BATCH_SIZE : last;
+
+		if (pool_group_cancelled(d->group))
+			return 0;
+		if (!compress_block_batch(d, order, j, end, worker_no))
+			return 0;
+	}
+
+	return 1;
+}
+
+static int compress_blocks(void* data, unsigned int worker_no)
+{
+	struct compress_data_shared* d = data;
+	struct block_scheduler* sched = d->sched;
+
+	size_t first, last;
+
+	while (scheduler_claim(sched, worker_no, &first, &last))
+	{
+		if (!compress_block_run(d, sched->order, first, last, worker_no))
+			return 0;
+
+		if (d->pool->threads.shared)
+			return thread_pool_submit(&d->pool->threads, d->group,
+					compress_blocks, d);
+	}
+
+	return 1;
+}
+
+/* a run of consecutive blocks submitted while the patch is applied */
+struct compress_range
+{
+	struct compress_data_shared* d;
+	size_t first;
+	size_t last;
+};
+
+static int compress_block_range(void* data, unsigned int worker_no)
+{
+	struct compress_range* r = data;
+
+	return compress_block_run(r->d, 0, r->first, r->last, worker_no);
+}
+
+/* find the block list and the uncompressed blocks in the expanded target;
+ * dh->block_count is set to the count of blocks to recompress */
+static int read_target_trailer(const struct mmap_file* target_f,
+		struct sqdelta_header* dh,
+		struct block_list* target_list,
+		size_t* unc_start)
+{
+	size_t block_list_size, block_list_offset, unc_total;
+
+	if (target_f->length < sizeof(*dh))
+	{
+		fprintf(stderr, "Expanded target file is too short.\n");
+		return 0;
+	}
+
+	*dh = read_sqdelta_header(target_f, target_f->length - sizeof(*dh));
+	if (dh->magic == 0)
+		return 0;
+
+	block_list_size = block_list_entry_size(dh->flags) * dh->block_count;
+	if (block_list_size / block_list_entry_size(dh->flags) != dh->block_count
+			|| block_list_size > target_f->length - sizeof(*dh))
+	{
+		fprintf(stderr, "Block list exceeds the target file size.\n");
+		return 0;
+	}
+	block_list_offset = target_f->length - sizeof(*dh) - block_list_size;
+
+	if (!block_list_read(target_f, block_list_offset, dh, target_list,
+				block_list_offset))
+		return 0;
+
+	unc_total = target_list->table.unc_offsets[target_list->block_count];
+	if (unc_total > block_list_offset)
+	{
+		fprintf(stderr, "Uncompressed blocks exceed the target file size.\n");
+		block_list_free(target_list);
+		return 0;
+	}
+
+	*unc_start = block_list_offset - unc_total;
+	if (block_table_end(&target_list->table) > *unc_start)
+	{
+		fprintf(stderr, "Compressed block overlaps uncompressed data.\n");
+		block_list_free(target_list);
+		return 0;
+	}
+	dh->block_count = target_list->block_count;
+	return 1;
+}
+
+/* a run of the segments between the target blocks to verify */
+struct checksum_range
+{
+	const struct mmap_file* target_f;
+	const struct block_table* blocks;
+	/* the end of the squashed image */
+	size_t end;
+	const struct target_checksums* checksums;
+	/* the blocks the segments precede, the last one ends at end */
+	size_t first;
+	size_t last;
+};
+
+static int verify_checksum_range(void* data, unsigned int worker_no)
+{
+	const struct checksum_range* r = data;
+	const struct block_table* blocks = r->blocks;
+	size_t i;
+
+	(void) worker_no;
+
+	for (i = r->first; i < r->last; ++i)
+	{
+		size_t start = i > 0 ? blocks->offsets[i - 1] + blocks->lengths[i - 1]
+			: 0;
+		size_t end = i < blocks->count ? blocks->offsets[i] : r->end;
+		const void* pos = mmap_read(r->target_f, start, end - start);
+
+		if (!pos || !checksum_verify(r->checksums, 2 * i, pos, end - start,
+					start))
+			return 0;
+	}
+
+	return 1;
+}
+
+/* the segments per task */
+#define CHECKSUM_RANGE_SEGMENTS 256
+
+/* verify the data around the target blocks (the blocks are verified
+ * as they are recompressed), in parallel */
+static int verify_target_data(struct merge_pool* pool,
+		const struct mmap_file* target_f, const struct block_table* blocks,
+		size_t squashed_length, const struct target_checksums* checksums)
+{
+	struct checksum_range* ranges;
+	struct pool_group group;
+	size_t segments = blocks->count + 1;
+	size_t range_count = (segments + CHECKSUM_RANGE_SEGMENTS - 1)
+		/ CHECKSUM_RANGE_SEGMENTS;
+	size_t i;
+	int ret = 1;
+
+	if (!checksums_match(checksums, blocks->count))
+		return 0;
+
+	ranges = malloc(sizeof(*ranges) * range_count);
+	if (!ranges)
+	{
+		fprintf(stderr, "Unable to allocate memory for checksum ranges.\n"
+				"\terrno: %s\n", strerror(errno));
+		return 0;
+	}
+
+	pool_group_init(&group);
+	for (i = 0; i < range_count; ++i)
+	{
+		struct checksum_range* r = &ranges[i];
+
+		r->target_f = target_f;
+		r->blocks = blocks;
+		r->end = squashed_length;
+		r->checksums = checksums;
+		r->first = i * CHECKSUM_RANGE_SEGMENTS;
+		r->last = r->first + CHECKSUM_RANGE_SEGMENTS < segments
+			? r->first + CHECKSUM_RANGE_SEGMENTS : segments;
+		if (!thread_pool_submit(&pool->threads, &group,
+					verify_checksum_range, r))
+		{
+			pool_group_cancel(&pool->threads, &group);
+			ret = 0;
+			break;
+		}
+	}
+	if (!thread_pool_wait(&pool->threads, &group))
+		ret = 0;
+
+	free(ranges);
+	return ret;
+}
+
+/* copy the compressed blocks the target shares with the source,
+ * and verify the data around the regular blocks if checksums are
+ * given; needs to be done before the trailer is truncated */
+static int copy_reused_blocks(struct merge_pool* pool,
+		const struct mmap_file* target_f,
+		const struct mmap_file* source_f,
+		const struct block_list* source_list,
+		const struct target_checksums* checksums)
+{
+	struct sqdelta_header dh;
+	struct block_list target_list;
+	size_t unc_start, i;
+	int ret = 1;
+
+	if (!read_target_trailer(target_f, &dh, &target_list, &unc_start))
+		return 0;
+
+	for (i = 0; i < target_list.reused_count; ++i)
+	{
+		const struct reused_block* r = &target_list.reused[i];
+		const struct compressed_block_reuse* src;
+		size_t offset, length;
+		void* in_pos;
+		void* out_pos;
+
+		if (!source_list->entries || r->source >= source_list->entry_count)
+		{
+			fprintf(stderr, "Reused block refers to unknown source block.\n"
+					"\toffset: 0x%08lx\n"
+					"\tsource block: %lu\n",
+					(unsigned long) r->offset, (unsigned long) r->source);
+			ret = 0;
+			break;
+		}
+
+		src = &source_list->entries[r->source];
+		offset = ntohl(src->offset);
+		length = ntohl(src->length);
+		if (length != r->length || r->offset + r->length > unc_start)
+		{
+			fprintf(stderr, "Reused block does not match the source block.\n"
+					"\toffset: 0x%08lx\n"
+					"\tsource block: %lu\n",
+					(unsigned long) r->offset, (unsigned long) r->source);
+			ret = 0;
+			break;
+		}
+
+		in_pos = mmap_read(source_f, offset, length);
+		out_pos = mmap_read(target_f, r->offset, length);
+		if (!in_pos || !out_pos)
+		{
+			ret = 0;
+			break;
+		}
+
+		memcpy(out_pos, in_pos, length);
+	}
+
+	if (ret && checksums)
+		ret = verify_target_data(pool, target_f, &target_list.table,
+				unc_start, checksums);
+
+	block_list_free(&target_list);
+	return ret;
+}
+
+/* reuse the contexts from expansion unless the target
+ * is compressed differently */
+static struct compressor_ctx** target_compressors(struct merge_pool* pool,
+		struct compressor_ctx** comp_ctx, uint32_t comp_ctx_type,
+		uint32_t compression, struct compressor_ctx*** own_ctx)
+{
+	*own_ctx = 0;
+	if (compression == comp_ctx_type)
+		return comp_ctx;
+
+	if (!compressor_init(compression))
+		return 0;
+	*own_ctx = compressor_ctx_create_set(compression,
+			pool->threads.worker_count);
+	return *own_ctx;
+}
+
+/* known compressed blocks are only usable for the same compression */
+static struct reuse_cache* target_reuse_cache(struct reuse_cache* reuse,
+		uint32_t compression)
+{
+	if (reuse && reuse->compression == compression)
+		return reuse;
+	return 0;
+}
+
+static int truncate_target_file(struct mmap_file* target_f, size_t length)
+{
+	if (ftruncate(target_f->fd, length) == -1)
+	{
+		fprintf(stderr, "Unable to truncate output file.\n"
+				"\terrno: %s\n", strerror(errno));
+		return 0;
+	}
+
+	return 1;
+}
+
+/* the hash of the block list and the header ending the expanded target */
+static void target_trailer_hash(const struct mmap_file* target_f,
+		const struct block_list* target_list, uint64_t hash[2])
+{
+	size_t length = target_list->size + sizeof(struct sqdelta_header);
+
+	reuse_hash((const char*) target_f->data + target_f->length - length,
+			length, hash);
+}
+
+/* recompress the expanded target in place; the squashed image
+ * is the first squashed_length bytes of it; the window and
+ * the journal are taken from progress, if not 0 */
+static int squash_target_file(struct merge_pool* pool,
+		struct compressor_ctx** comp_ctx, uint32_t comp_ctx_type,
+		struct mmap_file* target_f, size_t* squashed_length,
+		struct reuse_cache* reuse, struct merge_progress* progress)
+{
+	struct compressor_ctx** own_ctx;
+	struct sqdelta_header dh;
+	struct block_list target_list;
+	struct merge_journal* journal = progress ? progress->journal : 0;
+	size_t unc_start;
+
+	if (!read_target_trailer(target_f, &dh, &target_list, &unc_start))
+		return 0;
+	if (progress && progress->checksums
+			&& !checksums_match(progress->checksums, dh.block_count))
+	{
+		block_list_free(&target_list);
+		return 0;
+	}
+
+	/* the patch is done, from here on the target can be resumed */
+	if (journal)
+	{
+		uint64_t hash[2];
+
+		target_trailer_hash(target_f, &target_list, hash);
+		if (!journal_begin(journal, target_f, hash, dh.block_count))
+		{
+			block_list_free(&target_list);
+			return 0;
+		}
+	}
+
+	{
+		struct compress_data_shared d;
+		int mt_ret;
+
+		d.dh = &dh;
+		d.blocks = &target_list.table;
+		d.unc_base = unc_start;
+		d.output_f = target_f;
+		d.reuse = target_reuse_cache(reuse, dh.compression);
+		d.release = progress && progress->window;
+		d.journal = journal;
+		d.checksums = progress ? progress->checksums : 0;
+		d.comp_ctx = target_compressors(pool, comp_ctx, comp_ctx_type,
+				dh.compression, &own_ctx);
+		if (!d.comp_ctx)
+		{
+			block_list_free(&target_list);
+			return 0;
+		}
+
+		mt_ret = run_multithreaded(pool, compress_blocks, &d);
+		/* keep what was done for the rerun */
+		if (!mt_ret && journal)
+			journal_checkpoint(journal);
+		compressor_ctx_destroy_set(own_ctx, pool->threads.worker_count);
+		block_list_free(&target_list);
+
+		if (!mt_ret)
+			return 0;
+	}
+
+	*squashed_length = unc_start;
+	return 1;
+}
+
+/* squash_target_file() as a phase of its own */
+static int squash_reporting(struct merge_pool* pool,
+		struct compressor_ctx** comp_ctx, uint32_t comp_ctx_type,
+		struct mmap_file* target_f, size_t* squashed_length,
+		struct reuse_cache* reuse, struct merge_progress* progress)
+{
+	int ret;
+	struct stats_timer timer;
+
+	if (!progress_report(progress, SQUASHMERGE_STAGE_SQUASH, 0,
+				target_f->length))
+		return 0;
+
+	stats_phase_begin(&timer, STATS_SQUASH);
+	ret = squash_target_file(pool, comp_ctx, comp_ctx_type, target_f,
+			squashed_length, reuse, progress);
+	stats_phase_end(&timer);
+	if (!ret)
+		return 0;
+	stats_phase_add_bytes(STATS_SQUASH, target_f->length);
+
+	return progress_report(progress, SQUASHMERGE_STAGE_SQUASH,
+			target_f->length, target_f->length);
+}
+
+/* decode windows from the end of the patch until at least tail_length
+ * bytes at the end of the target are known */
+static int decode_target_tail(const struct vcdiff_decoder* vd,
+		const struct vcdiff_window* windows, size_t window_count,
+		size_t* first_decoded, const struct vcdiff_source* src,
+		struct mmap_file* target_f, size_t tail_length)
+{
+	while (*first_decoded > 0)
+	{
+		const struct vcdiff_window* w;
+
+		if (*first_decoded < window_count
+				&& target_f->length - windows[*first_decoded].target_offset
+					>= tail_length)
+			break;
+
+		w = &windows[--*first_decoded];
+		if (!vcdiff_decode_window(vd, w, src, target_f->data))
+			return 0;
+	}
+
+	return 1;
+}
+
+/* submit the blocks that were fully produced by the decoded windows */
+static int submit_completed_blocks(struct merge_pool* pool,
+		struct compress_data_shared* d, struct compress_range* ranges,
+		size_t* range_count, size_t* next_block, size_t produced)
+{
+	size_t end = *next_block;
+	size_t chunk, first;
+
+	while (end < d->blocks->count
+			&& d->unc_base + d->blocks->unc_offsets[end + 1] <= produced)
+		++end;
+	if (end == *next_block)
+		return 1;
+
+	/* split the run so that all workers get a share */
+	chunk = (end - *next_block + pool->threads.worker_count - 1)
+		/ pool->threads.worker_count;
+	for (first = *next_block; first < end; first += chunk)
+	{
+		struct compress_range* r = &ranges[(*range_count)++];
+
+		r->d = d;
+		r->first = first;
+		r->last = first + chunk < end ? first + chunk : end;
+		if (!thread_pool_submit(&pool->threads, d->group,
+					compress_block_range, r))
+			return 0;
+	}
+
+	*next_block = end;
+	return 1;
+}
+
+/* the recompression fed by the windows decoded on the pool */
+struct window_pipeline
+{
+	struct compress_data_shared* d;
+	struct compress_range* ranges;
+	size_t* range_count;
+	size_t* next_block;
+};
+
+/* windows decoded on the pool, each once the windows it copies from are */
+struct window_decode
+{
+	const struct vcdiff_decoder* vd;
+	const struct vcdiff_window* windows;
+	size_t window_count;
+	const struct vcdiff_source* src;
+	unsigned char* target;
+
+	struct merge_pool* pool;
+	struct pool_group group;
+	struct window_task* tasks;
+	/* optional, gets the blocks submitted as the decoded prefix grows */
+	struct window_pipeline* pipeline;
+
+	/* the windows decoded, and the count of leading ones all are */
+	unsigned char* done;
+	size_t done_prefix;
+	/* the windows copying from the target are submitted in order */
+	size_t next_waiting;
+	pthread_mutex_t lock;
+};
+
+struct window_task
+{
+	struct window_decode* wd;
+	size_t window;
+	/* the count of leading windows copied from */
+	size_t needs;
+};
+
+static int decode_window_task(void* data, unsigned int worker_no);
+
+/* called with the lock held, once the decoded prefix grows */
+static int window_prefix_done(struct window_decode* wd)
+{
+	struct window_pipeline* p = wd->pipeline;
+
+	if (p && wd->done_prefix > 0)
+	{
+		const struct vcdiff_window* w = &wd->windows[wd->done_prefix - 1];
+
+		if (!submit_completed_blocks(wd->pool, p->d, p->ranges,
+					p->range_count, p->next_block,
+					w->target_offset + w->target_length))
+			return 0;
+	}
+
+	for (; wd->next_waiting < wd->window_count; ++wd->next_waiting)
+	{
+		struct window_task* t = &wd->tasks[wd->next_waiting];
+
+		if (!vcdiff_window_needs_target(&wd->windows[t->window]))
+			continue;
+		if (t->needs > wd->done_prefix)
+			break;
+		if (!thread_pool_submit(&wd->pool->threads, &wd->group,
+					decode_window_task, t))
+			return 0;
+	}
+
+	return 1;
+}
+
+static int decode_window_task(void* data, unsigned int worker_no)
+{
+	struct window_task* t = data;
+	struct window_decode* wd = t->wd;
+	int ret = 1;
+
+	(void) worker_no;
+
+	if (pool_group_cancelled(&wd->group))
+		return 0;
+	if (!vcdiff_decode_window(wd->vd, &wd->windows[t->window], wd->src,
+				wd->target))
+		return 0;
+
+	pthread_mutex_lock(&wd->lock);
+	wd->done[t->window] = 1;
+	if (t->window == wd->done_prefix)
+	{
+		while (wd->done_prefix < wd->window_count
+				&& wd->done[wd->done_prefix])
+			++wd->done_prefix;
+		ret = window_prefix_done(wd);
+	}
+	pthread_mutex_unlock(&wd->lock);
+
+	return ret;
+}
+
+/* the count of leading windows a VCD_TARGET window copies from */
+static size_t window_target_needs(const struct vcdiff_window* windows,
+		size_t i)
+{
+	uint64_t end = windows[i].segment_position + windows[i].segment_length;
+	size_t lo = 0, hi = i;
+
+	/* find the first window starting past the segment */
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (windows[mid].target_offset < end)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* decode the windows on the pool, the independent ones at once and those
+ * copying from the target as soon as the windows they copy from are done;
+ * they are written straight into their final offsets in target */
+static int decode_windows_parallel(struct merge_pool* pool,
+		const struct vcdiff_decoder* vd,
+		const struct vcdiff_window* windows, size_t window_count,
+		const struct vcdiff_source* src, unsigned char* target,
+		struct window_pipeline* pipeline)
+{
+	struct window_decode wd;
+	size_t i;
+	int ret;
+
+	wd.vd = vd;
+	wd.windows = windows;
+	wd.window_count = window_count;
+	wd.src = src;
+	wd.target = target;
+	wd.pool = pool;
+	wd.pipeline = pipeline;
+	wd.done_prefix = 0;
+	wd.next_waiting = 0;
+
+	wd.tasks = malloc(sizeof(*wd.tasks) * window_count);
+	wd.done = calloc(window_count, 1);
+	if (!wd.tasks || !wd.done)
+	{
+		fprintf(stderr, "Unable to allocate memory for window decoding.\n"
+				"\terrno: %s\n", strerror(errno));
+		free(wd.tasks);
+		free(wd.done);
+		return 0;
+	}
+
+	ret = pthread_mutex_init(&wd.lock, 0);
+	if (ret != 0)
+	{
+		fprintf(stderr, "Unable to initialize window decoding.\n"
+				"\terror: %s\n", strerror(ret));
+		free(wd.tasks);
+		free(wd.done);
+		return 0;
+	}
+
+	for (i = 0; i < window_count; ++i)
+	{
+		wd.tasks[i].wd = &wd;
+		wd.tasks[i].window = i;
+		wd.tasks[i].needs = vcdiff_window_needs_target(&windows[i])
+			? window_target_needs(windows, i) : 0;
+	}
+
+	pool_group_init(&wd.group);
+	ret = 1;
+	for (i = 0; i < window_count && ret; ++i)
+	{
+		if (!vcdiff_window_needs_target(&windows[i]))
+			ret = thread_pool_submit(&pool->threads, &wd.group,
+					decode_window_task, &wd.tasks[i]);
+	}
+	if (ret)
+	{
+		pthread_mutex_lock(&wd.lock);
+		ret = window_prefix_done(&wd);
+		pthread_mutex_unlock(&wd.lock);
+	}
+
+	if (!ret)
+		pool_group_cancel(&pool->threads, &wd.group);
+	if (!thread_pool_wait(&pool->threads, &wd.group))
+		ret = 0;
+	if (wd.done_prefix != window_count)
+		ret = 0;
+
+	pthread_mutex_destroy(&wd.lock);
+	free(wd.tasks);
+	free(wd.done);
+	return ret;
+}
+
+/* decode the windows in order (or on the pool, if parallel),
+ * recompressing the target blocks as soon as they are complete */
+static int apply_vcdiff_pipelined(struct merge_pool* pool, int parallel,
+		struct compressor_ctx** comp_ctx, uint32_t comp_ctx_type,
+		const struct vcdiff_decoder* vd,
+		const struct vcdiff_window* windows, size_t window_count,
+		const struct vcdiff_source* src, struct mmap_file* target_f,
+		size_t* squashed_length, struct reuse_cache* reuse,
+		struct merge_progress* progress)
+{
+	struct compressor_ctx** own_ctx = 0;
+	struct compress_data_shared d;
+	struct compress_range* ranges = 0;
+	struct pool_group group;
+	struct sqdelta_header dh;
+	struct block_list target_list;
+	size_t first_decoded = window_count;
+	size_t unc_start, range_count = 0, next_block = 0, i;
+	int ret = 0;
+
+	/* the block list is needed first, and it is stored at the end */
+	if (!decode_target_tail(vd, windows, window_count, &first_decoded,
+				src, target_f, sizeof(dh)))
+		return 0;
+	if (target_f->length >= sizeof(dh))
+	{
+		const struct sqdelta_header* h = mmap_read(target_f,
+				target_f->length - sizeof(dh), sizeof(dh));
+
+		if (!decode_target_tail(vd, windows, window_count, &first_decoded,
+					src, target_f, sizeof(dh)
+						+ block_list_entry_size(ntohl(h->flags))
+						* (size_t) ntohl(h->block_count)))
+			return 0;
+	}
+	if (!read_target_trailer(target_f, &dh, &target_list, &unc_start))
+		return 0;
+	if (progress->checksums
+			&& !checksums_match(progress->checksums, dh.block_count))
+	{
+		block_list_free(&target_list);
+		return 0;
+	}
+	if (first_decoded < 2)
+		parallel = 0;
+
+	d.dh = &dh;
+	d.blocks = &target_list.table;
+	d.unc_base = unc_start;
+	d.output_f = target_f;
+	d.pool = pool;
+	d.group = &group;
+	d.reuse = target_reuse_cache(reuse, dh.compression);
+	d.release = progress->window != 0;
+	d.journal = 0;
+	d.checksums = progress->checksums;
+	d.thread_count = pool->threads.worker_count;
+	d.comp_ctx = target_compressors(pool, comp_ctx, comp_ctx_type,
+			dh.compression, &own_ctx);
+	if (!d.comp_ctx)
+	{
+		block_list_free(&target_list);
+		return 0;
+	}
+
+	ranges = malloc(sizeof(*ranges) * (dh.block_count + 1));
+	if (!ranges)
+	{
+		fprintf(stderr, "Unable to allocate memory for block ranges.\n"
+				"\terrno: %s\n", strerror(errno));
+		compressor_ctx_destroy_set(own_ctx, pool->threads.worker_count);
+		block_list_free(&target_list);
+		return 0;
+	}
+
+	pool_group_init(&group);
+	do
+	{
+		if (parallel)
+		{
+			struct window_pipeline pipeline;
+
+			pipeline.d = &d;
+			pipeline.ranges = ranges;
+			pipeline.range_count = &range_count;
+			pipeline.next_block = &next_block;
+			if (!decode_windows_parallel(pool, vd, windows, first_decoded,
+						src, target_f->data, &pipeline))
+				break;
+		}
+
+		for (i = parallel ? first_decoded : 0; i < first_decoded; ++i)
+		{
+			if (pool_group_cancelled(&group))
+				break;
+			if (!vcdiff_decode_window(vd, &windows[i], src, target_f->data))
+				break;
+			if (!submit_completed_blocks(pool, &d, ranges, &range_count,
+						&next_block,
+						windows[i].target_offset + windows[i].target_length))
+				break;
+			if (!progress_report(progress, SQUASHMERGE_STAGE_PATCH,
+						windows[i].target_offset + windows[i].target_length,
+						target_f->length))
+				break;
+		}
+		if (i != first_decoded)
+			break;
+
+		/* the remaining blocks are in the windows decoded first */
+		if (!submit_completed_blocks(pool, &d, ranges, &range_count,
+					&next_block, target_f->length))
+			break;
+
+		ret = 1;
+	} while (0);
+
+	if (!ret)
+		pool_group_cancel(&pool->threads, &group);
+	if (!thread_pool_wait(&pool->threads, &group))
+		ret = 0;
+
+	free(ranges);
+	compressor_ctx_destroy_set(own_ctx, pool->threads.worker_count);
+	block_list_free(&target_list);
+
+	*squashed_length = unc_start;
+	return ret;
+}
+
+/* apply the VCDIFF patch and recompress the result into target_f;
+ * without squashed_length, the target is left expanded */
+static int apply_vcdiff(struct merge_pool* pool,
+		struct compressor_ctx** comp_ctx, uint32_t comp_ctx_type,
+		struct mmap_file* patch_f, struct input_stream* patch_stream,
+		size_t patch_offset,
+		const struct vcdiff_source* src, struct mmap_file* target_f,
+		size_t* squashed_length, struct reuse_cache* reuse,
+		struct merge_progress* progress)
+{
+	struct vcdiff_decoder vd;
+	struct vcdiff_window* windows;
+	size_t window_count = 0, i;
+	/* a journal needs the patch done before the recompression */
+	int pipelined = squashed_length != 0 && !progress->journal;
+	/* the memory window is released in order, as the patch progresses */
+	int parallel = pool->threads.worker_count > 1 && !progress->window;
+	int decoded, ret = 0;
+	struct stats_timer timer;
+
+	/* the target length is only known once the whole patch is read */
+	if (patch_stream && !patch_stream_finish(patch_stream, patch_f,
+				patch_offset))
+		return 0;
+
+	if (!vcdiff_open(&vd, (const char*) patch_f->data + patch_offset,
+				patch_f->length - patch_offset))
+		return 0;
+
+	while (!vcdiff_at_end(&vd))
+	{
+		struct vcdiff_window w;
+
+		if (!vcdiff_next_window(&vd, &w))
+			return 0;
+		/* recompressed blocks would clobber data copied later */
+		if (vcdiff_window_needs_target(&w))
+			pipelined = 0;
+		++window_count;
+	}
+
+	if (vd.target_offset == 0 || vd.target_offset > (size_t) -1)
+	{
+		fprintf(stderr, "Invalid expanded target length.\n"
+				"\tlength: %lu\n", (unsigned long) vd.target_offset);
+		return 0;
+	}
+
+	windows = malloc(sizeof(*windows) * window_count);
+	if (!windows)
+	{
+		fprintf(stderr, "Unable to allocate memory for window list.\n"
+				"\terrno: %s\n", strerror(errno));
+		return 0;
+	}
+
+	do
+	{
+		/* windows are decoded straight into the mapped target */
+		if (!mmap_expand_created_file(target_f, vd.target_offset,
+					pool->huge_pages))
+			break;
+		if (progress->window)
+		{
+			progress->window->target_f = target_f;
+			progress->window->released = 0;
+		}
+
+		vcdiff_rewind(&vd);
+		for (i = 0; i < window_count; ++i)
+		{
+			if (!vcdiff_next_window(&vd, &windows[i]))
+				break;
+		}
+		if (i != window_count)
+			break;
+
+		if (!progress_report(progress, SQUASHMERGE_STAGE_PATCH, 0,
+					target_f->length))
+			break;
+		stats_phase_add_bytes(STATS_PATCH, target_f->length);
+		stats_phase_begin(&timer, STATS_PATCH);
+		if (pipelined)
+		{
+			/* the windows decoded first are not reported separately */
+			ret = apply_vcdiff_pipelined(pool, parallel,
+					comp_ctx, comp_ctx_type,
+					&vd, windows, window_count, src, target_f,
+					squashed_length, reuse, progress)
+				&& progress_report(progress, SQUASHMERGE_STAGE_PATCH,
+					target_f->length, target_f->length);
+			stats_phase_end(&timer);
+			break;
+		}
+
+		if (parallel && window_count > 1)
+		{
+			/* only the completion is reported */
+			decoded = decode_windows_parallel(pool, &vd, windows,
+					window_count, src, target_f->data, 0)
+				&& progress_report(progress, SQUASHMERGE_STAGE_PATCH,
+					target_f->length, target_f->length);
+		}
+		else
+		{
+			for (i = 0; i < window_count; ++i)
+			{
+				if (!vcdiff_decode_window(&vd, &windows[i], src,
+							target_f->data))
+					break;
+				if (!progress_report(progress, SQUASHMERGE_STAGE_PATCH,
+							windows[i].target_offset
+								+ windows[i].target_length,
+							target_f->length))
+					break;
+			}
+			decoded = i == window_count;
+		}
+		stats_phase_end(&timer);
+		if (!decoded)
+			break;
+
+		if (!squashed_length)
+		{
+			ret = 1;
+			break;
+		}
+		ret = squash_reporting(pool, comp_ctx, comp_ctx_type, target_f,
+				squashed_length, reuse, progress);
+	} while (0);
+
+	if (progress->window)
+		progress->window->target_f = 0;
+	free(windows);
+	return ret;
+}
+
+/* VCDIFF source reading the expanded temporary file, with larger
+ * copies cloned into the target file */
+struct file_source
+{
+	const struct mmap_file* source_f;
+	struct mmap_file* target_f;
+};
+
+static int file_source_read(void* priv, void* dest, uint64_t offset,
+		size_t length)
+{
+	struct file_source* fs = priv;
+	void* in_pos = mmap_read(fs->source_f, offset, length);
+
+	if (!in_pos)
+		return 0;
+	memcpy(dest, in_pos, length);
+	return 1;
+}
+
+static int file_source_copy(void* priv, void* dest, uint64_t target_offset,
+		uint64_t offset, size_t length)
+{
+	struct file_source* fs = priv;
+
+	if (mmap_clone_range(fs->target_f, target_offset, fs->source_f,
+				offset, length))
+		return 1;
+	return file_source_read(priv, dest, offset, length);
+}
+
+static int patch_in_memory(struct merge_pool* pool,
+		struct compressor_ctx** comp_ctx,
+		struct sqdelta_header* dh,
+		const struct block_table* source_blocks,
+		struct mmap_file* source_f,
+		struct mmap_file* patch_f,
+		size_t block_list_size,
+		struct input_stream* patch_stream,
+		size_t patch_offset,
+		size_t unc_length,
+		struct mmap_file* target_f,
+		size_t* squashed_length,
+		struct reuse_cache* reuse,
+		struct merge_progress* progress)
+{
+	struct mmap_file unc_f;
+	struct expanded_source exp_source;
+	struct vcdiff_source src;
+	int ret;
+	struct stats_timer timer;
+
+	if (!progress_report(progress, SQUASHMERGE_STAGE_EXPAND, 0, unc_length))
+		return 0;
+	stats_phase_begin(&timer, STATS_EXPAND);
+	ret = expand_input_in_memory(pool, comp_ctx, dh, source_blocks,
+			source_f, patch_f, block_list_size, unc_length,
+			&unc_f, &exp_source, reuse);
+	stats_phase_end(&timer);
+	if (!ret)
+		return 0;
+	stats_phase_add_bytes(STATS_EXPAND, unc_length);
+
+	exp_source.target_f = target_f;
+	expanded_source_init_vcdiff(&exp_source, &src);
+	ret = progress_report(progress, SQUASHMERGE_STAGE_EXPAND,
+				unc_length, unc_length)
+		&& apply_vcdiff(pool, comp_ctx, dh->compression,
+			patch_f, patch_stream, patch_offset, &src, target_f,
+			squashed_length, reuse, progress);
+
+	expanded_source_free(&exp_source);
+	mmap_close(&unc_f);
+	return ret;
+}
+
+static int patch_lazy(struct merge_pool* pool,
+		struct compressor_ctx** comp_ctx,
+		struct sqdelta_header* dh,
+		const struct block_table* source_blocks,
+		struct mmap_file* source_f,
+		struct mmap_file* patch_f,
+		size_t block_list_size,
+		struct input_stream* patch_stream,
+		size_t patch_offset,
+		size_t cache_size,
+		struct mmap_file* target_f,
+		size_t* squashed_length,
+		struct reuse_cache* reuse,
+		struct merge_progress* progress)
+{
+	struct expanded_source exp_source;
+	struct vcdiff_source src;
+	int ret;
+
+	/* the cache has decompressor contexts of its own, the windows
+	 * decoded in parallel read from the source at once */
+	if (!expanded_source_init_lazy(&exp_source, source_f, source_blocks,
+				(const char*) patch_f->data + sizeof(*dh), block_list_size,
+				patch_f->data, sizeof(*dh), dh->compression, cache_size))
+		return 0;
+	exp_source.cache->reuse = reuse;
+	exp_source.target_f = target_f;
+
+	expanded_source_init_vcdiff(&exp_source, &src);
+	ret = apply_vcdiff(pool, comp_ctx, dh->compression,
+			patch_f, patch_stream, patch_offset, &src, target_f,
+			squashed_length, reuse, progress);
+
+	expanded_source_free(&exp_source);
+	return ret;
+}
+
+/* temporary file name template in the given (or default) directory */
+static char* temp_file_template(const char* tmpdir)
+{
+	static const char name[] = "/tmp.XXXXXX";
+	char* out;
+
+	if (!tmpdir)
+		tmpdir = getenv("TMPDIR");
+#ifdef _P_tmpdir
+	if (!tmpdir)
+		tmpdir = P_tmpdir;
+#endif
+	if (!tmpdir)
+		tmpdir = "/tmp";
+
+	out = malloc(strlen(tmpdir) + sizeof(name));
+	if (!out)
+	{
+		fprintf(stderr, "Unable to allocate memory for temporary file name.\n"
+				"\terrno: %s\n", strerror(errno));
+		return 0;
+	}
+
+	strcpy(out, tmpdir);
+	strcat(out, name);
+	return out;
+}
+
+static int patch_via_temp_file(struct merge_pool* pool,
+		struct compressor_ctx** comp_ctx,
+		struct sqdelta_header* dh,
+		const struct block_table* source_blocks,
+		struct mmap_file* source_f,
+		struct mmap_file* patch_f,
+		size_t block_list_size,
+		struct input_stream* patch_stream,
+		size_t patch_offset,
+		size_t unc_length,
+		enum patch_format pformat,
+		const char* tmpdir,
+		struct mmap_file* target_f,
+		size_t* squashed_length,
+		struct reuse_cache* reuse,
+		struct merge_progress* progress)
+{
+	struct mmap_file temp_source_f;
+	char* tmp_name_buf;
+	size_t tmp_length = 0;
+	int ret = 0;
+	struct stats_timer timer;
+
+	tmp_length += source_f->length;
+	tmp_length += unc_length;
+	tmp_length += sizeof(*dh) + block_list_size;
+
+	/* xdelta3 needs a file to write the expanded target to */
+	if (target_f->fd == -1 && pformat == PATCH_VCDIFF_XDELTA3)
+	{
+		char* target_name_buf = temp_file_template(tmpdir);
+
+		if (!target_name_buf)
+			return 0;
+		*target_f = mmap_create_temp_without_mapping(target_name_buf);
+		if (target_f->fd != -1)
+			unlink(target_name_buf);
+		free(target_name_buf);
+		if (target_f->fd == -1)
+			return 0;
+	}
+
+	tmp_name_buf = temp_file_template(tmpdir);
+	if (!tmp_name_buf)
+		return 0;
+	temp_source_f = mmap_create_temp(tmp_name_buf, tmp_length,
+			pool->huge_pages);
+	if (temp_source_f.fd == -1)
+	{
+		free(tmp_name_buf);
+		return 0;
+	}
+
+	do
+	{
+		if (!progress_report(progress, SQUASHMERGE_STAGE_EXPAND, 0,
+					unc_length))
+		{
+			mmap_close(&temp_source_f);
+			break;
+		}
+		stats_phase_begin(&timer, STATS_EXPAND);
+		ret = expand_input(pool, comp_ctx, dh, source_blocks,
+				source_f, patch_f, block_list_size,
+				&temp_source_f, reuse);
+		stats_phase_end(&timer);
+		if (!ret || !progress_report(progress, SQUASHMERGE_STAGE_EXPAND,
+					unc_length, unc_length))
+		{
+			ret = 0;
+			mmap_close(&temp_source_f);
+			break;
+		}
+		stats_phase_add_bytes(STATS_EXPAND, unc_length);
+		ret = 0;
+
+		switch (pformat)
+		{
+			case PATCH_VCDIFF:
+			{
+				struct vcdiff_source src;
+				struct file_source fs;
+
+				fs.source_f = &temp_source_f;
+				fs.target_f = target_f;
+				src.read = file_source_read;
+				src.copy = file_source_copy;
+				src.priv = &fs;
+				src.length = temp_source_f.length;
+				ret = apply_vcdiff(pool, comp_ctx, dh->compression,
+						patch_f, patch_stream, patch_offset, &src, target_f,
+						squashed_length, reuse, progress);
+				mmap_close(&temp_source_f);
+				break;
+			}
+			case PATCH_VCDIFF_XDELTA3:
+				mmap_close(&temp_source_f);
+
+				if (lseek(patch_f->fd, patch_offset, SEEK_SET) == -1)
+				{
+					fprintf(stderr, "Unable to seek patch file for applying.\n"
+							"\terrno: %s\n", strerror(errno));
+					break;
+				}
+
+				if (!progress_report(progress, SQUASHMERGE_STAGE_PATCH, 0, 0))
+					break;
+				stats_phase_begin(&timer, STATS_PATCH);
+				ret = run_xdelta3(patch_f, target_f, tmp_name_buf)
+					&& mmap_map_created_file(target_f, pool->huge_pages);
+				stats_phase_end(&timer);
+				if (!ret || !progress_report(progress, SQUASHMERGE_STAGE_PATCH,
+							target_f->length, target_f->length))
+				{
+					ret = 0;
+					break;
+				}
+				stats_phase_add_bytes(STATS_PATCH, target_f->length);
+
+				if (squashed_length)
+					ret = squash_reporting(pool, comp_ctx, dh->compression,
+							target_f, squashed_length, reuse, progress);
+				break;
+			case PATCH_UNKNOWN:
+			default:
+				/* not reached */
+				mmap_close(&temp_source_f);
+		}
+	} while (0);
+
+	unlink(tmp_name_buf);
+	free(tmp_name_buf);
+	return ret;
+}
+/* default memory cap for lazily decompressed blocks */
+#define DEFAULT_CACHE_SIZE (64 << 20)
+/* default compressed data read ahead of the decompressing workers */
+#define DEFAULT_PREFETCH (32 << 20)
+
+struct merge_batch;
+
+/* the state of one merge at a time; the concurrent merges
+ * of a batch use one each */
+struct merge_slot
+{
+	/* kept for the following merges using the same compression */
+	struct compressor_ctx** comp_ctx;
+	uint32_t comp_ctx_type;
+
+	struct merge_progress progress;
+
+	/* the batch the merges are run for, if any */
+	struct merge_batch* batch;
+	/* the job being merged, and what it was admitted with */
+	size_t job;
+	int admitted;
+	uint64_t memory;
+	uint64_t temp;
+};
+
+struct squashmerge_ctx
+{
+	struct squashmerge_options opts;
+	struct merge_pool pool;
+
+	/* used by the merges outside of batches */
+	struct merge_slot slot;
+
+	/* held for the duration of a merge or a batch */
+	pthread_mutex_t lock;
+};
+
+void squashmerge_options_init(struct squashmerge_options* o)
+{
+	memset(o, 0, sizeof(*o));
+	o->expand_mode = SQUASHMERGE_EXPAND_TEMP_FILE;
+	o->cache_size = DEFAULT_CACHE_SIZE;
+	o->prefetch = DEFAULT_PREFETCH;
+	o->io = SQUASHMERGE_IO_MMAP;
+	o->sync = SQUASHMERGE_SYNC_FDATASYNC;
+	o->reuse = 1;
+}
+
+struct squashmerge_ctx* squashmerge_ctx_create(
+		const struct squashmerge_options* o)
+{
+	struct squashmerge_ctx* ctx;
+	unsigned int num_jobs = o->jobs;
+	int ret;
+
+	if (o->expand_mode > SQUASHMERGE_EXPAND_LAZY
+			|| o->io > SQUASHMERGE_IO_DIRECT
+			|| o->sync > SQUASHMERGE_SYNC_RANGE)
+	{
+		fprintf(stderr, "Invalid merge options.\n");
+		return 0;
+	}
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+	{
+		fprintf(stderr, "Unable to allocate memory for merge context.\n"
+				"\terrno: %s\n", strerror(errno));
+		return 0;
+	}
+	ctx->opts = *o;
+	/* decompress the source blocks as needed, with the cache taking
+	 * half of the limit; the mapped inputs can be released */
+	if (o->max_memory)
+	{
+		ctx->opts.expand_mode = SQUASHMERGE_EXPAND_LAZY;
+		if (ctx->opts.cache_size > o->max_memory / 2)
+			ctx->opts.cache_size = o->max_memory / 2;
+		ctx->opts.io = SQUASHMERGE_IO_MMAP;
+	}
+
+	ret = pthread_mutex_init(&ctx->lock, 0);
+	if (ret != 0)
+	{
+		fprintf(stderr, "Unable to initialize merge context.\n"
+				"\terror: %s\n", strerror(ret));
+		free(ctx);
+		return 0;
+	}
+
+	if (num_jobs == 0)
+		num_jobs = cpu_count_available();
+	if (!thread_pool_init(&ctx->pool.threads, num_jobs))
+	{
+		pthread_mutex_destroy(&ctx->lock);
+		free(ctx);
+		return 0;
+	}
+	if (o->pin_numa)
+		cpu_pin_pool_numa(&ctx->pool.threads);
+	ctx->pool.local_ranges = o->pin_numa || o->huge_pages;
+	ctx->pool.prefetch = o->prefetch;
+	ctx->pool.huge_pages = o->huge_pages;
+
+	return ctx;
+}
+
+void squashmerge_ctx_destroy(struct squashmerge_ctx* ctx)
+{
+	if (!ctx)
+		return;
+
+	compressor_ctx_destroy_set(ctx->slot.comp_ctx,
+			ctx->pool.threads.worker_count);
+	thread_pool_destroy(&ctx->pool.threads);
+	pthread_mutex_destroy(&ctx->lock);
+	free(ctx);
+}
+
+void squashmerge_set_progress(struct squashmerge_ctx* ctx,
+		squashmerge_progress_func func, void* priv)
+{
+	pthread_mutex_lock(&ctx->lock);
+	ctx->slot.progress.func = func;
+	ctx->slot.progress.priv = priv;
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+const char* squashmerge_strerror(enum squashmerge_error err)
+{
+	switch (err)
+	{
+		case SQUASHMERGE_OK:
+			return "Success";
+		case SQUASHMERGE_EINVAL:
+			return "Invalid argument";
+		case SQUASHMERGE_ENOMEM:
+			return "Out of memory";
+		case SQUASHMERGE_EIO:
+			return "I/O error";
+		case SQUASHMERGE_EFORMAT:
+			return "Invalid or mismatched patch";
+		case SQUASHMERGE_EUNSUPPORTED:
+			return "Unsupported patch";
+		case SQUASHMERGE_ECANCELLED:
+			return "Cancelled";
+	}
+
+	return "Unknown error";
+}
+
+static int input_open(struct mmap_file* f, const struct squashmerge_input* in,
+		enum io_backend backend)
+{
+	if (in->path)
+		*f = mmap_open_backend(in->path, backend);
+	else if (in->fd != -1)
+		*f = mmap_open_fd(in->fd, backend);
+	else
+	{
+		*f = mmap_from_memory(in->data, in->length);
+		return 1;
+	}
+
+	return f->fd != -1;
+}
+
+static void input_close(struct mmap_file* f, const struct squashmerge_input* in)
+{
+	if (in->path)
+		mmap_close(f);
+	else if (in->fd != -1)
+		mmap_release(f);
+}
+
+/* set up the target for writing in place if possible, otherwise
+ * it is written sequentially from output_fd */
+static int target_open(struct mmap_file* target_f, int target_fd,
+		int stream_output, enum io_sync sync_mode, int* output_fd)
+{
+	struct stat st;
+	int flags;
+
+	if (fstat(target_fd, &st) == -1 || (flags = fcntl(target_fd, F_GETFL)) == -1)
+	{
+		fprintf(stderr, "Unable to access target file.\n"
+				"\terrno: %s\n", strerror(errno));
+		return 0;
+	}
+
+	/* writing in place needs the file mapped read-write */
+	if (!S_ISREG(st.st_mode) || (flags & O_ACCMODE) != O_RDWR)
+		stream_output = 1;
+
+	target_f->data = 0;
+	target_f->length = 0;
+	if (stream_output)
+	{
+		/* expand the target in memory (or in a temporary file
+		 * for xdelta3) and write out only the squashed image */
+		*output_fd = target_fd;
+		target_f->fd = -1;
+		target_f->sync = IO_SYNC_NONE;
+		return 1;
+	}
+
+	if (ftruncate(target_fd, 0) == -1)
+	{
+		fprintf(stderr, "Unable to truncate target file.\n"
+				"\terrno: %s\n", strerror(errno));
+		return 0;
+	}
+
+	*output_fd = -1;
+	target_f->fd = target_fd;
+	target_f->sync = sync_mode;
+	return 1;
+}
+
+/* an opened patch with its source block list */
+struct merge_patch
+{
+	struct mmap_file f;
+	/* block_count is the count of the regular blocks */
+	struct sqdelta_header dh;
+	struct block_list list;
+	/* with SQDELTA_FLAG_CHECKSUMS */
+	struct target_checksums checksums;
+	enum patch_format pformat;
+	size_t patch_offset;
+	/* total length of the regular blocks, uncompressed */
+	size_t unc_length;
+
+	/* a patch that can not be mapped is read while it is used,
+	 * f covering the part received so far */
+	int streamed;
+	struct input_stream stream;
+	/* the descriptor opened for the stream, if any */
+	int stream_fd;
+};
+
+static struct input_stream* patch_stream(struct merge_patch* p)
+{
+	return p->streamed ? &p->stream : 0;
+}
+
+static const struct target_checksums* patch_checksums(
+		const struct merge_patch* p)
+{
+	return p->dh.flags & SQDELTA_FLAG_CHECKSUMS ? &p->checksums : 0;
+}
+
+/* wait until the streamed patch has length bytes (or ends) */
+static void patch_wait(struct merge_patch* p, size_t length)
+{
+	if (p->streamed)
+		p->f.length = input_stream_wait(&p->stream, length);
+}
+
+static int input_valid(const struct squashmerge_input* in)
+{
+	return in->path || in->fd != -1 || in->data;
+}
+
+/* start reading the patch in the background if it is a pipe
+ * or a socket, the other patches are mapped as usual */
+static int patch_stream_open(struct merge_patch* p,
+		const struct squashmerge_input* in)
+{
+	struct stat st;
+	int fd = in->fd;
+
+	if (!in->path && fd == -1)
+		return 1;
+	/* failures are reported when opening the file as usual */
+	if ((in->path ? stat(in->path, &st) : fstat(fd, &st)) == -1
+			|| S_ISREG(st.st_mode) || S_ISBLK(st.st_mode))
+		return 1;
+
+	if (in->path)
+	{
+		fd = open(in->path, O_RDONLY);
+		if (fd == -1)
+		{
+			fprintf(stderr, "Unable to open file.\n"
+					"\tpath: %s\n"
+					"\terrno: %s\n", in->path, strerror(errno));
+			return 0;
+		}
+		p->stream_fd = fd;
+	}
+
+	if (!input_stream_start(&p->stream, fd))
+	{
+		if (p->stream_fd != -1)
+			close(p->stream_fd);
+		p->stream_fd = -1;
+		return 0;
+	}
+
+	p->streamed = 1;
+	p->f = mmap_from_memory(p->stream.data, 0);
+	return 1;
+}
+
+static enum squashmerge_error patch_open(struct merge_patch* p,
+		const struct squashmerge_input* in, enum io_backend io_backend,
+		int use_xdelta3)
+{
+	size_t i;
+
+	memset(&p->list, 0, sizeof(p->list));
+	p->f.fd = -1;
+	p->f.data = 0;
+	p->streamed = 0;
+	p->stream_fd = -1;
+	if (!patch_stream_open(p, in))
+		return SQUASHMERGE_EIO;
+
+	if (p->streamed)
+		p->f.length = input_stream_wait(&p->stream, sizeof(p->dh));
+	else
+	{
+		if (!input_open(&p->f, in, io_backend))
+			return SQUASHMERGE_EIO;
+
+		/* the patch is read once, front to back */
+		mmap_advise(&p->f, MADV_SEQUENTIAL);
+	}
+
+	p->dh = read_sqdelta_header(&p->f, 0);
+	if (p->dh.magic == 0)
+		return SQUASHMERGE_EFORMAT;
+
+	if (!compressor_init(p->dh.compression))
+		return SQUASHMERGE_EUNSUPPORTED;
+
+	/* the expansion can start as soon as the block list is in */
+	patch_wait(p, sizeof(p->dh)
+			+ block_list_entry_size(p->dh.flags) * (size_t) p->dh.block_count
+			+ sizeof(vcdiff_magic));
+
+	/* checked against the source once it is known */
+	if (!block_list_read(&p->f, sizeof(p->dh), &p->dh, &p->list, UINT64_MAX))
+		return SQUASHMERGE_EFORMAT;
+	p->patch_offset = sizeof(p->dh) + p->list.size;
+
+	if (p->dh.flags & SQDELTA_FLAG_CHECKSUMS)
+	{
+		const struct sqdelta_checksum_header* h;
+		size_t size;
+
+		patch_wait(p, p->patch_offset + sizeof(*h));
+		h = mmap_read(&p->f, p->patch_offset, sizeof(*h));
+		if (!h)
+			return SQUASHMERGE_EFORMAT;
+		size = checksums_size(ntohl(h->segment_count));
+		if (size != 0)
+			patch_wait(p, p->patch_offset + size + sizeof(vcdiff_magic));
+
+		/* checked against the target once it is known */
+		if (!checksums_read(&p->f, p->patch_offset, &p->checksums))
+			return SQUASHMERGE_EFORMAT;
+		p->patch_offset += p->checksums.size;
+	}
+
+	/* source blocks can only be kept compressed */
+	for (i = 0; i < p->list.reused_count; ++i)
+	{
+		const struct reused_block* r = &p->list.reused[i];
+
+		if (r->source >= p->list.entry_count
+				|| ntohl(p->list.entries[r->source].source) != r->source
+				|| ntohl(p->list.entries[r->source].offset) != r->offset)
+		{
+			fprintf(stderr, "Source block refers to another block.\n"
+					"\toffset: 0x%08lx\n", (unsigned long) r->offset);
+			return SQUASHMERGE_EFORMAT;
+		}
+	}
+
+	/* only the regular blocks get expanded */
+	p->dh.block_count = p->list.block_count;
+	p->unc_length = p->list.table.unc_offsets[p->dh.block_count];
+
+	p->pformat = read_patch_format(&p->f, p->patch_offset, !p->streamed);
+	if (p->pformat == PATCH_UNKNOWN)
+		return SQUASHMERGE_EFORMAT;
+	if (p->pformat == PATCH_VCDIFF && use_xdelta3)
+		p->pformat = PATCH_VCDIFF_XDELTA3;
+	if (p->pformat == PATCH_VCDIFF_XDELTA3 && p->f.fd == -1)
+	{
+		fprintf(stderr, "xdelta3 needs the patch as a file.\n");
+		return SQUASHMERGE_EUNSUPPORTED;
+	}
+
+	return SQUASHMERGE_OK;
+}
+
+static void patch_close(struct merge_patch* p,
+		const struct squashmerge_input* in)
+{
+	block_list_free(&p->list);
+	if (p->streamed)
+	{
+		input_stream_free(&p->stream);
+		if (p->stream_fd != -1)
+			close(p->stream_fd);
+		p->streamed = 0;
+	}
+	else
+		input_close(&p->f, in);
+}
+
+/* the compressors for the given compression, kept in the slot */
+static struct compressor_ctx** merge_compressors(struct merge_pool* pool,
+		struct merge_slot* slot, uint32_t compression)
+{
+	if (!slot->comp_ctx || slot->comp_ctx_type != compression)
+	{
+		compressor_ctx_destroy_set(slot->comp_ctx, pool->threads.worker_count);
+		slot->comp_ctx = compressor_ctx_create_set(compression,
+				pool->threads.worker_count);
+		slot->comp_ctx_type = compression;
+	}
+
+	return slot->comp_ctx;
+}
+
+/* an expanded image only used as the source of the next patch */
+static int intermediate_create(struct mmap_file* f, const char* tmpdir,
+		int in_memory)
+{
+	char* name_buf;
+
+	if (in_memory)
+	{
+		f->fd = -1;
+		f->data = 0;
+		f->length = 0;
+		f->sync = IO_SYNC_NONE;
+		return 1;
+	}
+
+	name_buf = temp_file_template(tmpdir);
+	if (!name_buf)
+		return 0;
+	*f = mmap_create_temp_without_mapping(name_buf);
+	if (f->fd != -1)
+		unlink(name_buf);
+	free(name_buf);
+
+	return f->fd != -1;
+}
+
+static void intermediate_close(struct mmap_file* f)
+{
+	if (f->fd != -1 || f->data)
+		mmap_close(f);
+	f->fd = -1;
+	f->data = 0;
+}
+
+/* whether the regular blocks are the same, in the same order */
+static int block_lists_match(const struct block_list* a,
+		const struct block_list* b)
+{
+	return a->block_count == b->block_count
+		&& !memcmp(a->blocks, b->blocks, sizeof(*a->blocks) * a->block_count);
+}
+
+/* apply the patch against the image expanded by the previous patch;
+ * source_f is set to the part of it preceding the uncompressed blocks,
+ * i.e. the source image with the regular blocks missing */
+static int patch_chained(struct merge_pool* pool,
+		struct compressor_ctx** comp_ctx,
+		struct mmap_file* prev_f,
+		struct mmap_file* source_f,
+		struct merge_patch* p,
+		struct mmap_file* target_f,
+		size_t* squashed_length,
+		struct reuse_cache* reuse,
+		struct merge_progress* progress)
+{
+	struct sqdelta_header prev_dh;
+	struct block_list prev_list;
+	struct expanded_source exp_source;
+	struct vcdiff_source src;
+	struct mmap_file unc_f;
+	size_t unc_start;
+	int same_blocks;
+	int ret;
+	struct stats_timer timer;
+
+	if (p->pformat != PATCH_VCDIFF)
+	{
+		fprintf(stderr, "Only the first patch in a chain can use xdelta3.\n");
+		return 0;
+	}
+
+	if (!read_target_trailer(prev_f, &prev_dh, &prev_list, &unc_start))
+		return 0;
+	same_blocks = block_lists_match(&prev_list, &p->list);
+	block_list_free(&prev_list);
+
+	*source_f = *prev_f;
+	source_f->length = unc_start;
+	unc_f.data = 0;
+
+	if (!progress_report(progress, SQUASHMERGE_STAGE_EXPAND, 0,
+				p->unc_length))
+		return 0;
+	stats_phase_begin(&timer, STATS_EXPAND);
+	if (same_blocks)
+	{
+		/* the uncompressed blocks are already in place */
+		ret = expanded_source_init(&exp_source, source_f, &p->list.table,
+				(const char*) p->f.data + sizeof(p->dh), p->list.size,
+				p->f.data, sizeof(p->dh),
+				(const char*) prev_f->data + unc_start, p->unc_length);
+	}
+	else
+	{
+		size_t prev_squashed_length;
+
+		/* the patch expects different blocks, recreate the source image
+		 * and expand it as usual; prev_f is freed before the end, so its
+		 * blocks must not be registered in the reuse cache */
+		ret = squash_target_file(pool, comp_ctx, p->dh.compression,
+				prev_f, &prev_squashed_length, 0, 0)
+			&& expand_input_in_memory(pool, comp_ctx, &p->dh,
+				&p->list.table, source_f, &p->f, p->list.size,
+				p->unc_length, &unc_f, &exp_source, 0);
+		if (!ret)
+			unc_f.data = 0;
+	}
+	stats_phase_end(&timer);
+	if (!ret)
+		return 0;
+	stats_phase_add_bytes(STATS_EXPAND, p->unc_length);
+
+	exp_source.target_f = target_f;
+	expanded_source_init_vcdiff(&exp_source, &src);
+	ret = progress_report(progress, SQUASHMERGE_STAGE_EXPAND,
+				p->unc_length, p->unc_length)
+		&& apply_vcdiff(pool, comp_ctx, p->dh.compression,
+			&p->f, patch_stream(p), p->patch_offset, &src, target_f,
+			squashed_length, reuse, progress);
+
+	expanded_source_free(&exp_source);
+	if (unc_f.data)
+		mmap_close(&unc_f);
+	return ret;
+}
+
+/* apply the first patch against the compressed source */
+static int patch_first(struct squashmerge_ctx* ctx,
+		struct merge_slot* slot,
+		struct compressor_ctx** comp_ctx,
+		struct mmap_file* source_f,
+		struct merge_patch* p,
+		struct mmap_file* target_f,
+		size_t* squashed_length,
+		struct reuse_cache* reuse)
+{
+	const struct squashmerge_options* o = &ctx->opts;
+	struct merge_pool* pool = &ctx->pool;
+
+	if (o->expand_mode == SQUASHMERGE_EXPAND_LAZY
+			&& p->pformat == PATCH_VCDIFF)
+		return patch_lazy(pool, comp_ctx, &p->dh, &p->list.table, source_f,
+				&p->f, p->list.size, patch_stream(p), p->patch_offset,
+				o->cache_size,
+				target_f, squashed_length, reuse, &slot->progress);
+	else if (o->expand_mode == SQUASHMERGE_EXPAND_IN_MEMORY
+			&& p->pformat == PATCH_VCDIFF)
+		return patch_in_memory(pool, comp_ctx, &p->dh, &p->list.table,
+				source_f, &p->f, p->list.size, patch_stream(p), p->patch_offset,
+				p->unc_length, target_f, squashed_length, reuse, &slot->progress);
+	else
+		return patch_via_temp_file(pool, comp_ctx, &p->dh, &p->list.table,
+				source_f, &p->f, p->list.size, patch_stream(p), p->patch_offset,
+				p->unc_length, p->pformat, o->tmpdir, target_f, squashed_length,
+				reuse, &slot->progress);
+}
+
+/* the jobs of squashmerge_apply_batch(); they are admitted in order,
+ * each waiting until its estimated use fits within the limits */
+struct merge_batch
+{
+	struct squashmerge_ctx* ctx;
+	struct squashmerge_job* jobs;
+	size_t job_count;
+
+	/* the next job to start merging */
+	size_t next_job;
+	/* the first job neither admitted, nor failed before admission */
+	size_t next_admit;
+	unsigned char* passed;
+
+	unsigned int running;
+	uint64_t memory_used;
+	uint64_t temp_used;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+/* the memory and the temporary space needed to merge the patch,
+ * besides the inputs and the target file */
+static void merge_estimate(const struct squashmerge_options* o,
+		const struct mmap_file* source_f, const struct merge_patch* p,
+		int target_in_memory, uint64_t* memory, uint64_t* temp)
+{
+	/* the expanded target is not known before the patch is decoded,
+	 * assume it is about as large as the expanded source */
+	uint64_t expanded = (uint64_t) source_f->length + p->unc_length;
+
+	*memory = 0;
+	*temp = 0;
+
+	if (p->pformat != PATCH_VCDIFF
+			|| o->expand_mode == SQUASHMERGE_EXPAND_TEMP_FILE)
+		*temp += expanded + p->patch_offset;
+	else if (o->expand_mode == SQUASHMERGE_EXPAND_IN_MEMORY)
+		*memory += p->unc_length;
+	else
+		*memory += o->cache_size < p->unc_length
+			? o->cache_size : p->unc_length;
+
+	if (target_in_memory)
+	{
+		if (p->pformat == PATCH_VCDIFF_XDELTA3)
+			*temp += expanded;
+		else
+			*memory += expanded;
+	}
+}
+
+/* called with the lock held */
+static void batch_pass(struct merge_batch* b, size_t job)
+{
+	b->passed[job] = 1;
+	while (b->next_admit < b->job_count && b->passed[b->next_admit])
+		++b->next_admit;
+	pthread_cond_broadcast(&b->cond);
+}
+
+static int batch_fits(const struct merge_batch* b, uint64_t memory,
+		uint64_t temp)
+{
+	const struct squashmerge_options* o = &b->ctx->opts;
+
+	/* a job over the limits still runs, alone */
+	if (b->running == 0)
+		return 1;
+	return (o->batch_memory == 0
+				|| b->memory_used + memory <= o->batch_memory)
+		&& (o->batch_temp == 0 || b->temp_used + temp <= o->batch_temp);
+}
+
+/* wait for the turn of the job, and for the resources it needs */
+static void batch_admit(struct merge_slot* slot,
+		const struct mmap_file* source_f, const struct merge_patch* p,
+		int target_in_memory)
+{
+	struct merge_batch* b = slot->batch;
+
+	merge_estimate(&b->ctx->opts, source_f, p, target_in_memory,
+			&slot->memory, &slot->temp);
+
+	pthread_mutex_lock(&b->lock);
+	while (b->next_admit != slot->job
+			|| !batch_fits(b, slot->memory, slot->temp))
+		pthread_cond_wait(&b->cond, &b->lock);
+
+	++b->running;
+	b->memory_used += slot->memory;
+	b->temp_used += slot->temp;
+	slot->admitted = 1;
+	batch_pass(b, slot->job);
+	pthread_mutex_unlock(&b->lock);
+}
+
+/* return what the finished job was admitted with, or let the following
+ * jobs go first if it failed before */
+static void batch_release(struct merge_slot* slot)
+{
+	struct merge_batch* b = slot->batch;
+
+	pthread_mutex_lock(&b->lock);
+	if (slot->admitted)
+	{
+		--b->running;
+		b->memory_used -= slot->memory;
+		b->temp_used -= slot->temp;
+		pthread_cond_broadcast(&b->cond);
+	}
+	else
+		batch_pass(b, slot->job);
+	pthread_mutex_unlock(&b->lock);
+}
+
+/* check the target left by an interrupted merge against the journal,
+ * and map it for the recompression to continue */
+static int resume_target(struct merge_journal* j, struct mmap_file* target_f,
+		int target_fd, enum io_sync sync_mode, int huge_pages)
+{
+	struct stat st;
+	struct sqdelta_header dh;
+	struct block_list target_list;
+	size_t unc_start;
+	uint64_t hash[2];
+	int ret = 0;
+
+	if (fstat(target_fd, &st) == -1 || !S_ISREG(st.st_mode)
+			|| (uint64_t) st.st_size != j->target_length)
+	{
+		fprintf(stderr, "Warning: the target does not match the journal,"
+				" starting over.\n");
+		return 0;
+	}
+
+	target_f->fd = target_fd;
+	target_f->sync = sync_mode;
+	if (!mmap_map_created_file(target_f, huge_pages))
+	{
+		target_f->fd = -1;
+		return 0;
+	}
+
+	if (read_target_trailer(target_f, &dh, &target_list, &unc_start))
+	{
+		target_trailer_hash(target_f, &target_list, hash);
+		if (hash[0] == j->trailer_hash[0] && hash[1] == j->trailer_hash[1])
+			ret = journal_resume(j, target_f, dh.block_count);
+		block_list_free(&target_list);
+	}
+
+	if (!ret)
+	{
+		fprintf(stderr, "Warning: the target does not match the journal,"
+				" starting over.\n");
+		mmap_release(target_f);
+		target_f->fd = -1;
+		target_f->data = 0;
+	}
+	return ret;
+}
+
+static enum squashmerge_error merge(struct squashmerge_ctx* ctx,
+		struct merge_slot* slot,
+		const struct squashmerge_input* source,
+		const struct squashmerge_input* patches, size_t patch_count,
+		int target_fd)
+{
+	const struct squashmerge_options* o = &ctx->opts;
+	enum io_backend io_backend = (enum io_backend) o->io;
+	/* with a memory limit, the intermediate images are files too */
+	int in_memory = o->expand_mode != SQUASHMERGE_EXPAND_TEMP_FILE
+		&& !o->max_memory;
+
+	struct mmap_file source_f;
+	struct mmap_file target_f;
+	/* the expanded images of the preceding patches: prev_f is
+	 * the source of the current patch and older_f the one before */
+	struct mmap_file prev_f;
+	struct mmap_file older_f;
+	/* the source image the current patch copies reused blocks from */
+	struct mmap_file step_source_f;
+	struct merge_patch patch;
+	const struct squashmerge_input* patch_in = 0;
+	struct reuse_cache reuse;
+	struct reuse_cache* reuse_p = 0;
+	struct merge_window window;
+	struct merge_journal journal;
+	/* batches do not journal */
+	int journalled = o->journal && !slot->batch;
+	int resumed = 0;
+	int output_fd = -1;
+	size_t squashed_length = 0;
+	size_t i;
+
+	enum squashmerge_error ret;
+	struct stats_timer timer;
+
+	if (patch_count == 0 || !input_valid(source) || target_fd == -1)
+	{
+		fprintf(stderr, "Invalid merge arguments.\n");
+		return SQUASHMERGE_EINVAL;
+	}
+	for (i = 0; i < patch_count; ++i)
+	{
+		if (!input_valid(&patches[i]))
+		{
+			fprintf(stderr, "Invalid merge arguments.\n");
+			return SQUASHMERGE_EINVAL;
+		}
+	}
+	/* the intermediate images are gone after an interruption */
+	if (journalled && patch_count != 1)
+	{
+		fprintf(stderr, "The journal supports a single patch only.\n");
+		return SQUASHMERGE_EINVAL;
+	}
+
+	slot->progress.cancelled = 0;
+	slot->progress.window = 0;
+	slot->progress.journal = 0;
+	slot->progress.checksums = 0;
+
+	if (journalled && !journal_init(&journal, o->journal))
+		return SQUASHMERGE_ENOMEM;
+	if (!input_open(&source_f, source, io_backend))
+	{
+		if (journalled)
+			journal_free(&journal);
+		return SQUASHMERGE_EIO;
+	}
+	if (o->max_memory)
+	{
+		window.source_f = &source_f;
+		window.target_f = 0;
+		window.size = o->max_memory / 4;
+		window.released = 0;
+		slot->progress.window = &window;
+	}
+	else
+		mmap_advise(&source_f, MADV_WILLNEED);
+
+	prev_f.fd = -1;
+	prev_f.data = 0;
+	older_f = prev_f;
+	step_source_f = source_f;
+	target_f.fd = -1;
+	target_f.data = 0;
+
+	do
+	{
+		struct compressor_ctx** comp_ctx;
+
+		patch_in = &patches[0];
+		ret = patch_open(&patch, patch_in, io_backend, o->use_xdelta3);
+		if (ret != SQUASHMERGE_OK)
+			break;
+		/* only the final image is squashed, and can be verified */
+		if (patch_count == 1)
+			slot->progress.checksums = patch_checksums(&patch);
+
+		ret = SQUASHMERGE_EIO;
+		if (journalled)
+		{
+			journal_add_input(&journal, source_f.fd, source_f.length);
+			journal_add_input(&journal,
+					patch.streamed ? patch.stream.fd : patch.f.fd,
+					patch.streamed ? 0 : patch.f.length);
+			if (journal_load(&journal))
+				resumed = resume_target(&journal, &target_f, target_fd,
+						(enum io_sync) o->sync, ctx->pool.huge_pages);
+			/* a stale journal must not match the new target */
+			if (!resumed && !journal_discard(&journal))
+				break;
+			slot->progress.journal = &journal;
+		}
+		if (!resumed && !target_open(&target_f, target_fd, o->stream_output,
+					(enum io_sync) o->sync, &output_fd))
+		{
+			target_f.fd = -1;
+			target_f.data = 0;
+			break;
+		}
+		if (journalled && output_fd != -1)
+		{
+			fprintf(stderr, "The journal needs the target written in place.\n");
+			ret = SQUASHMERGE_EINVAL;
+			break;
+		}
+		/* anonymous memory could not be released */
+		if (o->max_memory && target_f.fd == -1
+				&& !intermediate_create(&target_f, o->tmpdir, 0))
+			break;
+		if (slot->batch)
+			batch_admit(slot, &source_f, &patch, target_f.fd == -1);
+
+		do
+		{
+			ret = SQUASHMERGE_ENOMEM;
+			comp_ctx = merge_compressors(&ctx->pool, slot, patch.dh.compression);
+			if (!comp_ctx)
+				break;
+
+			if (o->reuse)
+			{
+				if (!reuse_cache_init(&reuse, patch.dh.compression))
+					break;
+				reuse_p = &reuse;
+				ret = SQUASHMERGE_EIO;
+				if (o->cache_dir && !reuse_cache_load(&reuse, o->cache_dir))
+					break;
+			}
+
+			/* run patcher to obtain the expanded target file */
+			ret = SQUASHMERGE_EIO;
+			if (patch_count > 1 && !intermediate_create(&prev_f, o->tmpdir,
+						in_memory))
+				break;
+			ret = SQUASHMERGE_EFORMAT;
+			if (resumed)
+			{
+				/* the patch was applied by the interrupted run */
+				if (!squash_reporting(&ctx->pool, comp_ctx,
+							patch.dh.compression, &target_f, &squashed_length,
+							reuse_p, &slot->progress))
+					break;
+			}
+			else if (!patch_first(ctx, slot, comp_ctx, &source_f, &patch,
+						patch_count > 1 ? &prev_f : &target_f,
+						patch_count > 1 ? 0 : &squashed_length, reuse_p))
+				break;
+
+			/* the intermediate images stay expanded */
+			for (i = 1; i < patch_count; ++i)
+			{
+				int last = i == patch_count - 1;
+				struct mmap_file* next_f = last ? &target_f : &older_f;
+
+				if (!copy_reused_blocks(&ctx->pool, &prev_f, &step_source_f,
+							&patch.list, 0))
+					break;
+				patch_close(&patch, patch_in);
+				/* the source of the previous patch is not needed anymore */
+				intermediate_close(&older_f);
+
+				patch_in = &patches[i];
+				ret = patch_open(&patch, patch_in, io_backend, 0);
+				if (ret != SQUASHMERGE_OK)
+					break;
+				if (last)
+					slot->progress.checksums = patch_checksums(&patch);
+				ret = SQUASHMERGE_ENOMEM;
+				comp_ctx = merge_compressors(&ctx->pool, slot, patch.dh.compression);
+				if (!comp_ctx)
+					break;
+
+				ret = SQUASHMERGE_EIO;
+				if (!last && !intermediate_create(&older_f, o->tmpdir,
+							in_memory))
+					break;
+				ret = SQUASHMERGE_EFORMAT;
+				if (!patch_chained(&ctx->pool, comp_ctx, &prev_f,
+							&step_source_f, &patch, next_f,
+							last ? &squashed_length : 0,
+							target_reuse_cache(reuse_p, patch.dh.compression),
+							&slot->progress))
+					break;
+
+				/* swap, the next image becomes the source */
+				if (!last)
+				{
+					struct mmap_file tmp = prev_f;
+
+					prev_f = older_f;
+					older_f = tmp;
+				}
+			}
+			if (i != patch_count)
+				break;
+
+			if (!progress_report(&slot->progress, SQUASHMERGE_STAGE_WRITE,
+						0, squashed_length))
+				break;
+			stats_phase_begin(&timer, STATS_WRITE);
+			if (copy_reused_blocks(&ctx->pool, &target_f, &step_source_f,
+						&patch.list, slot->progress.checksums))
+			{
+				ret = SQUASHMERGE_EIO;
+				if (output_fd != -1
+						? mmap_write_to_fd(&target_f, squashed_length,
+							output_fd, (enum io_sync) o->sync)
+						: truncate_target_file(&target_f, squashed_length))
+					ret = SQUASHMERGE_OK;
+			}
+			stats_phase_end(&timer);
+			if (ret != SQUASHMERGE_OK)
+				break;
+			stats_phase_add_bytes(STATS_WRITE, squashed_length);
+			if (!progress_report(&slot->progress, SQUASHMERGE_STAGE_WRITE,
+						squashed_length, squashed_length))
+				break;
+
+			/* a failure to update the cache is not fatal */
+			if (reuse_p)
+				reuse_cache_save(reuse_p);
+		} while (0);
+
+		if (reuse_p)
+		{
+			stats_add_reuse(reuse_p->hits, reuse_p->misses);
+			reuse_cache_free(reuse_p);
+		}
+	} while (0);
+
+	if (patch_in)
+		patch_close(&patch, patch_in);
+	intermediate_close(&older_f);
+	intermediate_close(&prev_f);
+
+	/* closing syncs the target */
+	stats_phase_begin(&timer, STATS_WRITE);
+	if (target_f.fd == target_fd)
+		mmap_release(&target_f);
+	else
+		intermediate_close(&target_f);
+	stats_phase_end(&timer);
+
+	input_close(&source_f, source);
+
+	/* the target is complete (and synced) now */
+	if (journalled)
+	{
+		if (ret == SQUASHMERGE_OK && !journal_discard(&journal))
+			ret = SQUASHMERGE_EIO;
+		journal_free(&journal);
+	}
+	slot->progress.journal = 0;
+	slot->progress.window = 0;
+	slot->progress.checksums = 0;
+
+	if (slot->progress.cancelled)
+		return SQUASHMERGE_ECANCELLED;
+	return ret;
+}
+
+enum squashmerge_error squashmerge_apply(struct squashmerge_ctx* ctx,
+		const struct squashmerge_input* source,
+		const struct squashmerge_input* patch, int target_fd)
+{
+	return squashmerge_apply_chain(ctx, source, patch, 1, target_fd);
+}
+
+enum squashmerge_error squashmerge_apply_chain(struct squashmerge_ctx* ctx,
+		const struct squashmerge_input* source,
+		const struct squashmerge_input* patches, size_t patch_count,
+		int target_fd)
+{
+	enum squashmerge_error ret;
+
+	pthread_mutex_lock(&ctx->lock);
+	ret = merge(ctx, &ctx->slot, source, patches, patch_count, target_fd);
+	pthread_mutex_unlock(&ctx->lock);
+
+	return ret;
+}
+
+static void* batch_main(void* data)
+{
+	struct merge_slot* slot = data;
+	struct merge_batch* b = slot->batch;
+
+	for (;;)
+	{
+		struct squashmerge_job* job;
+
+		pthread_mutex_lock(&b->lock);
+		if (b->next_job == b->job_count)
+		{
+			pthread_mutex_unlock(&b->lock);
+			break;
+		}
+		slot->job = b->next_job++;
+		pthread_mutex_unlock(&b->lock);
+
+		job = &b->jobs[slot->job];
+		slot->admitted = 0;
+		if (job->target_fd != -1)
+			job->result = merge(b->ctx, slot, &job->source, &job->patch, 1,
+					job->target_fd);
+		else
+		{
+			/* opened only now, so that only the running merges hold
+			 * their targets open, and none is truncated in advance */
+			int target_fd = job->open_target
+				? job->open_target(job->open_target_priv) : -1;
+
+			if (target_fd == -1)
+				job->result = SQUASHMERGE_EIO;
+			else
+			{
+				job->result = merge(b->ctx, slot, &job->source, &job->patch,
+						1, target_fd);
+				if (close(target_fd) == -1)
+				{
+					fprintf(stderr, "Unable to close output file.\n"
+							"\terrno: %s\n", strerror(errno));
+					if (job->result == SQUASHMERGE_OK)
+						job->result = SQUASHMERGE_EIO;
+				}
+			}
+		}
+		batch_release(slot);
+	}
+
+	return slot;
+}
+
+enum squashmerge_error squashmerge_apply_batch(struct squashmerge_ctx* ctx,
+		struct squashmerge_job* jobs, size_t job_count)
+{
+	struct merge_batch b;
+	struct merge_slot* slots;
+	pthread_t* threads;
+	unsigned int merge_count = ctx->opts.batch_merges;
+	unsigned int i, started;
+	enum squashmerge_error ret = SQUASHMERGE_OK;
+	size_t j;
+	int pret;
+
+	if (job_count == 0)
+		return SQUASHMERGE_OK;
+
+	if (merge_count == 0)
+		merge_count = ctx->pool.threads.worker_count;
+	if (merge_count > job_count)
+		merge_count = job_count;
+
+	b.ctx = ctx;
+	b.jobs = jobs;
+	b.job_count = job_count;
+	b.next_job = 0;
+	b.next_admit = 0;
+	b.running = 0;
+	b.memory_used = 0;
+	b.temp_used = 0;
+
+	b.passed = calloc(job_count, sizeof(*b.passed));
+	slots = calloc(merge_count, sizeof(*slots));
+	threads = calloc(merge_count, sizeof(*threads));
+	if (!b.passed || !slots || !threads)
+	{
+		fprintf(stderr, "Unable to allocate memory for batch.\n"
+				"\terrno: %s\n", strerror(errno));
+		free(b.passed);
+		free(slots);
+		free(threads);
+		return SQUASHMERGE_ENOMEM;
+	}
+
+	pret = pthread_mutex_init(&b.lock, 0);
+	if (pret == 0)
+	{
+		pret = pthread_cond_init(&b.cond, 0);
+		if (pret != 0)
+			pthread_mutex_destroy(&b.lock);
+	}
+	if (pret != 0)
+	{
+		fprintf(stderr, "Unable to initialize batch.\n"
+				"\terror: %s\n", strerror(pret));
+		free(b.passed);
+		free(slots);
+		free(threads);
+		return SQUASHMERGE_ENOMEM;
+	}
+
+	for (j = 0; j < job_count; ++j)
+		jobs[j].result = SQUASHMERGE_EINVAL;
+	for (i = 0; i < merge_count; ++i)
+		slots[i].batch = &b;
+
+	pthread_mutex_lock(&ctx->lock);
+	ctx->pool.threads.shared = merge_count > 1;
+
+	/* the calling thread runs the last slot */
+	for (started = 0; started < merge_count - 1; ++started)
+	{
+		pret = pthread_create(&threads[started], 0, batch_main,
+				&slots[started]);
+		if (pret != 0)
+		{
+			fprintf(stderr, "Warning: unable to create merge thread %u.\n"
+					"\terror: %s\n", started, strerror(pret));
+			break;
+		}
+	}
+	batch_main(&slots[merge_count - 1]);
+	for (i = 0; i < started; ++i)
+		pthread_join(threads[i], 0);
+
+	ctx->pool.threads.shared = 0;
+	for (i = 0; i < merge_count; ++i)
+		compressor_ctx_destroy_set(slots[i].comp_ctx,
+				ctx->pool.threads.worker_count);
+	pthread_mutex_unlock(&ctx->lock);
+
+	for (j = 0; j < job_count; ++j)
+	{
+		if (jobs[j].result != SQUASHMERGE_OK)
+		{
+			ret = jobs[j].result;
+			break;
+		}
+	}
+
+	pthread_cond_destroy(&b.cond);
+	pthread_mutex_destroy(&b.lock);
+	free(b.passed);
+	free(slots);
+	free(threads);
+
+	return ret;
+}
+
+enum squashmerge_error squashmerge_create(struct squashmerge_ctx* ctx,
+		const struct squashmerge_input* source,
+		const struct squashmerge_input* target, int patch_fd)
+{
+	enum io_backend io_backend = (enum io_backend) ctx->opts.io;
+	struct mmap_file source_f;
+	struct mmap_file target_f;
+	enum squashmerge_error ret;
+
+	if (!input_valid(source) || !input_valid(target) || patch_fd == -1)
+	{
+		fprintf(stderr, "Invalid patch creation arguments.\n");
+		return SQUASHMERGE_EINVAL;
+	}
+
+	pthread_mutex_lock(&ctx->lock);
+	if (!input_open(&source_f, source, io_backend))
+		ret = SQUASHMERGE_EIO;
+	else
+	{
+		if (!input_open(&target_f, target, io_backend))
+			ret = SQUASHMERGE_EIO;
+		else
+		{
+			ret = create_patch(&ctx->pool.threads, &source_f, &target_f,
+					patch_fd);
+			input_close(&target_f, target);
+		}
+		input_close(&source_f, source);
+	}
+	pthread_mutex_unlock(&ctx->lock);
+
+	return ret;
+}
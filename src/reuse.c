@@ -0,0 +1,667 @@
+/**
+ * SquashFS delta merge tool
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h> /* for endian conversion */
+
+#include "reuse.h"
+#include "xxhash.h"
+
+#define REUSE_EMPTY_SLOT ((size_t) -1)
+#define REUSE_INITIAL_SLOTS 1024
+/* the cache file is rewritten with the newest records past that */
+#define REUSE_FILE_MAX_SIZE ((size_t) 256 << 20)
+
+/* two independent hashes make collisions practically impossible */
+#define REUSE_SEED_1 0
+#define REUSE_SEED_2 0x5371ceb4UL
+
+static const uint32_t reuse_file_magic = 0x53514d52UL; /* SQMR */
+static const uint32_t reuse_file_version = 2;
+
+struct reuse_file_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t compression;
+} __attribute__((packed));
+
+struct reuse_file_record
+{
+	uint32_t hash[4];
+	uint32_t uncompressed_length;
+	uint32_t length;
+	/* XXH64 of the compressed data, seeded with the fields above */
+	uint32_t check[2];
+} __attribute__((packed));
+
+int reuse_cache_init(struct reuse_cache* c, uint32_t compression)
+{
+	size_t i;
+
+	c->compression = compression;
+	c->entries = 0;
+	c->entry_count = 0;
+	c->entry_alloc = 0;
+	c->file.fd = -1;
+	c->file.data = 0;
+	c->path = 0;
+	c->hits = 0;
+	c->misses = 0;
+
+	c->slot_count = REUSE_INITIAL_SLOTS;
+	c->slots = malloc(sizeof(*c->slots) * c->slot_count);
+	if (!c->slots)
+	{
+		fprintf(stderr, "Unable to allocate memory for reuse cache.\n"
+				"\terrno: %s\n", strerror(errno));
+		return 0;
+	}
+	for (i = 0; i < c->slot_count; ++i)
+		c->slots[i] = REUSE_EMPTY_SLOT;
+
+	if (pthread_mutex_init(&c->lock, 0) != 0)
+	{
+		fprintf(stderr, "Unable to initialize reuse cache lock.\n");
+		free(c->slots);
+		return 0;
+	}
+
+	return 1;
+}
+
+void reuse_cache_free(struct reuse_cache* c)
+{
+	size_t i;
+
+	for (i = 0; i < c->entry_count; ++i)
+	{
+		if (c->entries[i].dirty)
+			free((void*) c->entries[i].data);
+	}
+
+	if (c->file.fd != -1)
+		mmap_close(&c->file);
+	free(c->entries);
+	free(c->slots);
+	free(c->path);
+	pthread_mutex_destroy(&c->lock);
+}
+
+void reuse_hash(const void* data, size_t length, uint64_t hash[2])
+{
+	hash[0] = xxh64(data, length, REUSE_SEED_1);
+	hash[1] = xxh64(data, length, REUSE_SEED_2);
+}
+
+/* covers the whole record, so a flipped key can not pass either */
+static uint64_t reuse_record_check(const uint64_t hash[2],
+		uint32_t uncompressed_length, const void* data, uint32_t length)
+{
+	uint64_t seed = hash[0] ^ hash[1]
+		^ ((uint64_t) uncompressed_length << 32 | length);
+
+	return xxh64(data, length, seed);
+}
+
+static int reuse_header_valid(const struct reuse_cache* c,
+		const struct reuse_file_header* h)
+{
+	return ntohl(h->magic) == reuse_file_magic
+		&& ntohl(h->version) == reuse_file_version
+		&& ntohl(h->compression) == c->compression;
+}
+
+/* find the slot holding the key, or the empty slot it would go to */
+static size_t reuse_find_slot(const struct reuse_cache* c,
+		const uint64_t hash[2], uint32_t uncompressed_length)
+{
+	size_t mask = c->slot_count - 1;
+	size_t i = hash[0] & mask;
+
+	for (;; i = (i + 1) & mask)
+	{
+		const struct reuse_entry* e;
+
+		if (c->slots[i] == REUSE_EMPTY_SLOT)
+			return i;
+
+		e = &c->entries[c->slots[i]];
+		if (e->hash[0] == hash[0] && e->hash[1] == hash[1]
+				&& e->uncompressed_length == uncompressed_length)
+			return i;
+	}
+}
+
+static int reuse_grow(struct reuse_cache* c)
+{
+	size_t* old_slots = c->slots;
+	size_t old_count = c->slot_count;
+	size_t i;
+
+	c->slot_count = old_count * 2;
+	c->slots = malloc(sizeof(*c->slots) * c->slot_count);
+	if (!c->slots)
+	{
+		fprintf(stderr, "Unable to allocate memory for reuse cache.\n"
+				"\terrno: %s\n", strerror(errno));
+		c->slots = old_slots;
+		c->slot_count = old_count;
+		return 0;
+	}
+
+	for (i = 0; i < c->slot_count; ++i)
+		c->slots[i] = REUSE_EMPTY_SLOT;
+	for (i = 0; i < old_count; ++i)
+	{
+		if (old_slots[i] != REUSE_EMPTY_SLOT)
+		{
+			const struct reuse_entry* e = &c->entries[old_slots[i]];
+
+			c->slots[reuse_find_slot(c, e->hash,
+					e->uncompressed_length)] = old_slots[i];
+		}
+	}
+
+	free(old_slots);
+	return 1;
+}
+
+static int reuse_insert(struct reuse_cache* c, const uint64_t hash[2],
+		uint32_t uncompressed_length, const void* data, uint32_t length,
+		int persist)
+{
+	struct reuse_entry* e;
+	size_t slot;
+
+	/* keep the load factor below 1/2 */
+	if ((c->entry_count + 1) * 2 > c->slot_count && !reuse_grow(c))
+		return 0;
+
+	slot = reuse_find_slot(c, hash, uncompressed_length);
+	if (c->slots[slot] != REUSE_EMPTY_SLOT)
+		return 1;
+
+	if (c->entry_count == c->entry_alloc)
+	{
+		size_t new_alloc = c->entry_alloc ? c->entry_alloc * 2 : 256;
+		struct reuse_entry* new_entries = realloc(c->entries,
+				sizeof(*new_entries) * new_alloc);
+
+		if (!new_entries)
+		{
+			fprintf(stderr, "Unable to allocate memory for reuse cache.\n"
+					"\terrno: %s\n", strerror(errno));
+			return 0;
+		}
+		c->entries = new_entries;
+		c->entry_alloc = new_alloc;
+	}
+
+	e = &c->entries[c->entry_count];
+	e->hash[0] = hash[0];
+	e->hash[1] = hash[1];
+	e->uncompressed_length = uncompressed_length;
+	e->length = length;
+	e->dirty = persist;
+	e->data = data;
+
+	if (persist)
+	{
+		unsigned char* copy = malloc(length > 0 ? length : 1);
+
+		if (!copy)
+		{
+			fprintf(stderr, "Unable to allocate memory for reuse cache.\n"
+					"\terrno: %s\n", strerror(errno));
+			return 0;
+		}
+		memcpy(copy, data, length);
+		e->data = copy;
+	}
+
+	c->slots[slot] = c->entry_count++;
+	return 1;
+}
+
+int reuse_cache_add(struct reuse_cache* c, const uint64_t hash[2],
+		uint32_t uncompressed_length, const void* data, uint32_t length,
+		int persist)
+{
+	int ret;
+
+	pthread_mutex_lock(&c->lock);
+	ret = reuse_insert(c, hash, uncompressed_length, data, length,
+			persist && c->path);
+	pthread_mutex_unlock(&c->lock);
+
+	return ret;
+}
+
+const void* reuse_cache_lookup(struct reuse_cache* c,
+		const uint64_t hash[2], uint32_t uncompressed_length,
+		uint32_t length)
+{
+	const void* ret = 0;
+	size_t slot;
+
+	pthread_mutex_lock(&c->lock);
+	slot = reuse_find_slot(c, hash, uncompressed_length);
+	if (c->slots[slot] != REUSE_EMPTY_SLOT
+			&& c->entries[c->slots[slot]].length == length)
+		ret = c->entries[c->slots[slot]].data;
+
+	if (ret)
+		++c->hits;
+	else
+		++c->misses;
+	pthread_mutex_unlock(&c->lock);
+
+	return ret;
+}
+
+/* insert the valid records of a mapped cache file, without copying them;
+ * the bytes they take (with the header) are stored in used */
+static int reuse_read_records(struct reuse_cache* c,
+		const struct mmap_file* f, size_t* used, size_t* dropped)
+{
+	size_t pos;
+
+	*used = sizeof(struct reuse_file_header);
+	*dropped = 0;
+
+	/* a record cut short by an interrupted write ends the file */
+	for (pos = sizeof(struct reuse_file_header);;)
+	{
+		const struct reuse_file_record* r;
+		const unsigned char* data;
+		uint64_t hash[2];
+		uint64_t check;
+		uint32_t length;
+		uint32_t unc_length;
+		size_t slot;
+
+		if (f->length - pos < sizeof(*r))
+			break;
+		r = (const void*) ((const unsigned char*) f->data + pos);
+		length = ntohl(r->length);
+		if (f->length - pos - sizeof(*r) < length)
+			break;
+		data = (const unsigned char*) (r + 1);
+
+		hash[0] = (uint64_t) ntohl(r->hash[0]) << 32 | ntohl(r->hash[1]);
+		hash[1] = (uint64_t) ntohl(r->hash[2]) << 32 | ntohl(r->hash[3]);
+		unc_length = ntohl(r->uncompressed_length);
+		check = (uint64_t) ntohl(r->check[0]) << 32 | ntohl(r->check[1]);
+		pos += sizeof(*r) + length;
+
+		/* torn or corrupted, the data can not be trusted */
+		if (reuse_record_check(hash, unc_length, data, length) != check)
+		{
+			++*dropped;
+			continue;
+		}
+
+		/* written by two instances at once */
+		slot = reuse_find_slot(c, hash, unc_length);
+		if (c->slots[slot] != REUSE_EMPTY_SLOT)
+			continue;
+
+		if (!reuse_insert(c, hash, unc_length, data, length, 0))
+			return 0;
+		*used += sizeof(*r) + length;
+	}
+
+	return 1;
+}
+
+int reuse_cache_load(struct reuse_cache* c, const char* dir)
+{
+	const struct reuse_file_header* h;
+	struct stat st;
+	size_t used;
+	size_t dropped;
+
+	char* abs_dir;
+
+	/* the caller may change the working directory before saving */
+	abs_dir = realpath(dir, 0);
+	if (!abs_dir)
+	{
+		fprintf(stderr, "Unable to access cache directory.\n"
+				"\tpath: %s\n"
+				"\terrno: %s\n", dir, strerror(errno));
+		return 0;
+	}
+
+	c->path = malloc(strlen(abs_dir) + sizeof("/squashmerge-01234567.cache"));
+	if (!c->path)
+	{
+		fprintf(stderr, "Unable to allocate memory for cache path.\n"
+				"\terrno: %s\n", strerror(errno));
+		free(abs_dir);
+		return 0;
+	}
+	sprintf(c->path, "%s/squashmerge-%08lx.cache", abs_dir,
+			(unsigned long) c->compression);
+	free(abs_dir);
+
+	if (stat(c->path, &st) == -1)
+	{
+		if (errno == ENOENT)
+			return 1;
+
+		fprintf(stderr, "Unable to access cache file.\n"
+				"\tpath: %s\n"
+				"\terrno: %s\n", c->path, strerror(errno));
+		return 0;
+	}
+	/* created but never written */
+	if (st.st_size == 0)
+		return 1;
+
+	c->file = mmap_open(c->path);
+	if (c->file.fd == -1)
+		return 0;
+
+	h = mmap_read(&c->file, 0, sizeof(*h));
+	if (!h || !reuse_header_valid(c, h))
+	{
+		fprintf(stderr, "Ignoring invalid cache file.\n"
+				"\tpath: %s\n", c->path);
+		return 1;
+	}
+
+	if (!reuse_read_records(c, &c->file, &used, &dropped))
+		return 0;
+	if (dropped > 0)
+		fprintf(stderr, "Ignoring %lu corrupted cache file records.\n"
+				"\tpath: %s\n", (unsigned long) dropped, c->path);
+
+	return 1;
+}
+
+/* open and lock the cache file, as found at the path once locked */
+static int reuse_lock_file(const struct reuse_cache* c)
+{
+	for (;;)
+	{
+		struct stat fd_st, path_st;
+		int fd = open(c->path, O_RDWR | O_CREAT | O_APPEND, 0666);
+
+		if (fd == -1)
+		{
+			fprintf(stderr, "Unable to open cache file for writing.\n"
+					"\tpath: %s\n"
+					"\terrno: %s\n", c->path, strerror(errno));
+			return -1;
+		}
+
+		/* other instances may be appending to the same file */
+		if (flock(fd, LOCK_EX) == -1 || fstat(fd, &fd_st) == -1)
+		{
+			fprintf(stderr, "Unable to lock cache file.\n"
+					"\tpath: %s\n"
+					"\terrno: %s\n", c->path, strerror(errno));
+			close(fd);
+			return -1;
+		}
+
+		/* or have replaced it while we were waiting for the lock */
+		if (stat(c->path, &path_st) == 0 && path_st.st_dev == fd_st.st_dev
+				&& path_st.st_ino == fd_st.st_ino)
+			return fd;
+		close(fd);
+	}
+}
+
+static int reuse_write_header(const struct reuse_cache* c, int fd,
+		const char* path)
+{
+	struct reuse_file_header h;
+
+	h.magic = htonl(reuse_file_magic);
+	h.version = htonl(reuse_file_version);
+	h.compression = htonl(c->compression);
+	if (write(fd, &h, sizeof(h)) != sizeof(h))
+	{
+		fprintf(stderr, "Unable to write cache file.\n"
+				"\tpath: %s\n"
+				"\terrno: %s\n", path, strerror(errno));
+		return 0;
+	}
+
+	return 1;
+}
+
+static size_t reuse_record_size(const struct reuse_entry* e)
+{
+	return sizeof(struct reuse_file_record) + e->length;
+}
+
+static int reuse_write_record(const struct reuse_entry* e, int fd,
+		const char* path)
+{
+	struct reuse_file_record r;
+	struct iovec iov[2];
+	uint64_t check = reuse_record_check(e->hash, e->uncompressed_length,
+			e->data, e->length);
+
+	r.hash[0] = htonl(e->hash[0] >> 32);
+	r.hash[1] = htonl(e->hash[0] & 0xffffffffUL);
+	r.hash[2] = htonl(e->hash[1] >> 32);
+	r.hash[3] = htonl(e->hash[1] & 0xffffffffUL);
+	r.uncompressed_length = htonl(e->uncompressed_length);
+	r.length = htonl(e->length);
+	r.check[0] = htonl(check >> 32);
+	r.check[1] = htonl(check & 0xffffffffUL);
+
+	iov[0].iov_base = &r;
+	iov[0].iov_len = sizeof(r);
+	iov[1].iov_base = (void*) e->data;
+	iov[1].iov_len = e->length;
+	if (writev(fd, iov, 2) != (ssize_t) reuse_record_size(e))
+	{
+		fprintf(stderr, "Unable to write cache file.\n"
+				"\tpath: %s\n"
+				"\terrno: %s\n", path, strerror(errno));
+		return 0;
+	}
+
+	return 1;
+}
+
+/* write the newest records that fit into a new file, and rename it over
+ * the old one, which the other instances may still have mapped */
+static int reuse_replace_file(const struct reuse_cache* c,
+		const struct reuse_cache* records)
+{
+	size_t tmp_len = strlen(c->path) + sizeof(".tmp-0123456789");
+	char* tmp_path = malloc(tmp_len);
+	size_t size = sizeof(struct reuse_file_header);
+	size_t first, i;
+	int fd;
+	int ret = 0;
+
+	if (!tmp_path)
+	{
+		fprintf(stderr, "Unable to allocate memory for cache path.\n"
+				"\terrno: %s\n", strerror(errno));
+		return 0;
+	}
+	snprintf(tmp_path, tmp_len, "%s.tmp-%lu", c->path,
+			(unsigned long) getpid());
+
+	/* the oldest records go first, leaving room for the later runs */
+	for (first = records->entry_count; first > 0; --first)
+	{
+		size_t next = reuse_record_size(&records->entries[first - 1]);
+
+		if (size + next > REUSE_FILE_MAX_SIZE / 2)
+			break;
+		size += next;
+	}
+
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+	if (fd == -1)
+	{
+		fprintf(stderr, "Unable to create cache file.\n"
+				"\tpath: %s\n"
+				"\terrno: %s\n", tmp_path, strerror(errno));
+		free(tmp_path);
+		return 0;
+	}
+
+	do
+	{
+		if (!reuse_write_header(c, fd, tmp_path))
+			break;
+		for (i = first; i < records->entry_count; ++i)
+		{
+			if (!reuse_write_record(&records->entries[i], fd, tmp_path))
+				break;
+		}
+		if (i != records->entry_count)
+			break;
+
+		if (rename(tmp_path, c->path) == -1)
+		{
+			fprintf(stderr, "Unable to replace cache file.\n"
+					"\tpath: %s\n"
+					"\terrno: %s\n", c->path, strerror(errno));
+			break;
+		}
+
+		ret = 1;
+	} while (0);
+
+	close(fd);
+	if (!ret)
+		unlink(tmp_path);
+	free(tmp_path);
+	return ret;
+}
+
+int reuse_cache_save(struct reuse_cache* c)
+{
+	struct reuse_cache records;
+	struct mmap_file file;
+	struct stat st;
+	size_t used = sizeof(struct reuse_file_header);
+	size_t dropped = 0;
+	size_t known;
+	size_t i;
+	int fd;
+	int ret = 0;
+
+	if (!c->path)
+		return 1;
+
+	for (i = 0; i < c->entry_count; ++i)
+	{
+		if (c->entries[i].dirty)
+			break;
+	}
+	if (i == c->entry_count)
+		return 1;
+
+	if (!reuse_cache_init(&records, c->compression))
+		return 0;
+	file.fd = -1;
+
+	fd = reuse_lock_file(c);
+	if (fd == -1)
+	{
+		reuse_cache_free(&records);
+		return 0;
+	}
+
+	do
+	{
+		int replace = 0;
+
+		if (fstat(fd, &st) == -1)
+		{
+			fprintf(stderr, "Unable to access cache file.\n"
+					"\tpath: %s\n"
+					"\terrno: %s\n", c->path, strerror(errno));
+			break;
+		}
+
+		/* what is in the file now, as the others may have added to it */
+		if (st.st_size != 0)
+		{
+			const struct reuse_file_header* h;
+
+			file = mmap_open_fd(fd, IO_BACKEND_MMAP);
+			if (file.fd == -1)
+				break;
+
+			h = mmap_read(&file, 0, sizeof(*h));
+			/* replace a cache file in an older format */
+			if (!h || !reuse_header_valid(c, h))
+				replace = 1;
+			else if (!reuse_read_records(&records, &file, &used, &dropped))
+				break;
+			/* and one holding duplicate or corrupted records */
+			else if (used != (size_t) st.st_size)
+				replace = 1;
+		}
+
+		known = records.entry_count;
+		for (i = 0; i < c->entry_count; ++i)
+		{
+			const struct reuse_entry* e = &c->entries[i];
+
+			if (e->dirty && !reuse_insert(&records, e->hash,
+						e->uncompressed_length, e->data, e->length, 0))
+				break;
+		}
+		if (i != c->entry_count)
+			break;
+
+		for (i = known; i < records.entry_count; ++i)
+			used += reuse_record_size(&records.entries[i]);
+		if (used > REUSE_FILE_MAX_SIZE)
+			replace = 1;
+
+		if (replace)
+		{
+			ret = reuse_replace_file(c, &records);
+			break;
+		}
+
+		if (st.st_size == 0 && !reuse_write_header(c, fd, c->path))
+			break;
+		for (i = known; i < records.entry_count; ++i)
+		{
+			if (!reuse_write_record(&records.entries[i], fd, c->path))
+				break;
+		}
+		if (i != records.entry_count)
+			break;
+
+		ret = 1;
+	} while (0);
+
+	reuse_cache_free(&records);
+	if (file.fd != -1)
+		mmap_release(&file);
+	close(fd);
+	return ret;
+}
@@ -0,0 +1,77 @@
+/**
+ * SquashFS delta merge tool
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#pragma once
+
+#ifndef SDT_REUSE_H
+#define SDT_REUSE_H 1
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#ifdef HAVE_STDINT_H
+#	include <stdint.h>
+#endif
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "util.h"
+
+/*
+ * Compressed forms of known uncompressed blocks, keyed by a hash
+ * of the uncompressed data. Lets recompression of a block identical
+ * to one seen before (e.g. an unchanged source block) copy the known
+ * compressed bytes instead of running the compressor.
+ */
+
+struct reuse_entry
+{
+	uint64_t hash[2];
+	uint32_t uncompressed_length;
+	uint32_t length;
+	const unsigned char* data;
+	/* data is owned and still has to be written to the cache file */
+	int dirty;
+};
+
+struct reuse_cache
+{
+	uint32_t compression;
+
+	struct reuse_entry* entries;
+	size_t entry_count;
+	size_t entry_alloc;
+	/* open addressing table of entry indexes, power-of-two sized */
+	size_t* slots;
+	size_t slot_count;
+
+	/* existing on-disk cache, and its path */
+	struct mmap_file file;
+	char* path;
+
+	size_t hits;
+	size_t misses;
+
+	pthread_mutex_t lock;
+};
+
+int reuse_cache_init(struct reuse_cache* c, uint32_t compression);
+int reuse_cache_load(struct reuse_cache* c, const char* dir);
+int reuse_cache_save(struct reuse_cache* c);
+void reuse_cache_free(struct reuse_cache* c);
+
+void reuse_hash(const void* data, size_t length, uint64_t hash[2]);
+
+/* data has to stay valid unless persist is set, then it is copied */
+int reuse_cache_add(struct reuse_cache* c, const uint64_t hash[2],
+		uint32_t uncompressed_length, const void* data, uint32_t length,
+		int persist);
+const void* reuse_cache_lookup(struct reuse_cache* c,
+		const uint64_t hash[2], uint32_t uncompressed_length,
+		uint32_t length);
+
+#endif /*!SDT_REUSE_H*/
@@ -0,0 +1,232 @@
+/**
+ * SquashFS delta merge tool
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#ifdef HAVE_STDINT_H
+#	include <stdint.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "scheduler.h"
+
+struct weighted_block
+{
+	size_t weight;
+	size_t index;
+};
+
+static int compare_weighted_blocks(const void* a, const void* b)
+{
+	const struct weighted_block* wa = a;
+	const struct weighted_block* wb = b;
+
+	/* largest first, ties resolved by position for reproducibility */
+	if (wa->weight != wb->weight)
+		return wa->weight < wb->weight ? 1 : -1;
+	if (wa->index != wb->index)
+		return wa->index < wb->index ? -1 : 1;
+	return 0;
+}
+
+static void scheduler_free_data(struct block_scheduler* s)
+{
+	free(s->order);
+	free(s->part_next);
+	free(s->part_end);
+}
+
+/* split the blocks into contiguous partitions of similar
+ * uncompressed size, one per worker */
+static int scheduler_partition(struct block_scheduler* s,
+		const size_t* unc_offsets)
+{
+	size_t total = unc_offsets[s->block_count] - unc_offsets[0];
+	size_t i = 0;
+	unsigned int w;
+
+	s->part_next = malloc(sizeof(*s->part_next) * s->thread_count);
+	s->part_end = malloc(sizeof(*s->part_end) * s->thread_count);
+	if (!s->part_next || !s->part_end)
+	{
+		fprintf(stderr, "Unable to allocate memory for block scheduler.\n"
+				"\terrno: %s\n", strerror(errno));
+		return 0;
+	}
+
+	for (w = 0; w < s->thread_count; ++w)
+	{
+		/* the partition ends where the next share starts */
+		uint64_t share_end = (uint64_t) total * (w + 1) / s->thread_count;
+
+		s->part_next[w] = i;
+		while (i < s->block_count
+				&& unc_offsets[i + 1] - unc_offsets[0] <= share_end)
+			++i;
+		if (w == s->thread_count - 1)
+			i = s->block_count;
+		s->part_end[w] = i;
+	}
+
+	return 1;
+}
+
+int scheduler_init(struct block_scheduler* s, const size_t* unc_offsets,
+		size_t block_count, unsigned int thread_count, int local)
+{
+	struct weighted_block* wb;
+	size_t i;
+	int ret;
+
+	s->block_count = block_count;
+	s->next = 0;
+	s->thread_count = thread_count > 0 ? thread_count : 1;
+	s->part_next = 0;
+	s->part_end = 0;
+
+	s->order = malloc(sizeof(*s->order) * (block_count + 1));
+	if (!s->order)
+	{
+		fprintf(stderr, "Unable to allocate memory for block scheduler.\n"
+				"\terrno: %s\n", strerror(errno));
+		return 0;
+	}
+
+	if (local)
+	{
+		/* the blocks are processed in order within a partition */
+		for (i = 0; i < block_count; ++i)
+			s->order[i] = i;
+		if (!scheduler_partition(s, unc_offsets))
+		{
+			scheduler_free_data(s);
+			return 0;
+		}
+	}
+	else
+	{
+		wb = malloc(sizeof(*wb) * (block_count + 1));
+		if (!wb)
+		{
+			fprintf(stderr, "Unable to allocate memory for block scheduler.\n"
+					"\terrno: %s\n", strerror(errno));
+			free(s->order);
+			return 0;
+		}
+
+		for (i = 0; i < block_count; ++i)
+		{
+			wb[i].weight = unc_offsets[i + 1] - unc_offsets[i];
+			wb[i].index = i;
+		}
+
+		qsort(wb, block_count, sizeof(*wb), compare_weighted_blocks);
+
+		for (i = 0; i < block_count; ++i)
+			s->order[i] = wb[i].index;
+		free(wb);
+	}
+
+	ret = pthread_mutex_init(&s->lock, 0);
+	if (ret != 0)
+	{
+		fprintf(stderr, "Unable to initialize scheduler lock.\n"
+				"\terror: %s\n", strerror(ret));
+		scheduler_free_data(s);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* claim from the worker's own partition, or steal the second half
+ * of the largest remaining one */
+static int scheduler_claim_local(struct block_scheduler* s,
+		unsigned int worker_no, size_t* first, size_t* last)
+{
+	unsigned int w = worker_no % s->thread_count;
+	size_t remaining = s->part_end[w] - s->part_next[w];
+	size_t chunk;
+	unsigned int i;
+
+	if (remaining > 0)
+	{
+		/* a quarter at a time, leaving something to steal */
+		chunk = remaining / 4;
+		if (chunk == 0)
+			chunk = 1;
+
+		*first = s->part_next[w];
+		s->part_next[w] += chunk;
+		*last = s->part_next[w];
+		return 1;
+	}
+
+	for (i = 0; i < s->thread_count; ++i)
+	{
+		if (s->part_end[i] - s->part_next[i] > remaining)
+		{
+			w = i;
+			remaining = s->part_end[i] - s->part_next[i];
+		}
+	}
+	if (remaining == 0)
+		return 0;
+
+	/* the owner keeps working from the front */
+	chunk = (remaining + 1) / 2;
+	*last = s->part_end[w];
+	s->part_end[w] -= chunk;
+	*first = s->part_end[w];
+	return 1;
+}
+
+int scheduler_claim(struct block_scheduler* s, unsigned int worker_no,
+		size_t* first, size_t* last)
+{
+	size_t remaining, chunk;
+	int ret;
+
+	pthread_mutex_lock(&s->lock);
+
+	if (s->part_next)
+	{
+		ret = scheduler_claim_local(s, worker_no, first, last);
+		pthread_mutex_unlock(&s->lock);
+		return ret;
+	}
+
+	remaining = s->block_count - s->next;
+	if (remaining == 0)
+	{
+		pthread_mutex_unlock(&s->lock);
+		return 0;
+	}
+
+	/* guided chunking: big chunks at first, single blocks near the end
+	 * so that no thread is left with a long tail */
+	chunk = remaining / (2 * s->thread_count);
+	if (chunk == 0)
+		chunk = 1;
+
+	*first = s->next;
+	s->next += chunk;
+	*last = s->next;
+
+	pthread_mutex_unlock(&s->lock);
+	return 1;
+}
+
+void scheduler_free(struct block_scheduler* s)
+{
+	pthread_mutex_destroy(&s->lock);
+	scheduler_free_data(s);
+}
@@ -0,0 +1,38 @@
+/**
+ * SquashFS delta merge tool
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#pragma once
+
+#ifndef SDT_SCHEDULER_H
+#define SDT_SCHEDULER_H 1
+
+#include <stdlib.h>
+#include <pthread.h>
+
+struct block_scheduler
+{
+	size_t* order;
+	size_t block_count;
+	size_t next;
+	unsigned int thread_count;
+
+	/* with local ranges, the blocks are split into a contiguous
+	 * partition per worker, [part_next, part_end) still to claim */
+	size_t* part_next;
+	size_t* part_end;
+
+	pthread_mutex_t lock;
+};
+
+/* with local set, each worker works on its own contiguous range
+ * of blocks first, so that it touches a contiguous range of memory */
+int scheduler_init(struct block_scheduler* s, const size_t* unc_offsets,
+		size_t block_count, unsigned int thread_count, int local);
+int scheduler_claim(struct block_scheduler* s, unsigned int worker_no,
+		size_t* first, size_t* last);
+void scheduler_free(struct block_scheduler* s);
+
+#endif /*!SDT_SCHEDULER_H*/
@@ -0,0 +1,63 @@
+/**
+ * SquashFS delta merge tool
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#pragma once
+
+#ifndef SDT_SQDELTA_H
+#define SDT_SQDELTA_H 1
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#ifdef HAVE_STDINT_H
+#	include <stdint.h>
+#endif
+
+/* block list entries carry the source block index */
+#define SQDELTA_FLAG_BLOCK_REUSE 0x00000001UL
+/* the block list of a patch is followed by the target checksums */
+#define SQDELTA_FLAG_CHECKSUMS 0x00000002UL
+#define SQDELTA_KNOWN_FLAGS (SQDELTA_FLAG_BLOCK_REUSE | SQDELTA_FLAG_CHECKSUMS)
+
+/* source index of a block that is decompressed and recompressed */
+#define SQDELTA_NO_SOURCE 0xffffffffUL
+
+/* on-disk structures, all fields big-endian */
+#pragma pack(push, 1)
+struct compressed_block
+{
+	uint32_t offset;
+	uint32_t length;
+	uint32_t uncompressed_length;
+};
+
+/* block list entry used with SQDELTA_FLAG_BLOCK_REUSE */
+struct compressed_block_reuse
+{
+	uint32_t offset;
+	uint32_t length;
+	uint32_t uncompressed_length;
+	uint32_t source;
+};
+
+struct sqdelta_header
+{
+	uint32_t magic;
+	uint32_t flags;
+	uint32_t compression;
+	uint32_t block_count;
+};
+
+/* followed by segment_count checksums, each split into halves */
+struct sqdelta_checksum_header
+{
+	uint32_t segment_count;
+	uint32_t digest[2];
+};
+#pragma pack(pop)
+
+#endif /*!SDT_SQDELTA_H*/
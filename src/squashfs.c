@@ -0,0 +1,633 @@
+/**
+ * SquashFS delta merge tool
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "compressor.h"
+#include "squashfs.h"
+
+#define SQFS_MAGIC 0x73717368UL
+#define SQFS_SUPERBLOCK_SIZE 96
+#define SQFS_FLAG_COMP_OPT 0x0400
+
+/* metadata blocks: a 16-bit length, then up to 8 KiB of data */
+#define SQFS_METADATA_SIZE 8192
+#define SQFS_METADATA_UNCOMPRESSED 0x8000
+#define SQFS_METADATA_LENGTH_MASK 0x7fff
+
+/* data and fragment block lengths */
+#define SQFS_BLOCK_UNCOMPRESSED 0x01000000UL
+#define SQFS_BLOCK_LENGTH_MASK 0x00ffffffUL
+
+#define SQFS_NO_FRAGMENT 0xffffffffUL
+#define SQFS_FRAGMENT_ENTRY_SIZE 16
+
+enum sqfs_compressor
+{
+	SQFS_COMP_GZIP = 1,
+	SQFS_COMP_LZMA,
+	SQFS_COMP_LZO,
+	SQFS_COMP_XZ,
+	SQFS_COMP_LZ4,
+	SQFS_COMP_ZSTD
+};
+
+enum sqfs_inode_type
+{
+	SQFS_DIR = 1,
+	SQFS_REG,
+	SQFS_SYMLINK,
+	SQFS_BLKDEV,
+	SQFS_CHRDEV,
+	SQFS_FIFO,
+	SQFS_SOCKET,
+	SQFS_LDIR,
+	SQFS_LREG,
+	SQFS_LSYMLINK,
+	SQFS_LBLKDEV,
+	SQFS_LCHRDEV,
+	SQFS_LFIFO,
+	SQFS_LSOCKET
+};
+
+/* the header common to all inodes */
+#define SQFS_INODE_HEADER_SIZE 16
+
+static uint16_t get16(const unsigned char* p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const unsigned char* p)
+{
+	return get16(p) | ((uint32_t) get16(p + 2) << 16);
+}
+
+static uint64_t get64(const unsigned char* p)
+{
+	return get32(p) | ((uint64_t) get32(p + 4) << 32);
+}
+
+int sqfs_read_superblock(struct sqfs_image* img, const struct mmap_file* f)
+{
+	const unsigned char* sb;
+	const unsigned char* opt = 0;
+	uint16_t flags;
+	uint32_t c;
+
+	memset(img, 0, sizeof(*img));
+
+	sb = mmap_read(f, 0, SQFS_SUPERBLOCK_SIZE);
+	if (!sb)
+		return 0;
+
+	if (get32(sb) != SQFS_MAGIC || get16(sb + 28) != 4)
+	{
+		fprintf(stderr, "Not a SquashFS 4.0 image.\n");
+		return 0;
+	}
+
+	img->inode_count = get32(sb + 4);
+	img->block_size = get32(sb + 12);
+	img->fragment_count = get32(sb + 16);
+	flags = get16(sb + 24);
+	img->bytes_used = get64(sb + 40);
+	img->inode_table_start = get64(sb + 64);
+	img->directory_table_start = get64(sb + 72);
+	img->fragment_table_start = get64(sb + 80);
+
+	if (img->block_size < 4096 || img->block_size > (1 << 20)
+			|| (img->block_size & (img->block_size - 1)) != 0
+			|| img->bytes_used > f->length
+			|| img->inode_table_start > img->directory_table_start
+			|| img->directory_table_start > img->bytes_used)
+	{
+		fprintf(stderr, "Invalid SquashFS superblock.\n");
+		return 0;
+	}
+
+	/* the options are always stored uncompressed */
+	if (flags & SQFS_FLAG_COMP_OPT)
+	{
+		const unsigned char* hdr = mmap_read(f, SQFS_SUPERBLOCK_SIZE, 2);
+
+		if (!hdr || !(get16(hdr) & SQFS_METADATA_UNCOMPRESSED)
+				|| (get16(hdr) & SQFS_METADATA_LENGTH_MASK) < 8)
+		{
+			fprintf(stderr, "Invalid SquashFS compressor options.\n");
+			return 0;
+		}
+		opt = mmap_read(f, SQFS_SUPERBLOCK_SIZE + 2, 8);
+		if (!opt)
+			return 0;
+	}
+
+	/* the defaults of mksquashfs apply without the options */
+	switch (get16(sb + 20))
+	{
+		case SQFS_COMP_GZIP:
+		{
+			uint32_t level = opt ? get32(opt) : 9;
+			uint32_t window = opt ? get16(opt + 4) : 15;
+			uint32_t strategies = opt ? get16(opt + 6) : 0;
+
+			if (level > 0x0f || window > 0x0f || strategies > 0x1f)
+				c = 0;
+			else
+				c = 0x03000000UL | level | (window << 4) | (strategies << 8);
+			break;
+		}
+		case SQFS_COMP_LZO:
+		{
+			/* only lzo1x_999 is deterministic enough */
+			uint32_t algorithm = opt ? get32(opt) : 4;
+			uint32_t level = opt ? get32(opt + 4) : 8;
+
+			if (algorithm != 4 || level > 0x0f)
+				c = 0;
+			else
+				c = 0x01000010UL | level;
+			break;
+		}
+		case SQFS_COMP_XZ:
+		{
+			uint32_t dict = opt ? get32(opt) : img->block_size;
+			uint32_t filters = opt ? get32(opt + 4) : 0;
+			unsigned int bits = 0;
+
+			while (bits < 31 && ((uint32_t) 2 << bits) <= dict)
+				++bits;
+
+			c = 0x04000006UL | (bits << 8);
+			if (dict == (uint32_t) 1 << bits)
+				;
+			else if (bits > 0 && dict == ((uint32_t) 1 << bits)
+					+ ((uint32_t) 1 << (bits - 1)))
+				c |= 0x2000;
+			else
+				c = 0;
+			if (filters > 0x3f)
+				c = 0;
+			else if (c != 0)
+				c |= filters << 16;
+			break;
+		}
+		case SQFS_COMP_LZ4:
+			if (opt && get32(opt) != 1)
+				c = 0;
+			else
+				c = 0x02000000UL | (opt ? get32(opt + 4) : 0);
+			break;
+		case SQFS_COMP_ZSTD:
+		{
+			uint32_t level = opt ? get32(opt) : 15;
+
+			c = level > 0x1f ? 0 : 0x05000000UL | level;
+			break;
+		}
+		default:
+			c = 0;
+	}
+
+	if (c == 0)
+	{
+		fprintf(stderr, "Unsupported SquashFS compressor or options.\n"
+				"\tcompressor: %u\n", get16(sb + 20));
+		return 0;
+	}
+
+	img->compression = c;
+	return 1;
+}
+
+struct sqfs_reader
+{
+	struct sqfs_image* img;
+	const struct mmap_file* f;
+	struct compressor_ctx* comp;
+
+	size_t block_alloc;
+
+	/* the uncompressed inode table */
+	unsigned char* inodes;
+	size_t inodes_length;
+	size_t inodes_alloc;
+
+	/* the uncompressed length each fragment needs to have */
+	uint32_t* fragment_lengths;
+};
+
+static int add_block(struct sqfs_reader* r, uint64_t offset, uint32_t length,
+		uint32_t uncompressed_length)
+{
+	struct sqfs_image* img = r->img;
+	struct sqfs_block* b;
+
+	if (offset + length > img->bytes_used || offset + length < offset)
+	{
+		fprintf(stderr, "SquashFS block exceeds the image.\n"
+				"\toffset: 0x%08llx\n", (unsigned long long) offset);
+		return 0;
+	}
+	if (offset + length > 0xffffffffULL)
+	{
+		fprintf(stderr, "SquashFS block beyond 4 GiB is not supported.\n"
+				"\toffset: 0x%08llx\n", (unsigned long long) offset);
+		return 0;
+	}
+
+	if (img->block_count == r->block_alloc)
+	{
+		size_t alloc = r->block_alloc ? r->block_alloc * 2 : 256;
+		struct sqfs_block* grown = realloc(img->blocks,
+				sizeof(*grown) * alloc);
+
+		if (!grown)
+		{
+			fprintf(stderr, "Unable to allocate memory for block list.\n"
+					"\terrno: %s\n", strerror(errno));
+			return 0;
+		}
+		img->blocks = grown;
+		r->block_alloc = alloc;
+	}
+
+	b = &img->blocks[img->block_count++];
+	b->offset = offset;
+	b->length = length;
+	b->uncompressed_length = uncompressed_length;
+	return 1;
+}
+
+/* read the metadata block at *offset into out, adding it to the blocks
+ * if listed; *offset is advanced to the next block */
+static int read_metadata_block(struct sqfs_reader* r, uint64_t* offset,
+		unsigned char* out, size_t* out_length, int listed)
+{
+	const unsigned char* hdr;
+	const unsigned char* data;
+	uint16_t length;
+
+	hdr = mmap_read(r->f, *offset, 2);
+	if (!hdr)
+		return 0;
+	length = get16(hdr) & SQFS_METADATA_LENGTH_MASK;
+	data = mmap_read(r->f, *offset + 2, length);
+	if (!data)
+		return 0;
+
+	if (get16(hdr) & SQFS_METADATA_UNCOMPRESSED)
+	{
+		if (length > SQFS_METADATA_SIZE)
+		{
+			fprintf(stderr, "SquashFS metadata block too long.\n"
+					"\toffset: 0x%08llx\n", (unsigned long long) *offset);
+			return 0;
+		}
+		memcpy(out, data, length);
+		*out_length = length;
+	}
+	else
+	{
+		*out_length = compressor_ctx_decompress(r->comp, out, data,
+				length, SQFS_METADATA_SIZE);
+		if (*out_length == 0)
+		{
+			fprintf(stderr, "Unable to decompress SquashFS metadata.\n"
+					"\toffset: 0x%08llx\n", (unsigned long long) *offset);
+			return 0;
+		}
+		if (listed && !add_block(r, *offset + 2, length, *out_length))
+			return 0;
+	}
+
+	*offset += 2 + length;
+	return 1;
+}
+
+static int read_inode_table(struct sqfs_reader* r)
+{
+	const struct sqfs_image* img = r->img;
+	uint64_t offset = img->inode_table_start;
+
+	while (offset < img->directory_table_start)
+	{
+		size_t length;
+
+		if (r->inodes_alloc - r->inodes_length < SQFS_METADATA_SIZE)
+		{
+			size_t alloc = r->inodes_alloc ? r->inodes_alloc * 2
+				: 16 * SQFS_METADATA_SIZE;
+			unsigned char* grown = realloc(r->inodes, alloc);
+
+			if (!grown)
+			{
+				fprintf(stderr, "Unable to allocate memory for inode table.\n"
+						"\terrno: %s\n", strerror(errno));
+				return 0;
+			}
+			r->inodes = grown;
+			r->inodes_alloc = alloc;
+		}
+
+		if (!read_metadata_block(r, &offset, r->inodes + r->inodes_length,
+					&length, 1))
+			return 0;
+		r->inodes_length += length;
+	}
+
+	return 1;
+}
+
+/* the next length bytes of the inode table */
+static const unsigned char* inode_data(const struct sqfs_reader* r,
+		size_t* pos, size_t length)
+{
+	const unsigned char* p = r->inodes + *pos;
+
+	if (length > r->inodes_length - *pos)
+	{
+		fprintf(stderr, "SquashFS inode table is truncated.\n");
+		return 0;
+	}
+
+	*pos += length;
+	return p;
+}
+
+/* add the data blocks of a file, and note the fragment it ends in */
+static int read_file_blocks(struct sqfs_reader* r, size_t* pos,
+		uint64_t start, uint64_t file_size, uint32_t fragment,
+		uint32_t fragment_offset)
+{
+	const struct sqfs_image* img = r->img;
+	uint64_t block_count = file_size / img->block_size;
+	uint64_t k;
+
+	if (fragment == SQFS_NO_FRAGMENT && file_size % img->block_size)
+		++block_count;
+	if (block_count > (r->inodes_length - *pos) / 4)
+	{
+		fprintf(stderr, "SquashFS inode table is truncated.\n");
+		return 0;
+	}
+
+	for (k = 0; k < block_count; ++k)
+	{
+		const unsigned char* p = inode_data(r, pos, 4);
+		uint32_t length = get32(p) & SQFS_BLOCK_LENGTH_MASK;
+		uint64_t remaining = file_size - k * img->block_size;
+
+		/* sparse */
+		if (length == 0)
+			continue;
+		if (!(get32(p) & SQFS_BLOCK_UNCOMPRESSED)
+				&& !add_block(r, start, length,
+					remaining < img->block_size ? remaining : img->block_size))
+			return 0;
+		start += length;
+	}
+
+	if (fragment != SQFS_NO_FRAGMENT)
+	{
+		uint64_t end = fragment_offset + file_size % img->block_size;
+
+		if (fragment >= img->fragment_count || end > img->block_size)
+		{
+			fprintf(stderr, "SquashFS file refers to invalid fragment.\n"
+					"\tfragment: %lu\n", (unsigned long) fragment);
+			return 0;
+		}
+		if (end > r->fragment_lengths[fragment])
+			r->fragment_lengths[fragment] = end;
+	}
+
+	return 1;
+}
+
+static int read_inodes(struct sqfs_reader* r)
+{
+	size_t pos = 0;
+	uint32_t i;
+
+	for (i = 0; i < r->img->inode_count; ++i)
+	{
+		const unsigned char* p = inode_data(r, &pos, SQFS_INODE_HEADER_SIZE);
+		unsigned int type;
+
+		if (!p)
+			return 0;
+		type = get16(p);
+
+		switch (type)
+		{
+			case SQFS_DIR:
+				p = inode_data(r, &pos, 16);
+				break;
+			case SQFS_LDIR:
+			{
+				uint16_t index_count;
+
+				p = inode_data(r, &pos, 24);
+				if (!p)
+					break;
+				/* the directory index, of variable-length names */
+				for (index_count = get16(p + 16); p && index_count > 0;
+						--index_count)
+				{
+					p = inode_data(r, &pos, 12);
+					if (p)
+						p = inode_data(r, &pos, get32(p + 8) + 1);
+				}
+				break;
+			}
+			case SQFS_REG:
+				p = inode_data(r, &pos, 16);
+				if (p && !read_file_blocks(r, &pos, get32(p), get32(p + 12),
+							get32(p + 4), get32(p + 8)))
+					return 0;
+				break;
+			case SQFS_LREG:
+				p = inode_data(r, &pos, 40);
+				if (p && !read_file_blocks(r, &pos, get64(p), get64(p + 8),
+							get32(p + 28), get32(p + 32)))
+					return 0;
+				break;
+			case SQFS_SYMLINK:
+			case SQFS_LSYMLINK:
+				p = inode_data(r, &pos, 8);
+				if (p)
+					p = inode_data(r, &pos, get32(p + 4));
+				if (p && type == SQFS_LSYMLINK)
+					p = inode_data(r, &pos, 4);
+				break;
+			case SQFS_BLKDEV:
+			case SQFS_CHRDEV:
+				p = inode_data(r, &pos, 8);
+				break;
+			case SQFS_LBLKDEV:
+			case SQFS_LCHRDEV:
+				p = inode_data(r, &pos, 12);
+				break;
+			case SQFS_FIFO:
+			case SQFS_SOCKET:
+				p = inode_data(r, &pos, 4);
+				break;
+			case SQFS_LFIFO:
+			case SQFS_LSOCKET:
+				p = inode_data(r, &pos, 8);
+				break;
+			default:
+				fprintf(stderr, "Unknown SquashFS inode type.\n"
+						"\ttype: %u\n", type);
+				return 0;
+		}
+
+		if (!p)
+			return 0;
+	}
+
+	return 1;
+}
+
+static int read_fragment_table(struct sqfs_reader* r)
+{
+	const struct sqfs_image* img = r->img;
+	unsigned char entries[SQFS_METADATA_SIZE];
+	const unsigned char* index;
+	size_t per_block = SQFS_METADATA_SIZE / SQFS_FRAGMENT_ENTRY_SIZE;
+	size_t index_count = (img->fragment_count + per_block - 1) / per_block;
+	size_t i, j;
+
+	index = mmap_read(r->f, img->fragment_table_start, index_count * 8);
+	if (!index)
+		return 0;
+
+	for (i = 0; i < index_count; ++i)
+	{
+		uint64_t offset = get64(index + i * 8);
+		size_t length;
+
+		if (!read_metadata_block(r, &offset, entries, &length, 0))
+			return 0;
+
+		for (j = 0; j < length / SQFS_FRAGMENT_ENTRY_SIZE; ++j)
+		{
+			const unsigned char* e = entries + j * SQFS_FRAGMENT_ENTRY_SIZE;
+			size_t fragment = i * per_block + j;
+			uint32_t size = get32(e + 8);
+
+			if (fragment >= img->fragment_count)
+				break;
+			/* an unused fragment has no known length */
+			if ((size & SQFS_BLOCK_UNCOMPRESSED) || size == 0
+					|| r->fragment_lengths[fragment] == 0)
+				continue;
+			if (!add_block(r, get64(e), size & SQFS_BLOCK_LENGTH_MASK,
+						r->fragment_lengths[fragment]))
+				return 0;
+		}
+	}
+
+	return 1;
+}
+
+static int block_cmp(const void* a, const void* b)
+{
+	const struct sqfs_block* ba = a;
+	const struct sqfs_block* bb = b;
+
+	if (ba->offset != bb->offset)
+		return ba->offset < bb->offset ? -1 : 1;
+	return 0;
+}
+
+/* sort the blocks, merging the files sharing them */
+static int sort_blocks(struct sqfs_image* img)
+{
+	size_t i, out = 0;
+
+	qsort(img->blocks, img->block_count, sizeof(*img->blocks), block_cmp);
+
+	for (i = 0; i < img->block_count; ++i)
+	{
+		const struct sqfs_block* b = &img->blocks[i];
+
+		if (out > 0)
+		{
+			const struct sqfs_block* prev = &img->blocks[out - 1];
+
+			if (b->offset == prev->offset && b->length == prev->length
+					&& b->uncompressed_length == prev->uncompressed_length)
+				continue;
+			if (b->offset < (uint64_t) prev->offset + prev->length)
+			{
+				fprintf(stderr, "Overlapping blocks in SquashFS image.\n"
+						"\toffset: 0x%08lx\n", (unsigned long) b->offset);
+				return 0;
+			}
+		}
+
+		img->blocks[out++] = *b;
+	}
+
+	img->block_count = out;
+	return 1;
+}
+
+int sqfs_read_blocks(struct sqfs_image* img, const struct mmap_file* f)
+{
+	struct sqfs_reader r;
+	int ret = 0;
+
+	memset(&r, 0, sizeof(r));
+	r.img = img;
+	r.f = f;
+
+	do
+	{
+		r.comp = compressor_ctx_create(img->compression);
+		if (!r.comp)
+			break;
+
+		r.fragment_lengths = calloc(img->fragment_count + 1,
+				sizeof(*r.fragment_lengths));
+		if (!r.fragment_lengths)
+		{
+			fprintf(stderr, "Unable to allocate memory for fragments.\n"
+					"\terrno: %s\n", strerror(errno));
+			break;
+		}
+
+		if (!read_inode_table(&r) || !read_inodes(&r))
+			break;
+		if (img->fragment_count > 0 && !read_fragment_table(&r))
+			break;
+		if (!sort_blocks(img))
+			break;
+
+		ret = 1;
+	} while (0);
+
+	if (r.comp)
+		compressor_ctx_destroy(r.comp);
+	free(r.inodes);
+	free(r.fragment_lengths);
+	return ret;
+}
+
+void sqfs_image_free(struct sqfs_image* img)
+{
+	free(img->blocks);
+	img->blocks = 0;
+	img->block_count = 0;
+}
@@ -0,0 +1,64 @@
+/**
+ * SquashFS delta merge tool
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#pragma once
+
+#ifndef SDT_SQUASHFS_H
+#define SDT_SQUASHFS_H 1
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#ifdef HAVE_STDINT_H
+#	include <stdint.h>
+#endif
+#include <stdlib.h>
+
+#include "util.h"
+
+/*
+ * A reader for SquashFS 4.0 images, finding the compressed blocks
+ * squashdelta expands: the inode table metadata blocks, the file data
+ * blocks and the fragment blocks. The other metadata is left as is.
+ */
+
+/* a compressed block of the image, host-endian */
+struct sqfs_block
+{
+	uint32_t offset;
+	uint32_t length;
+	/* the length the block needs to decompress to */
+	uint32_t uncompressed_length;
+};
+
+struct sqfs_image
+{
+	/* the compression in the SquashDelta header format */
+	uint32_t compression;
+	uint32_t block_size;
+
+	/* from the superblock */
+	uint32_t inode_count;
+	uint32_t fragment_count;
+	uint64_t bytes_used;
+	uint64_t inode_table_start;
+	uint64_t directory_table_start;
+	uint64_t fragment_table_start;
+
+	/* sorted by offset, not overlapping */
+	struct sqfs_block* blocks;
+	size_t block_count;
+};
+
+/* read the superblock and the compressor options */
+int sqfs_read_superblock(struct sqfs_image* img, const struct mmap_file* f);
+/* find the blocks, the compressor needs to be supported; the blocks
+ * need to be in the first 4 GiB, the block list can not address more */
+int sqfs_read_blocks(struct sqfs_image* img, const struct mmap_file* f);
+void sqfs_image_free(struct sqfs_image* img);
+
+#endif /*!SDT_SQUASHFS_H*/
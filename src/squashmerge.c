@@ -8,650 +8,685 @@
 #	include "config.h"
 #endif
 
-#include <pthread.h>
-
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
-#include <sys/types.h>
-#include <sys/wait.h>
-#include <arpa/inet.h> /* for endian conversion */
-
-#ifdef HAVE_STDINT_H
-#	include <stdint.h>
-#endif
+#include <fcntl.h>
+#include <getopt.h>
 
-#include "compressor.h"
+#include "cpuinfo.h"
+#include "squashmerge.h"
+#include "stats.h"
 #include "util.h"
 
-#pragma pack(push, 1)
-struct compressed_block
+enum long_only_options
 {
-	uint32_t offset;
-	uint32_t length;
-	uint32_t uncompressed_length;
+	OPT_PIN_NUMA = 0x100,
+	OPT_HUGE_PAGES,
+	OPT_XDELTA3,
+	OPT_IN_MEMORY,
+	OPT_LAZY,
+	OPT_CACHE_SIZE,
+	OPT_MAX_MEMORY,
+	OPT_PREFETCH,
+	OPT_JOURNAL,
+	OPT_STREAM_OUTPUT,
+	OPT_IO,
+	OPT_SYNC,
+	OPT_NO_REUSE,
+	OPT_CACHE_DIR,
+	OPT_STATS,
+	OPT_STATS_JSON,
+	OPT_TRACE,
+	OPT_MANIFEST,
+	OPT_BATCH_JOBS,
+	OPT_BATCH_MEMORY,
+	OPT_BATCH_TEMP,
+	OPT_CREATE
 };
 
-struct sqdelta_header
-{
-	uint32_t magic;
-	uint32_t flags;
-	uint32_t compression;
-	uint32_t block_count;
+const struct option long_options[] = {
+	{ "jobs", required_argument, 0, 'j' },
+	{ "pin-numa", no_argument, 0, OPT_PIN_NUMA },
+	{ "huge-pages", no_argument, 0, OPT_HUGE_PAGES },
+	{ "xdelta3", no_argument, 0, OPT_XDELTA3 },
+	{ "in-memory", no_argument, 0, OPT_IN_MEMORY },
+	{ "lazy", no_argument, 0, OPT_LAZY },
+	{ "cache-size", required_argument, 0, OPT_CACHE_SIZE },
+	{ "max-memory", required_argument, 0, OPT_MAX_MEMORY },
+	{ "prefetch", required_argument, 0, OPT_PREFETCH },
+	{ "journal", required_argument, 0, OPT_JOURNAL },
+	{ "stream-output", no_argument, 0, OPT_STREAM_OUTPUT },
+	{ "io", required_argument, 0, OPT_IO },
+	{ "sync", required_argument, 0, OPT_SYNC },
+	{ "no-reuse", no_argument, 0, OPT_NO_REUSE },
+	{ "cache-dir", required_argument, 0, OPT_CACHE_DIR },
+	{ "stats", no_argument, 0, OPT_STATS },
+	{ "stats-json", required_argument, 0, OPT_STATS_JSON },
+	{ "trace", required_argument, 0, OPT_TRACE },
+	{ "manifest", required_argument, 0, OPT_MANIFEST },
+	{ "batch-jobs", required_argument, 0, OPT_BATCH_JOBS },
+	{ "batch-memory", required_argument, 0, OPT_BATCH_MEMORY },
+	{ "batch-temp", required_argument, 0, OPT_BATCH_TEMP },
+	{ "create", no_argument, 0, OPT_CREATE },
+	{ "help", no_argument, 0, 'h' },
+	{ 0, 0, 0, 0 }
 };
-#pragma pack(pop)
 
-const uint32_t sqdelta_magic = 0x5371ceb4UL;
-
-struct sqdelta_header read_sqdelta_header(const struct mmap_file* f,
-		size_t offset)
+void print_usage(const char* prog)
 {
-	struct sqdelta_header* h;
-	struct sqdelta_header out;
-
-	out.magic = 0;
-
-	h = mmap_read(f, offset, sizeof(*h));
-	if (!h)
-		return out;
+	fprintf(stderr, "Usage: %s [options] <source> <patch>... <target>\n"
+			"       %s [options] --manifest <file>\n"
+			"       %s [options] --create <source> <target> <patch>\n"
+			"\n"
+			"Multiple patches are applied in order, without recompressing\n"
+			"the intermediate images. A patch of \"-\" is read from stdin,\n"
+			"a patch from a pipe is used while it is still arriving.\n"
+			"\n"
+			"A manifest lists independent merges, one \"<source> <patch>\n"
+			"<target>\" per line (# starts a comment), run several at once\n"
+			"on the same worker threads. Each target is truncated when\n"
+			"its merge starts; at most one input can be \"-\" (stdin).\n"
+			"\n"
+			"With --create, a patch from the source to the target SquashFS\n"
+			"image is generated instead, on the worker threads. A patch\n"
+			"of \"-\" is written to stdout.\n"
+			"\n"
+			"Options:\n"
+			"\t-j, --jobs N     use N worker threads (default: available CPUs,\n"
+			"\t                 or SQUASHMERGE_THREADS if set)\n"
+			"\t    --pin-numa   pin workers to NUMA nodes\n"
+			"\t    --huge-pages use huge pages for the temporary files\n"
+			"\t                 where supported (e.g. tmpfs TMPDIR)\n"
+			"\t    --xdelta3    apply vcdiff patches using external xdelta3\n"
+			"\t    --in-memory  keep the expanded source in memory instead\n"
+			"\t                 of a temporary file (in-process decoder only)\n"
+			"\t    --lazy       decompress source blocks only when the patch\n"
+			"\t                 references them (in-process decoder only)\n"
+			"\t    --cache-size SIZE\n"
+			"\t                 memory cap for --lazy block cache (default: 64M)\n"
+			"\t    --max-memory SIZE\n"
+			"\t                 keep about SIZE of the images in memory, dropping\n"
+			"\t                 the finished parts (implies --lazy and --io mmap)\n"
+			"\t    --prefetch SIZE\n"
+			"\t                 read SIZE of the compressed source ahead of\n"
+			"\t                 the decompressing workers (default: 32M, 0 off)\n"
+			"\t    --journal FILE\n"
+			"\t                 record the progress in FILE, and resume from it\n"
+			"\t                 if the merge was interrupted (single patch only)\n"
+			"\t    --stream-output\n"
+			"\t                 write the squashed image sequentially to a fresh\n"
+			"\t                 target; implied if the target is \"-\" (stdout)\n"
+			"\t    --io MODE    read input files using mmap (default), pread\n"
+			"\t                 or direct (pread with O_DIRECT)\n"
+			"\t    --sync MODE  make the target durable using fdatasync (default),\n"
+			"\t                 range (sync_file_range while streaming) or none\n"
+			"\t    --no-reuse   always recompress blocks, even if identical\n"
+			"\t                 blocks with known compressed form were seen\n"
+			"\t    --cache-dir DIR\n"
+			"\t                 keep compressed forms of recompressed blocks\n"
+			"\t                 in DIR, for reuse by later runs\n"
+			"\t    --stats      print phase, thread and block timings to stderr\n"
+			"\t    --stats-json FILE\n"
+			"\t                 write the statistics to FILE as JSON\n"
+			"\t    --trace FILE write a Chrome trace of the phases and worker\n"
+			"\t                 tasks to FILE\n"
+			"\t    --manifest FILE\n"
+			"\t                 apply the merges listed in FILE\n"
+			"\t    --batch-jobs N\n"
+			"\t                 run up to N merges of the manifest at once\n"
+			"\t                 (default: one per worker thread)\n"
+			"\t    --batch-memory SIZE\n"
+			"\t                 limit the estimated memory used by the merges\n"
+			"\t                 running at once (default: no limit)\n"
+			"\t    --batch-temp SIZE\n"
+			"\t                 limit the estimated temporary space used by\n"
+			"\t                 the merges running at once (default: no limit)\n"
+			"\t    --create     create a patch instead of applying it\n"
+			"\t-h, --help       print this help\n", prog, prog, prog);
+}
 
-	if (ntohl(h->magic) != sqdelta_magic)
-	{
-		fprintf(stderr, "Incorrect magic in patch file.\n"
-				"\tmagic: %08x, expected: %08x\n",
-				ntohl(h->magic), sqdelta_magic);
-		return out;
-	}
+/* with keep, the target of an interrupted merge is kept for resuming,
+ * the merge truncates it otherwise */
+static int open_target(const char* path, int stream_output, int keep)
+{
+	int fd;
 
-	out.flags = ntohl(h->flags);
-	if (out.flags)
+	if (stream_output)
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	else
+		fd = open(path, O_RDWR | O_CREAT | (keep ? 0 : O_TRUNC), 0666);
+	if (fd == -1)
 	{
-		fprintf(stderr, "Unknown flag enabled in patch file.\n"
-				"\tflags: %08x\n", ntohl(h->flags));
-		return out;
+		fprintf(stderr, "Unable to open file.\n"
+				"\tpath: %s\n"
+				"\terrno: %s\n", path, strerror(errno));
 	}
 
-	out.compression = ntohl(h->compression);
-	out.block_count = ntohl(h->block_count);
-	out.magic = sqdelta_magic;
-
-	return out;
+	return fd;
 }
 
-enum patch_format
-{
-	PATCH_UNKNOWN = 0,
-
-	PATCH_VCDIFF,
-};
-
-const unsigned char vcdiff_magic[3] = {0xd6, 0xc3, 0xc4};
-
-int read_patch_format(const struct mmap_file* f, size_t offset)
+static void input_from_arg(struct squashmerge_input* in, const char* arg)
 {
-	unsigned char* hdr;
-
-	hdr = mmap_read(f, offset, sizeof(vcdiff_magic));
-	if (!hdr)
-		return PATCH_UNKNOWN;
-
-	if (!memcmp(hdr, vcdiff_magic, sizeof(vcdiff_magic)))
-		return PATCH_VCDIFF;
-
-	fprintf(stderr, "Unknown delta format (only vcdiff"
-			" is supported at the moment).\n");
-	return PATCH_UNKNOWN;
+	memset(in, 0, sizeof(*in));
+	if (!strcmp(arg, "-"))
+		in->fd = 0;
+	else
+	{
+		in->path = arg;
+		in->fd = -1;
+	}
 }
 
-struct compress_data_shared
+/* a merge listed in the manifest */
+struct manifest_entry
 {
-	struct sqdelta_header* dh;
-	struct compressed_block* block_list;
-	struct mmap_file* input_f;
-	struct mmap_file* output_f;
-	size_t* prev_offset;
-	int thread_count;
+	char* source;
+	char* patch;
+	char* target;
+	int stream_output;
 };
 
-struct compress_data_private
+static void manifest_free(struct manifest_entry* entries, size_t count)
 {
-	struct compress_data_shared* shared;
-	unsigned int thread_no;
-	pthread_t thread_id;
-};
-
-int run_multithreaded(void* (*func) (void*), struct compress_data_shared* d)
-{
-	struct compress_data_private* pd;
-	int i, spawned, ret;
-
-	int num_cpus = 1;
+	size_t i;
 
-#ifdef _SC_NPROCESSORS_ONLN
-	num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
-	if (num_cpus < 1)
+	for (i = 0; i < count; ++i)
 	{
-		fprintf(stderr, "Warning: unable to get number of CPUs.\n");
-		num_cpus = 1;
+		free(entries[i].source);
+		free(entries[i].patch);
+		free(entries[i].target);
 	}
-#endif
+	free(entries);
+}
+
+static int manifest_read(const char* path, struct manifest_entry** out,
+		size_t* count)
+{
+	FILE* f;
+	char line[3 * 4096];
+	struct manifest_entry* entries = 0;
+	size_t alloc = 0;
+	unsigned long line_no = 0;
+	unsigned long stdin_line = 0;
+	int ret = 1;
 
-	d->thread_count = num_cpus;
+	*count = 0;
 
-	pd = calloc(num_cpus, sizeof(*pd));
-	if (!pd)
+	f = fopen(path, "r");
+	if (!f)
 	{
-		fprintf(stderr, "Unable to allocate memory for threading.\n"
-				"\terrno: %s\n", strerror(errno));
+		fprintf(stderr, "Unable to open manifest.\n"
+				"\tpath: %s\n"
+				"\terrno: %s\n", path, strerror(errno));
 		return 0;
 	}
 
-	for (i = 0; i < num_cpus; ++i)
+	while (ret && fgets(line, sizeof(line), f))
 	{
-		pd[i].shared = d;
-		pd[i].thread_no = i;
+		char* fields[4];
+		char* comment;
+		char* save;
+		int n;
 
-		if (i != num_cpus - 1)
+		++line_no;
+		if (!strchr(line, '\n') && !feof(f))
 		{
-			ret = pthread_create(&pd[i].thread_id, 0, func, &pd[i]);
-			if (ret != 0)
-			{
-				fprintf(stderr, "Unable to create thread %d.\n"
-						"\terror: %s\n", i, strerror(ret));
-				break;
-			}
+			fprintf(stderr, "Manifest line too long.\n"
+					"\tline: %lu\n", line_no);
+			ret = 0;
+			break;
 		}
-		else
-			ret = !func(&pd[i]);
-	}
-	spawned = i;
 
-	if (ret != 0)
-	{
-		int cret;
+		comment = strchr(line, '#');
+		if (comment)
+			*comment = 0;
 
-		for (i = 0; i < spawned; ++i)
+		/* one more, to catch extra fields */
+		for (n = 0; n < 4; ++n)
 		{
-			if (i == num_cpus - 1)
+			fields[n] = strtok_r(n == 0 ? line : 0, " \t\r\n", &save);
+			if (!fields[n])
 				break;
-
-			cret = pthread_cancel(pd[i].thread_id);
-			if (cret != 0)
-				fprintf(stderr, "Warning: unable to cancel thread %d.\n"
-						"\terror: %s\n", i, strerror(cret));
 		}
-	}
-
-	for (i = 0; i < spawned; ++i)
-	{
-		int jret;
-		void* res;
-
-		if (i == num_cpus - 1)
+		if (n == 0)
+			continue;
+		if (n != 3)
+		{
+			fprintf(stderr, "Manifest line needs a source, a patch"
+					" and a target.\n"
+					"\tline: %lu\n", line_no);
+			ret = 0;
 			break;
-
-		jret = pthread_join(pd[i].thread_id, &res);
-		if (jret != 0)
+		}
+		/* the targets are written in parallel */
+		if (!strcmp(fields[2], "-"))
 		{
-			fprintf(stderr, "Warning: unable to join thread %d.\n"
-					"\terror: %s\n", i, strerror(jret));
+			fprintf(stderr, "Manifest targets can not be stdout.\n"
+					"\tline: %lu\n", line_no);
+			ret = 0;
+			break;
 		}
-
-		if (!res)
-			ret = 1;
-	}
-
-	free(pd);
-
-	return !ret;
-}
-
-void* decompress_blocks(void* data)
-{
-	struct compress_data_private* pd = data;
-
-	struct sqdelta_header* dh = pd->shared->dh;
-	struct compressed_block* source_blocks = pd->shared->block_list;
-	struct mmap_file* source_f = pd->shared->input_f;
-	struct mmap_file* temp_source_f = pd->shared->output_f;
-	size_t prev_offset = *pd->shared->prev_offset;
-	unsigned int id = pd->thread_no;
-	int no_threads = pd->shared->thread_count;
-
-	size_t i;
-
-	for (i = 0; i < dh->block_count; ++i)
-	{
-		size_t unc_length = ntohl(source_blocks[i].uncompressed_length);
-
-		if (i % no_threads == id)
+		/* it can be read only once */
+		if (!strcmp(fields[0], "-") || !strcmp(fields[1], "-"))
 		{
-			size_t offset = ntohl(source_blocks[i].offset);
-			size_t length = ntohl(source_blocks[i].length);
-			size_t ret;
-
-			void* in_pos = mmap_read(source_f, offset, length);
-			void* out_pos = mmap_read(temp_source_f,
-					prev_offset, unc_length);
-
-			if (!in_pos || !out_pos)
-				return 0;
+			if (stdin_line != 0
+					|| (!strcmp(fields[0], "-") && !strcmp(fields[1], "-")))
+			{
+				fprintf(stderr, "Only one manifest input can be stdin.\n"
+						"\tline: %lu\n", line_no);
+				ret = 0;
+				break;
+			}
+			stdin_line = line_no;
+		}
 
-			ret = compressor_decompress(dh->compression,
-					out_pos, in_pos, length, unc_length);
+		if (*count == alloc)
+		{
+			struct manifest_entry* grown;
 
-			if (ret != unc_length)
+			alloc = alloc ? alloc * 2 : 16;
+			grown = realloc(entries, alloc * sizeof(*entries));
+			if (!grown)
 			{
-				if (ret != 0)
-					fprintf(stderr, "Block decompression resulted in different size.\n"
-							"\toffset: 0x%08lx\n"
-							"\tlength: %lu\n"
-							"\texpected unpacked length: %lu\n"
-							"\treal unpacked length: %lu\n",
-							offset, length, unc_length, ret);
-
-				return 0;
+				fprintf(stderr, "Unable to allocate memory for manifest.\n"
+						"\terrno: %s\n", strerror(errno));
+				ret = 0;
+				break;
 			}
+			entries = grown;
+		}
+
+		entries[*count].source = strdup(fields[0]);
+		entries[*count].patch = strdup(fields[1]);
+		entries[*count].target = strdup(fields[2]);
+		++*count;
+		if (!entries[*count - 1].source || !entries[*count - 1].patch
+				|| !entries[*count - 1].target)
+		{
+			fprintf(stderr, "Unable to allocate memory for manifest.\n"
+					"\terrno: %s\n", strerror(errno));
+			ret = 0;
 		}
+	}
 
-		prev_offset += unc_length;
+	if (ret && ferror(f))
+	{
+		fprintf(stderr, "Unable to read manifest.\n"
+				"\tpath: %s\n"
+				"\terrno: %s\n", path, strerror(errno));
+		ret = 0;
 	}
+	fclose(f);
 
-	if (id == 0)
-		*pd->shared->prev_offset = prev_offset;
+	if (!ret)
+	{
+		manifest_free(entries, *count);
+		return 0;
+	}
 
-	return pd;
+	*out = entries;
+	return 1;
 }
 
-int expand_input(struct sqdelta_header* dh,
-		struct compressed_block* source_blocks,
-		struct mmap_file* source_f,
-		struct mmap_file* patch_f,
-		struct mmap_file* temp_source_f)
+static int open_manifest_target(void* priv)
 {
-	size_t prev_offset = 0;
-	size_t i;
-
-	for (i = 0; i < dh->block_count; ++i)
-	{
-		size_t offset = ntohl(source_blocks[i].offset);
-		size_t length = ntohl(source_blocks[i].length);
+	const struct manifest_entry* e = priv;
 
-		void* in_pos = mmap_read(source_f, prev_offset,
-				offset - prev_offset);
-		void* out_pos = mmap_read(temp_source_f,
-				prev_offset, offset - prev_offset);
+	return open_target(e->target, e->stream_output, 0);
+}
 
-		if (!in_pos || !out_pos)
-			return 0;
+/* run the merges of the manifest on one context */
+static int run_manifest(const struct squashmerge_options* opts,
+		const char* path)
+{
+	struct manifest_entry* entries;
+	struct squashmerge_job* jobs;
+	struct squashmerge_ctx* ctx;
+	size_t count, i;
+	int ret = 0;
 
-		memcpy(out_pos, in_pos, offset - prev_offset);
-		prev_offset = offset + length;
-	}
+	if (!manifest_read(path, &entries, &count))
+		return 0;
 
-	/* the last block */
+	jobs = calloc(count + 1, sizeof(*jobs));
+	if (!jobs)
 	{
-		void* in_pos = mmap_read(source_f, prev_offset,
-				source_f->length - prev_offset);
-		void* out_pos = mmap_read(temp_source_f,
-				prev_offset, source_f->length - prev_offset);
-
-		if (!in_pos || !out_pos)
-			return 0;
-
-		memcpy(out_pos, in_pos, source_f->length - prev_offset);
+		fprintf(stderr, "Unable to allocate memory for manifest.\n"
+				"\terrno: %s\n", strerror(errno));
+		manifest_free(entries, count);
+		return 0;
 	}
 
-	prev_offset = source_f->length;
-
+	for (i = 0; i < count; ++i)
 	{
-		struct compress_data_shared d;
-
-		d.dh = dh;
-		d.block_list = source_blocks;
-		d.input_f = source_f;
-		d.output_f = temp_source_f;
-		d.prev_offset = &prev_offset;
-
-		if (!run_multithreaded(decompress_blocks, &d))
-			return 0;
+		struct squashmerge_job* job = &jobs[i];
+
+		input_from_arg(&job->source, entries[i].source);
+		input_from_arg(&job->patch, entries[i].patch);
+		/* the targets are opened as their merges start */
+		entries[i].stream_output = opts->stream_output;
+		job->target_fd = -1;
+		job->open_target = open_manifest_target;
+		job->open_target_priv = &entries[i];
 	}
 
-	/* copy the block lists and the header */
+	ctx = squashmerge_ctx_create(opts);
+	if (ctx)
 	{
-		size_t block_list_size = sizeof(*source_blocks) * dh->block_count;
-
-		void* in_pos = mmap_read(patch_f, sizeof(*dh),
-				block_list_size);
-		void* out_pos = mmap_read(temp_source_f,
-				prev_offset, block_list_size);
-		if (!in_pos || !out_pos)
-			return 0;
-
-		memcpy(out_pos, in_pos, block_list_size);
+		ret = 1;
+		squashmerge_apply_batch(ctx, jobs, count);
+		for (i = 0; i < count; ++i)
+		{
+			if (jobs[i].result != SQUASHMERGE_OK)
+			{
+				fprintf(stderr, "Merge failed: %s: %s.\n",
+						entries[i].target,
+						squashmerge_strerror(jobs[i].result));
+				ret = 0;
+			}
+		}
 
-		prev_offset += block_list_size;
-		in_pos = mmap_read(patch_f, 0, sizeof(*dh));
-		out_pos = mmap_read(temp_source_f, prev_offset, sizeof(*dh));
-		if (!in_pos || !out_pos)
-			return 0;
-		memcpy(out_pos, in_pos, sizeof(*dh));
+		/* merges the per-thread statistics */
+		squashmerge_ctx_destroy(ctx);
 	}
 
-	return 1;
+	free(jobs);
+	manifest_free(entries, count);
+	return ret;
 }
 
-int run_xdelta3(struct mmap_file* patch, struct mmap_file* output,
-		const char* input_path)
+/* apply the patches in args[1..count-2] to args[0], writing args[count-1] */
+static int run_merge(struct squashmerge_options* opts, int count,
+		char* args[])
 {
-	pid_t child_pid = fork();
-
-	if (child_pid == -1)
+	struct squashmerge_input source;
+	struct squashmerge_input* patches;
+	int patch_count = count - 2;
+	const char* target_file = args[count - 1];
+	struct squashmerge_ctx* ctx;
+	enum squashmerge_error err;
+	int target_fd;
+	int i;
+	int ret = 0;
+
+	memset(&source, 0, sizeof(source));
+	source.path = args[0];
+	source.fd = -1;
+
+	patches = calloc(patch_count, sizeof(*patches));
+	if (!patches)
 	{
-		fprintf(stderr, "fork() failed\n"
+		fprintf(stderr, "Unable to allocate memory for patch list.\n"
 				"\terrno: %s\n", strerror(errno));
 		return 0;
 	}
+	for (i = 0; i < patch_count; ++i)
+		input_from_arg(&patches[i], args[1 + i]);
 
-	if (child_pid == 0)
+	if (!strcmp(target_file, "-"))
 	{
-		/* child */
-		if (close(0) == -1)
-		{
-			fprintf(stderr, "Unable to close stdin in child\n"
-					"\terrno: %s\n", strerror(errno));
-			exit(1);
-		}
-		if (close(1) == -1)
-		{
-			fprintf(stderr, "Unable to close stdout in child\n"
-					"\terrno: %s\n", strerror(errno));
-			exit(1);
-		}
-
-		if (dup2(patch->fd, 0) == -1)
-		{
-			fprintf(stderr, "Unable to dup2() patch file into stdin\n"
-					"\terrno: %s\n", strerror(errno));
-			exit(1);
-		}
-		if (dup2(output->fd, 1) == -1)
-		{
-			fprintf(stderr, "Unable to dup2() output file into stdout\n"
-					"\terrno: %s\n", strerror(errno));
-			exit(1);
-		}
-
-		if (execlp("xdelta3",
-					"xdelta3", "-c", "-d", "-s", input_path, 0) == -1)
-		{
-			fprintf(stderr, "execlp() failed\n"
-					"\terrno: %s\n", strerror(errno));
-			exit(1);
-		}
+		opts->stream_output = 1;
+		target_fd = 1;
 	}
 	else
 	{
-		int ret;
-		waitpid(child_pid, &ret, 0);
-
-		if (WEXITSTATUS(ret) != 0)
+		target_fd = open_target(target_file, opts->stream_output,
+				opts->journal != 0);
+		if (target_fd == -1)
 		{
-			fprintf(stderr, "Child exited with non-success status\n"
-					"\texit status: %d\n", WEXITSTATUS(ret));
+			free(patches);
 			return 0;
 		}
 	}
 
-	return 1;
-}
-
-void* compress_blocks(void* data)
-{
-	struct compress_data_private* pd = data;
-
-	struct sqdelta_header* dh = pd->shared->dh;
-	struct compressed_block* target_blocks = pd->shared->block_list;
-	struct mmap_file* target_f = pd->shared->output_f;
-	size_t prev_offset = *pd->shared->prev_offset;
-	unsigned int id = pd->thread_no;
-	int no_threads = pd->shared->thread_count;
-
-	size_t i;
-
-	for (i = dh->block_count; i > 0; --i)
+	ctx = squashmerge_ctx_create(opts);
+	if (ctx)
 	{
-		size_t unc_length = ntohl(target_blocks[i - 1].uncompressed_length);
-
-		prev_offset -= unc_length;
-
-		if (i % no_threads == id)
-		{
-			size_t offset = ntohl(target_blocks[i - 1].offset);
-			size_t length = ntohl(target_blocks[i - 1].length);
-			size_t ret;
-
-			void* in_pos;
-			void* out_pos = mmap_read(target_f, offset, length);
-
-			in_pos = mmap_read(target_f, prev_offset, unc_length);
-			if (!in_pos || !out_pos)
-				return 0;
-
-			ret = compressor_compress(dh->compression,
-					out_pos, in_pos, unc_length, length);
-
-			if (ret != length)
-			{
-				if (ret != 0)
-					fprintf(stderr, "Block re-compression resulted in different size.\n"
-							"\toffset: 0x%08lx\n"
-							"\tinput length: %lu\n"
-							"\texpected packed length: %lu\n"
-							"\treal packed length: %lu\n",
-							offset, unc_length, length, ret);
+		err = squashmerge_apply_chain(ctx, &source, patches, patch_count,
+				target_fd);
+		if (err == SQUASHMERGE_OK)
+			ret = 1;
+		else
+			fprintf(stderr, "Merge failed: %s.\n", squashmerge_strerror(err));
 
-				return 0;
-			}
-		}
+		/* merges the per-thread statistics */
+		squashmerge_ctx_destroy(ctx);
 	}
 
-	if (id == 0)
-		*pd->shared->prev_offset = prev_offset;
+	free(patches);
+	if (target_fd > 1 && close(target_fd) == -1)
+	{
+		fprintf(stderr, "Unable to close output file.\n"
+				"\terrno: %s\n", strerror(errno));
+		ret = 0;
+	}
 
-	return pd;
+	return ret;
 }
 
-int squash_target_file(struct mmap_file* target_f)
+/* create a patch from args[0] to args[1], writing args[2] */
+static int run_create(const struct squashmerge_options* opts, char* args[])
 {
-	struct sqdelta_header dh;
-	size_t block_list_size, block_list_offset;
-	struct compressed_block* target_blocks;
-	size_t prev_offset;
-
-	dh = read_sqdelta_header(target_f, target_f->length - sizeof(dh));
-
-	if (dh.magic == 0)
-		return 0;
-	block_list_size = sizeof(*target_blocks) * dh.block_count;
-	block_list_offset = target_f->length - sizeof(dh) - block_list_size;
-
-	target_blocks = mmap_read(target_f, block_list_offset,
-			block_list_size);
-	if (!target_blocks)
-		return 0;
-
-	prev_offset = block_list_offset;
-
+	struct squashmerge_input source;
+	struct squashmerge_input target;
+	struct squashmerge_ctx* ctx;
+	enum squashmerge_error err;
+	int patch_fd;
+	int ret = 0;
+
+	memset(&source, 0, sizeof(source));
+	source.path = args[0];
+	source.fd = -1;
+	target = source;
+	target.path = args[1];
+
+	if (!strcmp(args[2], "-"))
+		patch_fd = 1;
+	else
 	{
-		struct compress_data_shared d;
+		patch_fd = open_target(args[2], 1, 0);
+		if (patch_fd == -1)
+			return 0;
+	}
 
-		d.dh = &dh;
-		d.block_list = target_blocks;
-		d.output_f = target_f;
-		d.prev_offset = &prev_offset;
+	ctx = squashmerge_ctx_create(opts);
+	if (ctx)
+	{
+		err = squashmerge_create(ctx, &source, &target, patch_fd);
+		if (err == SQUASHMERGE_OK)
+			ret = 1;
+		else
+			fprintf(stderr, "Patch creation failed: %s.\n",
+					squashmerge_strerror(err));
 
-		if (!run_multithreaded(compress_blocks, &d))
-			return 0;
+		squashmerge_ctx_destroy(ctx);
 	}
 
-	/* truncate the resulting file */
-	if (ftruncate(target_f->fd, prev_offset) == -1)
+	if (patch_fd > 1 && close(patch_fd) == -1)
 	{
-		fprintf(stderr, "Unable to truncate output file.\n"
+		fprintf(stderr, "Unable to close output file.\n"
 				"\terrno: %s\n", strerror(errno));
-		return 0;
+		ret = 0;
 	}
 
-	return 1;
+	return ret;
 }
 
 int main(int argc, char* argv[])
 {
-	const char* source_file;
-	const char* patch_file;
-	const char* target_file;
+	struct squashmerge_options opts;
+	enum io_backend io_backend = IO_BACKEND_MMAP;
+	enum io_sync sync_mode = IO_SYNC_FDATASYNC;
+	int print_stats = 0;
+	const char* stats_file = 0;
+	const char* trace_file = 0;
+	const char* manifest_file = 0;
+	int create = 0;
+	int opt;
 
-	struct mmap_file source_f;
-	struct mmap_file patch_f;
-	struct mmap_file temp_source_f;
-	struct mmap_file target_f;
+	int ret;
 
-	int ret = 1;
-
-	if (argc < 4)
-	{
-		fprintf(stderr, "Usage: %s <source> <patch> <target>\n", argv[0]);
-		return 1;
-	}
-
-	source_file = argv[1];
-	patch_file = argv[2];
-	target_file = argv[3];
-
-	source_f = mmap_open(source_file);
-	if (source_f.fd == -1)
-		return 1;
+	squashmerge_options_init(&opts);
 
-	do
+	while ((opt = getopt_long(argc, argv, "j:h", long_options, 0)) != -1)
 	{
-		patch_f = mmap_open(patch_file);
-		if (patch_f.fd == -1)
-			break;
-
-		do
+		switch (opt)
 		{
-			struct compressed_block* source_blocks;
-			char tmp_name_buf[] = "tmp.XXXXXX";
-			size_t tmp_length = 0;
-			size_t block_list_size;
-			enum patch_format pformat;
-
-			struct sqdelta_header dh = read_sqdelta_header(&patch_f, 0);
-			if (dh.magic == 0)
+			case 'j':
+				if (!cpu_parse_job_count(optarg, &opts.jobs))
+				{
+					fprintf(stderr, "Invalid job count: %s\n", optarg);
+					return 1;
+				}
 				break;
-
-			block_list_size = sizeof(*source_blocks) * dh.block_count;
-			source_blocks = mmap_read(&patch_f, sizeof(dh),
-					block_list_size);
-			if (!source_blocks)
+			case OPT_PIN_NUMA:
+				opts.pin_numa = 1;
 				break;
-
-			pformat = read_patch_format(&patch_f,
-					sizeof(dh) + block_list_size);
-			if (pformat == PATCH_UNKNOWN)
+			case OPT_HUGE_PAGES:
+				opts.huge_pages = 1;
 				break;
-
-			/* open target before chdir() */
-			target_f = mmap_create_without_mapping(target_file);
-			if (target_f.fd == -1)
+			case OPT_XDELTA3:
+				opts.use_xdelta3 = 1;
 				break;
-
-			do
-			{
-				size_t i;
-
+			case OPT_IN_MEMORY:
+				opts.expand_mode = SQUASHMERGE_EXPAND_IN_MEMORY;
+				break;
+			case OPT_LAZY:
+				opts.expand_mode = SQUASHMERGE_EXPAND_LAZY;
+				break;
+			case OPT_IO:
+				if (!io_parse_backend(optarg, &io_backend))
 				{
-					const char* tmpdir = getenv("TMPDIR");
-#ifdef _P_tmpdir
-					if (!tmpdir)
-						tmpdir = P_tmpdir;
-#endif
-					if (!tmpdir)
-						tmpdir = "/tmp";
-
-					if (chdir(tmpdir) == -1)
-					{
-						fprintf(stderr, "Unable to enter temporary directory.\n"
-								"\tpath: %s\n"
-								"\terrno: %s\n", tmpdir, strerror(errno));
-						break;
-					}
+					fprintf(stderr, "Invalid I/O mode: %s\n", optarg);
+					return 1;
 				}
-
-				tmp_length += source_f.length;
-				tmp_length += sizeof(dh);
-				tmp_length += block_list_size;
-
-				for (i = 0; i < dh.block_count; ++i)
+				opts.io = (enum squashmerge_io) io_backend;
+				break;
+			case OPT_SYNC:
+				if (!io_parse_sync(optarg, &sync_mode))
 				{
-					size_t unc_length = ntohl(source_blocks[i].uncompressed_length);
-					tmp_length += unc_length;
+					fprintf(stderr, "Invalid sync mode: %s\n", optarg);
+					return 1;
 				}
-
-				temp_source_f = mmap_create_temp(tmp_name_buf, tmp_length);
-
-				do
+				opts.sync = (enum squashmerge_sync) sync_mode;
+				break;
+			case OPT_NO_REUSE:
+				opts.reuse = 0;
+				break;
+			case OPT_CACHE_DIR:
+				opts.cache_dir = optarg;
+				break;
+			case OPT_STATS:
+				print_stats = 1;
+				stats_enable();
+				break;
+			case OPT_STATS_JSON:
+				stats_file = optarg;
+				stats_enable();
+				break;
+			case OPT_TRACE:
+				trace_file = optarg;
+				stats_enable_trace();
+				break;
+			case OPT_STREAM_OUTPUT:
+				opts.stream_output = 1;
+				break;
+			case OPT_CACHE_SIZE:
+				if (!parse_size(optarg, &opts.cache_size))
 				{
-					int patch_ret;
-
-					if (!expand_input(&dh, source_blocks,
-								&source_f, &patch_f, &temp_source_f))
-						break;
-
-					mmap_close(&temp_source_f);
-
-					if (lseek(patch_f.fd, sizeof(dh) + block_list_size,
-								SEEK_SET) == -1)
-					{
-						fprintf(stderr, "Unable to seek patch file for applying.\n"
-								"\terrno: %s\n", strerror(errno));
-						break;
-					}
-
-					/* run patcher to obtain the expanded target file */
-					switch (pformat)
-					{
-						case PATCH_VCDIFF:
-							patch_ret = run_xdelta3(&patch_f, &target_f, tmp_name_buf);
-							break;
-						case PATCH_UNKNOWN:
-							/* not reached */
-							patch_ret = 0;
-					}
-
-					if (!patch_ret)
-						break;
-
-					if (!mmap_map_created_file(&target_f))
-						break;
-
-					if (squash_target_file(&target_f))
-						ret = 0;
-				} while (0);
-
-				unlink(tmp_name_buf);
-			} while (0);
-
-			mmap_close(&target_f);
-		} while (0);
-
-		mmap_close(&patch_f);
-	} while (0);
+					fprintf(stderr, "Invalid cache size: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case OPT_MANIFEST:
+				manifest_file = optarg;
+				break;
+			case OPT_BATCH_JOBS:
+				if (!cpu_parse_job_count(optarg, &opts.batch_merges))
+				{
+					fprintf(stderr, "Invalid batch job count: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case OPT_BATCH_MEMORY:
+				if (!parse_size(optarg, &opts.batch_memory))
+				{
+					fprintf(stderr, "Invalid batch memory limit: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case OPT_BATCH_TEMP:
+				if (!parse_size(optarg, &opts.batch_temp))
+				{
+					fprintf(stderr, "Invalid batch temporary space limit: %s\n",
+							optarg);
+					return 1;
+				}
+				break;
+			case OPT_MAX_MEMORY:
+				if (!parse_size(optarg, &opts.max_memory))
+				{
+					fprintf(stderr, "Invalid memory limit: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case OPT_PREFETCH:
+				if (!parse_size(optarg, &opts.prefetch))
+				{
+					fprintf(stderr, "Invalid prefetch distance: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case OPT_JOURNAL:
+				opts.journal = optarg;
+				break;
+			case OPT_CREATE:
+				create = 1;
+				break;
+			case 'h':
+				print_usage(argv[0]);
+				return 0;
+			default:
+				print_usage(argv[0]);
+				return 1;
+		}
+	}
 
-	mmap_close(&source_f);
+	if (create)
+	{
+		if (manifest_file || argc - optind != 3)
+		{
+			print_usage(argv[0]);
+			return 1;
+		}
+		ret = !run_create(&opts, argv + optind);
+	}
+	else if (manifest_file)
+	{
+		if (argc != optind)
+		{
+			print_usage(argv[0]);
+			return 1;
+		}
+		ret = !run_manifest(&opts, manifest_file);
+	}
+	else if (argc - optind < 3)
+	{
+		print_usage(argv[0]);
+		return 1;
+	}
+	else
+		ret = !run_merge(&opts, argc - optind, argv + optind);
+
+	if (ret == 0 && print_stats)
+		stats_print(stderr);
+	if (ret == 0 && stats_file && !stats_write_json(stats_file))
+		ret = 1;
+	if (ret == 0 && trace_file && !stats_write_trace(trace_file))
+		ret = 1;
 
 	return ret;
 }
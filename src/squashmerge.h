@@ -0,0 +1,199 @@
+/**
+ * SquashFS delta merge tool
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#pragma once
+
+#ifndef SDT_SQUASHMERGE_H
+#define SDT_SQUASHMERGE_H 1
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * libsquashmerge: applying squashmerge deltas in-process.
+ *
+ * A context owns a thread pool and the per-thread compressor contexts,
+ * and reuses them for consecutive merges. A single context runs one
+ * merge or one batch of merges at a time; the merges of a batch share
+ * the thread pool.
+ * Diagnostics are still printed to stderr, the return values only
+ * classify the failure.
+ */
+
+enum squashmerge_error
+{
+	SQUASHMERGE_OK = 0,
+	/* invalid arguments or options */
+	SQUASHMERGE_EINVAL,
+	SQUASHMERGE_ENOMEM,
+	/* reading the inputs, or writing the target, failed */
+	SQUASHMERGE_EIO,
+	/* the patch is malformed or does not match the source */
+	SQUASHMERGE_EFORMAT,
+	/* the patch needs a compressor or a feature that is unavailable */
+	SQUASHMERGE_EUNSUPPORTED,
+	/* the progress callback requested to stop */
+	SQUASHMERGE_ECANCELLED
+};
+
+enum squashmerge_stage
+{
+	/* decompressing the source blocks */
+	SQUASHMERGE_STAGE_EXPAND = 0,
+	/* applying the delta */
+	SQUASHMERGE_STAGE_PATCH,
+	/* recompressing the target blocks */
+	SQUASHMERGE_STAGE_SQUASH,
+	/* writing out the target */
+	SQUASHMERGE_STAGE_WRITE
+};
+
+enum squashmerge_expand
+{
+	/* expand the source into a temporary file */
+	SQUASHMERGE_EXPAND_TEMP_FILE = 0,
+	/* keep the decompressed blocks in memory */
+	SQUASHMERGE_EXPAND_IN_MEMORY,
+	/* decompress the blocks as the patch references them */
+	SQUASHMERGE_EXPAND_LAZY
+};
+
+/* the same values as enum io_backend and enum io_sync */
+enum squashmerge_io
+{
+	SQUASHMERGE_IO_MMAP = 0,
+	SQUASHMERGE_IO_PREAD,
+	SQUASHMERGE_IO_DIRECT
+};
+
+enum squashmerge_sync
+{
+	SQUASHMERGE_SYNC_NONE = 0,
+	SQUASHMERGE_SYNC_FDATASYNC,
+	SQUASHMERGE_SYNC_RANGE
+};
+
+struct squashmerge_options
+{
+	/* worker threads, 0 for the available CPUs */
+	unsigned int jobs;
+	int pin_numa;
+	/* back the temporary files with huge pages where possible; this
+	 * and pin_numa make the workers process contiguous block ranges */
+	int huge_pages;
+	/* use the external xdelta3 for VCDIFF patches */
+	int use_xdelta3;
+	enum squashmerge_expand expand_mode;
+	/* memory cap for the lazily decompressed blocks */
+	size_t cache_size;
+	enum squashmerge_io io;
+	/* compressed source data read ahead of the decompressing workers,
+	 * in the background, 0 to read it on access only (mmap I/O only) */
+	size_t prefetch;
+	enum squashmerge_sync sync;
+	/* write the target sequentially instead of in place; implied
+	 * if the target is not a regular file open for reading and writing */
+	int stream_output;
+	/* reuse the compressed forms of identical blocks */
+	int reuse;
+	/* optional, keeps the compressed forms between merges */
+	const char* cache_dir;
+	/* optional, overrides TMPDIR */
+	const char* tmpdir;
+
+	/* approximate memory the merge may keep mapped, 0 for no limit;
+	 * implies lazy expansion and mmap I/O, the decoded target is
+	 * written back and dropped from memory as the patch progresses */
+	size_t max_memory;
+
+	/* optional, records the progress of a single-patch merge written
+	 * in place, for a rerun to resume the recompression; the target
+	 * is not truncated when the journal matches it, removed when
+	 * done; not used by batches */
+	const char* journal;
+
+	/* merges of a batch run at once, 0 for one per worker thread */
+	unsigned int batch_merges;
+	/* the estimated memory and temporary space the running merges
+	 * of a batch may use together, 0 for no limit; a merge exceeding
+	 * the limit alone is run alone */
+	size_t batch_memory;
+	size_t batch_temp;
+};
+
+/* an input, read from path if set, otherwise from fd (owned by
+ * the caller) or, if fd is -1, from the memory buffer; a patch
+ * from a pipe or a socket is used while it is still arriving */
+struct squashmerge_input
+{
+	const char* path;
+	int fd;
+	const void* data;
+	size_t length;
+};
+
+/* a merge of a batch */
+struct squashmerge_job
+{
+	struct squashmerge_input source;
+	struct squashmerge_input patch;
+	/* if -1, open_target(open_target_priv) is called when the merge
+	 * starts instead, and the descriptor it returns is closed after */
+	int target_fd;
+	int (*open_target)(void* priv);
+	void* open_target_priv;
+
+	/* set by squashmerge_apply_batch() */
+	enum squashmerge_error result;
+};
+
+/* called from the merging thread; done and total are in bytes of
+ * the stage's output, return 0 to cancel the merge */
+typedef int (*squashmerge_progress_func)(void* priv,
+		enum squashmerge_stage stage, uint64_t done, uint64_t total);
+
+struct squashmerge_ctx;
+
+void squashmerge_options_init(struct squashmerge_options* o);
+
+/* returns 0 on failure; the option strings are not copied,
+ * they need to outlive the context */
+struct squashmerge_ctx* squashmerge_ctx_create(
+		const struct squashmerge_options* o);
+void squashmerge_ctx_destroy(struct squashmerge_ctx* ctx);
+void squashmerge_set_progress(struct squashmerge_ctx* ctx,
+		squashmerge_progress_func func, void* priv);
+
+/* merge the patch against the source, writing the new image to target_fd;
+ * a regular file is truncated and written in place, anything else needs
+ * to be writable sequentially */
+enum squashmerge_error squashmerge_apply(struct squashmerge_ctx* ctx,
+		const struct squashmerge_input* source,
+		const struct squashmerge_input* patch, int target_fd);
+
+/* apply the patches in order, each against the image produced by
+ * the previous one; the intermediate images are kept expanded */
+enum squashmerge_error squashmerge_apply_chain(struct squashmerge_ctx* ctx,
+		const struct squashmerge_input* source,
+		const struct squashmerge_input* patches, size_t patch_count,
+		int target_fd);
+
+/* apply the independent merges of the jobs, several at once, started
+ * in order; returns the first failure, the result of each merge is
+ * stored in its job; the progress callback is not used */
+enum squashmerge_error squashmerge_apply_batch(struct squashmerge_ctx* ctx,
+		struct squashmerge_job* jobs, size_t job_count);
+
+/* create a patch from the source to the target SquashFS image, written
+ * sequentially to patch_fd; uses the worker threads and the I/O option
+ * only, the progress callback is not used */
+enum squashmerge_error squashmerge_create(struct squashmerge_ctx* ctx,
+		const struct squashmerge_input* source,
+		const struct squashmerge_input* target, int patch_fd);
+
+const char* squashmerge_strerror(enum squashmerge_error err);
+
+#endif /*!SDT_SQUASHMERGE_H*/
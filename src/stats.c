@@ -0,0 +1,544 @@
+/**
+ * SquashFS delta merge tool
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <sys/resource.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+#include "util.h"
+
+/* getrusage() block counts are in 512-byte units */
+#define STATS_BLOCK_SIZE 512
+
+struct stats_worker
+{
+	unsigned long tasks;
+	double busy_time;
+	double idle_time;
+};
+
+/* a complete event, thread 0 being the phases and the rest workers */
+struct stats_event
+{
+	unsigned int thread;
+	const char* name;
+	double start;
+	double end;
+};
+
+static int stats_enabled = 0;
+static int stats_tracing = 0;
+static double stats_start_time;
+
+/* everything below is updated from multiple threads */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct stats_phase_data stats_phases[STATS_PHASE_COUNT];
+
+static struct stats_worker* stats_workers = 0;
+static unsigned int stats_worker_count = 0;
+
+static struct stats_histogram
+	stats_blocks[STATS_MAX_COMPRESSORS][STATS_BLOCK_OP_COUNT];
+
+static struct stats_event* stats_events = 0;
+static size_t stats_event_count = 0;
+static size_t stats_event_alloc = 0;
+static int stats_events_dropped = 0;
+
+static unsigned long stats_reuse_hits = 0;
+static unsigned long stats_reuse_misses = 0;
+
+static const char* const stats_phase_names[STATS_PHASE_COUNT] = {
+	"expand",
+	"patch",
+	"squash",
+	"write"
+};
+
+static const char* const stats_block_op_names[STATS_BLOCK_OP_COUNT] = {
+	"decompress",
+	"compress"
+};
+
+static const char* const stats_compressor_names[STATS_MAX_COMPRESSORS] = {
+	"unknown",
+	"lzo",
+	"lz4",
+	"zlib",
+	"xz",
+	"zstd"
+};
+
+static double timeval_seconds(const struct timeval* tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+double stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void stats_sample(struct stats_sample* s)
+{
+	struct rusage ru;
+
+	s->wall_time = stats_now();
+
+	/* covers all the threads of the process */
+	getrusage(RUSAGE_SELF, &ru);
+	s->user_time = timeval_seconds(&ru.ru_utime);
+	s->system_time = timeval_seconds(&ru.ru_stime);
+	s->max_rss_kb = ru.ru_maxrss;
+	s->read_bytes = (uint64_t) ru.ru_inblock * STATS_BLOCK_SIZE;
+	s->written_bytes = (uint64_t) ru.ru_oublock * STATS_BLOCK_SIZE;
+}
+
+/* called with the lock held */
+static void stats_add_event(unsigned int thread, const char* name,
+		double start, double end)
+{
+	struct stats_event* ev;
+
+	if (!stats_tracing || stats_events_dropped)
+		return;
+
+	if (stats_event_count == stats_event_alloc)
+	{
+		size_t new_alloc = stats_event_alloc ? stats_event_alloc * 2 : 256;
+		struct stats_event* new_events = realloc(stats_events,
+				new_alloc * sizeof(*new_events));
+
+		if (!new_events)
+		{
+			/* the trace is best-effort, do not fail the merge */
+			stats_events_dropped = 1;
+			return;
+		}
+
+		stats_events = new_events;
+		stats_event_alloc = new_alloc;
+	}
+
+	ev = &stats_events[stats_event_count++];
+	ev->thread = thread;
+	ev->name = name;
+	ev->start = start;
+	ev->end = end;
+}
+
+/* called with the lock held */
+static struct stats_worker* stats_get_worker(unsigned int worker_no)
+{
+	if (worker_no >= stats_worker_count)
+	{
+		unsigned int new_count = worker_no + 1;
+		struct stats_worker* new_workers = realloc(stats_workers,
+				new_count * sizeof(*new_workers));
+
+		if (!new_workers)
+			return 0;
+
+		memset(&new_workers[stats_worker_count], 0,
+				(new_count - stats_worker_count) * sizeof(*new_workers));
+		stats_workers = new_workers;
+		stats_worker_count = new_count;
+	}
+
+	return &stats_workers[worker_no];
+}
+
+void stats_enable(void)
+{
+	if (!stats_enabled)
+		stats_start_time = stats_now();
+	stats_enabled = 1;
+	mmap_count_reads();
+}
+
+void stats_enable_trace(void)
+{
+	stats_enable();
+	stats_tracing = 1;
+}
+
+int stats_is_enabled(void)
+{
+	return stats_enabled;
+}
+
+const char* stats_phase_name(enum stats_phase p)
+{
+	return stats_phase_names[p];
+}
+
+void stats_phase_begin(struct stats_timer* t, enum stats_phase p)
+{
+	t->phase = p;
+	if (stats_enabled)
+		stats_sample(&t->start);
+}
+
+void stats_phase_end(const struct stats_timer* t)
+{
+	struct stats_phase_data* d = &stats_phases[t->phase];
+	const struct stats_sample* start = &t->start;
+	struct stats_sample end;
+
+	if (!stats_enabled)
+		return;
+
+	stats_sample(&end);
+	pthread_mutex_lock(&stats_lock);
+	++d->count;
+	d->wall_time += end.wall_time - start->wall_time;
+	d->user_time += end.user_time - start->user_time;
+	d->system_time += end.system_time - start->system_time;
+	if (end.max_rss_kb > d->max_rss_kb)
+		d->max_rss_kb = end.max_rss_kb;
+	d->read_bytes += end.read_bytes - start->read_bytes;
+	d->written_bytes += end.written_bytes - start->written_bytes;
+	stats_add_event(0, stats_phase_names[t->phase], start->wall_time,
+			end.wall_time);
+	pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_phase_add_bytes(enum stats_phase p, uint64_t bytes)
+{
+	if (!stats_enabled)
+		return;
+
+	pthread_mutex_lock(&stats_lock);
+	stats_phases[p].processed_bytes += bytes;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+const struct stats_phase_data* stats_get_phase(enum stats_phase p)
+{
+	return &stats_phases[p];
+}
+
+void stats_worker_task(unsigned int worker_no, double start, double end)
+{
+	struct stats_worker* w;
+
+	pthread_mutex_lock(&stats_lock);
+	w = stats_get_worker(worker_no);
+	if (w)
+	{
+		++w->tasks;
+		w->busy_time += end - start;
+	}
+	stats_add_event(worker_no + 1, "task", start, end);
+	pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_worker_idle(unsigned int worker_no, double seconds)
+{
+	struct stats_worker* w;
+
+	pthread_mutex_lock(&stats_lock);
+	w = stats_get_worker(worker_no);
+	if (w)
+		w->idle_time += seconds;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_histogram_add(struct stats_histogram* h, double seconds)
+{
+	double us = seconds * 1e6;
+	int bucket = 0;
+
+	/* bucket n holds [2^(n-1), 2^n) us, bucket 0 anything below 1 us */
+	while (us >= 1 && bucket < STATS_HISTOGRAM_BUCKETS - 1)
+	{
+		us /= 2;
+		++bucket;
+	}
+
+	++h->count;
+	h->total_time += seconds;
+	++h->buckets[bucket];
+}
+
+void stats_merge_blocks(uint32_t compression, enum stats_block_op op,
+		const struct stats_histogram* h)
+{
+	struct stats_histogram* dest;
+	unsigned int comp_no = compression >> 24;
+	int i;
+
+	if (!h->count)
+		return;
+	if (comp_no >= STATS_MAX_COMPRESSORS)
+		comp_no = 0;
+
+	pthread_mutex_lock(&stats_lock);
+	dest = &stats_blocks[comp_no][op];
+	dest->count += h->count;
+	dest->total_time += h->total_time;
+	for (i = 0; i < STATS_HISTOGRAM_BUCKETS; ++i)
+		dest->buckets[i] += h->buckets[i];
+	pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_add_reuse(unsigned long hits, unsigned long misses)
+{
+	pthread_mutex_lock(&stats_lock);
+	stats_reuse_hits += hits;
+	stats_reuse_misses += misses;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+static const char* stats_compressor_name(unsigned int comp_no)
+{
+	const char* name = stats_compressor_names[comp_no];
+
+	return name ? name : "unknown";
+}
+
+static double stats_histogram_mean_us(const struct stats_histogram* h)
+{
+	return h->count ? h->total_time / h->count * 1e6 : 0;
+}
+
+/* upper bound of the bucket containing the given fraction of samples */
+static double stats_histogram_quantile_us(const struct stats_histogram* h,
+		double q)
+{
+	uint64_t seen = 0;
+	int i;
+
+	for (i = 0; i < STATS_HISTOGRAM_BUCKETS; ++i)
+	{
+		seen += h->buckets[i];
+		if (seen >= h->count * q)
+			break;
+	}
+
+	return (double) (1ULL << i);
+}
+
+void stats_print(FILE* f)
+{
+	unsigned int c;
+	int i;
+
+	fprintf(f, "Statistics:\n"
+			"\t%-8s %6s %10s %10s %10s %10s %12s\n",
+			"phase", "count", "wall [s]", "user [s]", "sys [s]",
+			"MiB/s", "max RSS [kB]");
+	for (i = 0; i < STATS_PHASE_COUNT; ++i)
+	{
+		const struct stats_phase_data* d = &stats_phases[i];
+
+		if (!d->count)
+			continue;
+
+		fprintf(f, "\t%-8s %6u %10.3f %10.3f %10.3f %10.1f %12ld\n",
+				stats_phase_names[i], d->count, d->wall_time, d->user_time,
+				d->system_time, d->wall_time > 0
+					? d->processed_bytes / d->wall_time / (1 << 20) : 0,
+				d->max_rss_kb);
+	}
+
+	if (stats_worker_count > 0)
+		fprintf(f, "\t%-8s %6s %10s %10s\n", "worker", "tasks",
+				"busy [s]", "idle [s]");
+	for (c = 0; c < stats_worker_count; ++c)
+	{
+		const struct stats_worker* w = &stats_workers[c];
+
+		fprintf(f, "\t%-8u %6lu %10.3f %10.3f\n", c, w->tasks,
+				w->busy_time, w->idle_time);
+	}
+
+	for (c = 0; c < STATS_MAX_COMPRESSORS; ++c)
+	{
+		for (i = 0; i < STATS_BLOCK_OP_COUNT; ++i)
+		{
+			const struct stats_histogram* h = &stats_blocks[c][i];
+
+			if (!h->count)
+				continue;
+
+			fprintf(f, "\t%s %s: %llu blocks, mean %.1f us,"
+					" p50 < %.0f us, p99 < %.0f us\n",
+					stats_compressor_name(c), stats_block_op_names[i],
+					(unsigned long long) h->count,
+					stats_histogram_mean_us(h),
+					stats_histogram_quantile_us(h, 0.5),
+					stats_histogram_quantile_us(h, 0.99));
+		}
+	}
+
+	fprintf(f, "\tmapped reads: %.1f MiB\n",
+			mmap_read_count() / (double) (1 << 20));
+	if (stats_reuse_hits || stats_reuse_misses)
+		fprintf(f, "\treused blocks: %lu hits, %lu misses\n",
+				stats_reuse_hits, stats_reuse_misses);
+}
+
+static FILE* stats_open(const char* path)
+{
+	FILE* f = fopen(path, "w");
+
+	if (!f)
+	{
+		fprintf(stderr, "Unable to open statistics file.\n"
+				"\tpath: %s\n"
+				"\terrno: %s\n", path, strerror(errno));
+	}
+
+	return f;
+}
+
+static int stats_close(FILE* f, const char* path)
+{
+	if (fclose(f) != 0)
+	{
+		fprintf(stderr, "Unable to write statistics file.\n"
+				"\tpath: %s\n"
+				"\terrno: %s\n", path, strerror(errno));
+		return 0;
+	}
+
+	return 1;
+}
+
+int stats_write_json(const char* path)
+{
+	FILE* f;
+	unsigned int c;
+	int i, first;
+
+	f = stats_open(path);
+	if (!f)
+		return 0;
+
+	fprintf(f, "{\n\t\"phases\": {");
+	for (i = 0; i < STATS_PHASE_COUNT; ++i)
+	{
+		const struct stats_phase_data* d = &stats_phases[i];
+		double throughput = 0;
+
+		if (d->wall_time > 0)
+			throughput = d->processed_bytes / d->wall_time / 1e6;
+
+		fprintf(f, "%s\n\t\t\"%s\": {\"count\": %u, \"wall_time\": %.6f,"
+				" \"user_time\": %.6f, \"system_time\": %.6f,"
+				" \"max_rss_kb\": %ld, \"read_bytes\": %llu,"
+				" \"written_bytes\": %llu, \"processed_bytes\": %llu,"
+				" \"throughput_mbps\": %.3f}",
+				i > 0 ? "," : "", stats_phase_names[i], d->count,
+				d->wall_time, d->user_time, d->system_time, d->max_rss_kb,
+				(unsigned long long) d->read_bytes,
+				(unsigned long long) d->written_bytes,
+				(unsigned long long) d->processed_bytes, throughput);
+	}
+
+	fprintf(f, "\n\t},\n\t\"threads\": [");
+	for (c = 0; c < stats_worker_count; ++c)
+	{
+		const struct stats_worker* w = &stats_workers[c];
+
+		fprintf(f, "%s\n\t\t{\"worker\": %u, \"tasks\": %lu,"
+				" \"busy_time\": %.6f, \"idle_time\": %.6f}",
+				c > 0 ? "," : "", c, w->tasks, w->busy_time, w->idle_time);
+	}
+
+	fprintf(f, "\n\t],\n\t\"blocks\": [");
+	first = 1;
+	for (c = 0; c < STATS_MAX_COMPRESSORS; ++c)
+	{
+		for (i = 0; i < STATS_BLOCK_OP_COUNT; ++i)
+		{
+			const struct stats_histogram* h = &stats_blocks[c][i];
+			int b, last;
+
+			if (!h->count)
+				continue;
+
+			fprintf(f, "%s\n\t\t{\"compressor\": \"%s\","
+					" \"operation\": \"%s\", \"count\": %llu,"
+					" \"total_time\": %.6f, \"histogram_us\": {",
+					first ? "" : ",", stats_compressor_name(c),
+					stats_block_op_names[i], (unsigned long long) h->count,
+					h->total_time);
+			first = 0;
+
+			/* keyed by the bucket upper bound; skip the empty tail */
+			for (last = STATS_HISTOGRAM_BUCKETS - 1; last > 0; --last)
+			{
+				if (h->buckets[last])
+					break;
+			}
+			for (b = 0; b <= last; ++b)
+			{
+				fprintf(f, "%s\"%llu\": %llu", b > 0 ? ", " : "",
+						1ULL << b, (unsigned long long) h->buckets[b]);
+			}
+			fprintf(f, "}}");
+		}
+	}
+
+	fprintf(f, "\n\t],\n\t\"mapped_read_bytes\": %llu,\n"
+			"\t\"reuse\": {\"hits\": %lu, \"misses\": %lu}\n}\n",
+			(unsigned long long) mmap_read_count(),
+			stats_reuse_hits, stats_reuse_misses);
+
+	return stats_close(f, path);
+}
+
+int stats_write_trace(const char* path)
+{
+	FILE* f;
+	size_t i;
+
+	f = stats_open(path);
+	if (!f)
+		return 0;
+
+	fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n"
+			"{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1,"
+			" \"tid\": 0, \"args\": {\"name\": \"phases\"}}");
+	for (i = 0; i < stats_worker_count; ++i)
+	{
+		fprintf(f, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1,"
+				" \"tid\": %lu, \"args\": {\"name\": \"worker %lu\"}}",
+				(unsigned long) i + 1, (unsigned long) i);
+	}
+
+	for (i = 0; i < stats_event_count; ++i)
+	{
+		const struct stats_event* ev = &stats_events[i];
+
+		fprintf(f, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\","
+				" \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f}",
+				ev->name, ev->thread == 0 ? "phase" : "worker", ev->thread,
+				(ev->start - stats_start_time) * 1e6,
+				(ev->end - ev->start) * 1e6);
+	}
+	fprintf(f, "\n]}\n");
+
+	if (stats_events_dropped)
+		fprintf(stderr, "Warning: trace truncated due to lack of memory.\n");
+
+	return stats_close(f, path);
+}
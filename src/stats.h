@@ -0,0 +1,121 @@
+/**
+ * SquashFS delta merge tool
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#pragma once
+
+#ifndef SDT_STATS_H
+#define SDT_STATS_H 1
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#ifdef HAVE_STDINT_H
+#	include <stdint.h>
+#endif
+#include <stdio.h>
+
+/* log2 microsecond buckets, the last one takes everything longer */
+#define STATS_HISTOGRAM_BUCKETS 24
+/* compressors are told apart by the top byte of the compression field */
+#define STATS_MAX_COMPRESSORS 8
+
+enum stats_phase
+{
+	/* decompressing the source blocks */
+	STATS_EXPAND = 0,
+	/* applying the delta (with pipelined recompression) */
+	STATS_PATCH,
+	/* recompressing the expanded target */
+	STATS_SQUASH,
+	/* copying reused blocks and writing out the image */
+	STATS_WRITE,
+
+	STATS_PHASE_COUNT
+};
+
+enum stats_block_op
+{
+	STATS_DECOMPRESS = 0,
+	STATS_COMPRESS,
+
+	STATS_BLOCK_OP_COUNT
+};
+
+struct stats_phase_data
+{
+	unsigned int count;
+	double wall_time;
+	double user_time;
+	double system_time;
+	/* peak RSS of the process at the end of the phase */
+	long max_rss_kb;
+	uint64_t read_bytes;
+	uint64_t written_bytes;
+	/* data produced by the phase, for throughput */
+	uint64_t processed_bytes;
+};
+
+/* a resource usage sample */
+struct stats_sample
+{
+	double wall_time;
+	double user_time;
+	double system_time;
+	long max_rss_kb;
+	uint64_t read_bytes;
+	uint64_t written_bytes;
+};
+
+/* a running phase, kept by the caller so that concurrent merges
+ * do not overwrite each other's start samples; the resource usage
+ * is process-wide though, and overlaps between concurrent phases */
+struct stats_timer
+{
+	enum stats_phase phase;
+	struct stats_sample start;
+};
+
+/* block latencies, kept per thread and merged afterwards */
+struct stats_histogram
+{
+	uint64_t count;
+	double total_time;
+	uint64_t buckets[STATS_HISTOGRAM_BUCKETS];
+};
+
+/* the statistics are only collected once enabled */
+void stats_enable(void);
+/* keep the timed events for stats_write_trace() */
+void stats_enable_trace(void);
+int stats_is_enabled(void);
+double stats_now(void);
+
+const char* stats_phase_name(enum stats_phase p);
+/* thread-safe */
+void stats_phase_begin(struct stats_timer* t, enum stats_phase p);
+void stats_phase_end(const struct stats_timer* t);
+void stats_phase_add_bytes(enum stats_phase p, uint64_t bytes);
+const struct stats_phase_data* stats_get_phase(enum stats_phase p);
+
+/* thread pool workers, thread-safe */
+void stats_worker_task(unsigned int worker_no, double start, double end);
+void stats_worker_idle(unsigned int worker_no, double seconds);
+
+void stats_histogram_add(struct stats_histogram* h, double seconds);
+/* thread-safe */
+void stats_merge_blocks(uint32_t compression, enum stats_block_op op,
+		const struct stats_histogram* h);
+
+/* thread-safe, summed over the merges */
+void stats_add_reuse(unsigned long hits, unsigned long misses);
+
+void stats_print(FILE* f);
+int stats_write_json(const char* path);
+/* Chrome trace event format, as read by chrome://tracing and Perfetto */
+int stats_write_trace(const char* path);
+
+#endif /*!SDT_STATS_H*/
@@ -0,0 +1,169 @@
+/**
+ * SquashFS delta merge tool
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "stream.h"
+
+/* the read size, and the granularity the waiters are woken up with */
+#define STREAM_CHUNK_SIZE (1 << 20)
+/* address space reserved for the data, only the pages written are used */
+#define STREAM_MAX_CAPACITY ((size_t) 1 << (sizeof(size_t) >= 8 ? 40 : 30))
+#define STREAM_MIN_CAPACITY ((size_t) 64 << 20)
+
+static void* input_stream_main(void* arg)
+{
+	struct input_stream* s = arg;
+	int failed = 0;
+
+	for (;;)
+	{
+		size_t n = s->capacity - s->length;
+		ssize_t ret;
+
+		if (n == 0)
+		{
+			fprintf(stderr, "Input stream exceeds the reserved memory.\n"
+					"\tlength: %lu\n", (unsigned long) s->capacity);
+			failed = 1;
+			break;
+		}
+		if (n > STREAM_CHUNK_SIZE)
+			n = STREAM_CHUNK_SIZE;
+
+		/* only this thread writes past length */
+		ret = read(s->fd, s->data + s->length, n);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret == -1)
+		{
+			fprintf(stderr, "Unable to read input stream.\n"
+					"\terrno: %s\n", strerror(errno));
+			failed = 1;
+			break;
+		}
+		if (ret == 0)
+			break;
+
+		pthread_mutex_lock(&s->lock);
+		s->length += ret;
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+	}
+
+	pthread_mutex_lock(&s->lock);
+	s->done = 1;
+	s->failed = failed;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+
+	return 0;
+}
+
+int input_stream_start(struct input_stream* s, int fd)
+{
+	int ret;
+
+	s->fd = fd;
+	s->length = 0;
+	s->done = 0;
+	s->failed = 0;
+
+	/* the length is not known, reserve as much as possible */
+	for (s->capacity = STREAM_MAX_CAPACITY; ; s->capacity /= 2)
+	{
+		s->data = mmap(0, s->capacity, PROT_READ|PROT_WRITE,
+				MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+		if (s->data != MAP_FAILED)
+			break;
+		if (s->capacity / 2 < STREAM_MIN_CAPACITY)
+		{
+			fprintf(stderr, "Unable to reserve memory for input stream.\n"
+					"\terrno: %s\n", strerror(errno));
+			s->data = 0;
+			return 0;
+		}
+	}
+
+	ret = pthread_mutex_init(&s->lock, 0);
+	if (ret == 0)
+	{
+		ret = pthread_cond_init(&s->cond, 0);
+		if (ret == 0)
+		{
+			ret = pthread_create(&s->thread, 0, input_stream_main, s);
+			if (ret != 0)
+				pthread_cond_destroy(&s->cond);
+		}
+		if (ret != 0)
+			pthread_mutex_destroy(&s->lock);
+	}
+	if (ret != 0)
+	{
+		fprintf(stderr, "Unable to start reading input stream.\n"
+				"\terror: %s\n", strerror(ret));
+		munmap(s->data, s->capacity);
+		s->data = 0;
+		return 0;
+	}
+
+	return 1;
+}
+
+size_t input_stream_wait(struct input_stream* s, size_t length)
+{
+	size_t ret;
+
+	pthread_mutex_lock(&s->lock);
+	while (s->length < length && !s->done)
+		pthread_cond_wait(&s->cond, &s->lock);
+	ret = s->length;
+	pthread_mutex_unlock(&s->lock);
+
+	return ret;
+}
+
+int input_stream_finish(struct input_stream* s)
+{
+	int ret;
+
+	pthread_mutex_lock(&s->lock);
+	while (!s->done)
+		pthread_cond_wait(&s->cond, &s->lock);
+	ret = !s->failed;
+	pthread_mutex_unlock(&s->lock);
+
+	return ret;
+}
+
+void input_stream_free(struct input_stream* s)
+{
+	int done;
+
+	if (!s->data)
+		return;
+
+	/* the reader may be blocked reading a stream nobody needs anymore */
+	pthread_mutex_lock(&s->lock);
+	done = s->done;
+	pthread_mutex_unlock(&s->lock);
+	if (!done)
+		pthread_cancel(s->thread);
+	pthread_join(s->thread, 0);
+
+	pthread_cond_destroy(&s->cond);
+	pthread_mutex_destroy(&s->lock);
+	munmap(s->data, s->capacity);
+	s->data = 0;
+}
@@ -0,0 +1,45 @@
+/**
+ * SquashFS delta merge tool
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#pragma once
+
+#ifndef SDT_STREAM_H
+#define SDT_STREAM_H 1
+
+#include <stdlib.h>
+#include <pthread.h>
+
+/*
+ * A non-seekable input (a pipe or a socket) read into memory by
+ * a background thread, so that its beginning can be used while
+ * the rest is still arriving. The data does not move as it grows.
+ */
+struct input_stream
+{
+	int fd;
+	unsigned char* data;
+	size_t capacity;
+
+	/* bytes received so far */
+	size_t length;
+	int done;
+	int failed;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+int input_stream_start(struct input_stream* s, int fd);
+/* wait for length bytes, return the count available (less only
+ * when the stream ended before) */
+size_t input_stream_wait(struct input_stream* s, size_t length);
+/* wait for the end of the stream, return 0 if reading failed */
+int input_stream_finish(struct input_stream* s);
+/* stops the reader if it is still running */
+void input_stream_free(struct input_stream* s);
+
+#endif /*!SDT_STREAM_H*/
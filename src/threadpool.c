@@ -0,0 +1,323 @@
+/**
+ * SquashFS delta merge tool
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+#include "threadpool.h"
+
+/* called with the lock held, returns with the lock held; the stats
+ * are recorded under stats_no */
+static void pool_run_task(struct thread_pool* p, struct pool_task* t,
+		unsigned int worker_no, unsigned int stats_no)
+{
+	struct pool_group* g = t->group;
+	int ret = 1;
+
+	pthread_mutex_unlock(&p->lock);
+	if (!g->cancelled)
+	{
+		if (stats_is_enabled())
+		{
+			double start = stats_now();
+
+			ret = t->func(t->arg, worker_no);
+			stats_worker_task(stats_no, start, stats_now());
+		}
+		else
+			ret = t->func(t->arg, worker_no);
+	}
+	free(t);
+	pthread_mutex_lock(&p->lock);
+
+	if (!ret)
+	{
+		g->failed = 1;
+		g->cancelled = 1;
+	}
+
+	if (--g->pending == 0)
+		pthread_cond_broadcast(&p->done_cond);
+}
+
+/* called with the lock held; the first task of g, or of any group
+ * if g is 0 */
+static struct pool_task* pool_pop_task(struct thread_pool* p,
+		const struct pool_group* g)
+{
+	struct pool_task* prev = 0;
+	struct pool_task* t = p->queue_head;
+
+	while (t && g && t->group != g)
+	{
+		prev = t;
+		t = t->next;
+	}
+
+	if (t)
+	{
+		if (prev)
+			prev->next = t->next;
+		else
+			p->queue_head = t->next;
+		if (p->queue_tail == t)
+			p->queue_tail = prev;
+	}
+
+	return t;
+}
+
+static void* pool_worker_main(void* data)
+{
+	struct pool_worker* w = data;
+	struct thread_pool* p = w->pool;
+
+	pthread_mutex_lock(&p->lock);
+	for (;;)
+	{
+		struct pool_task* t;
+
+		if (!p->queue_head && !p->shutdown && stats_is_enabled())
+		{
+			double start = stats_now();
+
+			while (!p->queue_head && !p->shutdown)
+				pthread_cond_wait(&p->task_cond, &p->lock);
+			/* the final wait for shutdown is not idle time */
+			if (!p->shutdown)
+				stats_worker_idle(w->worker_no, stats_now() - start);
+		}
+
+		while (!p->queue_head && !p->shutdown)
+			pthread_cond_wait(&p->task_cond, &p->lock);
+
+		t = pool_pop_task(p, 0);
+		if (!t)
+			break;
+
+		pool_run_task(p, t, w->worker_no, w->worker_no);
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	return w;
+}
+
+int thread_pool_init(struct thread_pool* p, unsigned int worker_count)
+{
+	unsigned int i;
+	int ret;
+
+	if (worker_count < 1)
+		worker_count = 1;
+
+	p->queue_head = 0;
+	p->queue_tail = 0;
+	p->shutdown = 0;
+	p->thread_count = 0;
+	p->worker_count = 1;
+	p->shared = 0;
+	p->waiter_busy = 0;
+	p->waiter_slots = 0;
+
+	p->threads = calloc(worker_count, sizeof(*p->threads));
+	if (!p->threads)
+	{
+		fprintf(stderr, "Unable to allocate memory for threading.\n"
+				"\terrno: %s\n", strerror(errno));
+		return 0;
+	}
+
+	ret = pthread_mutex_init(&p->lock, 0);
+	if (ret == 0)
+	{
+		ret = pthread_cond_init(&p->task_cond, 0);
+		if (ret == 0)
+		{
+			ret = pthread_cond_init(&p->done_cond, 0);
+			if (ret != 0)
+				pthread_cond_destroy(&p->task_cond);
+		}
+		if (ret != 0)
+			pthread_mutex_destroy(&p->lock);
+	}
+	if (ret != 0)
+	{
+		fprintf(stderr, "Unable to initialize thread pool.\n"
+				"\terror: %s\n", strerror(ret));
+		free(p->threads);
+		return 0;
+	}
+
+	/* the thread waiting for the results does its share of work too */
+	for (i = 0; i < worker_count - 1; ++i)
+	{
+		p->threads[i].pool = p;
+		p->threads[i].worker_no = i;
+
+		ret = pthread_create(&p->threads[i].thread_id, 0,
+				pool_worker_main, &p->threads[i]);
+		if (ret != 0)
+		{
+			fprintf(stderr, "Warning: unable to create thread %u.\n"
+					"\terror: %s\n", i, strerror(ret));
+			break;
+		}
+	}
+
+	p->thread_count = i;
+	p->worker_count = i + 1;
+
+	return 1;
+}
+
+void thread_pool_destroy(struct thread_pool* p)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&p->lock);
+	p->shutdown = 1;
+	pthread_cond_broadcast(&p->task_cond);
+	pthread_mutex_unlock(&p->lock);
+
+	for (i = 0; i < p->thread_count; ++i)
+	{
+		int jret = pthread_join(p->threads[i].thread_id, 0);
+		if (jret != 0)
+		{
+			fprintf(stderr, "Warning: unable to join thread %u.\n"
+					"\terror: %s\n", i, strerror(jret));
+		}
+	}
+
+	pthread_cond_destroy(&p->done_cond);
+	pthread_cond_destroy(&p->task_cond);
+	pthread_mutex_destroy(&p->lock);
+	free(p->waiter_busy);
+	free(p->threads);
+}
+
+void pool_group_init(struct pool_group* g)
+{
+	g->pending = 0;
+	g->failed = 0;
+	g->cancelled = 0;
+}
+
+int pool_group_cancelled(const struct pool_group* g)
+{
+	return g->cancelled;
+}
+
+void pool_group_cancel(struct thread_pool* p, struct pool_group* g)
+{
+	pthread_mutex_lock(&p->lock);
+	g->cancelled = 1;
+	pthread_mutex_unlock(&p->lock);
+}
+
+int thread_pool_submit(struct thread_pool* p, struct pool_group* g,
+		pool_task_func func, void* arg)
+{
+	struct pool_task* t = malloc(sizeof(*t));
+
+	if (!t)
+	{
+		fprintf(stderr, "Unable to allocate memory for a task.\n"
+				"\terrno: %s\n", strerror(errno));
+		pool_group_cancel(p, g);
+		return 0;
+	}
+
+	t->func = func;
+	t->arg = arg;
+	t->group = g;
+	t->next = 0;
+
+	pthread_mutex_lock(&p->lock);
+	++g->pending;
+	if (p->queue_tail)
+		p->queue_tail->next = t;
+	else
+		p->queue_head = t;
+	p->queue_tail = t;
+	pthread_cond_signal(&p->task_cond);
+	/* the waiters of the other merges may pick it up too */
+	if (p->shared)
+		pthread_cond_broadcast(&p->done_cond);
+	pthread_mutex_unlock(&p->lock);
+
+	return 1;
+}
+
+/* called with the lock held; takes the lowest stats slot not used
+ * by another waiter, so that the concurrent merges do not share one */
+static int pool_take_waiter_slot(struct thread_pool* p, unsigned int* slot)
+{
+	unsigned int i;
+
+	for (i = 0; i < p->waiter_slots; ++i)
+	{
+		if (!p->waiter_busy[i])
+			break;
+	}
+
+	if (i == p->waiter_slots)
+	{
+		int* new_busy = realloc(p->waiter_busy,
+				(i + 1) * sizeof(*new_busy));
+
+		if (!new_busy)
+			return 0;
+		p->waiter_busy = new_busy;
+		p->waiter_busy[i] = 0;
+		p->waiter_slots = i + 1;
+	}
+
+	p->waiter_busy[i] = 1;
+	*slot = i;
+	return 1;
+}
+
+int thread_pool_wait(struct thread_pool* p, struct pool_group* g)
+{
+	unsigned int slot = 0;
+	int have_slot, ret;
+
+	pthread_mutex_lock(&p->lock);
+	/* the stats are merely merged into the first slot otherwise */
+	have_slot = pool_take_waiter_slot(p, &slot);
+	while (g->pending > 0)
+	{
+		/* the tasks of other groups may be waited for elsewhere,
+		 * and may need the per-worker state of that waiter */
+		struct pool_task* t = pool_pop_task(p, g);
+
+		if (t)
+			pool_run_task(p, t, p->thread_count, p->thread_count + slot);
+		else if (stats_is_enabled())
+		{
+			double start = stats_now();
+
+			pthread_cond_wait(&p->done_cond, &p->lock);
+			stats_worker_idle(p->thread_count + slot, stats_now() - start);
+		}
+		else
+			pthread_cond_wait(&p->done_cond, &p->lock);
+	}
+	ret = !g->failed;
+	if (have_slot)
+		p->waiter_busy[slot] = 0;
+	pthread_mutex_unlock(&p->lock);
+
+	return ret;
+}
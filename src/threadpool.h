@@ -0,0 +1,74 @@
+/**
+ * SquashFS delta merge tool
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#pragma once
+
+#ifndef SDT_THREADPOOL_H
+#define SDT_THREADPOOL_H 1
+
+#include <pthread.h>
+
+typedef int (*pool_task_func)(void* arg, unsigned int worker_no);
+
+struct pool_task
+{
+	pool_task_func func;
+	void* arg;
+	struct pool_group* group;
+
+	struct pool_task* next;
+};
+
+/* a set of tasks that is waited for (and cancelled) together */
+struct pool_group
+{
+	unsigned int pending;
+	int failed;
+	volatile int cancelled;
+};
+
+struct pool_worker
+{
+	struct thread_pool* pool;
+	unsigned int worker_no;
+	pthread_t thread_id;
+};
+
+struct thread_pool
+{
+	struct pool_worker* threads;
+	/* spawned threads; the waiting thread acts as one extra worker */
+	unsigned int thread_count;
+	unsigned int worker_count;
+	/* several merges queue tasks at once, each waiting for its own;
+	 * long tasks give up the worker between block ranges */
+	int shared;
+	/* the stats slots of the waiting threads, following the workers */
+	int* waiter_busy;
+	unsigned int waiter_slots;
+
+	struct pool_task* queue_head;
+	struct pool_task* queue_tail;
+	int shutdown;
+
+	pthread_mutex_t lock;
+	pthread_cond_t task_cond;
+	pthread_cond_t done_cond;
+};
+
+int thread_pool_init(struct thread_pool* p, unsigned int worker_count);
+void thread_pool_destroy(struct thread_pool* p);
+
+void pool_group_init(struct pool_group* g);
+int pool_group_cancelled(const struct pool_group* g);
+void pool_group_cancel(struct thread_pool* p, struct pool_group* g);
+
+int thread_pool_submit(struct thread_pool* p, struct pool_group* g,
+		pool_task_func func, void* arg);
+/* runs the queued tasks of g while waiting for them */
+int thread_pool_wait(struct thread_pool* p, struct pool_group* g);
+
+#endif /*!SDT_THREADPOOL_H*/
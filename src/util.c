@@ -9,6 +9,7 @@
 #endif
 
 #include <sys/types.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <errno.h>
@@ -16,53 +17,188 @@
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#ifdef HAVE_LINUX_FS_H
+#	include <linux/fs.h> /* for FICLONERANGE */
+#endif
 
 #include "util.h"
 
-struct mmap_file mmap_open(const char* path)
+/* chunk size for reading and writing whole files */
+#define IO_CHUNK_SIZE (8 << 20)
+/* alignment required for O_DIRECT */
+#define IO_DIRECT_ALIGN 4096
+/* smaller copies are not worth the system calls */
+#define IO_CLONE_MIN_LENGTH (64 << 10)
+
+static void mmap_advise_huge(void* data, size_t length, int huge_pages)
 {
-	struct mmap_file out;
-	off_t length;
+#ifdef MADV_HUGEPAGE
+	/* effective for files on tmpfs mounted with huge=advise */
+	if (huge_pages && length >= (2 << 20))
+		madvise(data, length, MADV_HUGEPAGE);
+#endif
+}
 
-	out.fd = open(path, O_RDONLY);
-	if (out.fd == -1)
+/* read the whole file into anonymous memory */
+static int mmap_read_whole(struct mmap_file* f, const char* path,
+		enum io_backend backend)
+{
+	size_t map_length = (f->length + IO_DIRECT_ALIGN - 1)
+		& ~(size_t) (IO_DIRECT_ALIGN - 1);
+	size_t pos = 0;
+	int fd = f->fd;
+
+#ifdef O_DIRECT
+	/* use a separate descriptor, f->fd may be passed to xdelta3 */
+	if (backend == IO_BACKEND_DIRECT)
 	{
-		fprintf(stderr, "Unable to open file.\n"
+		fd = open(path, O_RDONLY | O_DIRECT);
+		if (fd == -1)
+		{
+			fprintf(stderr, "Unable to open file for direct I/O, using buffered reads.\n"
+					"\tpath: %s\n"
+					"\terrno: %s\n", path, strerror(errno));
+			fd = f->fd;
+		}
+	}
+#endif
+
+	f->data = mmap(0, map_length, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (f->data == MAP_FAILED)
+	{
+		fprintf(stderr, "Unable to allocate memory for file.\n"
 				"\tpath: %s\n"
 				"\terrno: %s\n", path, strerror(errno));
-		return out;
+		f->data = 0;
+	}
+
+	while (f->data && pos < f->length)
+	{
+		size_t n = map_length - pos;
+		ssize_t ret;
+
+		if (n > IO_CHUNK_SIZE)
+			n = IO_CHUNK_SIZE;
+
+		ret = pread(fd, (char*) f->data + pos, n, pos);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+		{
+			fprintf(stderr, "Unable to read file.\n"
+					"\tpath: %s\n"
+					"\terrno: %s\n", path,
+					ret == 0 ? "unexpected end of file" : strerror(errno));
+			munmap(f->data, map_length);
+			f->data = 0;
+			break;
+		}
+		pos += ret;
 	}
 
-	length = lseek(out.fd, 0, SEEK_END);
+	if (fd != f->fd)
+		close(fd);
+	return f->data != 0;
+}
+
+struct mmap_file mmap_open(const char* path)
+{
+	return mmap_open_backend(path, IO_BACKEND_MMAP);
+}
+
+/* map the whole of an open file, closing nothing on failure */
+static int mmap_map_fd(struct mmap_file* f, const char* path,
+		enum io_backend backend)
+{
+	off_t length;
+
+	length = lseek(f->fd, 0, SEEK_END);
 	if (length == -1)
 	{
 		fprintf(stderr, "Unable to seek file (is it a regular file?).\n"
 				"\tpath: %s\n"
 				"\terrno: %s\n", path, strerror(errno));
-		close(out.fd);
-		out.fd = -1;
-		return out;
+		return 0;
 	}
 
-	out.length = length;
-	out.data = mmap(0, out.length, PROT_READ, MAP_SHARED, out.fd, 0);
-	if (out.data == MAP_FAILED)
+	f->length = length;
+	if (backend != IO_BACKEND_MMAP)
+		return mmap_read_whole(f, path, backend);
+
+	f->data = mmap(0, f->length, PROT_READ, MAP_SHARED, f->fd, 0);
+	if (f->data == MAP_FAILED)
 	{
 		fprintf(stderr, "Unable to mmap() file.\n"
 				"\tpath: %s\n"
 				"\terrno: %s\n", path, strerror(errno));
+		f->data = 0;
+		return 0;
+	}
+
+	return 1;
+}
+
+struct mmap_file mmap_open_backend(const char* path, enum io_backend backend)
+{
+	struct mmap_file out;
+
+	out.sync = IO_SYNC_NONE;
+	out.data = 0;
+	out.fd = open(path, O_RDONLY);
+	if (out.fd == -1)
+	{
+		fprintf(stderr, "Unable to open file.\n"
+				"\tpath: %s\n"
+				"\terrno: %s\n", path, strerror(errno));
+		return out;
+	}
+
+	if (!mmap_map_fd(&out, path, backend))
+	{
 		close(out.fd);
 		out.fd = -1;
-		return out;
 	}
 
 	return out;
 }
 
-struct mmap_file mmap_create_temp(char* path_buf, size_t size)
+struct mmap_file mmap_open_fd(int fd, enum io_backend backend)
 {
 	struct mmap_file out;
 
+	out.sync = IO_SYNC_NONE;
+	out.data = 0;
+	out.fd = fd;
+
+	/* O_DIRECT needs reopening the file by path */
+	if (backend == IO_BACKEND_DIRECT)
+		backend = IO_BACKEND_PREAD;
+	if (!mmap_map_fd(&out, "(file descriptor)", backend))
+		out.fd = -1;
+
+	return out;
+}
+
+struct mmap_file mmap_from_memory(const void* data, size_t length)
+{
+	struct mmap_file out;
+
+	out.fd = -1;
+	out.data = (void*) data;
+	out.length = length;
+	out.sync = IO_SYNC_NONE;
+
+	return out;
+}
+
+struct mmap_file mmap_create_temp(char* path_buf, size_t size,
+		int huge_pages)
+{
+	struct mmap_file out;
+
+	/* the file is removed afterwards, never sync it */
+	out.sync = IO_SYNC_NONE;
 	out.fd = mkstemp(path_buf);
 	if (out.fd == -1)
 	{
@@ -82,7 +218,8 @@ struct mmap_file mmap_create_temp(char* path_buf, size_t size)
 	}
 
 	out.length = size;
-	out.data = mmap(0, out.length, PROT_WRITE, MAP_SHARED, out.fd, 0);
+	out.data = mmap(0, out.length, PROT_READ|PROT_WRITE, MAP_SHARED,
+			out.fd, 0);
 	if (out.data == MAP_FAILED)
 	{
 		fprintf(stderr, "Unable to mmap() file.\n"
@@ -92,6 +229,50 @@ struct mmap_file mmap_create_temp(char* path_buf, size_t size)
 		out.fd = -1;
 		return out;
 	}
+	mmap_advise_huge(out.data, out.length, huge_pages);
+
+	return out;
+}
+
+struct mmap_file mmap_create_temp_without_mapping(char* path_buf)
+{
+	struct mmap_file out;
+
+	out.sync = IO_SYNC_NONE;
+	out.fd = mkstemp(path_buf);
+	if (out.fd == -1)
+	{
+		fprintf(stderr, "Unable to create a temporary file.\n"
+				"\terrno: %s\n", strerror(errno));
+		return out;
+	}
+	out.data = 0;
+	out.length = 0;
+
+	return out;
+}
+
+struct mmap_file mmap_create_anonymous(size_t size)
+{
+	struct mmap_file out;
+
+	/* mmap() refuses empty mappings */
+	out.fd = -1;
+	out.sync = IO_SYNC_NONE;
+	out.length = size;
+	out.data = mmap(0, size > 0 ? size : 1, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (out.data == MAP_FAILED)
+	{
+		fprintf(stderr, "Unable to allocate anonymous memory.\n"
+				"\tsize: %lu\n"
+				"\terrno: %s\n", (unsigned long) size, strerror(errno));
+		out.data = 0;
+	}
+#ifdef MADV_HUGEPAGE
+	else if (size >= (2 << 20))
+		madvise(out.data, size, MADV_HUGEPAGE);
+#endif
 
 	return out;
 }
@@ -100,6 +281,7 @@ struct mmap_file mmap_create_without_mapping(const char* path)
 {
 	struct mmap_file out;
 
+	out.sync = IO_SYNC_FDATASYNC;
 	out.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
 	if (out.fd == -1)
 	{
@@ -114,7 +296,7 @@ struct mmap_file mmap_create_without_mapping(const char* path)
 	return out;
 }
 
-int mmap_map_created_file(struct mmap_file* f)
+int mmap_map_created_file(struct mmap_file* f, int huge_pages)
 {
 	off_t length;
 
@@ -136,15 +318,66 @@ int mmap_map_created_file(struct mmap_file* f)
 		f->data = 0;
 		return 0;
 	}
+	mmap_advise_huge(f->data, f->length, huge_pages);
 
 	return 1;
 }
 
-void mmap_close(struct mmap_file* f)
+int mmap_expand_created_file(struct mmap_file* f, size_t size,
+		int huge_pages)
 {
+	/* not backed by a file, allocate memory instead */
+	if (f->fd == -1)
+	{
+		*f = mmap_create_anonymous(size);
+		return f->data != 0;
+	}
+
+	if (ftruncate(f->fd, size) == -1)
+	{
+		fprintf(stderr, "Unable to expand the file to requested size.\n"
+				"\terrno: %s\n", strerror(errno));
+		return 0;
+	}
+
+	return mmap_map_created_file(f, huge_pages);
+}
+
+/* make the data written to fd durable, as requested */
+static void io_sync_fd(int fd, enum io_sync sync)
+{
+	if (sync == IO_SYNC_NONE)
+		return;
+
+#ifdef HAVE_FDATASYNC
+	/* EINVAL means it can not be synced (pipe, socket...) */
+	if (fdatasync(fd) == -1 && errno != EINVAL && errno != EROFS)
+#else
+	if (fsync(fd) == -1 && errno != EINVAL && errno != EROFS)
+#endif
+	{
+		fprintf(stderr, "File update failed.\n"
+				"\terrno: %s\n", strerror(errno));
+	}
+}
+
+void mmap_release(struct mmap_file* f)
+{
+	if (f->fd == -1)
+	{
+		/* anonymous memory, nothing to sync */
+		if (f->data && munmap(f->data, f->length > 0 ? f->length : 1) == -1)
+		{
+			fprintf(stderr, "Unable unmap memory.\n"
+					"\terrno: %s\n", strerror(errno));
+		}
+		return;
+	}
+
 	if (f->data)
 	{
-		if (msync(f->data, f->length, MS_SYNC) == -1)
+		if (f->sync != IO_SYNC_NONE
+				&& msync(f->data, f->length, MS_SYNC) == -1)
 		{
 			fprintf(stderr, "File update failed.\n"
 					"\terrno: %s\n", strerror(errno));
@@ -157,13 +390,373 @@ void mmap_close(struct mmap_file* f)
 		}
 	}
 
-	if (close(f->fd) == -1)
+	/* flush the metadata (e.g. the truncation) too */
+	io_sync_fd(f->fd, f->sync);
+}
+
+void mmap_close(struct mmap_file* f)
+{
+	mmap_release(f);
+
+	if (f->fd != -1 && close(f->fd) == -1)
 	{
 		fprintf(stderr, "Unable to close file.\n"
 				"\terrno: %s\n", strerror(errno));
 	}
 }
 
+void mmap_advise(const struct mmap_file* f, int advice)
+{
+	/* only a hint, failures do not matter */
+	if (f->data && f->length > 0)
+		madvise(f->data, f->length, advice);
+}
+
+void mmap_release_range(const struct mmap_file* f, size_t offset,
+		size_t length)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t start, end;
+
+	/* anonymous memory would lose the data */
+	if (f->fd == -1 || !f->data || offset >= f->length)
+		return;
+	if (length > f->length - offset)
+		length = f->length - offset;
+
+	/* only the pages entirely within the range */
+	start = (offset + page - 1) & ~(page - 1);
+	end = (offset + length) & ~(page - 1);
+	if (end <= start)
+		return;
+
+	/* the dirty pages of a shared mapping stay in the page cache,
+	 * start writing them back for the cache to drop them as well;
+	 * only hints, failures do not matter */
+	madvise((char*) f->data + start, end - start, MADV_DONTNEED);
+#ifdef HAVE_SYNC_FILE_RANGE
+	sync_file_range(f->fd, start, end - start, SYNC_FILE_RANGE_WRITE);
+#endif
+#ifdef HAVE_POSIX_FADVISE
+	posix_fadvise(f->fd, start, end - start, POSIX_FADV_DONTNEED);
+#endif
+}
+
+void mmap_prefetch_range(const struct mmap_file* f, size_t offset,
+		size_t length)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t start;
+
+	if (f->fd == -1 || !f->data || offset >= f->length)
+		return;
+	if (length > f->length - offset)
+		length = f->length - offset;
+
+	/* a hint, the data is read on access anyway; anonymous memory
+	 * of the pread backends ignores it */
+	start = offset & ~(page - 1);
+	madvise((char*) f->data + start, offset + length - start, MADV_WILLNEED);
+}
+
+int mmap_write_to_fd(const struct mmap_file* f, size_t length, int fd,
+		enum io_sync sync)
+{
+	const char* pos = f->data;
+	size_t written = 0;
+
+	if (length > f->length)
+	{
+		fprintf(stderr, "Trying to write out past file.\n");
+		return 0;
+	}
+
+#ifdef HAVE_COPY_FILE_RANGE
+	/* let the kernel copy (or reflink) between files */
+	if (f->fd != -1)
+	{
+		loff_t in_offset = 0;
+		ssize_t ret = 0;
+
+		while (written < length)
+		{
+			ret = copy_file_range(f->fd, &in_offset, fd, 0,
+					length - written, 0);
+			if (ret <= 0)
+				break;
+			written += ret;
+		}
+
+		/* unsupported for that pair (e.g. a pipe), write it out */
+		if (ret == -1 && errno != EINVAL && errno != EXDEV
+				&& errno != ENOSYS && errno != EOPNOTSUPP && errno != EBADF)
+		{
+			fprintf(stderr, "Unable to copy output file.\n"
+					"\terrno: %s\n", strerror(errno));
+			return 0;
+		}
+	}
+#endif
+
+	while (written < length)
+	{
+		size_t n = length - written;
+		ssize_t ret;
+
+		if (n > IO_CHUNK_SIZE)
+			n = IO_CHUNK_SIZE;
+
+		ret = write(fd, pos + written, n);
+		if (ret == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Unable to write output file.\n"
+					"\terrno: %s\n", strerror(errno));
+			return 0;
+		}
+
+#ifdef HAVE_SYNC_FILE_RANGE
+		/* start writeback of this chunk, wait for the previous one
+		 * (fails harmlessly on pipes) */
+		if (sync == IO_SYNC_RANGE)
+		{
+			sync_file_range(fd, written, ret, SYNC_FILE_RANGE_WRITE);
+			if (written > 0)
+				sync_file_range(fd, written > IO_CHUNK_SIZE
+						? written - IO_CHUNK_SIZE : 0,
+						written > IO_CHUNK_SIZE ? IO_CHUNK_SIZE : written,
+						SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE
+						| SYNC_FILE_RANGE_WAIT_AFTER);
+		}
+#endif
+		written += ret;
+	}
+
+	io_sync_fd(fd, sync);
+	return 1;
+}
+
+/* copy a single data extent, letting the kernel share it if possible */
+static int mmap_copy_extent(struct mmap_file* dest, size_t dest_offset,
+		const struct mmap_file* src, size_t src_offset, size_t length)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+	if (dest->fd != -1 && src->fd != -1)
+	{
+		loff_t in_offset = src_offset;
+		loff_t out_offset = dest_offset;
+		ssize_t ret = 0;
+
+		while (length > 0)
+		{
+			ret = copy_file_range(src->fd, &in_offset, dest->fd, &out_offset,
+					length, 0);
+			if (ret <= 0)
+				break;
+			length -= ret;
+		}
+
+		if (ret == -1 && errno != EINVAL && errno != EXDEV
+				&& errno != ENOSYS && errno != EOPNOTSUPP && errno != EBADF)
+		{
+			fprintf(stderr, "Unable to copy file range.\n"
+					"\terrno: %s\n", strerror(errno));
+			return 0;
+		}
+
+		/* copy the rest through the mappings */
+		src_offset = in_offset;
+		dest_offset = out_offset;
+	}
+#endif
+
+	memcpy((char*) dest->data + dest_offset,
+			(const char*) src->data + src_offset, length);
+	return 1;
+}
+
+int mmap_copy_range(struct mmap_file* dest, size_t dest_offset,
+		const struct mmap_file* src, size_t src_offset, size_t length)
+{
+	if (!mmap_read(dest, dest_offset, length)
+			|| !mmap_read(src, src_offset, length))
+		return 0;
+
+	while (length > 0)
+	{
+		size_t n = length;
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+		if (src->fd != -1)
+		{
+			off_t data = lseek(src->fd, src_offset, SEEK_DATA);
+
+			/* the rest of the range is a hole */
+			if (data == -1 && errno == ENXIO)
+				break;
+			if (data != -1)
+			{
+				off_t hole;
+
+				if ((size_t) data - src_offset >= length)
+					break;
+				if ((size_t) data > src_offset)
+				{
+					n = data - src_offset;
+					src_offset += n;
+					dest_offset += n;
+					length -= n;
+					continue;
+				}
+
+				hole = lseek(src->fd, src_offset, SEEK_HOLE);
+				if (hole != -1 && (size_t) hole - src_offset < n)
+					n = hole - src_offset;
+			}
+		}
+#endif
+
+		if (!mmap_copy_extent(dest, dest_offset, src, src_offset, n))
+			return 0;
+
+		src_offset += n;
+		dest_offset += n;
+		length -= n;
+	}
+
+	return 1;
+}
+
+int mmap_clone_range(struct mmap_file* dest, size_t dest_offset,
+		const struct mmap_file* src, size_t src_offset, size_t length)
+{
+	if (dest->fd == -1 || src->fd == -1 || length < IO_CLONE_MIN_LENGTH
+			|| !mmap_read(dest, dest_offset, length)
+			|| !mmap_read(src, src_offset, length))
+		return 0;
+
+#ifdef FICLONERANGE
+	{
+		struct stat st;
+
+		/* whole blocks can be shared if both sides are aligned alike */
+		if (fstat(dest->fd, &st) == 0 && st.st_blksize > 0
+				&& (dest_offset - src_offset) % st.st_blksize == 0)
+		{
+			size_t block_size = st.st_blksize;
+			size_t head = (block_size - dest_offset % block_size) % block_size;
+			size_t middle = (length - head) & ~(block_size - 1);
+			struct file_clone_range range;
+
+			range.src_fd = src->fd;
+			range.src_offset = src_offset + head;
+			range.src_length = middle;
+			range.dest_offset = dest_offset + head;
+			if (head < length && middle > 0
+					&& ioctl(dest->fd, FICLONERANGE, &range) == 0)
+			{
+				memcpy((char*) dest->data + dest_offset,
+						(const char*) src->data + src_offset, head);
+				memcpy((char*) dest->data + dest_offset + head + middle,
+						(const char*) src->data + src_offset + head + middle,
+						length - head - middle);
+				return 1;
+			}
+		}
+	}
+#endif
+
+	return mmap_copy_extent(dest, dest_offset, src, src_offset, length);
+}
+
+size_t mmap_clone_file(struct mmap_file* dest, const struct mmap_file* src)
+{
+#ifdef FICLONERANGE
+	struct file_clone_range range;
+	struct stat st;
+	size_t length;
+
+	if (dest->fd == -1 || src->fd == -1 || fstat(dest->fd, &st) == -1
+			|| st.st_blksize <= 0)
+		return 0;
+
+	/* only whole filesystem blocks can be cloned */
+	length = src->length & ~((size_t) st.st_blksize - 1);
+	if (length == 0 || length > dest->length)
+		return 0;
+
+	range.src_fd = src->fd;
+	range.src_offset = 0;
+	range.src_length = length;
+	range.dest_offset = 0;
+	if (ioctl(dest->fd, FICLONERANGE, &range) == -1)
+		return 0;
+
+	return length;
+#else
+	(void) dest;
+	(void) src;
+	return 0;
+#endif
+}
+
+int mmap_punch_hole(struct mmap_file* f, size_t offset, size_t length)
+{
+	if (!mmap_read(f, offset, length))
+		return 0;
+
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+	if (f->fd != -1 && fallocate(f->fd, FALLOC_FL_PUNCH_HOLE
+				| FALLOC_FL_KEEP_SIZE, offset, length) == 0)
+		return 1;
+#endif
+
+	memset((char*) f->data + offset, 0, length);
+	return 1;
+}
+
+int io_parse_backend(const char* str, enum io_backend* out)
+{
+	if (!strcmp(str, "mmap"))
+		*out = IO_BACKEND_MMAP;
+	else if (!strcmp(str, "pread"))
+		*out = IO_BACKEND_PREAD;
+	else if (!strcmp(str, "direct"))
+		*out = IO_BACKEND_DIRECT;
+	else
+		return 0;
+
+	return 1;
+}
+
+int io_parse_sync(const char* str, enum io_sync* out)
+{
+	if (!strcmp(str, "none"))
+		*out = IO_SYNC_NONE;
+	else if (!strcmp(str, "fdatasync"))
+		*out = IO_SYNC_FDATASYNC;
+	else if (!strcmp(str, "range"))
+		*out = IO_SYNC_RANGE;
+	else
+		return 0;
+
+	return 1;
+}
+
+static int mmap_counting_reads = 0;
+static uint64_t mmap_read_bytes = 0;
+
+void mmap_count_reads(void)
+{
+	mmap_counting_reads = 1;
+}
+
+uint64_t mmap_read_count(void)
+{
+	return mmap_read_bytes;
+}
+
 void* mmap_read(const struct mmap_file* f, size_t offset, size_t length)
 {
 	char* pos = f->data;
@@ -174,6 +767,15 @@ void* mmap_read(const struct mmap_file* f, size_t offset, size_t length)
 		return 0;
 	}
 
+	if (mmap_counting_reads)
+	{
+#ifdef __ATOMIC_RELAXED
+		__atomic_fetch_add(&mmap_read_bytes, length, __ATOMIC_RELAXED);
+#else
+		__sync_fetch_and_add(&mmap_read_bytes, length);
+#endif
+	}
+
 	return pos + offset;
 }
 
@@ -190,3 +792,43 @@ size_t mmap_write(const struct mmap_file* f, void* data, size_t offset, size_t l
 	memcpy(pos + offset, data, length);
 	return length;
 }
+
+int parse_size(const char* str, size_t* out)
+{
+	char* end;
+	unsigned long long val;
+	unsigned int shift = 0;
+
+	errno = 0;
+	val = strtoull(str, &end, 10);
+	if (errno != 0 || end == str)
+		return 0;
+
+	switch (*end)
+	{
+		case 'k':
+		case 'K':
+			shift = 10;
+			break;
+		case 'm':
+		case 'M':
+			shift = 20;
+			break;
+		case 'g':
+		case 'G':
+			shift = 30;
+			break;
+		case 0:
+			break;
+		default:
+			return 0;
+	}
+	if (shift != 0 && *++end)
+		return 0;
+
+	if (val > ((size_t) -1) >> shift)
+		return 0;
+
+	*out = val << shift;
+	return 1;
+}
@@ -9,21 +9,98 @@
 #ifndef SDT_UTIL_H
 #define SDT_UTIL_H 1
 
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#ifdef HAVE_STDINT_H
+#	include <stdint.h>
+#endif
 #include <stdlib.h>
 
+enum io_backend
+{
+	IO_BACKEND_MMAP = 0,
+	/* read the whole file into memory */
+	IO_BACKEND_PREAD,
+	/* as above, bypassing the page cache (O_DIRECT) */
+	IO_BACKEND_DIRECT
+};
+
+enum io_sync
+{
+	IO_SYNC_NONE = 0,
+	/* sync the data when closing the file */
+	IO_SYNC_FDATASYNC,
+	/* as above, but start writeback while writing output */
+	IO_SYNC_RANGE
+};
+
 struct mmap_file
 {
 	int fd;
 	void* data;
 	size_t length;
+	enum io_sync sync;
 };
 
 struct mmap_file mmap_open(const char* path);
-struct mmap_file mmap_create_temp(char* path_buf, size_t size);
+struct mmap_file mmap_open_backend(const char* path, enum io_backend backend);
+/* map a descriptor owned by the caller, release with mmap_release() */
+struct mmap_file mmap_open_fd(int fd, enum io_backend backend);
+/* wrap a buffer owned by the caller, must not be closed */
+struct mmap_file mmap_from_memory(const void* data, size_t length);
+/* huge_pages asks for the mapping to be backed by huge pages, anonymous
+ * memory gets them always */
+struct mmap_file mmap_create_temp(char* path_buf, size_t size,
+		int huge_pages);
+struct mmap_file mmap_create_temp_without_mapping(char* path_buf);
+struct mmap_file mmap_create_anonymous(size_t size);
 struct mmap_file mmap_create_without_mapping(const char* path);
-int mmap_map_created_file(struct mmap_file* f);
+int mmap_map_created_file(struct mmap_file* f, int huge_pages);
+/* for a file with fd == -1, anonymous memory is allocated instead */
+int mmap_expand_created_file(struct mmap_file* f, size_t size,
+		int huge_pages);
 void mmap_close(struct mmap_file* f);
+/* as above, but leave the descriptor open */
+void mmap_release(struct mmap_file* f);
+void mmap_advise(const struct mmap_file* f, int advice);
+/* drop the range of a file mapped from its descriptor from memory,
+ * to be reread when accessed again; no-op for anonymous memory */
+void mmap_release_range(const struct mmap_file* f, size_t offset,
+		size_t length);
+/* start reading the range of a file mapped from its descriptor in
+ * the background; no-op for the files read into memory */
+void mmap_prefetch_range(const struct mmap_file* f, size_t offset,
+		size_t length);
+
+/* write the first length bytes of the file to fd */
+int mmap_write_to_fd(const struct mmap_file* f, size_t length, int fd,
+		enum io_sync sync);
+
+/* copy the range between files, sharing the extents and skipping
+ * the holes in src if possible; the dest range needs to be zero-filled */
+int mmap_copy_range(struct mmap_file* dest, size_t dest_offset,
+		const struct mmap_file* src, size_t src_offset, size_t length);
+/* copy a larger range between files, sharing the extents if possible;
+ * return 0 if the range needs to be copied by the caller */
+int mmap_clone_range(struct mmap_file* dest, size_t dest_offset,
+		const struct mmap_file* src, size_t src_offset, size_t length);
+/* reflink the leading whole filesystem blocks of src into dest,
+ * return the cloned length (0 if cloning is not supported) */
+size_t mmap_clone_file(struct mmap_file* dest, const struct mmap_file* src);
+/* zero the range, freeing the underlying storage if possible */
+int mmap_punch_hole(struct mmap_file* f, size_t offset, size_t length);
+
+int io_parse_backend(const char* str, enum io_backend* out);
+int io_parse_sync(const char* str, enum io_sync* out);
 
 void* mmap_read(const struct mmap_file* f, size_t offset, size_t length);
+/* start counting the bytes requested through mmap_read() */
+void mmap_count_reads(void);
+uint64_t mmap_read_count(void);
+
+/* parse a byte count with an optional K/M/G suffix */
+int parse_size(const char* str, size_t* out);
 
 #endif /*!SDT_UTIL_H*/
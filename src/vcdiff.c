@@ -0,0 +1,1106 @@
+/**
+ * SquashFS delta merge tool
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+/*
+ * VCDIFF (RFC 3284) decoder, with the xdelta3 extensions (application
+ * header, window checksums and DJW secondary compression), and a simple
+ * encoder producing independent source-only windows.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "djw.h"
+#include "vcdiff.h"
+
+enum vcdiff_header_indicator
+{
+	VCD_DECOMPRESS = 0x01,
+	VCD_CODETABLE = 0x02,
+	VCD_APPHEADER = 0x04,
+
+	VCD_HDR_KNOWN_MASK = 0x07
+};
+
+enum vcdiff_window_indicator
+{
+	VCD_SOURCE = 0x01,
+	VCD_TARGET = 0x02,
+	VCD_ADLER32 = 0x04,
+
+	VCD_WIN_KNOWN_MASK = 0x07
+};
+
+enum vcdiff_delta_indicator
+{
+	VCD_DATACOMP = 0x01,
+	VCD_INSTCOMP = 0x02,
+	VCD_ADDRCOMP = 0x04,
+
+	VCD_DELTA_KNOWN_MASK = 0x07
+};
+
+enum vcdiff_inst_type
+{
+	VCD_NOOP = 0,
+	VCD_ADD,
+	VCD_RUN,
+	VCD_COPY
+};
+
+/* default address cache */
+#define VCD_NEAR_SIZE 4
+#define VCD_SAME_SIZE 3
+#define VCD_MODE_SELF 0
+#define VCD_MODE_HERE 1
+
+static const unsigned char vcdiff_file_magic[4] = {0xd6, 0xc3, 0xc4, 0x00};
+
+struct vcdiff_addr_cache
+{
+	uint64_t near[VCD_NEAR_SIZE];
+	unsigned int next_slot;
+	uint64_t same[VCD_SAME_SIZE * 256];
+};
+
+static int read_varint(const unsigned char** pos, const unsigned char* end,
+		uint64_t* out)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i = 0; i < 10; ++i)
+	{
+		unsigned char b;
+
+		if (*pos == end)
+			return 0;
+		b = *(*pos)++;
+
+		if (v >> 57)
+			return 0;
+		v = (v << 7) | (b & 0x7f);
+
+		if (!(b & 0x80))
+		{
+			*out = v;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int read_size(const unsigned char** pos, const unsigned char* end,
+		size_t* out)
+{
+	uint64_t v;
+
+	if (!read_varint(pos, end, &v) || v > (size_t) -1)
+		return 0;
+
+	*out = v;
+	return 1;
+}
+
+/* RFC 3284, section 5.6 */
+static void vcdiff_init_code_table(struct vcdiff_code* t)
+{
+	unsigned int i = 0, mode, size, add_size, copy_size;
+
+	memset(t, 0, sizeof(*t) * 256);
+
+	t[i].type[0] = VCD_RUN;
+	++i;
+
+	for (size = 0; size <= 17; ++size, ++i)
+	{
+		t[i].type[0] = VCD_ADD;
+		t[i].size[0] = size;
+	}
+
+	for (mode = 0; mode < 2 + VCD_NEAR_SIZE + VCD_SAME_SIZE; ++mode)
+	{
+		for (size = 0; size <= 18; ++size)
+		{
+			if (size >= 1 && size <= 3)
+				continue;
+
+			t[i].type[0] = VCD_COPY;
+			t[i].size[0] = size;
+			t[i].mode[0] = mode;
+			++i;
+		}
+	}
+
+	for (mode = 0; mode < 2 + VCD_NEAR_SIZE; ++mode)
+	{
+		for (add_size = 1; add_size <= 4; ++add_size)
+		{
+			for (copy_size = 4; copy_size <= 6; ++copy_size, ++i)
+			{
+				t[i].type[0] = VCD_ADD;
+				t[i].size[0] = add_size;
+				t[i].type[1] = VCD_COPY;
+				t[i].size[1] = copy_size;
+				t[i].mode[1] = mode;
+			}
+		}
+	}
+
+	for (; mode < 2 + VCD_NEAR_SIZE + VCD_SAME_SIZE; ++mode)
+	{
+		for (add_size = 1; add_size <= 4; ++add_size, ++i)
+		{
+			t[i].type[0] = VCD_ADD;
+			t[i].size[0] = add_size;
+			t[i].type[1] = VCD_COPY;
+			t[i].size[1] = 4;
+			t[i].mode[1] = mode;
+		}
+	}
+
+	for (mode = 0; mode < 2 + VCD_NEAR_SIZE + VCD_SAME_SIZE; ++mode, ++i)
+	{
+		t[i].type[0] = VCD_COPY;
+		t[i].size[0] = 4;
+		t[i].mode[0] = mode;
+		t[i].type[1] = VCD_ADD;
+		t[i].size[1] = 1;
+	}
+}
+
+/* parse the file header, return the offset of the first window */
+static int vcdiff_parse_header(const unsigned char* data, size_t length,
+		int* secondary_id, size_t* windows_start)
+{
+	const unsigned char* pos = data;
+	const unsigned char* end = data + length;
+	unsigned char hdr_indicator;
+	int ret = VCDIFF_SUPPORTED;
+
+	*secondary_id = 0;
+
+	if (length < sizeof(vcdiff_file_magic) + 1
+			|| memcmp(data, vcdiff_file_magic, sizeof(vcdiff_file_magic)))
+	{
+		fprintf(stderr, "Invalid VCDIFF magic or version.\n");
+		return VCDIFF_INVALID;
+	}
+	pos += sizeof(vcdiff_file_magic);
+
+	hdr_indicator = *pos++;
+	if (hdr_indicator & ~VCD_HDR_KNOWN_MASK)
+	{
+		fprintf(stderr, "Unknown VCDIFF header flags.\n"
+				"\tindicator: %02x\n", hdr_indicator);
+		return VCDIFF_INVALID;
+	}
+
+	if (hdr_indicator & VCD_DECOMPRESS)
+	{
+		if (pos == end)
+			return VCDIFF_INVALID;
+		*secondary_id = *pos++;
+		if (*secondary_id != DJW_SECONDARY_ID)
+			ret = VCDIFF_UNSUPPORTED;
+	}
+
+	if (hdr_indicator & VCD_CODETABLE)
+	{
+		size_t len;
+
+		if (!read_size(&pos, end, &len) || len > (size_t) (end - pos))
+			return VCDIFF_INVALID;
+		pos += len;
+		ret = VCDIFF_UNSUPPORTED;
+	}
+
+	if (hdr_indicator & VCD_APPHEADER)
+	{
+		size_t len;
+
+		if (!read_size(&pos, end, &len) || len > (size_t) (end - pos))
+			return VCDIFF_INVALID;
+		pos += len;
+	}
+
+	*windows_start = pos - data;
+	return ret;
+}
+
+int vcdiff_probe(const void* data, size_t length)
+{
+	int secondary_id;
+	size_t windows_start;
+
+	return vcdiff_parse_header(data, length, &secondary_id, &windows_start);
+}
+
+int vcdiff_open(struct vcdiff_decoder* d, const void* data, size_t length)
+{
+	int ret;
+
+	d->data = data;
+	d->length = length;
+
+	ret = vcdiff_parse_header(d->data, d->length,
+			&d->secondary_id, &d->windows_start);
+	if (ret == VCDIFF_UNSUPPORTED)
+		fprintf(stderr, "VCDIFF patch uses an unsupported code table"
+				" or secondary compressor.\n"
+				"\tsecondary compressor id: %d\n", d->secondary_id);
+	if (ret != VCDIFF_SUPPORTED)
+		return 0;
+
+	vcdiff_init_code_table(d->code_table);
+	vcdiff_rewind(d);
+	return 1;
+}
+
+void vcdiff_rewind(struct vcdiff_decoder* d)
+{
+	d->pos = d->windows_start;
+	d->target_offset = 0;
+}
+
+int vcdiff_at_end(const struct vcdiff_decoder* d)
+{
+	return d->pos == d->length;
+}
+
+int vcdiff_next_window(struct vcdiff_decoder* d, struct vcdiff_window* w)
+{
+	const unsigned char* pos = d->data + d->pos;
+	const unsigned char* end = d->data + d->length;
+	const unsigned char* delta_end;
+	size_t delta_length;
+
+	do
+	{
+		if (pos == end)
+			break;
+		w->indicator = *pos++;
+		if (w->indicator & ~VCD_WIN_KNOWN_MASK
+				|| (w->indicator & (VCD_SOURCE | VCD_TARGET))
+					== (VCD_SOURCE | VCD_TARGET))
+			break;
+
+		w->segment_length = 0;
+		w->segment_position = 0;
+		if (w->indicator & (VCD_SOURCE | VCD_TARGET))
+		{
+			if (!read_varint(&pos, end, &w->segment_length)
+					|| !read_varint(&pos, end, &w->segment_position))
+				break;
+			if (w->segment_position + w->segment_length
+					< w->segment_position)
+				break;
+		}
+
+		if (!read_size(&pos, end, &delta_length)
+				|| delta_length > (size_t) (end - pos))
+			break;
+		delta_end = pos + delta_length;
+
+		if (!read_size(&pos, delta_end, &w->target_length))
+			break;
+		if (pos == delta_end)
+			break;
+		w->delta_indicator = *pos++;
+		if (w->delta_indicator & ~VCD_DELTA_KNOWN_MASK)
+			break;
+		if (w->delta_indicator && d->secondary_id == 0)
+			break;
+
+		if (!read_size(&pos, delta_end, &w->data_length)
+				|| !read_size(&pos, delta_end, &w->inst_length)
+				|| !read_size(&pos, delta_end, &w->addr_length))
+			break;
+
+		w->has_checksum = !!(w->indicator & VCD_ADLER32);
+		if (w->has_checksum)
+		{
+			if (delta_end - pos < 4)
+				break;
+			w->checksum = ((uint32_t) pos[0] << 24) | ((uint32_t) pos[1] << 16)
+				| ((uint32_t) pos[2] << 8) | pos[3];
+			pos += 4;
+		}
+
+		if (w->data_length > (size_t) (delta_end - pos))
+			break;
+		w->data = pos;
+		pos += w->data_length;
+		if (w->inst_length > (size_t) (delta_end - pos))
+			break;
+		w->inst = pos;
+		pos += w->inst_length;
+		if (w->addr_length != (size_t) (delta_end - pos))
+			break;
+		w->addr = pos;
+
+		w->target_offset = d->target_offset;
+		d->target_offset += w->target_length;
+		d->pos = delta_end - d->data;
+
+		return 1;
+	} while (0);
+
+	fprintf(stderr, "Invalid VCDIFF window header.\n"
+			"\toffset: %lu\n", (unsigned long) d->pos);
+	return 0;
+}
+
+int vcdiff_window_needs_target(const struct vcdiff_window* w)
+{
+	return !!(w->indicator & VCD_TARGET);
+}
+
+int vcdiff_target_length(struct vcdiff_decoder* d, uint64_t* out)
+{
+	struct vcdiff_window w;
+
+	vcdiff_rewind(d);
+	while (!vcdiff_at_end(d))
+	{
+		if (!vcdiff_next_window(d, &w))
+			return 0;
+	}
+
+	*out = d->target_offset;
+	vcdiff_rewind(d);
+	return 1;
+}
+
+static uint32_t vcdiff_adler32(const unsigned char* buf, size_t length)
+{
+	const uint32_t mod = 65521;
+	uint32_t a = 1, b = 0;
+
+	while (length > 0)
+	{
+		/* 5552 is the largest n keeping b below 2^32 */
+		size_t n = length < 5552 ? length : 5552;
+
+		length -= n;
+		while (n-- > 0)
+		{
+			a += *buf++;
+			b += a;
+		}
+
+		a %= mod;
+		b %= mod;
+	}
+
+	return (b << 16) | a;
+}
+
+/* undo the secondary compression of a section if necessary */
+static int vcdiff_section(const struct vcdiff_decoder* d, int compressed,
+		const unsigned char** data, size_t* length, unsigned char** buf)
+{
+	const unsigned char* pos = *data;
+	const unsigned char* end = *data + *length;
+	size_t out_length;
+
+	*buf = 0;
+	if (!compressed)
+		return 1;
+
+	if (!read_size(&pos, end, &out_length))
+	{
+		fprintf(stderr, "Invalid VCDIFF secondary compressed section.\n");
+		return 0;
+	}
+
+	if (out_length > 0)
+	{
+		*buf = malloc(out_length);
+		if (!*buf)
+		{
+			fprintf(stderr, "Unable to allocate memory for VCDIFF section.\n"
+					"\terrno: %s\n", strerror(errno));
+			return 0;
+		}
+
+		switch (d->secondary_id)
+		{
+			case DJW_SECONDARY_ID:
+				if (!djw_decompress(pos, end - pos, *buf, out_length))
+				{
+					free(*buf);
+					*buf = 0;
+					return 0;
+				}
+				break;
+			default:
+				/* vcdiff_open() rejects the others */
+				free(*buf);
+				*buf = 0;
+				return 0;
+		}
+	}
+
+	*data = *buf;
+	*length = out_length;
+	return 1;
+}
+
+static int vcdiff_decode_address(struct vcdiff_addr_cache* c,
+		unsigned int mode, uint64_t here,
+		const unsigned char** pos, const unsigned char* end, uint64_t* out)
+{
+	uint64_t addr;
+
+	if (mode == VCD_MODE_SELF)
+	{
+		if (!read_varint(pos, end, &addr))
+			return 0;
+	}
+	else if (mode == VCD_MODE_HERE)
+	{
+		uint64_t v;
+
+		if (!read_varint(pos, end, &v) || v > here)
+			return 0;
+		addr = here - v;
+	}
+	else if (mode < 2 + VCD_NEAR_SIZE)
+	{
+		uint64_t v;
+
+		if (!read_varint(pos, end, &v))
+			return 0;
+		addr = c->near[mode - 2] + v;
+	}
+	else
+	{
+		if (*pos == end)
+			return 0;
+		addr = c->same[(mode - 2 - VCD_NEAR_SIZE) * 256 + *(*pos)++];
+	}
+
+	c->near[c->next_slot] = addr;
+	c->next_slot = (c->next_slot + 1) % VCD_NEAR_SIZE;
+	c->same[addr % (VCD_SAME_SIZE * 256)] = addr;
+
+	*out = addr;
+	return 1;
+}
+
+int vcdiff_decode_window(const struct vcdiff_decoder* d,
+		const struct vcdiff_window* w, const struct vcdiff_source* src,
+		unsigned char* target)
+{
+	unsigned char* data_buf = 0;
+	unsigned char* inst_buf = 0;
+	unsigned char* addr_buf = 0;
+	int ret = 0;
+
+	do
+	{
+		const unsigned char* data = w->data;
+		const unsigned char* inst = w->inst;
+		const unsigned char* addr = w->addr;
+		size_t data_length = w->data_length;
+		size_t inst_length = w->inst_length;
+		size_t addr_length = w->addr_length;
+		const unsigned char* data_end;
+		const unsigned char* inst_end;
+		const unsigned char* addr_end;
+
+		unsigned char* out = target + w->target_offset;
+		const unsigned char* segment = 0;
+		uint64_t seg_length = w->segment_length;
+		size_t t = 0;
+		int inst_ok = 1;
+
+		struct vcdiff_addr_cache cache;
+
+		if (!vcdiff_section(d, w->delta_indicator & VCD_DATACOMP,
+					&data, &data_length, &data_buf)
+				|| !vcdiff_section(d, w->delta_indicator & VCD_INSTCOMP,
+					&inst, &inst_length, &inst_buf)
+				|| !vcdiff_section(d, w->delta_indicator & VCD_ADDRCOMP,
+					&addr, &addr_length, &addr_buf))
+			break;
+
+		data_end = data + data_length;
+		inst_end = inst + inst_length;
+		addr_end = addr + addr_length;
+
+		if (w->indicator & VCD_SOURCE)
+		{
+			if (w->segment_position + seg_length > src->length)
+			{
+				fprintf(stderr, "VCDIFF source segment exceeds the source file.\n");
+				break;
+			}
+		}
+		else if (w->indicator & VCD_TARGET)
+		{
+			if (w->segment_position + seg_length > w->target_offset)
+			{
+				fprintf(stderr, "VCDIFF target segment exceeds the decoded data.\n");
+				break;
+			}
+			segment = target + w->segment_position;
+		}
+
+		memset(&cache, 0, sizeof(cache));
+
+		while (inst < inst_end)
+		{
+			const struct vcdiff_code* code = &d->code_table[*inst++];
+			int k;
+
+			for (k = 0; k < 2; ++k)
+			{
+				uint64_t size = code->size[k];
+
+				if (code->type[k] == VCD_NOOP)
+					continue;
+
+				if (size == 0 && !read_varint(&inst, inst_end, &size))
+					break;
+				if (size > w->target_length - t)
+					break;
+
+				if (code->type[k] == VCD_ADD)
+				{
+					if (size > (size_t) (data_end - data))
+						break;
+					memcpy(out + t, data, size);
+					data += size;
+				}
+				else if (code->type[k] == VCD_RUN)
+				{
+					if (data == data_end)
+						break;
+					memset(out + t, *data++, size);
+				}
+				else
+				{
+					uint64_t here = seg_length + t;
+					uint64_t a;
+					size_t n, i;
+
+					if (!vcdiff_decode_address(&cache, code->mode[k], here,
+								&addr, addr_end, &a) || a >= here)
+						break;
+
+					if (a < seg_length)
+					{
+						n = seg_length - a < size ? seg_length - a : size;
+
+						if (segment)
+							memcpy(out + t, segment + a, n);
+						else if (src->copy)
+						{
+							if (!src->copy(src->priv, out + t,
+										w->target_offset + t,
+										w->segment_position + a, n))
+								break;
+						}
+						else if (!src->read(src->priv, out + t,
+									w->segment_position + a, n))
+							break;
+					}
+					else
+						n = 0;
+
+					/* the rest comes from this window, possibly
+					 * overlapping with the output being produced */
+					for (i = n; i < size; ++i)
+						out[t + i] = out[a + i - seg_length];
+				}
+
+				t += size;
+			}
+
+			if (k != 2)
+			{
+				fprintf(stderr, "Invalid VCDIFF instruction.\n"
+						"\ttarget offset: %lu\n",
+						(unsigned long) (w->target_offset + t));
+				inst_ok = 0;
+				break;
+			}
+		}
+		if (!inst_ok)
+			break;
+
+		if (t != w->target_length)
+		{
+			fprintf(stderr, "VCDIFF window decoded to a different size.\n"
+					"\texpected: %lu\n"
+					"\tdecoded: %lu\n",
+					(unsigned long) w->target_length, (unsigned long) t);
+			break;
+		}
+
+		if (w->has_checksum && vcdiff_adler32(out, t) != w->checksum)
+		{
+			fprintf(stderr, "VCDIFF window checksum mismatch.\n"
+					"\ttarget offset: %lu\n",
+					(unsigned long) w->target_offset);
+			break;
+		}
+
+		ret = 1;
+	} while (0);
+
+	free(data_buf);
+	free(inst_buf);
+	free(addr_buf);
+	return ret;
+}
+
+static int vcdiff_read_memory(void* priv, void* dest, uint64_t offset,
+		size_t length)
+{
+	const unsigned char* data = priv;
+
+	memcpy(dest, data + offset, length);
+	return 1;
+}
+
+void vcdiff_source_init_memory(struct vcdiff_source* src,
+		const void* data, size_t length)
+{
+	src->read = vcdiff_read_memory;
+	src->copy = 0;
+	src->priv = (void*) data;
+	src->length = length;
+}
+
+/* the encoder matches chunks of HASH_LEN bytes, indexed every HASH_LEN
+ * bytes of the source; shorter matches are added literally */
+#define VCD_HASH_LEN 16
+#define VCD_HASH_BASE 0x01000193UL
+#define VCD_TABLE_MIN_BITS 10
+#define VCD_TABLE_MAX_BITS 26
+/* for the matches within the target window */
+#define VCD_WINDOW_TABLE_BITS 16
+
+/* the default code table opcodes used */
+#define VCD_OP_RUN 0
+#define VCD_OP_ADD 1
+#define VCD_OP_ADD_MAX_SIZE 17
+#define VCD_OP_COPY_SELF 19
+
+static uint32_t vcdiff_hash(const unsigned char* p)
+{
+	uint32_t h = 0;
+	unsigned int i;
+
+	for (i = 0; i < VCD_HASH_LEN; ++i)
+		h = h * VCD_HASH_BASE + p[i];
+
+	return h;
+}
+
+/* VCD_HASH_BASE ^ (VCD_HASH_LEN - 1), to roll the oldest byte out */
+static uint32_t vcdiff_hash_roll_factor(void)
+{
+	uint32_t f = 1;
+	unsigned int i;
+
+	for (i = 1; i < VCD_HASH_LEN; ++i)
+		f *= VCD_HASH_BASE;
+
+	return f;
+}
+
+static size_t vcdiff_hash_slot(const struct vcdiff_encoder* e, uint32_t h)
+{
+	return (uint32_t) (h * 0x9e3779b1UL) >> (32 - e->table_bits);
+}
+
+int vcdiff_encoder_init(struct vcdiff_encoder* e, const void* source,
+		size_t length)
+{
+	size_t chunks = length / VCD_HASH_LEN;
+	size_t i;
+
+	e->source = source;
+	e->source_length = length;
+	/* the table stores the chunk index + 1 */
+	if (chunks > 0xfffffffeUL)
+		chunks = 0xfffffffeUL;
+
+	e->table_bits = VCD_TABLE_MIN_BITS;
+	while (e->table_bits < VCD_TABLE_MAX_BITS
+			&& ((size_t) 1 << e->table_bits) < chunks)
+		++e->table_bits;
+
+	e->table = calloc((size_t) 1 << e->table_bits, sizeof(*e->table));
+	if (!e->table)
+	{
+		fprintf(stderr, "Unable to allocate memory for VCDIFF source index.\n"
+				"\terrno: %s\n", strerror(errno));
+		return 0;
+	}
+
+	/* the first chunk of the colliding ones is kept */
+	for (i = 0; i < chunks; ++i)
+	{
+		uint32_t* slot = &e->table[vcdiff_hash_slot(e,
+				vcdiff_hash(e->source + i * VCD_HASH_LEN))];
+
+		if (*slot == 0)
+			*slot = i + 1;
+	}
+
+	return 1;
+}
+
+void vcdiff_encoder_free(struct vcdiff_encoder* e)
+{
+	free(e->table);
+	e->table = 0;
+}
+
+size_t vcdiff_encode_header(unsigned char* out)
+{
+	memcpy(out, vcdiff_file_magic, sizeof(vcdiff_file_magic));
+	/* no secondary compression, code table or application header */
+	out[sizeof(vcdiff_file_magic)] = 0;
+	return VCDIFF_HEADER_SIZE;
+}
+
+struct vcdiff_buffer
+{
+	unsigned char* data;
+	size_t length;
+	size_t alloc;
+};
+
+static int buffer_put(struct vcdiff_buffer* b, const void* data,
+		size_t length)
+{
+	if (b->alloc - b->length < length)
+	{
+		size_t alloc = b->alloc ? b->alloc : 4096;
+		unsigned char* grown;
+
+		while (alloc - b->length < length)
+			alloc *= 2;
+		grown = realloc(b->data, alloc);
+		if (!grown)
+		{
+			fprintf(stderr, "Unable to allocate memory for VCDIFF window.\n"
+					"\terrno: %s\n", strerror(errno));
+			return 0;
+		}
+		b->data = grown;
+		b->alloc = alloc;
+	}
+
+	memcpy(b->data + b->length, data, length);
+	b->length += length;
+	return 1;
+}
+
+static size_t varint_length(uint64_t v)
+{
+	size_t n = 1;
+
+	while (v >>= 7)
+		++n;
+
+	return n;
+}
+
+static int buffer_put_varint(struct vcdiff_buffer* b, uint64_t v)
+{
+	unsigned char out[10];
+	size_t n = varint_length(v);
+	size_t i;
+
+	/* the most significant digits first */
+	for (i = n; i-- > 0; v >>= 7)
+		out[i] = (v & 0x7f) | (i == n - 1 ? 0 : 0x80);
+
+	return buffer_put(b, out, n);
+}
+
+static int buffer_put_byte(struct vcdiff_buffer* b, unsigned char c)
+{
+	return buffer_put(b, &c, 1);
+}
+
+struct vcdiff_sections
+{
+	struct vcdiff_buffer data;
+	struct vcdiff_buffer inst;
+	struct vcdiff_buffer addr;
+};
+
+static int encode_add(struct vcdiff_sections* s, const unsigned char* data,
+		size_t length)
+{
+	if (length == 0)
+		return 1;
+
+	if (length <= VCD_OP_ADD_MAX_SIZE)
+	{
+		if (!buffer_put_byte(&s->inst, VCD_OP_ADD + length))
+			return 0;
+	}
+	else if (!buffer_put_byte(&s->inst, VCD_OP_ADD)
+			|| !buffer_put_varint(&s->inst, length))
+		return 0;
+
+	return buffer_put(&s->data, data, length);
+}
+
+static int encode_copy(struct vcdiff_sections* s, size_t length,
+		uint64_t address)
+{
+	return buffer_put_byte(&s->inst, VCD_OP_COPY_SELF)
+		&& buffer_put_varint(&s->inst, length)
+		&& buffer_put_varint(&s->addr, address);
+}
+
+static int encode_run(struct vcdiff_sections* s, size_t length,
+		unsigned char c)
+{
+	return buffer_put_byte(&s->inst, VCD_OP_RUN)
+		&& buffer_put_varint(&s->inst, length)
+		&& buffer_put_byte(&s->data, c);
+}
+
+static size_t run_length(const unsigned char* p, size_t length)
+{
+	size_t n = 1;
+
+	while (n < length && p[n] == p[0])
+		++n;
+
+	return n;
+}
+
+/* the source offset the data at pos matches at, checking the continuation
+ * of the previous copy first; (size_t) -1 if none */
+static size_t find_source_match(const struct vcdiff_encoder* e,
+		const unsigned char* pos, uint32_t h, size_t predicted)
+{
+	uint32_t chunk;
+
+	if (e->source_length >= VCD_HASH_LEN
+			&& predicted <= e->source_length - VCD_HASH_LEN
+			&& !memcmp(pos, e->source + predicted, VCD_HASH_LEN))
+		return predicted;
+
+	chunk = e->table[vcdiff_hash_slot(e, h)];
+	if (chunk != 0 && !memcmp(pos, e->source
+				+ (size_t) (chunk - 1) * VCD_HASH_LEN, VCD_HASH_LEN))
+		return (size_t) (chunk - 1) * VCD_HASH_LEN;
+
+	return (size_t) -1;
+}
+
+/* the length of the match of target[pos..] at ref[ref_pos..], extended
+ * back to add_start at most; *back is set to the part before pos */
+static size_t match_length(const unsigned char* target, size_t pos,
+		size_t length, size_t add_start, const unsigned char* ref,
+		size_t ref_pos, size_t ref_length, size_t* back)
+{
+	size_t b = 0, f = VCD_HASH_LEN;
+
+	while (pos - b > add_start && ref_pos - b > 0
+			&& target[pos - b - 1] == ref[ref_pos - b - 1])
+		++b;
+	while (pos + f < length && ref_pos + f < ref_length
+			&& target[pos + f] == ref[ref_pos + f])
+		++f;
+
+	*back = b;
+	return b + f;
+}
+
+static int encode_instructions(const struct vcdiff_encoder* e,
+		const unsigned char* target, size_t length,
+		struct vcdiff_sections* s)
+{
+	const uint32_t roll = vcdiff_hash_roll_factor();
+	size_t pos = 0, add_start = 0;
+	/* the source offset of the target data at pos, by the last copy */
+	size_t predicted = (size_t) -1;
+	uint32_t h = 0;
+	int hashed = 0;
+	/* the earlier positions in the window, + 1, by hash */
+	uint32_t* recent;
+
+	recent = calloc((size_t) 1 << VCD_WINDOW_TABLE_BITS, sizeof(*recent));
+	if (!recent)
+	{
+		fprintf(stderr, "Unable to allocate memory for VCDIFF window.\n"
+				"\terrno: %s\n", strerror(errno));
+		return 0;
+	}
+
+	while (length - pos >= VCD_HASH_LEN)
+	{
+		size_t slot, src, earlier;
+		size_t match = 0, back = 0;
+		uint64_t address = 0;
+
+		if (!hashed)
+			h = vcdiff_hash(target + pos);
+		hashed = 1;
+		slot = (uint32_t) (h * 0x9e3779b1UL) >> (32 - VCD_WINDOW_TABLE_BITS);
+
+		/* the longer of the source match and the earlier window data */
+		src = find_source_match(e, target + pos, h, predicted);
+		if (src != (size_t) -1)
+		{
+			match = match_length(target, pos, length, add_start,
+					e->source, src, e->source_length, &back);
+			address = src - back;
+		}
+
+		earlier = recent[slot];
+		if (earlier != 0 && !memcmp(target + pos, target + earlier - 1,
+					VCD_HASH_LEN))
+		{
+			size_t b;
+			size_t n = match_length(target, pos, length, add_start,
+					target, earlier - 1, length, &b);
+
+			if (n > match)
+			{
+				match = n;
+				back = b;
+				address = e->source_length + earlier - 1 - b;
+			}
+		}
+		recent[slot] = pos + 1;
+
+		if (match > 0)
+		{
+			if (!encode_add(s, target + add_start, pos - back - add_start)
+					|| !encode_copy(s, match, address))
+				break;
+
+			pos += match - back;
+			predicted = address < e->source_length
+				? address + match : (size_t) -1;
+			add_start = pos;
+			hashed = 0;
+			continue;
+		}
+
+		if (target[pos] == target[pos + 1]
+				&& target[pos] == target[pos + VCD_HASH_LEN - 1])
+		{
+			size_t n = run_length(target + pos, length - pos);
+
+			if (n >= VCD_HASH_LEN)
+			{
+				if (!encode_add(s, target + add_start, pos - add_start)
+						|| !encode_run(s, n, target[pos]))
+					break;
+
+				pos += n;
+				if (predicted != (size_t) -1)
+					predicted += n;
+				add_start = pos;
+				hashed = 0;
+				continue;
+			}
+		}
+
+		if (length - pos > VCD_HASH_LEN)
+			h = (h - target[pos] * roll) * VCD_HASH_BASE
+				+ target[pos + VCD_HASH_LEN];
+		if (predicted != (size_t) -1)
+			++predicted;
+		++pos;
+	}
+
+	free(recent);
+	if (length - pos >= VCD_HASH_LEN)
+		return 0;
+	return encode_add(s, target + add_start, length - add_start);
+}
+
+int vcdiff_encode_window(const struct vcdiff_encoder* e, const void* target,
+		size_t length, unsigned char** out, size_t* out_length)
+{
+	struct vcdiff_sections s;
+	struct vcdiff_buffer w;
+	uint32_t checksum = vcdiff_adler32(target, length);
+	unsigned char checksum_bytes[4];
+	size_t delta_length;
+	int ret = 0;
+
+	memset(&s, 0, sizeof(s));
+	memset(&w, 0, sizeof(w));
+
+	checksum_bytes[0] = checksum >> 24;
+	checksum_bytes[1] = checksum >> 16;
+	checksum_bytes[2] = checksum >> 8;
+	checksum_bytes[3] = checksum;
+
+	do
+	{
+		if (!encode_instructions(e, target, length, &s))
+			break;
+
+		delta_length = varint_length(length) + 1
+			+ varint_length(s.data.length) + varint_length(s.inst.length)
+			+ varint_length(s.addr.length) + sizeof(checksum_bytes)
+			+ s.data.length + s.inst.length + s.addr.length;
+
+		/* the whole source is the segment of every window */
+		if (e->source_length > 0)
+		{
+			if (!buffer_put_byte(&w, VCD_SOURCE | VCD_ADLER32)
+					|| !buffer_put_varint(&w, e->source_length)
+					|| !buffer_put_varint(&w, 0))
+				break;
+		}
+		else if (!buffer_put_byte(&w, VCD_ADLER32))
+			break;
+
+		if (!buffer_put_varint(&w, delta_length)
+				|| !buffer_put_varint(&w, length)
+				|| !buffer_put_byte(&w, 0)
+				|| !buffer_put_varint(&w, s.data.length)
+				|| !buffer_put_varint(&w, s.inst.length)
+				|| !buffer_put_varint(&w, s.addr.length)
+				|| !buffer_put(&w, checksum_bytes, sizeof(checksum_bytes))
+				|| !buffer_put(&w, s.data.data, s.data.length)
+				|| !buffer_put(&w, s.inst.data, s.inst.length)
+				|| !buffer_put(&w, s.addr.data, s.addr.length))
+			break;
+
+		ret = 1;
+	} while (0);
+
+	free(s.data.data);
+	free(s.inst.data);
+	free(s.addr.data);
+
+	if (!ret)
+	{
+		free(w.data);
+		return 0;
+	}
+
+	*out = w.data;
+	*out_length = w.length;
+	return 1;
+}
@@ -0,0 +1,126 @@
+/**
+ * SquashFS delta merge tool
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#pragma once
+
+#ifndef SDT_VCDIFF_H
+#define SDT_VCDIFF_H 1
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#ifdef HAVE_STDINT_H
+#	include <stdint.h>
+#endif
+#include <stdlib.h>
+
+enum vcdiff_support
+{
+	VCDIFF_INVALID = 0,
+	VCDIFF_SUPPORTED,
+	/* valid but using features only xdelta3 itself can handle */
+	VCDIFF_UNSUPPORTED
+};
+
+struct vcdiff_code
+{
+	unsigned char type[2];
+	unsigned char size[2];
+	unsigned char mode[2];
+};
+
+struct vcdiff_decoder
+{
+	const unsigned char* data;
+	size_t length;
+	/* offset of the first and the next window */
+	size_t windows_start;
+	size_t pos;
+	int secondary_id;
+	/* length of the target produced by the preceding windows */
+	uint64_t target_offset;
+
+	struct vcdiff_code code_table[256];
+};
+
+struct vcdiff_window
+{
+	unsigned char indicator;
+	unsigned char delta_indicator;
+
+	uint64_t segment_length;
+	uint64_t segment_position;
+
+	uint64_t target_offset;
+	size_t target_length;
+
+	const unsigned char* data;
+	size_t data_length;
+	const unsigned char* inst;
+	size_t inst_length;
+	const unsigned char* addr;
+	size_t addr_length;
+
+	int has_checksum;
+	uint32_t checksum;
+};
+
+/* the source (dictionary) the VCD_SOURCE windows copy from */
+struct vcdiff_source
+{
+	/* copy length bytes at offset into dest, return 0 on failure */
+	int (*read)(void* priv, void* dest, uint64_t offset, size_t length);
+	/* optional, used instead of read for COPY instructions; dest
+	 * is at target_offset in the target file */
+	int (*copy)(void* priv, void* dest, uint64_t target_offset,
+			uint64_t offset, size_t length);
+	void* priv;
+	uint64_t length;
+};
+
+int vcdiff_probe(const void* data, size_t length);
+
+int vcdiff_open(struct vcdiff_decoder* d, const void* data, size_t length);
+void vcdiff_rewind(struct vcdiff_decoder* d);
+int vcdiff_at_end(const struct vcdiff_decoder* d);
+int vcdiff_next_window(struct vcdiff_decoder* d, struct vcdiff_window* w);
+int vcdiff_target_length(struct vcdiff_decoder* d, uint64_t* out);
+/* whether the window copies from the target produced by earlier windows */
+int vcdiff_window_needs_target(const struct vcdiff_window* w);
+
+int vcdiff_decode_window(const struct vcdiff_decoder* d,
+		const struct vcdiff_window* w, const struct vcdiff_source* src,
+		unsigned char* target);
+
+void vcdiff_source_init_memory(struct vcdiff_source* src,
+		const void* data, size_t length);
+
+/* the source chunks indexed for matching the target windows */
+struct vcdiff_encoder
+{
+	const unsigned char* source;
+	size_t source_length;
+	/* the chunk index + 1 by hash, 0 for none */
+	uint32_t* table;
+	unsigned int table_bits;
+};
+
+/* the length of the file header written by vcdiff_encode_header() */
+#define VCDIFF_HEADER_SIZE 5
+
+/* the source needs to outlive the encoder; the windows can be encoded
+ * from several threads at once */
+int vcdiff_encoder_init(struct vcdiff_encoder* e, const void* source,
+		size_t length);
+void vcdiff_encoder_free(struct vcdiff_encoder* e);
+size_t vcdiff_encode_header(unsigned char* out);
+/* encode the target window against the whole source, the window
+ * is returned in a malloc()ed buffer */
+int vcdiff_encode_window(const struct vcdiff_encoder* e, const void* target,
+		size_t length, unsigned char** out, size_t* out_length);
+
+#endif /*!SDT_VCDIFF_H*/
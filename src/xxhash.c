@@ -0,0 +1,116 @@
+/**
+ * SquashFS delta merge tool
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+/*
+ * XXH64, as specified by Yann Collet's xxHash. Used to recognize
+ * uncompressed blocks, so it only needs to be fast, not cryptographic.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <string.h>
+
+#include "xxhash.h"
+
+static const uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t prime3 = 0x165667B19E3779F9ULL;
+static const uint64_t prime4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t prime5 = 0x27D4EB2F165667C5ULL;
+
+static uint64_t rotl64(uint64_t x, unsigned int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+/* little-endian loads, independent of the host byte order */
+static uint64_t read64(const unsigned char* p)
+{
+	return (uint64_t) p[0] | (uint64_t) p[1] << 8
+		| (uint64_t) p[2] << 16 | (uint64_t) p[3] << 24
+		| (uint64_t) p[4] << 32 | (uint64_t) p[5] << 40
+		| (uint64_t) p[6] << 48 | (uint64_t) p[7] << 56;
+}
+
+static uint32_t read32(const unsigned char* p)
+{
+	return (uint32_t) p[0] | (uint32_t) p[1] << 8
+		| (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+	acc += input * prime2;
+	acc = rotl64(acc, 31);
+	return acc * prime1;
+}
+
+static uint64_t xxh64_merge_round(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh64_round(0, val);
+	return acc * prime1 + prime4;
+}
+
+uint64_t xxh64(const void* data, size_t length, uint64_t seed)
+{
+	const unsigned char* p = data;
+	const unsigned char* end = p + length;
+	uint64_t h;
+
+	if (length >= 32)
+	{
+		const unsigned char* limit = end - 32;
+		uint64_t v1 = seed + prime1 + prime2;
+		uint64_t v2 = seed + prime2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - prime1;
+
+		do
+		{
+			v1 = xxh64_round(v1, read64(p));
+			v2 = xxh64_round(v2, read64(p + 8));
+			v3 = xxh64_round(v3, read64(p + 16));
+			v4 = xxh64_round(v4, read64(p + 24));
+			p += 32;
+		} while (p <= limit);
+
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+		h = xxh64_merge_round(h, v1);
+		h = xxh64_merge_round(h, v2);
+		h = xxh64_merge_round(h, v3);
+		h = xxh64_merge_round(h, v4);
+	}
+	else
+		h = seed + prime5;
+
+	h += length;
+
+	for (; p + 8 <= end; p += 8)
+	{
+		h ^= xxh64_round(0, read64(p));
+		h = rotl64(h, 27) * prime1 + prime4;
+	}
+	if (p + 4 <= end)
+	{
+		h ^= (uint64_t) read32(p) * prime1;
+		h = rotl64(h, 23) * prime2 + prime3;
+		p += 4;
+	}
+	for (; p < end; ++p)
+	{
+		h ^= *p * prime5;
+		h = rotl64(h, 11) * prime1;
+	}
+
+	h ^= h >> 33;
+	h *= prime2;
+	h ^= h >> 29;
+	h *= prime3;
+	h ^= h >> 32;
+	return h;
+}
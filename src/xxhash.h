@@ -0,0 +1,24 @@
+/**
+ * SquashFS delta merge tool
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#pragma once
+
+#ifndef SDT_XXHASH_H
+#define SDT_XXHASH_H 1
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#ifdef HAVE_STDINT_H
+#	include <stdint.h>
+#endif
+#include <stdlib.h>
+
+/* the XXH64 hash function */
+uint64_t xxh64(const void* data, size_t length, uint64_t seed);
+
+#endif /*!SDT_XXHASH_H*/
@@ -0,0 +1,44 @@
+#!/usr/bin/env bash
+# Create a pair of synthetic directory trees of a given size,
+# and the SquashFS benchmark images (and deltas) for them.
+
+size=${1}
+out=${2}
+changed=${3:-10}
+
+if ! [[ ${size} && ${out} ]]; then
+	echo "Usage: ${0} <size-in-MiB> <output-file-prefix> [<changed-percent>]" >&2
+	exit 1
+fi
+
+tmpdir=$(mktemp -d)
+trap 'rm -rf "${tmpdir}"' EXIT
+
+set -e
+
+# files of 64 to 1024 KiB, half compressible text and half random data
+n=0
+filled=0
+while (( filled < size * 1024 )); do
+	kib=$(( (RANDOM % 16 + 1) * 64 ))
+	dir=${tmpdir}/old/d$(( n / 64 ))
+	mkdir -p "${dir}"
+	if (( n % 2 )); then
+		head -c $(( kib * 1024 )) /dev/urandom > "${dir}/f${n}"
+	else
+		head -c $(( kib * 768 )) /dev/urandom | base64 \
+			| head -c $(( kib * 1024 )) > "${dir}/f${n}"
+	fi
+	(( filled += kib, ++n ))
+done
+
+cp -a "${tmpdir}"/old "${tmpdir}"/new
+for f in $(find "${tmpdir}"/new -type f | sort); do
+	if (( RANDOM % 100 < changed )); then
+		head -c 4096 /dev/urandom | dd of="${f}" bs=4096 \
+			seek=$(( RANDOM % 16 )) conv=notrunc status=none
+	fi
+done
+
+"$(dirname "${0}")"/create-sqfs-tests.bash \
+	"${tmpdir}"/old "${tmpdir}"/new "${out}" > /dev/null
@@ -0,0 +1,114 @@
+#!/usr/bin/env python3
+# Create deltas with a corrupted checksum table entry for the test images
+# (made by create-sqfs-tests.bash), using squashmerge --create; the table
+# digest is updated, for the entry itself to be checked by the merge.
+
+import struct
+import subprocess
+import sys
+
+MASK = (1 << 64) - 1
+P1 = 0x9E3779B185EBCA87
+P2 = 0xC2B2AE3D27D4EB4F
+P3 = 0x165667B19E3779F9
+P4 = 0x85EBCA77C2B2AE63
+P5 = 0x27D4EB2F165667C5
+
+
+def rotl(x, r):
+    return ((x << r) | (x >> (64 - r))) & MASK
+
+
+def xxh64_round(acc, val):
+    acc = (acc + val * P2) & MASK
+    return (rotl(acc, 31) * P1) & MASK
+
+
+def xxh64_merge(acc, val):
+    acc ^= xxh64_round(0, val)
+    return (acc * P1 + P4) & MASK
+
+
+def xxh64(data, seed=0):
+    n = len(data)
+    pos = 0
+    if n >= 32:
+        v = [(seed + P1 + P2) & MASK, (seed + P2) & MASK, seed,
+             (seed - P1) & MASK]
+        while pos + 32 <= n:
+            for i in range(4):
+                v[i] = xxh64_round(v[i], struct.unpack_from(
+                    '<Q', data, pos + i * 8)[0])
+            pos += 32
+        h = (rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12)
+             + rotl(v[3], 18)) & MASK
+        for x in v:
+            h = xxh64_merge(h, x)
+    else:
+        h = (seed + P5) & MASK
+    h = (h + n) & MASK
+    while pos + 8 <= n:
+        h ^= xxh64_round(0, struct.unpack_from('<Q', data, pos)[0])
+        h = (rotl(h, 27) * P1 + P4) & MASK
+        pos += 8
+    if pos + 4 <= n:
+        h ^= (struct.unpack_from('<I', data, pos)[0] * P1) & MASK
+        h = (rotl(h, 23) * P2 + P3) & MASK
+        pos += 4
+    while pos < n:
+        h ^= (data[pos] * P5) & MASK
+        h = (rotl(h, 11) * P1) & MASK
+        pos += 1
+    h ^= h >> 33
+    h = (h * P2) & MASK
+    h ^= h >> 29
+    h = (h * P3) & MASK
+    h ^= h >> 32
+    return h
+
+
+def corrupt_block_checksum(path):
+    with open(path, 'rb') as f:
+        d = bytearray(f.read())
+
+    magic, flags, compression, block_count = struct.unpack_from('>4I', d, 0)
+    if not flags & 0x2:
+        raise SystemExit('%s: no checksum table' % path)
+    entry_size = 16 if flags & 0x1 else 12
+    table = 16 + block_count * entry_size
+    segment_count = struct.unpack_from('>I', d, table)[0]
+    entries = table + 12
+
+    # block i of the target is segment 2i + 1, take the middle one
+    segment = (segment_count - 1) // 2 | 1
+    d[entries + segment * 8 + 7] ^= 0xff
+
+    digest = xxh64(bytes(d[entries:entries + segment_count * 8]))
+    struct.pack_into('>2I', d, table + 4, digest >> 32, digest & 0xffffffff)
+
+    with open(path, 'wb') as f:
+        f.write(d)
+
+
+def main():
+    if len(sys.argv) < 3:
+        print('Usage: %s <squashmerge> <test-file-prefix>...' % sys.argv[0],
+              file=sys.stderr)
+        return 1
+
+    tests = []
+    for prefix in sys.argv[2:]:
+        out = prefix + '.bad-checksum.sqdelta'
+        subprocess.check_call([sys.argv[1], '--create', prefix + '.in',
+                               prefix + '.out', out])
+        corrupt_block_checksum(out)
+        tests.append(out.rsplit('/', 1)[-1])
+
+    print('TESTS += \\')
+    for x in tests:
+        print('\t%s \\' % x)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -7,15 +7,79 @@ DELTA=${3}
 
 # figure all the correct paths out
 BASEPATH=${DELTA%.sqdelta}
+BASENAME=${BASEPATH##*/}
+# X.bad-<variant>.sqdelta is a corrupted delta for X
+VARIANT=${BASEPATH##*.bad-}
+BASEPATH=${BASEPATH%.bad-*}
 IN=${BASEPATH}.in
 OUT=${BASEPATH}.out
 
-BASENAME=${BASEPATH##*/}
 TESTOUT=${OUTDIR}/${BASENAME}.testout
+JOURNAL=${OUTDIR}/${BASENAME}.journal
+CREATED=${OUTDIR}/${BASENAME}.created.sqdelta
+LOG=${OUTDIR}/${BASENAME}.testlog
+BADIN=${OUTDIR}/${BASENAME}.bad.in
+
+# print the big endian uint32 at the given offset
+be32() {
+	od -A n -t u1 -j "${2}" -N 4 "${1}" | {
+		read a b c d
+		echo $(( ((a * 256 + b) * 256 + c) * 256 + d ))
+	}
+}
 
 set -e -x
 
+# the corrupted deltas need to be refused
+if [ "${VARIANT}" = checksum ]; then
+	if "${SQMERGE}" "${IN}" "${DELTA}" "${TESTOUT}" 2> "${LOG}"; then
+		exit 1
+	fi
+	grep -q "Target data does not match the checksum" "${LOG}"
+	exit 0
+fi
+
 # check if we can apply the delta
 "${SQMERGE}" "${IN}" "${DELTA}" "${TESTOUT}"
 # and if it matches the reference output
 cmp "${TESTOUT}" "${OUT}"
+
+# stop a journalled merge after the first blocks, and resume it
+if [ -n "${SQUASHMERGE_TEST_HOOKS}" ]; then
+	rm -f "${TESTOUT}" "${JOURNAL}"
+	if SQUASHMERGE_JOURNAL_STOP_AFTER=4 "${SQMERGE}" --journal "${JOURNAL}" \
+			"${IN}" "${DELTA}" "${TESTOUT}"; then
+		exit 1
+	fi
+	test -s "${JOURNAL}"
+	"${SQMERGE}" --journal "${JOURNAL}" "${IN}" "${DELTA}" "${TESTOUT}" \
+		2> "${LOG}"
+	grep -q "Resuming the merge" "${LOG}"
+	test ! -e "${JOURNAL}"
+	cmp "${TESTOUT}" "${OUT}"
+fi
+
+# generate a delta of our own, and apply it
+"${SQMERGE}" --create "${IN}" "${OUT}" "${CREATED}"
+# it reuses the unchanged blocks, and has the checksums (flags 0x1, 0x2)
+test "$(od -A n -t u1 -j 7 -N 1 "${CREATED}" | tr -d ' ')" = 3
+"${SQMERGE}" "${IN}" "${CREATED}" "${TESTOUT}"
+cmp "${TESTOUT}" "${OUT}"
+
+# corrupt a source block reused verbatim, the checksums need to catch it
+i=0
+count=$(be32 "${CREATED}" 12)
+while [ $(be32 "${CREATED}" $(( 16 + i * 16 + 12 ))) != ${i} ]; do
+	i=$(( i + 1 ))
+	test ${i} -lt ${count}
+done
+pos=$(( $(be32 "${CREATED}" $(( 16 + i * 16 ))) \
+	+ $(be32 "${CREATED}" $(( 16 + i * 16 + 4 ))) / 2 ))
+byte=$(od -A n -t u1 -j ${pos} -N 1 "${IN}" | tr -d ' ')
+cp "${IN}" "${BADIN}"
+printf "\\$(printf %03o $(( byte ^ 255 )))" \
+	| dd of="${BADIN}" bs=1 seek=${pos} conv=notrunc 2> /dev/null
+if "${SQMERGE}" "${BADIN}" "${CREATED}" "${TESTOUT}" 2> "${LOG}"; then
+	exit 1
+fi
+grep -q "Target data does not match the checksum" "${LOG}"